@@ -0,0 +1,364 @@
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+use ppenc::{Batch, Receiver, Records, Sender, SenderRng, VERSION_COMPACT, VERSION_DEFAULT};
+
+/* struct sizes from blockcipher.h/cprng.h, u64 backed for alignment */
+const THREEFISH_BUF_LEN: usize = 1312 / 8;
+const CHACHA_LEN: usize = 128 / 8;
+
+const BODY_LENS: [usize; 7] = [1, 16, 64, 256, 1024, 16384, 65536];
+/* bodies that pad to a single Threefish block, most device messages */
+const SMALL_BODY_LENS: [usize; 6] = [1, 8, 16, 32, 48, 56];
+/* telemetry records sent one per message or batched into one */
+const RECORD_LEN: usize = 16;
+const NUM_RECORDS: usize = 32;
+/* bulk uploads, read on one thread and split over every core */
+const LARGE_BODY_LENS: [usize; 2] = [1 << 20, 4 << 20];
+
+extern "C" {
+    fn ppenc_threefish512_encrypt(
+        key: *const u8,
+        tweak_seed: *const u8,
+        body: *mut u8,
+        num_blocks: u32,
+        buf3f: *mut u64,
+        buf64: *mut u8,
+    );
+    fn ppenc_threefish512_decrypt(
+        key: *const u8,
+        tweak_seed: *const u8,
+        body: *mut u8,
+        num_blocks: u32,
+        buf3f: *mut u64,
+        buf64: *mut u8,
+    );
+    fn ppenc_threefish512_encrypt_64bit(
+        key: *const u8,
+        tweak_seed: *const u8,
+        body: *mut u8,
+        num_blocks: u32,
+        buf3f: *mut u64,
+        buf64: *mut u8,
+    );
+    fn ppenc_threefish512_decrypt_64bit(
+        key: *const u8,
+        tweak_seed: *const u8,
+        body: *mut u8,
+        num_blocks: u32,
+        buf3f: *mut u64,
+        buf64: *mut u8,
+    );
+
+    fn ppenc_sha256_len48(hash_value: *mut u8, msg: *const u8, message_schedule_buf: *mut u32);
+    fn ppenc_cubehash(hash_value: *mut u8, msg: *const u8, msg_len: u32);
+
+    fn ppenc_chacha8_init(chacha8: *mut u64, key: *const u8, nonce: *const u8);
+    fn ppenc_chacha8_nbytes(chacha8: *mut u64, dst: *mut u8, num_bytes: u16);
+    fn ppenc_chacha20_init(chacha20: *mut u64, key: *const u8, nonce: *const u8);
+    fn ppenc_chacha20_xor_header(chacha20: *mut u64, header: *mut u8);
+}
+
+type ThreeFish = unsafe extern "C" fn(*const u8, *const u8, *mut u8, u32, *mut u64, *mut u8);
+
+/* deterministic filler so runs are comparable between commits */
+fn fill(buf: &mut [u8], seed: u8) {
+    for (i, b) in buf.iter_mut().enumerate() {
+        *b = (i as u8).wrapping_mul(31).wrapping_add(seed);
+    }
+}
+
+fn threefish(c: &mut Criterion) {
+    let fns: [(&str, ThreeFish); 4] = [
+        ("encrypt", ppenc_threefish512_encrypt),
+        ("decrypt", ppenc_threefish512_decrypt),
+        ("encrypt_64bit", ppenc_threefish512_encrypt_64bit),
+        ("decrypt_64bit", ppenc_threefish512_decrypt_64bit),
+    ];
+    let mut key = [0u8; 64];
+    let mut tweak_seed = [0u8; 8];
+    let mut buf3f = vec![0u64; THREEFISH_BUF_LEN];
+    let mut buf64 = [0u8; 64];
+    fill(&mut key, 1);
+    fill(&mut tweak_seed, 2);
+
+    let mut group = c.benchmark_group("threefish512");
+    for num_blocks in [1usize, 16, 256] {
+        let mut body = vec![0u8; num_blocks * 64];
+        fill(&mut body, 3);
+        group.throughput(Throughput::Bytes(body.len() as u64));
+
+        for (name, f) in fns {
+            group.bench_with_input(BenchmarkId::new(name, num_blocks), &num_blocks, |b, &n| {
+                b.iter(|| unsafe {
+                    f(
+                        key.as_ptr(),
+                        tweak_seed.as_ptr(),
+                        body.as_mut_ptr(),
+                        n as u32,
+                        buf3f.as_mut_ptr(),
+                        buf64.as_mut_ptr(),
+                    )
+                })
+            });
+        }
+    }
+    group.finish();
+}
+
+fn hashes(c: &mut Criterion) {
+    let mut msg = [0u8; 64];
+    let mut message_schedule_buf = [0u32; 64];
+    let mut hash_value = [0u8; 32];
+    fill(&mut msg[..48], 4);
+
+    c.bench_function("sha256_len48", |b| {
+        b.iter(|| unsafe {
+            ppenc_sha256_len48(
+                hash_value.as_mut_ptr(),
+                black_box(msg.as_ptr()),
+                message_schedule_buf.as_mut_ptr(),
+            )
+        })
+    });
+
+    let mut group = c.benchmark_group("cubehash");
+    let mut state = [0u32; 32];
+    for msg_len in [32usize, 1024, 16384, 65536] {
+        let msg = vec![0u32; msg_len / 4];
+        group.throughput(Throughput::Bytes(msg_len as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(msg_len), &msg_len, |b, &n| {
+            b.iter(|| unsafe {
+                ppenc_cubehash(
+                    state.as_mut_ptr() as *mut u8,
+                    msg.as_ptr() as *const u8,
+                    n as u32,
+                )
+            })
+        });
+    }
+    group.finish();
+}
+
+fn chacha(c: &mut Criterion) {
+    let mut key = [0u8; 32];
+    let mut nonce = [0u8; 12];
+    let mut state = [0u64; CHACHA_LEN];
+    fill(&mut key, 5);
+    fill(&mut nonce, 6);
+
+    unsafe {
+        ppenc_chacha8_init(state.as_mut_ptr(), key.as_ptr(), nonce.as_ptr());
+    }
+
+    let mut group = c.benchmark_group("chacha8_nbytes");
+    let mut dst = vec![0u8; 1024];
+    for num_bytes in [32usize, 64, 1024] {
+        group.throughput(Throughput::Bytes(num_bytes as u64));
+        group.bench_with_input(
+            BenchmarkId::from_parameter(num_bytes),
+            &num_bytes,
+            |b, &n| {
+                b.iter(|| unsafe {
+                    ppenc_chacha8_nbytes(state.as_mut_ptr(), dst.as_mut_ptr(), n as u16)
+                })
+            },
+        );
+    }
+    group.finish();
+
+    unsafe {
+        ppenc_chacha20_init(state.as_mut_ptr(), key.as_ptr(), nonce.as_ptr());
+    }
+
+    let mut header = [0u8; 32];
+    c.bench_function("chacha20_xor_header", |b| {
+        b.iter(|| unsafe { ppenc_chacha20_xor_header(state.as_mut_ptr(), header.as_mut_ptr()) })
+    });
+}
+
+fn new_session() -> (Sender, Receiver) {
+    let mut header_key_salt = [0u8; 16];
+    let mut header_state_init = [0u8; 32];
+    let mut header_rng_nonce = [0u8; 12];
+    let mut body_salt = [0u8; 16];
+    let mut body_state0 = [0u8; 32];
+    let mut rng_key = [0u8; 32];
+    let mut rng_nonce = [0u8; 8];
+    fill(&mut header_key_salt, 7);
+    fill(&mut header_state_init, 8);
+    fill(&mut header_rng_nonce, 9);
+    fill(&mut body_salt, 10);
+    fill(&mut body_state0, 11);
+    fill(&mut rng_key, 12);
+    fill(&mut rng_nonce, 13);
+
+    let sender = Sender::new(
+        SenderRng::new(&rng_key, &rng_nonce),
+        &header_key_salt,
+        &header_state_init,
+        &header_rng_nonce,
+        &body_salt,
+        &body_state0,
+    );
+    let receiver = Receiver::new(
+        &header_key_salt,
+        &header_state_init,
+        &header_rng_nonce,
+        &body_salt,
+        &body_state0,
+    );
+
+    (sender, receiver)
+}
+
+fn body_key(c: &mut Criterion) {
+    let (mut sender, _) = new_session();
+
+    c.bench_function("sender_new_body_key", |b| b.iter(|| sender.new_body_key()));
+}
+
+fn round_trip(c: &mut Criterion) {
+    round_trip_group(c, "round_trip", &BODY_LENS, VERSION_DEFAULT);
+    round_trip_group(c, "small_round_trip", &SMALL_BODY_LENS, VERSION_DEFAULT);
+    round_trip_group(c, "compact_round_trip", &SMALL_BODY_LENS, VERSION_COMPACT);
+}
+
+fn round_trip_group(c: &mut Criterion, name: &str, body_lens: &[usize], version: u8) {
+    let mut group = c.benchmark_group(name);
+
+    for &body_len in body_lens {
+        let (mut sender, mut receiver) = new_session();
+        sender.set_version(version).expect("bad version");
+        receiver.set_version(version).expect("bad version");
+        let header_len = sender.header_len();
+        let mut body = vec![0u8; body_len];
+        fill(&mut body, 14);
+        let mut received = Vec::with_capacity(body_len + 71);
+        let mut header = [0u8; 32];
+
+        group.throughput(Throughput::Bytes(body_len as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(body_len), &body, |b, body| {
+            b.iter(|| {
+                let (msg, _) = sender.new_msg_from(body);
+
+                let wire = msg.as_wire();
+                header[..header_len].copy_from_slice(&wire[..header_len]);
+                let h = receiver.read_header(&mut header).expect("bad header");
+                let response_mac = receiver
+                    .read_body_to(h, &wire[header_len..], &mut received)
+                    .expect("bad body");
+
+                sender.recycle(msg);
+                response_mac
+            })
+        });
+    }
+    group.finish();
+}
+
+fn records(c: &mut Criterion) {
+    let mut group = c.benchmark_group("records");
+    group.throughput(Throughput::Elements(NUM_RECORDS as u64));
+    let mut record = [0u8; RECORD_LEN];
+    fill(&mut record, 16);
+    let mut header = [0u8; 32];
+
+    let (mut sender, mut receiver) = new_session();
+    let mut received = Vec::with_capacity(RECORD_LEN + 71);
+    group.bench_function("one_per_msg", |b| {
+        b.iter(|| {
+            for _ in 0..NUM_RECORDS {
+                let (msg, _) = sender.new_msg_from(&record);
+
+                let wire = msg.as_wire();
+                header.copy_from_slice(&wire[..32]);
+                let h = receiver.read_header(&mut header).expect("bad header");
+                receiver
+                    .read_body_to(h, &wire[32..], &mut received)
+                    .expect("bad body");
+                sender.recycle(msg);
+            }
+        })
+    });
+
+    let (mut sender, mut receiver) = new_session();
+    let body_len = NUM_RECORDS * (RECORD_LEN + 2);
+    let mut batch = Batch::new(body_len, body_len, u32::MAX);
+    let mut received = Vec::with_capacity(body_len + 71);
+    group.bench_function("batched", |b| {
+        b.iter(|| {
+            for _ in 0..NUM_RECORDS {
+                batch.push(&record, 0).expect("batch full");
+            }
+            let (msg, _) = batch.flush(&mut sender).expect("empty batch");
+
+            let wire = msg.as_wire();
+            header.copy_from_slice(&wire[..32]);
+            let h = receiver.read_header(&mut header).expect("bad header");
+            receiver
+                .read_body_to(h, &wire[32..], &mut received)
+                .expect("bad body");
+            let n = Records::new(&received).count();
+            sender.recycle(msg);
+            n
+        })
+    });
+    group.finish();
+}
+
+fn read_body_parallel(c: &mut Criterion) {
+    let num_threads = std::thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1);
+    let mut thread_counts = vec![1];
+    if num_threads > 1 {
+        thread_counts.push(num_threads);
+    }
+    let mut group = c.benchmark_group("read_body_large");
+    group.sample_size(20);
+
+    for body_len in LARGE_BODY_LENS {
+        let mut body = vec![0u8; body_len];
+        fill(&mut body, 15);
+        group.throughput(Throughput::Bytes(body_len as u64));
+
+        for &threads in &thread_counts {
+            let (mut sender, mut receiver) = new_session();
+            let mut received = Vec::with_capacity(body_len + 71);
+            let mut header = [0u8; 32];
+
+            group.bench_with_input(
+                BenchmarkId::new(format!("threads_{}", threads), body_len),
+                &body,
+                |b, body| {
+                    b.iter(|| {
+                        let (msg, _) = sender.new_msg_from(body);
+
+                        let wire = msg.as_wire();
+                        header.copy_from_slice(&wire[..32]);
+                        let h = receiver.read_header(&mut header).expect("bad header");
+                        let response_mac = receiver
+                            .read_body_parallel(h, &wire[32..], &mut received, threads)
+                            .expect("bad body");
+
+                        sender.recycle(msg);
+                        response_mac
+                    })
+                },
+            );
+        }
+    }
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    threefish,
+    hashes,
+    chacha,
+    body_key,
+    round_trip,
+    records,
+    read_body_parallel
+);
+criterion_main!(benches);
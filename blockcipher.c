@@ -5,6 +5,52 @@
 #endif
 
 #define U32_MAX 0xffffffff
+
+/* the 32 bit block functions keep a block in 16 locals, x0 x1 *
+ * being the lower and upper half of 64 bit word 0 and so on.  *
+ * MIX is a Threefish mix with a left rotation of r (< 32) or  *
+ * a right rotation of r (64 - the left rotation), UNMIX is    *
+ * its inverse                                                  */
+#define SIXTY4_ADD(al, ah, bl, bh) \
+  do { al += bl; ah += bh + (al < bl); } while (0)
+#define SIXTY4_SUB(al, ah, bl, bh) \
+  do { ah -= bh + (al < bl); al -= bl; } while (0)
+
+#define MIX_LEFT(al, ah, bl, bh, r) \
+  do { uint32_t t_; \
+    SIXTY4_ADD(al, ah, bl, bh); \
+    t_ = (bh << r) | (bl >> (32 - r)); \
+    bl = ((bl << r) | (bh >> (32 - r))) ^ al; \
+    bh = t_ ^ ah; } while (0)
+#define MIX_RIGHT(al, ah, bl, bh, r) \
+  do { uint32_t t_; \
+    SIXTY4_ADD(al, ah, bl, bh); \
+    t_ = (bl >> r) | (bh << (32 - r)); \
+    bh = ((bh >> r) | (bl << (32 - r))) ^ ah; \
+    bl = t_ ^ al; } while (0)
+#define UNMIX_LEFT(al, ah, bl, bh, r) \
+  do { uint32_t t_; \
+    bl ^= al; bh ^= ah; \
+    t_ = (bl >> r) | (bh << (32 - r)); \
+    bh = (bh >> r) | (bl << (32 - r)); \
+    bl = t_; \
+    SIXTY4_SUB(al, ah, bl, bh); } while (0)
+#define UNMIX_RIGHT(al, ah, bl, bh, r) \
+  do { uint32_t t_; \
+    bl ^= al; bh ^= ah; \
+    t_ = (bh << r) | (bl >> (32 - r)); \
+    bl = (bl << r) | (bh >> (32 - r)); \
+    bh = t_; \
+    SIXTY4_SUB(al, ah, bl, bh); } while (0)
+
+/* op is SIXTY4_ADD or SIXTY4_SUB */
+#define INJECT_SUBKEY(op, k) \
+  do { \
+    op(x0, x1, k[0], k[1]); op(x2, x3, k[2], k[3]); \
+    op(x4, x5, k[4], k[5]); op(x6, x7, k[6], k[7]); \
+    op(x8, x9, k[8], k[9]); op(x10, x11, k[10], k[11]); \
+    op(x12, x13, k[12], k[13]); op(x14, x15, k[14], k[15]); \
+  } while (0)
 static const uint32_t C240_UPPER = 0x1BD11BDA;
 static const uint32_t C240_LOWER = 0xA9FC1A22;
 
@@ -14,28 +60,9 @@ static const uint64_t C240 = 0x1BD11BDAA9FC1A22;
 
 /* 64 bit functions */
 STATIC INLINE void sixty4_add_inplace(uint32_t *const lhs, uint32_t rhs_lower, uint32_t rhs_upper);
-STATIC INLINE void sixty4_sub_inplace(uint32_t *const lhs, uint32_t rhs_lower, uint32_t rhs_upper);
-STATIC INLINE void sixty4_rotleft_inplace(uint32_t *const lhs, const uint8_t amount);
-STATIC INLINE void sixty4_rotright_inplace(uint32_t *const lhs, const uint8_t amount);
-STATIC INLINE void sixty4_rotleft_xor_inplace(uint32_t *const lhs,
-					      uint32_t rhs_lower,
-					      uint32_t rhs_upper,
-					      const uint8_t amount);
-
-STATIC INLINE void sixty4_rotright_xor_inplace(uint32_t *const lhs,
-					       uint32_t rhs_lower,
-					       uint32_t rhs_upper,
-					       const uint8_t amount);
-
-STATIC INLINE void sixty4_xor_rotleft_inplace(uint32_t *const lhs,
-					      uint32_t rhs_lower,
-					      uint32_t rhs_upper,
-					      const uint8_t amount);
-
-STATIC INLINE void sixty4_xor_rotright_inplace(uint32_t *const lhs,
-					       uint32_t rhs_lower,
-					       uint32_t rhs_upper,
-					       const uint8_t amount);
+
+
+
 STATIC INLINE void sixty4_mult_pcg32_const(uint32_t *const lhs);
 static INLINE void sixty4_read_be64(uint32_t *const dst, const uint8_t *const value);
 
@@ -43,6 +70,10 @@ static INLINE void sixty4_read_be64(uint32_t *const dst, const uint8_t *const va
 static INLINE uint64_t read_be64_64bit(const uint8_t *const value);
 #endif
 
+static INLINE void block_load(uint8_t *const dst,
+                              const uint8_t *const src,
+                              const uint32_t src_len);
+
 /* PCG32 functions */
 STATIC INLINE uint32_t pcg32(const uint32_t inc, uint32_t *const state);
 static void pcg32_next_tweaks(uint32_t *const tweaks, uint32_t block_num, uint32_t *const state);
@@ -56,6 +87,38 @@ static void pcg32_next_tweaks_64bit(uint32_t *const tweaks, uint32_t block_num,
 STATIC void threefish_buf_init(struct ThreeFishBuffer *const buf3f,
                                const uint8_t *const key,
                                uint32_t *const pcg32_state);
+STATIC void threefish_extend_key(struct ThreeFishKey *const keys,
+                                 const uint8_t *const body_key);
+STATIC void threefish_add_tweaks(struct ThreeFishBuffer *const buf3f,
+                                 uint32_t *const pcg32_state);
+STATIC INLINE void threefish_add_block_tweaks(struct ThreeFishBuffer *const buf3f);
+STATIC INLINE const uint32_t* threefish_subkey(const struct ThreeFishBuffer *const buf3f,
+                                               const uint16_t s,
+                                               uint32_t *const subkey_buf);
+#if !defined(PPENC_LOW_RAM)
+STATIC void threefish_key_schedule(struct ThreeFishSubKeys *const subkeys,
+                                   struct ThreeFishKey *const keys,
+                                   const uint8_t *const body_key);
+static void threefish_seek(struct ThreeFishBuffer *const buf3f,
+                           const struct ThreeFishSubKeys *const key_schedule,
+                           const struct ThreeFishTweakPos *const pos,
+                           uint32_t *const pcg32_state);
+#endif
+static void threefish_encrypt_blocks(struct ThreeFishBuffer *const buf3f,
+                                     uint32_t *const pcg32_state,
+                                     const uint32_t first_block,
+                                     uint8_t *const dst,
+                                     const uint8_t *const src,
+                                     const uint32_t src_len,
+                                     const uint32_t num_blocks,
+                                     uint8_t *const buf64);
+static void threefish_decrypt_blocks(struct ThreeFishBuffer *const buf3f,
+                                     uint32_t *const pcg32_state,
+                                     const uint32_t first_block,
+                                     uint8_t *const dst,
+                                     const uint8_t *const src,
+                                     const uint32_t num_blocks,
+                                     uint8_t *const buf64);
 STATIC void threefish_encrypt_block(const struct ThreeFishBuffer *const buf3f,
                                     uint32_t *const block,
                                     uint32_t *const block_alt);
@@ -68,6 +131,35 @@ STATIC void
 threefish_buf_init_64bit(struct ThreeFishBuffer64 *const buf3f,
                          const uint8_t *const body_key,
 			 uint64_t *const pcg32_state);
+STATIC void
+threefish_key_schedule_64bit(struct ThreeFishSubKeys64 *const subkeys,
+                             uint64_t *const keys,
+                             const uint8_t *const body_key);
+STATIC void
+threefish_add_tweaks_64bit(struct ThreeFishBuffer64 *const buf3f,
+                           uint64_t *const pcg32_state);
+static void
+threefish_seek_64bit(struct ThreeFishBuffer64 *const buf3f,
+                     const struct ThreeFishSubKeys64 *const key_schedule,
+                     const struct ThreeFishTweakPos64 *const pos,
+                     uint64_t *const pcg32_state);
+static void
+threefish_encrypt_blocks_64bit(struct ThreeFishBuffer64 *const buf3f,
+                               uint64_t *const pcg32_state,
+                               const uint32_t first_block,
+                               uint8_t *const dst,
+                               const uint8_t *const src,
+                               const uint32_t src_len,
+                               const uint32_t num_blocks,
+                               uint8_t *const buf64);
+static void
+threefish_decrypt_blocks_64bit(struct ThreeFishBuffer64 *const buf3f,
+                               uint64_t *const pcg32_state,
+                               const uint32_t first_block,
+                               uint8_t *const dst,
+                               const uint8_t *const src,
+                               const uint32_t num_blocks,
+                               uint8_t *const buf64);
 
 STATIC void
 threefish_encrypt_block_64bit(const struct ThreeFishBuffer64 *const buf3f,
@@ -80,63 +172,431 @@ threefish_decrypt_block_64bit(const struct ThreeFishBuffer64 *const buf3f,
 #endif
 
 
+#if !defined(PPENC_LOW_RAM)
+void
+ppenc_threefish512_key_schedule(struct ThreeFishSubKeys *const key_schedule,
+                                const uint8_t *const key,
+                                struct ThreeFishKey *const keys_buf)
+{
+  threefish_key_schedule(key_schedule, keys_buf, key);
+}
+#endif
+
+#if defined(PPENC_64BIT)
+void
+ppenc_threefish512_key_schedule_64bit(struct ThreeFishSubKeys64 *const key_schedule,
+                                      const uint8_t *const key,
+                                      uint64_t *const keys_buf)
+{
+  threefish_key_schedule_64bit(key_schedule, keys_buf, key);
+}
+#endif
+
 void
 ppenc_threefish512_encrypt(const uint8_t *const key,
                            const uint8_t *const tweak_seed,
-                           uint8_t* const body,
+                           uint8_t *const body,
                            const uint32_t num_blocks,
                            struct ThreeFishBuffer *const buf3f,
                            uint8_t *const buf64)
+{
+  ppenc_threefish512_encrypt_to(key, tweak_seed, body, body,
+                                num_blocks * 64, num_blocks, buf3f, buf64);
+}
+
+void
+ppenc_threefish512_encrypt_to(const uint8_t *const key,
+                              const uint8_t *const tweak_seed,
+                              uint8_t *const dst,
+                              const uint8_t *const src,
+                              const uint32_t src_len,
+                              const uint32_t num_blocks,
+                              struct ThreeFishBuffer *const buf3f,
+                              uint8_t *const buf64)
 {
   uint32_t pcg32_state[2];
-  uint32_t block_num, s;
-  uint32_t* block;
 
   sixty4_read_be64(pcg32_state, tweak_seed);
   threefish_buf_init(buf3f, key, pcg32_state);
+  threefish_encrypt_blocks(buf3f, pcg32_state, 0, dst, src, src_len, num_blocks, buf64);
+}
 
-  block = (uint32_t*) body;
+#if !defined(PPENC_LOW_RAM)
+void
+ppenc_threefish512_encrypt_scheduled(const struct ThreeFishSubKeys *const key_schedule,
+                                     const uint8_t *const tweak_seed,
+                                     uint8_t *const dst,
+                                     const uint8_t *const src,
+                                     const uint32_t src_len,
+                                     const uint32_t num_blocks,
+                                     struct ThreeFishBuffer *const buf3f,
+                                     uint8_t *const buf64)
+{
+  uint32_t pcg32_state[2];
+  uint16_t i;
 
-  for (block_num = 1; block_num <= num_blocks; block_num++) {
-    threefish_encrypt_block(buf3f, block, (uint32_t*) buf64);
+  for (i = 0; i <= 18; i++)
+    buf3f->subkeys[i] = key_schedule[i];
 
-    pcg32_next_tweaks(buf3f->tweaks, block_num, pcg32_state);
-    for (s = 0; s <= 18; s++) {
-      uint16_t tweak_ind;
+  sixty4_read_be64(pcg32_state, tweak_seed);
+  threefish_add_tweaks(buf3f, pcg32_state);
+  threefish_encrypt_blocks(buf3f, pcg32_state, 0, dst, src, src_len, num_blocks, buf64);
+}
+#endif
 
-      tweak_ind = (s % 3) * 2;
-      sixty4_add_inplace(buf3f->subkeys[s]._5, buf3f->tweaks[tweak_ind], buf3f->tweaks[tweak_ind + 1]);
+#if defined(PPENC_64BIT)
+void
+ppenc_threefish512_encrypt_64bit(const uint8_t *const key,
+                                 const uint8_t *const tweak_seed,
+                                 uint8_t *const body,
+                                 const uint32_t num_blocks,
+                                 struct ThreeFishBuffer64 *const buf3f,
+                                 uint8_t *const buf64)
+{
+  ppenc_threefish512_encrypt_to_64bit(key, tweak_seed, body, body,
+                                      num_blocks * 64, num_blocks, buf3f, buf64);
+}
 
-      tweak_ind = ((s + 1) % 3) * 2;
-      sixty4_add_inplace(buf3f->subkeys[s]._6, buf3f->tweaks[tweak_ind], buf3f->tweaks[tweak_ind + 1]);
-    }
+void
+ppenc_threefish512_encrypt_to_64bit(const uint8_t *const key,
+                                    const uint8_t *const tweak_seed,
+                                    uint8_t *const dst,
+                                    const uint8_t *const src,
+                                    const uint32_t src_len,
+                                    const uint32_t num_blocks,
+                                    struct ThreeFishBuffer64 *const buf3f,
+                                    uint8_t *const buf64)
+{
+  uint64_t pcg32_state;
 
-    block = block + 16;
-  }
+  pcg32_state = read_be64_64bit(tweak_seed);
+  threefish_buf_init_64bit(buf3f, key, &pcg32_state);
+  threefish_encrypt_blocks_64bit(buf3f, &pcg32_state, 0, dst, src, src_len, num_blocks, buf64);
 }
 
+void
+ppenc_threefish512_encrypt_scheduled_64bit(const struct ThreeFishSubKeys64 *const key_schedule,
+                                           const uint8_t *const tweak_seed,
+                                           uint8_t *const dst,
+                                           const uint8_t *const src,
+                                           const uint32_t src_len,
+                                           const uint32_t num_blocks,
+                                           struct ThreeFishBuffer64 *const buf3f,
+                                           uint8_t *const buf64)
+{
+  uint64_t pcg32_state;
+  uint16_t i;
+
+  for (i = 0; i <= 18; i++)
+    buf3f->subkeys[i] = key_schedule[i];
+
+  pcg32_state = read_be64_64bit(tweak_seed);
+  threefish_add_tweaks_64bit(buf3f, &pcg32_state);
+  threefish_encrypt_blocks_64bit(buf3f, &pcg32_state, 0, dst, src, src_len, num_blocks, buf64);
+}
+#endif
+
+void
+ppenc_threefish512_decrypt(const uint8_t *const key,
+                           const uint8_t *const tweak_seed,
+                           uint8_t *const body,
+                           const uint32_t num_blocks,
+                           struct ThreeFishBuffer *const buf3f,
+                           uint8_t *const buf64)
+{
+  ppenc_threefish512_decrypt_to(key, tweak_seed, body, body,
+                                num_blocks, buf3f, buf64);
+}
+
+void
+ppenc_threefish512_decrypt_to(const uint8_t *const key,
+                              const uint8_t *const tweak_seed,
+                              uint8_t *const dst,
+                              const uint8_t *const src,
+                              const uint32_t num_blocks,
+                              struct ThreeFishBuffer *const buf3f,
+                              uint8_t *const buf64)
+{
+  uint32_t pcg32_state[2];
+
+  sixty4_read_be64(pcg32_state, tweak_seed);
+  threefish_buf_init(buf3f, key, pcg32_state);
+  threefish_decrypt_blocks(buf3f, pcg32_state, 0, dst, src, num_blocks, buf64);
+}
+
+#if !defined(PPENC_LOW_RAM)
+void
+ppenc_threefish512_decrypt_scheduled(const struct ThreeFishSubKeys *const key_schedule,
+                                     const uint8_t *const tweak_seed,
+                                     uint8_t *const dst,
+                                     const uint8_t *const src,
+                                     const uint32_t num_blocks,
+                                     struct ThreeFishBuffer *const buf3f,
+                                     uint8_t *const buf64)
+{
+  uint32_t pcg32_state[2];
+  uint16_t i;
+
+  for (i = 0; i <= 18; i++)
+    buf3f->subkeys[i] = key_schedule[i];
+
+  sixty4_read_be64(pcg32_state, tweak_seed);
+  threefish_add_tweaks(buf3f, pcg32_state);
+  threefish_decrypt_blocks(buf3f, pcg32_state, 0, dst, src, num_blocks, buf64);
+}
+#endif
+
 #if defined(PPENC_64BIT)
 void
-ppenc_threefish512_encrypt_64bit(const uint8_t *const key,
+ppenc_threefish512_decrypt_64bit(const uint8_t *const key,
                                  const uint8_t *const tweak_seed,
-                                 uint8_t* const body,
+                                 uint8_t *const body,
                                  const uint32_t num_blocks,
                                  struct ThreeFishBuffer64 *const buf3f,
                                  uint8_t *const buf64)
+{
+  ppenc_threefish512_decrypt_to_64bit(key, tweak_seed, body, body,
+                                      num_blocks, buf3f, buf64);
+}
+
+void
+ppenc_threefish512_decrypt_to_64bit(const uint8_t *const key,
+                                    const uint8_t *const tweak_seed,
+                                    uint8_t *const dst,
+                                    const uint8_t *const src,
+                                    const uint32_t num_blocks,
+                                    struct ThreeFishBuffer64 *const buf3f,
+                                    uint8_t *const buf64)
 {
   uint64_t pcg32_state;
-  uint32_t block_num, s;
-  uint64_t* block;
 
   pcg32_state = read_be64_64bit(tweak_seed);
   threefish_buf_init_64bit(buf3f, key, &pcg32_state);
+  threefish_decrypt_blocks_64bit(buf3f, &pcg32_state, 0, dst, src, num_blocks, buf64);
+}
+
+void
+ppenc_threefish512_decrypt_scheduled_64bit(const struct ThreeFishSubKeys64 *const key_schedule,
+                                           const uint8_t *const tweak_seed,
+                                           uint8_t *const dst,
+                                           const uint8_t *const src,
+                                           const uint32_t num_blocks,
+                                           struct ThreeFishBuffer64 *const buf3f,
+                                           uint8_t *const buf64)
+{
+  uint64_t pcg32_state;
+  uint16_t i;
+
+  for (i = 0; i <= 18; i++)
+    buf3f->subkeys[i] = key_schedule[i];
+
+  pcg32_state = read_be64_64bit(tweak_seed);
+  threefish_add_tweaks_64bit(buf3f, &pcg32_state);
+  threefish_decrypt_blocks_64bit(buf3f, &pcg32_state, 0, dst, src, num_blocks, buf64);
+}
+#endif
+
+void
+ppenc_threefish512_tweak_seek(struct ThreeFishTweakPos *const pos,
+                              const uint8_t *const tweak_seed,
+                              const uint32_t chunk_blocks,
+                              const uint32_t num_chunks)
+{
+  uint32_t pcg32_state[2];
+  uint32_t tweaks[6];
+  uint32_t tweak_sums[6];
+  uint32_t block_num, chunk;
+  uint16_t i;
+
+  sixty4_read_be64(pcg32_state, tweak_seed);
+  for (i = 0; i < 6; i++)
+    tweak_sums[i] = 0;
+
+  /* only the tweak stream is run, no blocks are touched */
+  block_num = 0;
+  for (chunk = 0; chunk < num_chunks; chunk++) {
+    for (; block_num <= chunk * chunk_blocks; block_num++) {
+      pcg32_next_tweaks(tweaks, block_num, pcg32_state);
+      for (i = 0; i < 6; i += 2)
+        sixty4_add_inplace(tweak_sums + i, tweaks[i], tweaks[i + 1]);
+    }
+
+    pos[chunk].pcg32_state[0] = pcg32_state[0];
+    pos[chunk].pcg32_state[1] = pcg32_state[1];
+    for (i = 0; i < 6; i++)
+      pos[chunk].tweak_sums[i] = tweak_sums[i];
+  }
+}
+
+#if !defined(PPENC_LOW_RAM)
+void
+ppenc_threefish512_encrypt_chunk(const struct ThreeFishSubKeys *const key_schedule,
+                                 const struct ThreeFishTweakPos *const pos,
+                                 const uint32_t first_block,
+                                 uint8_t *const dst,
+                                 const uint8_t *const src,
+                                 const uint32_t src_len,
+                                 const uint32_t num_blocks,
+                                 struct ThreeFishBuffer *const buf3f,
+                                 uint8_t *const buf64)
+{
+  uint32_t pcg32_state[2];
+
+  threefish_seek(buf3f, key_schedule, pos, pcg32_state);
+  threefish_encrypt_blocks(buf3f, pcg32_state, first_block, dst, src, src_len, num_blocks, buf64);
+}
+
+void
+ppenc_threefish512_decrypt_chunk(const struct ThreeFishSubKeys *const key_schedule,
+                                 const struct ThreeFishTweakPos *const pos,
+                                 const uint32_t first_block,
+                                 uint8_t *const dst,
+                                 const uint8_t *const src,
+                                 const uint32_t num_blocks,
+                                 struct ThreeFishBuffer *const buf3f,
+                                 uint8_t *const buf64)
+{
+  uint32_t pcg32_state[2];
+
+  threefish_seek(buf3f, key_schedule, pos, pcg32_state);
+  threefish_decrypt_blocks(buf3f, pcg32_state, first_block, dst, src, num_blocks, buf64);
+}
+#endif
+
+#if defined(PPENC_64BIT)
+void
+ppenc_threefish512_tweak_seek_64bit(struct ThreeFishTweakPos64 *const pos,
+                                    const uint8_t *const tweak_seed,
+                                    const uint32_t chunk_blocks,
+                                    const uint32_t num_chunks)
+{
+  uint64_t pcg32_state;
+  uint32_t tweaks[6];
+  uint64_t tweak_sums[3];
+  uint32_t block_num, chunk;
+  uint16_t i;
+
+  pcg32_state = read_be64_64bit(tweak_seed);
+  for (i = 0; i < 3; i++)
+    tweak_sums[i] = 0;
+
+  /* only the tweak stream is run, no blocks are touched */
+  block_num = 0;
+  for (chunk = 0; chunk < num_chunks; chunk++) {
+    for (; block_num <= chunk * chunk_blocks; block_num++) {
+      pcg32_next_tweaks_64bit(tweaks, block_num, &pcg32_state);
+      for (i = 0; i < 3; i++) {
+        uint64_t tmp;
+
+        tmp = tweaks[i * 2 + 1];
+        tmp <<= 32;
+        tmp += tweaks[i * 2];
+        tweak_sums[i] += tmp;
+      }
+    }
+
+    pos[chunk].pcg32_state = pcg32_state;
+    for (i = 0; i < 3; i++)
+      pos[chunk].tweak_sums[i] = tweak_sums[i];
+  }
+}
+
+void
+ppenc_threefish512_encrypt_chunk_64bit(const struct ThreeFishSubKeys64 *const key_schedule,
+                                       const struct ThreeFishTweakPos64 *const pos,
+                                       const uint32_t first_block,
+                                       uint8_t *const dst,
+                                       const uint8_t *const src,
+                                       const uint32_t src_len,
+                                       const uint32_t num_blocks,
+                                       struct ThreeFishBuffer64 *const buf3f,
+                                       uint8_t *const buf64)
+{
+  uint64_t pcg32_state;
+
+  threefish_seek_64bit(buf3f, key_schedule, pos, &pcg32_state);
+  threefish_encrypt_blocks_64bit(buf3f, &pcg32_state, first_block, dst, src, src_len, num_blocks, buf64);
+}
+
+void
+ppenc_threefish512_decrypt_chunk_64bit(const struct ThreeFishSubKeys64 *const key_schedule,
+                                       const struct ThreeFishTweakPos64 *const pos,
+                                       const uint32_t first_block,
+                                       uint8_t *const dst,
+                                       const uint8_t *const src,
+                                       const uint32_t num_blocks,
+                                       struct ThreeFishBuffer64 *const buf3f,
+                                       uint8_t *const buf64)
+{
+  uint64_t pcg32_state;
+
+  threefish_seek_64bit(buf3f, key_schedule, pos, &pcg32_state);
+  threefish_decrypt_blocks_64bit(buf3f, &pcg32_state, first_block, dst, src, num_blocks, buf64);
+}
+#endif
+
+/* buf3f holds the subkeys with the tweaks of blocks up to  *
+ * first_block applied (dst/src start at first_block), each *
+ * block's tweaks are added on after it is processed        */
+static void
+threefish_encrypt_blocks(struct ThreeFishBuffer *const buf3f,
+                         uint32_t *const pcg32_state,
+                         const uint32_t first_block,
+                         uint8_t *const dst,
+                         const uint8_t *const src,
+                         const uint32_t src_len,
+                         const uint32_t num_blocks,
+                         uint8_t *const buf64)
+{
+  uint32_t block_num, offset;
+  uint32_t* block;
+
+  block = (uint32_t*) dst;
 
-  block = (uint64_t*) body;
+  for (block_num = 1; block_num <= num_blocks; block_num++) {
+    offset = (block_num - 1) * 64;
+    if (src != dst && offset < src_len)
+      block_load((uint8_t*) block, src + offset, src_len - offset);
+    threefish_encrypt_block(buf3f, block, (uint32_t*) buf64);
+
+    /* nothing uses the tweaks after the last block */
+    if (block_num == num_blocks)
+      break;
+
+    pcg32_next_tweaks(buf3f->tweaks, first_block + block_num, pcg32_state);
+    threefish_add_block_tweaks(buf3f);
+
+    block = block + 16;
+  }
+}
+
+#if defined(PPENC_64BIT)
+static void
+threefish_encrypt_blocks_64bit(struct ThreeFishBuffer64 *const buf3f,
+                               uint64_t *const pcg32_state,
+                               const uint32_t first_block,
+                               uint8_t *const dst,
+                               const uint8_t *const src,
+                               const uint32_t src_len,
+                               const uint32_t num_blocks,
+                               uint8_t *const buf64)
+{
+  uint32_t block_num, offset, s;
+  uint64_t* block;
+
+  block = (uint64_t*) dst;
 
   for (block_num = 1; block_num <= num_blocks; block_num++) {
+    offset = (block_num - 1) * 64;
+    if (src != dst && offset < src_len)
+      block_load((uint8_t*) block, src + offset, src_len - offset);
     threefish_encrypt_block_64bit(buf3f, block, (uint64_t*) buf64);
 
-    pcg32_next_tweaks_64bit(buf3f->tweaks, block_num, &pcg32_state);
+    /* nothing uses the tweaks after the last block */
+    if (block_num == num_blocks)
+      break;
+
+    pcg32_next_tweaks_64bit(buf3f->tweaks, first_block + block_num, pcg32_state);
     for (s = 0; s <= 18; s++) {
       uint16_t tweak_ind;
       uint64_t tmp;
@@ -158,63 +618,61 @@ ppenc_threefish512_encrypt_64bit(const uint8_t *const key,
 }
 #endif
 
-void
-ppenc_threefish512_decrypt(const uint8_t *const key,
-                           const uint8_t *const tweak_seed,
-                           uint8_t* const body,
-                           const uint32_t num_blocks,
-                           struct ThreeFishBuffer *const buf3f,
-                           uint8_t *const buf64)
+static void
+threefish_decrypt_blocks(struct ThreeFishBuffer *const buf3f,
+                         uint32_t *const pcg32_state,
+                         const uint32_t first_block,
+                         uint8_t *const dst,
+                         const uint8_t *const src,
+                         const uint32_t num_blocks,
+                         uint8_t *const buf64)
 {
-  uint32_t pcg32_state[2];
-  uint32_t block_num, s;
+  uint32_t block_num;
   uint32_t* block;
 
-  sixty4_read_be64(pcg32_state, tweak_seed);
-  threefish_buf_init(buf3f, key, pcg32_state);
-
-  block = (uint32_t*) body;
+  block = (uint32_t*) dst;
 
   for (block_num = 1; block_num <= num_blocks; block_num++) {
+    if (src != dst)
+      block_load((uint8_t*) block, src + (block_num - 1) * 64, 64);
     threefish_decrypt_block(buf3f, block, (uint32_t*) buf64);
 
-    pcg32_next_tweaks(buf3f->tweaks, block_num, pcg32_state);
-    for (s = 0; s <= 18; s++) {
-      uint16_t tweak_ind;
-
-      tweak_ind = (s % 3) * 2;
-      sixty4_add_inplace(buf3f->subkeys[s]._5, buf3f->tweaks[tweak_ind], buf3f->tweaks[tweak_ind + 1]);
+    /* nothing uses the tweaks after the last block */
+    if (block_num == num_blocks)
+      break;
 
-      tweak_ind = ((s + 1) % 3) * 2;
-      sixty4_add_inplace(buf3f->subkeys[s]._6, buf3f->tweaks[tweak_ind], buf3f->tweaks[tweak_ind + 1]);
-    }
+    pcg32_next_tweaks(buf3f->tweaks, first_block + block_num, pcg32_state);
+    threefish_add_block_tweaks(buf3f);
 
     block = block + 16;
   }
 }
 
 #if defined(PPENC_64BIT)
-void
-ppenc_threefish512_decrypt_64bit(const uint8_t *const key,
-                                 const uint8_t *const tweak_seed,
-                                 uint8_t* const body,
-                                 const uint32_t num_blocks,
-                                 struct ThreeFishBuffer64 *const buf3f,
-                                 uint8_t *const buf64)
+static void
+threefish_decrypt_blocks_64bit(struct ThreeFishBuffer64 *const buf3f,
+                               uint64_t *const pcg32_state,
+                               const uint32_t first_block,
+                               uint8_t *const dst,
+                               const uint8_t *const src,
+                               const uint32_t num_blocks,
+                               uint8_t *const buf64)
 {
-  uint64_t pcg32_state;
   uint32_t block_num, s;
   uint64_t* block;
 
-  pcg32_state = read_be64_64bit(tweak_seed);
-  threefish_buf_init_64bit(buf3f, key, &pcg32_state);
-
-  block = (uint64_t*) body;
+  block = (uint64_t*) dst;
 
   for (block_num = 1; block_num <= num_blocks; block_num++) {
+    if (src != dst)
+      block_load((uint8_t*) block, src + (block_num - 1) * 64, 64);
     threefish_decrypt_block_64bit(buf3f, block, (uint64_t*) buf64);
 
-    pcg32_next_tweaks_64bit(buf3f->tweaks, block_num, &pcg32_state);
+    /* nothing uses the tweaks after the last block */
+    if (block_num == num_blocks)
+      break;
+
+    pcg32_next_tweaks_64bit(buf3f->tweaks, first_block + block_num, pcg32_state);
     for (s = 0; s <= 18; s++) {
       uint16_t tweak_ind;
       uint64_t tmp;
@@ -247,71 +705,6 @@ sixty4_add_inplace(uint32_t *const lhs, uint32_t rhs_lower, uint32_t rhs_upper)
   lhs[0] += rhs_lower;
 }
 
-STATIC INLINE void
-sixty4_sub_inplace(uint32_t *const lhs, uint32_t rhs_lower, uint32_t rhs_upper)
-{
-  rhs_lower = ~rhs_lower;
-  rhs_upper = ~rhs_upper;
-
-  if (rhs_lower == U32_MAX)
-    rhs_upper += 1;
-
-  rhs_lower += 1;
-  sixty4_add_inplace(lhs, rhs_lower, rhs_upper);
-}
-
-STATIC INLINE void
-sixty4_rotleft_inplace(uint32_t *const lhs, const uint8_t amount)
-{
-  uint32_t upper;
-
-  upper = (lhs[1] << amount) | (lhs[0] >> (32 - amount));
-  lhs[0] = (lhs[0] << amount) | (lhs[1] >> (32 - amount));
-  lhs[1] = upper;
-}
-
-STATIC INLINE void
-sixty4_rotright_inplace(uint32_t *const lhs, const uint8_t amount)
-{
-  uint32_t lower;
-
-  lower = (lhs[0] >> amount) | (lhs[1] << (32 - amount));
-  lhs[1] = (lhs[1] >> amount) | (lhs[0] << (32 - amount));
-  lhs[0] = lower;
-}
-
-STATIC INLINE void
-sixty4_rotleft_xor_inplace(uint32_t *const lhs, uint32_t rhs_lower, uint32_t rhs_upper, const uint8_t amount)
-{
-  sixty4_rotleft_inplace(lhs, amount);
-  lhs[0] ^= rhs_lower;
-  lhs[1] ^= rhs_upper;
-}
-
-STATIC INLINE void
-sixty4_rotright_xor_inplace(uint32_t *const lhs, uint32_t rhs_lower, uint32_t rhs_upper, const uint8_t amount)
-{
-  sixty4_rotright_inplace(lhs, amount);
-  lhs[0] ^= rhs_lower;
-  lhs[1] ^= rhs_upper;
-}
-
-STATIC INLINE void
-sixty4_xor_rotleft_inplace(uint32_t *const lhs, uint32_t rhs_lower, uint32_t rhs_upper, const uint8_t amount)
-{
-  lhs[0] ^= rhs_lower;
-  lhs[1] ^= rhs_upper;
-  sixty4_rotleft_inplace(lhs, amount);
-}
-
-STATIC INLINE void
-sixty4_xor_rotright_inplace(uint32_t *const lhs, uint32_t rhs_lower, uint32_t rhs_upper, const uint8_t amount)
-{
-  lhs[0] ^= rhs_lower;
-  lhs[1] ^= rhs_upper;
-  sixty4_rotright_inplace(lhs, amount);
-}
-
 STATIC INLINE void
 sixty4_mult_pcg32_const(uint32_t *const lhs)
 {
@@ -371,6 +764,22 @@ read_be64_64bit(const uint8_t *const value)
 }
 #endif
 
+/* copy up to a block from src, bytes of the block past src_len *
+ * are left as they are in dst (the sender's padding)           */
+static INLINE void
+block_load(uint8_t *const dst, const uint8_t *const src, const uint32_t src_len)
+{
+  uint8_t i;
+
+  if (src_len >= 64) {
+    for (i = 0; i < 64; i++)
+      dst[i] = src[i];
+  } else {
+    for (i = 0; i < src_len; i++)
+      dst[i] = src[i];
+  }
+}
+
 STATIC INLINE uint32_t
 pcg32(const uint32_t inc, uint32_t *const state)
 {
@@ -443,50 +852,156 @@ threefish_buf_init(struct ThreeFishBuffer *const buf3f,
                    const uint8_t *const body_key,
 		   uint32_t *const pcg32_state)
 {
+#if defined(PPENC_LOW_RAM)
   uint16_t i;
 
-  /* set the tweaks */
-  pcg32_next_tweaks(buf3f->tweaks, 0, pcg32_state);
+  threefish_extend_key(buf3f->keys, body_key);
+  for (i = 0; i < 6; i++)
+    buf3f->tweak_sums[i] = 0;
+#else
+  threefish_key_schedule(buf3f->subkeys, buf3f->keys, body_key);
+#endif
+  threefish_add_tweaks(buf3f, pcg32_state);
+}
 
-  /* save the keys */
-  buf3f->keys[8].lower = C240_LOWER;
-  buf3f->keys[8].upper = C240_UPPER;
+/* the key words plus the parity word k8 */
+STATIC void
+threefish_extend_key(struct ThreeFishKey *const keys,
+                     const uint8_t *const body_key)
+{
+  uint16_t i;
+
+  keys[8].lower = C240_LOWER;
+  keys[8].upper = C240_UPPER;
   for (i = 0; i < 8; i++) {
-    buf3f->keys[i].lower = ((uint32_t*) body_key)[i * 2];
-    buf3f->keys[i].upper = ((uint32_t*) body_key)[(i * 2) + 1];
-    buf3f->keys[8].lower ^= buf3f->keys[i].lower;
-    buf3f->keys[8].upper ^= buf3f->keys[i].upper;
+    keys[i].lower = ((uint32_t*) body_key)[i * 2];
+    keys[i].upper = ((uint32_t*) body_key)[(i * 2) + 1];
+    keys[8].lower ^= keys[i].lower;
+    keys[8].upper ^= keys[i].upper;
   }
+}
+
+#if !defined(PPENC_LOW_RAM)
+/* the subkeys without the tweak, these only change with the key */
+STATIC void
+threefish_key_schedule(struct ThreeFishSubKeys *const subkeys,
+                       struct ThreeFishKey *const keys,
+                       const uint8_t *const body_key)
+{
+  uint16_t i;
+
+  threefish_extend_key(keys, body_key);
 
   /* compute the subkeys */
+  for (i = 0; i <= 18; i++) {
+    subkeys[i]._0[0] = keys[i % 9].lower;
+    subkeys[i]._0[1] = keys[i % 9].upper;
+    subkeys[i]._1[0] = keys[(i + 1) % 9].lower;
+    subkeys[i]._1[1] = keys[(i + 1) % 9].upper;
+    subkeys[i]._2[0] = keys[(i + 2) % 9].lower;
+    subkeys[i]._2[1] = keys[(i + 2) % 9].upper;
+    subkeys[i]._3[0] = keys[(i + 3) % 9].lower;
+    subkeys[i]._3[1] = keys[(i + 3) % 9].upper;
+    subkeys[i]._4[0] = keys[(i + 4) % 9].lower;
+    subkeys[i]._4[1] = keys[(i + 4) % 9].upper;
+    subkeys[i]._5[0] = keys[(i + 5) % 9].lower;
+    subkeys[i]._5[1] = keys[(i + 5) % 9].upper;
+    subkeys[i]._6[0] = keys[(i + 6) % 9].lower;
+    subkeys[i]._6[1] = keys[(i + 6) % 9].upper;
+    subkeys[i]._7[0] = keys[(i + 7) % 9].lower;
+    subkeys[i]._7[1] = keys[(i + 7) % 9].upper;
+
+    sixty4_add_inplace(subkeys[i]._7, i, 0);
+  }
+}
+#endif
+
+/* generate tweak0 and apply it to the key only subkeys */
+STATIC void
+threefish_add_tweaks(struct ThreeFishBuffer *const buf3f,
+                     uint32_t *const pcg32_state)
+{
+  pcg32_next_tweaks(buf3f->tweaks, 0, pcg32_state);
+  threefish_add_block_tweaks(buf3f);
+}
+
+/* add the tweaks just generated into buf3f->tweaks on to the *
+ * subkeys, in low ram mode on to the sums they're derived from */
+STATIC INLINE void
+threefish_add_block_tweaks(struct ThreeFishBuffer *const buf3f)
+{
+  uint16_t i;
+
+#if defined(PPENC_LOW_RAM)
+  for (i = 0; i < 6; i += 2)
+    sixty4_add_inplace(buf3f->tweak_sums + i, buf3f->tweaks[i], buf3f->tweaks[i + 1]);
+#else
   for (i = 0; i <= 18; i++) {
     uint16_t tweak_ind;
-    buf3f->subkeys[i]._0[0] = buf3f->keys[i % 9].lower;
-    buf3f->subkeys[i]._0[1] = buf3f->keys[i % 9].upper;
-    buf3f->subkeys[i]._1[0] = buf3f->keys[(i + 1) % 9].lower;
-    buf3f->subkeys[i]._1[1] = buf3f->keys[(i + 1) % 9].upper;
-    buf3f->subkeys[i]._2[0] = buf3f->keys[(i + 2) % 9].lower;
-    buf3f->subkeys[i]._2[1] = buf3f->keys[(i + 2) % 9].upper;
-    buf3f->subkeys[i]._3[0] = buf3f->keys[(i + 3) % 9].lower;
-    buf3f->subkeys[i]._3[1] = buf3f->keys[(i + 3) % 9].upper;
-    buf3f->subkeys[i]._4[0] = buf3f->keys[(i + 4) % 9].lower;
-    buf3f->subkeys[i]._4[1] = buf3f->keys[(i + 4) % 9].upper;
-    buf3f->subkeys[i]._5[0] = buf3f->keys[(i + 5) % 9].lower;
-    buf3f->subkeys[i]._5[1] = buf3f->keys[(i + 5) % 9].upper;
-    buf3f->subkeys[i]._6[0] = buf3f->keys[(i + 6) % 9].lower;
-    buf3f->subkeys[i]._6[1] = buf3f->keys[(i + 6) % 9].upper;
-    buf3f->subkeys[i]._7[0] = buf3f->keys[(i + 7) % 9].lower;
-    buf3f->subkeys[i]._7[1] = buf3f->keys[(i + 7) % 9].upper;
-
-    /* apply tweak0 */
     tweak_ind = (i % 3) * 2;
     sixty4_add_inplace(buf3f->subkeys[i]._5, buf3f->tweaks[tweak_ind], buf3f->tweaks[tweak_ind + 1]);
     tweak_ind = ((i + 1) % 3) * 2;
     sixty4_add_inplace(buf3f->subkeys[i]._6, buf3f->tweaks[tweak_ind], buf3f->tweaks[tweak_ind + 1]);
- 
-    sixty4_add_inplace(buf3f->subkeys[i]._7, i, 0);
   }
+#endif
+}
+
+/* subkey s as 16 words (lower, upper for each 64 bit word). In *
+ * low ram mode it is derived into subkey_buf: word w is key      *
+ * (s + w) mod 9, words 5 and 6 add tweaks s mod 3 and (s + 1)    *
+ * mod 3 and word 7 adds s. Otherwise it's read from the schedule  */
+STATIC INLINE const uint32_t*
+threefish_subkey(const struct ThreeFishBuffer *const buf3f,
+                 const uint16_t s,
+                 uint32_t *const subkey_buf)
+{
+#if defined(PPENC_LOW_RAM)
+  uint16_t w, k, t;
+
+  k = s % 9;
+  for (w = 0; w < 16; w += 2) {
+    subkey_buf[w] = buf3f->keys[k].lower;
+    subkey_buf[w + 1] = buf3f->keys[k].upper;
+    k = (k == 8) ? 0 : k + 1;
+  }
+
+  t = (s % 3) * 2;
+  sixty4_add_inplace(subkey_buf + 10, buf3f->tweak_sums[t], buf3f->tweak_sums[t + 1]);
+  t = (t == 4) ? 0 : t + 2;
+  sixty4_add_inplace(subkey_buf + 12, buf3f->tweak_sums[t], buf3f->tweak_sums[t + 1]);
+  sixty4_add_inplace(subkey_buf + 14, s, 0);
+
+  return subkey_buf;
+#else
+  (void) subkey_buf;
+  return buf3f->subkeys[s]._0;
+#endif
+}
+
+#if !defined(PPENC_LOW_RAM)
+/* key_schedule may be buf3f->subkeys itself */
+static void
+threefish_seek(struct ThreeFishBuffer *const buf3f,
+               const struct ThreeFishSubKeys *const key_schedule,
+               const struct ThreeFishTweakPos *const pos,
+               uint32_t *const pcg32_state)
+{
+  uint16_t i;
+
+  for (i = 0; i <= 18; i++) {
+    uint16_t tweak_ind;
+
+    buf3f->subkeys[i] = key_schedule[i];
+    tweak_ind = (i % 3) * 2;
+    sixty4_add_inplace(buf3f->subkeys[i]._5, pos->tweak_sums[tweak_ind], pos->tweak_sums[tweak_ind + 1]);
+    tweak_ind = ((i + 1) % 3) * 2;
+    sixty4_add_inplace(buf3f->subkeys[i]._6, pos->tweak_sums[tweak_ind], pos->tweak_sums[tweak_ind + 1]);
+  }
+
+  pcg32_state[0] = pos->pcg32_state[0];
+  pcg32_state[1] = pos->pcg32_state[1];
 }
+#endif
 
 #if defined(PPENC_64BIT)
 STATIC void
@@ -494,32 +1009,50 @@ threefish_buf_init_64bit(struct ThreeFishBuffer64 *const buf3f,
                          const uint8_t *const body_key,
 			 uint64_t *const pcg32_state)
 {
-  uint16_t i;
+  threefish_key_schedule_64bit(buf3f->subkeys, buf3f->keys, body_key);
+  threefish_add_tweaks_64bit(buf3f, pcg32_state);
+}
 
-  /* generate the tweaks */
-  pcg32_next_tweaks_64bit(buf3f->tweaks, 0, pcg32_state);
+STATIC void
+threefish_key_schedule_64bit(struct ThreeFishSubKeys64 *const subkeys,
+                             uint64_t *const keys,
+                             const uint8_t *const body_key)
+{
+  uint16_t i;
 
   /* save the keys */
-  buf3f->keys[8] = C240;
+  keys[8] = C240;
   for (i = 0; i < 8; i++) {
-    buf3f->keys[i] = ((uint64_t*) body_key)[i];
-    buf3f->keys[8] ^= buf3f->keys[i];
+    keys[i] = ((uint64_t*) body_key)[i];
+    keys[8] ^= keys[i];
   }
 
   /* compute the subkeys */
+  for (i = 0; i <= 18; i++) {
+    subkeys[i]._0 = keys[i % 9];
+    subkeys[i]._1 = keys[(i + 1) % 9];
+    subkeys[i]._2 = keys[(i + 2) % 9];
+    subkeys[i]._3 = keys[(i + 3) % 9];
+    subkeys[i]._4 = keys[(i + 4) % 9];
+    subkeys[i]._5 = keys[(i + 5) % 9];
+    subkeys[i]._6 = keys[(i + 6) % 9];
+    subkeys[i]._7 = keys[(i + 7) % 9] + i;
+  }
+}
+
+STATIC void
+threefish_add_tweaks_64bit(struct ThreeFishBuffer64 *const buf3f,
+                           uint64_t *const pcg32_state)
+{
+  uint16_t i;
+
+  /* generate the tweaks */
+  pcg32_next_tweaks_64bit(buf3f->tweaks, 0, pcg32_state);
+
   for (i = 0; i <= 18; i++) {
     uint16_t tweak_ind;
     uint64_t tmp;
-    buf3f->subkeys[i]._0 = buf3f->keys[i % 9];
-    buf3f->subkeys[i]._1 = buf3f->keys[(i + 1) % 9];
-    buf3f->subkeys[i]._2 = buf3f->keys[(i + 2) % 9];
-    buf3f->subkeys[i]._3 = buf3f->keys[(i + 3) % 9];
-    buf3f->subkeys[i]._4 = buf3f->keys[(i + 4) % 9];
-    buf3f->subkeys[i]._5 = buf3f->keys[(i + 5) % 9];
-    buf3f->subkeys[i]._6 = buf3f->keys[(i + 6) % 9];
-    buf3f->subkeys[i]._7 = buf3f->keys[(i + 7) % 9];
-
-    /* apply tweak0 */
+
     tweak_ind = (i % 3) * 2;
     tmp = buf3f->tweaks[tweak_ind + 1];
     tmp <<= 32;
@@ -531,9 +1064,24 @@ threefish_buf_init_64bit(struct ThreeFishBuffer64 *const buf3f,
     tmp <<= 32;
     tmp += buf3f->tweaks[tweak_ind];
     buf3f->subkeys[i]._6 += tmp;
+  }
+}
+
+static void
+threefish_seek_64bit(struct ThreeFishBuffer64 *const buf3f,
+                     const struct ThreeFishSubKeys64 *const key_schedule,
+                     const struct ThreeFishTweakPos64 *const pos,
+                     uint64_t *const pcg32_state)
+{
+  uint16_t i;
 
-    buf3f->subkeys[i]._7 += i;
+  for (i = 0; i <= 18; i++) {
+    buf3f->subkeys[i] = key_schedule[i];
+    buf3f->subkeys[i]._5 += pos->tweak_sums[i % 3];
+    buf3f->subkeys[i]._6 += pos->tweak_sums[(i + 1) % 3];
   }
+
+  *pcg32_state = pos->pcg32_state;
 }
 
 #endif
@@ -543,260 +1091,80 @@ threefish_encrypt_block(const struct ThreeFishBuffer *const buf3f,
                         uint32_t *const block,
                         uint32_t *const block_alt)
 {
-  uint16_t d, s;
-  const struct ThreeFishSubKeys *subkeys;
+  const uint32_t *subkey;
+  uint32_t x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
+  uint16_t s;
 
-  subkeys = buf3f->subkeys;
+  x0 = block[0]; x1 = block[1]; x2 = block[2]; x3 = block[3];
+  x4 = block[4]; x5 = block[5]; x6 = block[6]; x7 = block[7];
+  x8 = block[8]; x9 = block[9]; x10 = block[10]; x11 = block[11];
+  x12 = block[12]; x13 = block[13]; x14 = block[14]; x15 = block[15];
 
-  for (d = 0; d < 72; d += 8) {
-    s = d / 4;
-
-    sixty4_add_inplace(block, subkeys[s]._0[0], subkeys[s]._0[1]);
-    sixty4_add_inplace(block + 2, subkeys[s]._1[0], subkeys[s]._1[1]);
-    sixty4_add_inplace(block + 4, subkeys[s]._2[0], subkeys[s]._2[1]);
-    sixty4_add_inplace(block + 6, subkeys[s]._3[0], subkeys[s]._3[1]);
-    sixty4_add_inplace(block + 8, subkeys[s]._4[0], subkeys[s]._4[1]);
-    sixty4_add_inplace(block + 10, subkeys[s]._5[0], subkeys[s]._5[1]);
-    sixty4_add_inplace(block + 12, subkeys[s]._6[0], subkeys[s]._6[1]);
-    sixty4_add_inplace(block + 14, subkeys[s]._7[0], subkeys[s]._7[1]);
+  for (s = 0; s < 18; s += 2) {
+    subkey = threefish_subkey(buf3f, s, block_alt);
+    INJECT_SUBKEY(SIXTY4_ADD, subkey);
 
     /* round 1 */
-    sixty4_add_inplace(block, block[2], block[3]);
-    sixty4_add_inplace(block + 4, block[6], block[7]);
-    sixty4_add_inplace(block + 8, block[10], block[11]);
-    sixty4_add_inplace(block + 12, block[14], block[15]);
-    sixty4_rotright_xor_inplace(block + 2, block[0], block[1], 18);
-    sixty4_rotright_xor_inplace(block + 6, block[4], block[5], 28);
-    sixty4_rotleft_xor_inplace(block + 10, block[8], block[9], 19);
-    sixty4_rotright_xor_inplace(block + 14, block[12], block[13], 27);
-
-    block_alt[0] = block[4];
-    block_alt[1] = block[5];
-    block_alt[2] = block[2];
-    block_alt[3] = block[3];
-    block_alt[4] = block[8];
-    block_alt[5] = block[9];
-    block_alt[6] = block[14];
-    block_alt[7] = block[15];
-    block_alt[8] = block[12];
-    block_alt[9] = block[13];
-    block_alt[10] = block[10];
-    block_alt[11] = block[11];
-    block_alt[12] = block[0];
-    block_alt[13] = block[1];
-    block_alt[14] = block[6];
-    block_alt[15] = block[7];
+    MIX_RIGHT(x0, x1, x2, x3, 18);
+    MIX_RIGHT(x4, x5, x6, x7, 28);
+    MIX_LEFT(x8, x9, x10, x11, 19);
+    MIX_RIGHT(x12, x13, x14, x15, 27);
 
     /* round 2 */
-    sixty4_add_inplace(block_alt, block_alt[2], block_alt[3]);
-    sixty4_add_inplace(block_alt + 4, block_alt[6], block_alt[7]);
-    sixty4_add_inplace(block_alt + 8, block_alt[10], block_alt[11]);
-    sixty4_add_inplace(block_alt + 12, block_alt[14], block_alt[15]);
-    sixty4_rotright_xor_inplace(block_alt + 2, block_alt[0], block_alt[1], 31);
-    sixty4_rotleft_xor_inplace(block_alt + 6, block_alt[4], block_alt[5], 27);
-    sixty4_rotleft_xor_inplace(block_alt + 10, block_alt[8], block_alt[9], 14);
-    sixty4_rotright_xor_inplace(block_alt + 14, block_alt[12], block_alt[13], 22);
-
-    block[0] = block_alt[4];
-    block[1] = block_alt[5];
-    block[2] = block_alt[2];
-    block[3] = block_alt[3];
-    block[4] = block_alt[8];
-    block[5] = block_alt[9];
-    block[6] = block_alt[14];
-    block[7] = block_alt[15];
-    block[8] = block_alt[12];
-    block[9] = block_alt[13];
-    block[10] = block_alt[10];
-    block[11] = block_alt[11];
-    block[12] = block_alt[0];
-    block[13] = block_alt[1];
-    block[14] = block_alt[6];
-    block[15] = block_alt[7];
-
+    MIX_RIGHT(x4, x5, x2, x3, 31);
+    MIX_LEFT(x8, x9, x14, x15, 27);
+    MIX_LEFT(x12, x13, x10, x11, 14);
+    MIX_RIGHT(x0, x1, x6, x7, 22);
 
     /* round 3 */
-    sixty4_add_inplace(block, block[2], block[3]);
-    sixty4_add_inplace(block + 4, block[6], block[7]);
-    sixty4_add_inplace(block + 8, block[10], block[11]);
-    sixty4_add_inplace(block + 12, block[14], block[15]);
-    sixty4_rotleft_xor_inplace(block + 2, block[0], block[1], 17);
-    sixty4_rotright_xor_inplace(block + 6, block[4], block[5], 15);
-    sixty4_rotright_xor_inplace(block + 10, block[8], block[9], 28);
-    sixty4_rotright_xor_inplace(block + 14, block[12], block[13], 25);
-
-    block_alt[0] = block[4];
-    block_alt[1] = block[5];
-    block_alt[2] = block[2];
-    block_alt[3] = block[3];
-    block_alt[4] = block[8];
-    block_alt[5] = block[9];
-    block_alt[6] = block[14];
-    block_alt[7] = block[15];
-    block_alt[8] = block[12];
-    block_alt[9] = block[13];
-    block_alt[10] = block[10];
-    block_alt[11] = block[11];
-    block_alt[12] = block[0];
-    block_alt[13] = block[1];
-    block_alt[14] = block[6];
-    block_alt[15] = block[7];
+    MIX_LEFT(x8, x9, x2, x3, 17);
+    MIX_RIGHT(x12, x13, x6, x7, 15);
+    MIX_RIGHT(x0, x1, x10, x11, 28);
+    MIX_RIGHT(x4, x5, x14, x15, 25);
 
     /* round 4 */
-    sixty4_add_inplace(block_alt, block_alt[2], block_alt[3]);
-    sixty4_add_inplace(block_alt + 4, block_alt[6], block_alt[7]);
-    sixty4_add_inplace(block_alt + 8, block_alt[10], block_alt[11]);
-    sixty4_add_inplace(block_alt + 12, block_alt[14], block_alt[15]);
-    sixty4_rotright_xor_inplace(block_alt + 2, block_alt[0], block_alt[1], 20);
-    sixty4_rotleft_xor_inplace(block_alt + 6, block_alt[4], block_alt[5], 9);
-    sixty4_rotright_xor_inplace(block_alt + 10, block_alt[8], block_alt[9], 10);
-    sixty4_rotright_xor_inplace(block_alt + 14, block_alt[12], block_alt[13], 8);
-
-    block[0] = block_alt[4];
-    block[1] = block_alt[5];
-    block[2] = block_alt[2];
-    block[3] = block_alt[3];
-    block[4] = block_alt[8];
-    block[5] = block_alt[9];
-    block[6] = block_alt[14];
-    block[7] = block_alt[15];
-    block[8] = block_alt[12];
-    block[9] = block_alt[13];
-    block[10] = block_alt[10];
-    block[11] = block_alt[11];
-    block[12] = block_alt[0];
-    block[13] = block_alt[1];
-    block[14] = block_alt[6];
-    block[15] = block_alt[7];
+    MIX_RIGHT(x12, x13, x2, x3, 20);
+    MIX_LEFT(x0, x1, x14, x15, 9);
+    MIX_RIGHT(x4, x5, x10, x11, 10);
+    MIX_RIGHT(x8, x9, x6, x7, 8);
 
     /* add round subkey a */
-    sixty4_add_inplace(block, subkeys[s+1]._0[0], subkeys[s+1]._0[1]);
-    sixty4_add_inplace(block + 2, subkeys[s+1]._1[0], subkeys[s+1]._1[1]);
-    sixty4_add_inplace(block + 4, subkeys[s+1]._2[0], subkeys[s+1]._2[1]);
-    sixty4_add_inplace(block + 6, subkeys[s+1]._3[0], subkeys[s+1]._3[1]);
-    sixty4_add_inplace(block + 8, subkeys[s+1]._4[0], subkeys[s+1]._4[1]);
-    sixty4_add_inplace(block + 10, subkeys[s+1]._5[0], subkeys[s+1]._5[1]);
-    sixty4_add_inplace(block + 12, subkeys[s+1]._6[0], subkeys[s+1]._6[1]);
-    sixty4_add_inplace(block + 14, subkeys[s+1]._7[0], subkeys[s+1]._7[1]);
+    subkey = threefish_subkey(buf3f, s + 1, block_alt);
+    INJECT_SUBKEY(SIXTY4_ADD, subkey);
 
     /* round 1a */
-    sixty4_add_inplace(block, block[2], block[3]);
-    sixty4_add_inplace(block + 4, block[6], block[7]);
-    sixty4_add_inplace(block + 8, block[10], block[11]);
-    sixty4_add_inplace(block + 12, block[14], block[15]);
-    sixty4_rotright_xor_inplace(block + 2, block[0], block[1], 25);
-    sixty4_rotleft_xor_inplace(block + 6, block[4], block[5], 30);
-    sixty4_rotright_xor_inplace(block + 10, block[8], block[9], 30);
-    sixty4_rotleft_xor_inplace(block + 14, block[12], block[13], 24);
-
-    block_alt[0] = block[4];
-    block_alt[1] = block[5];
-    block_alt[2] = block[2];
-    block_alt[3] = block[3];
-    block_alt[4] = block[8];
-    block_alt[5] = block[9];
-    block_alt[6] = block[14];
-    block_alt[7] = block[15];
-    block_alt[8] = block[12];
-    block_alt[9] = block[13];
-    block_alt[10] = block[10];
-    block_alt[11] = block[11];
-    block_alt[12] = block[0];
-    block_alt[13] = block[1];
-    block_alt[14] = block[6];
-    block_alt[15] = block[7];
+    MIX_RIGHT(x0, x1, x2, x3, 25);
+    MIX_LEFT(x4, x5, x6, x7, 30);
+    MIX_RIGHT(x8, x9, x10, x11, 30);
+    MIX_LEFT(x12, x13, x14, x15, 24);
 
     /* round 2a */
-    sixty4_add_inplace(block_alt, block_alt[2], block_alt[3]);
-    sixty4_add_inplace(block_alt + 4, block_alt[6], block_alt[7]);
-    sixty4_add_inplace(block_alt + 8, block_alt[10], block_alt[11]);
-    sixty4_add_inplace(block_alt + 12, block_alt[14], block_alt[15]);
-    sixty4_rotleft_xor_inplace(block_alt + 2, block_alt[0], block_alt[1], 13);
-    sixty4_rotright_xor_inplace(block_alt + 6, block_alt[4], block_alt[5], 14);
-    sixty4_rotleft_xor_inplace(block_alt + 10, block_alt[8], block_alt[9], 10);
-    sixty4_rotleft_xor_inplace(block_alt + 14, block_alt[12], block_alt[13], 17);
-
-    block[0] = block_alt[4];
-    block[1] = block_alt[5];
-    block[2] = block_alt[2];
-    block[3] = block_alt[3];
-    block[4] = block_alt[8];
-    block[5] = block_alt[9];
-    block[6] = block_alt[14];
-    block[7] = block_alt[15];
-    block[8] = block_alt[12];
-    block[9] = block_alt[13];
-    block[10] = block_alt[10];
-    block[11] = block_alt[11];
-    block[12] = block_alt[0];
-    block[13] = block_alt[1];
-    block[14] = block_alt[6];
-    block[15] = block_alt[7];
+    MIX_LEFT(x4, x5, x2, x3, 13);
+    MIX_RIGHT(x8, x9, x14, x15, 14);
+    MIX_LEFT(x12, x13, x10, x11, 10);
+    MIX_LEFT(x0, x1, x6, x7, 17);
 
     /* round 3a */
-    sixty4_add_inplace(block, block[2], block[3]);
-    sixty4_add_inplace(block + 4, block[6], block[7]);
-    sixty4_add_inplace(block + 8, block[10], block[11]);
-    sixty4_add_inplace(block + 12, block[14], block[15]);
-    sixty4_rotleft_xor_inplace(block + 2, block[0], block[1], 25);
-    sixty4_rotleft_xor_inplace(block + 6, block[4], block[5], 29);
-    sixty4_rotright_xor_inplace(block + 10, block[8], block[9], 25);
-    sixty4_rotright_xor_inplace(block + 14, block[12], block[13], 21);
-
-    block_alt[0] = block[4];
-    block_alt[1] = block[5];
-    block_alt[2] = block[2];
-    block_alt[3] = block[3];
-    block_alt[4] = block[8];
-    block_alt[5] = block[9];
-    block_alt[6] = block[14];
-    block_alt[7] = block[15];
-    block_alt[8] = block[12];
-    block_alt[9] = block[13];
-    block_alt[10] = block[10];
-    block_alt[11] = block[11];
-    block_alt[12] = block[0];
-    block_alt[13] = block[1];
-    block_alt[14] = block[6];
-    block_alt[15] = block[7];
+    MIX_LEFT(x8, x9, x2, x3, 25);
+    MIX_LEFT(x12, x13, x6, x7, 29);
+    MIX_RIGHT(x0, x1, x10, x11, 25);
+    MIX_RIGHT(x4, x5, x14, x15, 21);
 
     /* round 4a */
-    sixty4_add_inplace(block_alt, block_alt[2], block_alt[3]);
-    sixty4_add_inplace(block_alt + 4, block_alt[6], block_alt[7]);
-    sixty4_add_inplace(block_alt + 8, block_alt[10], block_alt[11]);
-    sixty4_add_inplace(block_alt + 12, block_alt[14], block_alt[15]);
-    sixty4_rotleft_xor_inplace(block_alt + 2, block_alt[0], block_alt[1], 8);
-    sixty4_rotright_xor_inplace(block_alt + 6, block_alt[4], block_alt[5], 29);
-    sixty4_rotright_xor_inplace(block_alt + 10, block_alt[8], block_alt[9], 8);
-    sixty4_rotleft_xor_inplace(block_alt + 14, block_alt[12], block_alt[13], 22);
-
-    block[0] = block_alt[4];
-    block[1] = block_alt[5];
-    block[2] = block_alt[2];
-    block[3] = block_alt[3];
-    block[4] = block_alt[8];
-    block[5] = block_alt[9];
-    block[6] = block_alt[14];
-    block[7] = block_alt[15];
-    block[8] = block_alt[12];
-    block[9] = block_alt[13];
-    block[10] = block_alt[10];
-    block[11] = block_alt[11];
-    block[12] = block_alt[0];
-    block[13] = block_alt[1];
-    block[14] = block_alt[6];
-    block[15] = block_alt[7];
+    MIX_LEFT(x12, x13, x2, x3, 8);
+    MIX_RIGHT(x0, x1, x14, x15, 29);
+    MIX_RIGHT(x4, x5, x10, x11, 8);
+    MIX_LEFT(x8, x9, x6, x7, 22);
   }
 
   /* add the final subkey */
-  sixty4_add_inplace(block, subkeys[18]._0[0], subkeys[18]._0[1]);
-  sixty4_add_inplace(block + 2, subkeys[18]._1[0], subkeys[18]._1[1]);
-  sixty4_add_inplace(block + 4, subkeys[18]._2[0], subkeys[18]._2[1]);
-  sixty4_add_inplace(block + 6, subkeys[18]._3[0], subkeys[18]._3[1]);
-  sixty4_add_inplace(block + 8, subkeys[18]._4[0], subkeys[18]._4[1]);
-  sixty4_add_inplace(block + 10, subkeys[18]._5[0], subkeys[18]._5[1]);
-  sixty4_add_inplace(block + 12, subkeys[18]._6[0], subkeys[18]._6[1]);
-  sixty4_add_inplace(block + 14, subkeys[18]._7[0], subkeys[18]._7[1]);
+  subkey = threefish_subkey(buf3f, 18, block_alt);
+  INJECT_SUBKEY(SIXTY4_ADD, subkey);
+
+  block[0] = x0; block[1] = x1; block[2] = x2; block[3] = x3;
+  block[4] = x4; block[5] = x5; block[6] = x6; block[7] = x7;
+  block[8] = x8; block[9] = x9; block[10] = x10; block[11] = x11;
+  block[12] = x12; block[13] = x13; block[14] = x14; block[15] = x15;
 }
 
 #if defined(PPENC_64BIT)
@@ -1003,261 +1371,81 @@ threefish_decrypt_block(const struct ThreeFishBuffer *const buf3f,
                         uint32_t *const block,
                         uint32_t *const block_alt)
 {
-  uint32_t d, s;
-  const struct ThreeFishSubKeys *subkeys;
+  const uint32_t *subkey;
+  uint32_t x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
+  uint16_t s;
 
-  subkeys = buf3f->subkeys;
+  x0 = block[0]; x1 = block[1]; x2 = block[2]; x3 = block[3];
+  x4 = block[4]; x5 = block[5]; x6 = block[6]; x7 = block[7];
+  x8 = block[8]; x9 = block[9]; x10 = block[10]; x11 = block[11];
+  x12 = block[12]; x13 = block[13]; x14 = block[14]; x15 = block[15];
 
   /* subtract the final key */
-  sixty4_sub_inplace(block, subkeys[18]._0[0], subkeys[18]._0[1]);
-  sixty4_sub_inplace(block + 2, subkeys[18]._1[0], subkeys[18]._1[1]);
-  sixty4_sub_inplace(block + 4, subkeys[18]._2[0], subkeys[18]._2[1]);
-  sixty4_sub_inplace(block + 6, subkeys[18]._3[0], subkeys[18]._3[1]);
-  sixty4_sub_inplace(block + 8, subkeys[18]._4[0], subkeys[18]._4[1]);
-  sixty4_sub_inplace(block + 10, subkeys[18]._5[0], subkeys[18]._5[1]);
-  sixty4_sub_inplace(block + 12, subkeys[18]._6[0], subkeys[18]._6[1]);
-  sixty4_sub_inplace(block + 14, subkeys[18]._7[0], subkeys[18]._7[1]);
-
-  for (d = 72; d > 0; d-= 8) {
-    s = (d - 8) / 4;
+  subkey = threefish_subkey(buf3f, 18, block_alt);
+  INJECT_SUBKEY(SIXTY4_SUB, subkey);
 
+  for (s = 18; s > 0; s -= 2) {
     /* round 4a */
-    block_alt[0] = block[12];
-    block_alt[1] = block[13];
-    block_alt[2] = block[2];
-    block_alt[3] = block[3];
-    block_alt[4] = block[0];
-    block_alt[5] = block[1];
-    block_alt[6] = block[14];
-    block_alt[7] = block[15];
-    block_alt[8] = block[4];
-    block_alt[9] = block[5];
-    block_alt[10] = block[10];
-    block_alt[11] = block[11];
-    block_alt[12] = block[8];
-    block_alt[13] = block[9];
-    block_alt[14] = block[6];
-    block_alt[15] = block[7];
-
-    sixty4_xor_rotright_inplace(block_alt + 14, block_alt[12], block_alt[13], 22);
-    sixty4_xor_rotleft_inplace(block_alt + 10, block_alt[8], block_alt[9], 8);
-    sixty4_xor_rotleft_inplace(block_alt + 6, block_alt[4], block_alt[5], 29);
-    sixty4_xor_rotright_inplace(block_alt + 2, block_alt[0], block_alt[1], 8);
-    sixty4_sub_inplace(block_alt + 12, block_alt[14], block_alt[15]);
-    sixty4_sub_inplace(block_alt + 8, block_alt[10], block_alt[11]);
-    sixty4_sub_inplace(block_alt + 4, block_alt[6], block_alt[7]);
-    sixty4_sub_inplace(block_alt, block_alt[2], block_alt[3]);
+    UNMIX_LEFT(x8, x9, x6, x7, 22);
+    UNMIX_RIGHT(x4, x5, x10, x11, 8);
+    UNMIX_RIGHT(x0, x1, x14, x15, 29);
+    UNMIX_LEFT(x12, x13, x2, x3, 8);
 
     /* round 3a */
-    block[0] = block_alt[12];
-    block[1] = block_alt[13];
-    block[2] = block_alt[2];
-    block[3] = block_alt[3];
-    block[4] = block_alt[0];
-    block[5] = block_alt[1];
-    block[6] = block_alt[14];
-    block[7] = block_alt[15];
-    block[8] = block_alt[4];
-    block[9] = block_alt[5];
-    block[10] = block_alt[10];
-    block[11] = block_alt[11];
-    block[12] = block_alt[8];
-    block[13] = block_alt[9];
-    block[14] = block_alt[6];
-    block[15] = block_alt[7];
-
-    sixty4_xor_rotleft_inplace(block + 14, block[12], block[13], 21);
-    sixty4_xor_rotleft_inplace(block + 10, block[8], block[9], 25);
-    sixty4_xor_rotright_inplace(block + 6, block[4], block[5], 29);
-    sixty4_xor_rotright_inplace(block + 2, block[0], block[1], 25);
-    sixty4_sub_inplace(block + 12, block[14], block[15]);
-    sixty4_sub_inplace(block + 8, block[10], block[11]);
-    sixty4_sub_inplace(block + 4, block[6], block[7]);
-    sixty4_sub_inplace(block, block[2], block[3]);
-
-     /* round 2a */
-    block_alt[0] = block[12];
-    block_alt[1] = block[13];
-    block_alt[2] = block[2];
-    block_alt[3] = block[3];
-    block_alt[4] = block[0];
-    block_alt[5] = block[1];
-    block_alt[6] = block[14];
-    block_alt[7] = block[15];
-    block_alt[8] = block[4];
-    block_alt[9] = block[5];
-    block_alt[10] = block[10];
-    block_alt[11] = block[11];
-    block_alt[12] = block[8];
-    block_alt[13] = block[9];
-    block_alt[14] = block[6];
-    block_alt[15] = block[7];
-
-    sixty4_xor_rotright_inplace(block_alt + 14, block_alt[12], block_alt[13], 17);
-    sixty4_xor_rotright_inplace(block_alt + 10, block_alt[8], block_alt[9], 10);
-    sixty4_xor_rotleft_inplace(block_alt + 6, block_alt[4], block_alt[5], 14);
-    sixty4_xor_rotright_inplace(block_alt + 2, block_alt[0], block_alt[1], 13);
-    sixty4_sub_inplace(block_alt + 12, block_alt[14], block_alt[15]);
-    sixty4_sub_inplace(block_alt + 8, block_alt[10], block_alt[11]);
-    sixty4_sub_inplace(block_alt + 4, block_alt[6], block_alt[7]);
-    sixty4_sub_inplace(block_alt, block_alt[2], block_alt[3]);
+    UNMIX_RIGHT(x4, x5, x14, x15, 21);
+    UNMIX_RIGHT(x0, x1, x10, x11, 25);
+    UNMIX_LEFT(x12, x13, x6, x7, 29);
+    UNMIX_LEFT(x8, x9, x2, x3, 25);
+
+    /* round 2a */
+    UNMIX_LEFT(x0, x1, x6, x7, 17);
+    UNMIX_LEFT(x12, x13, x10, x11, 10);
+    UNMIX_RIGHT(x8, x9, x14, x15, 14);
+    UNMIX_LEFT(x4, x5, x2, x3, 13);
 
     /* round 1a */
-    block[0] = block_alt[12];
-    block[1] = block_alt[13];
-    block[2] = block_alt[2];
-    block[3] = block_alt[3];
-    block[4] = block_alt[0];
-    block[5] = block_alt[1];
-    block[6] = block_alt[14];
-    block[7] = block_alt[15];
-    block[8] = block_alt[4];
-    block[9] = block_alt[5];
-    block[10] = block_alt[10];
-    block[11] = block_alt[11];
-    block[12] = block_alt[8];
-    block[13] = block_alt[9];
-    block[14] = block_alt[6];
-    block[15] = block_alt[7];
-
-    sixty4_xor_rotright_inplace(block + 14, block[12], block[13], 24);
-    sixty4_xor_rotleft_inplace(block + 10, block[8], block[9], 30);
-    sixty4_xor_rotright_inplace(block + 6, block[4], block[5], 30);
-    sixty4_xor_rotleft_inplace(block + 2, block[0], block[1], 25);
-    sixty4_sub_inplace(block + 12, block[14], block[15]);
-    sixty4_sub_inplace(block + 8, block[10], block[11]);
-    sixty4_sub_inplace(block + 4, block[6], block[7]);
-    sixty4_sub_inplace(block, block[2], block[3]);
+    UNMIX_LEFT(x12, x13, x14, x15, 24);
+    UNMIX_RIGHT(x8, x9, x10, x11, 30);
+    UNMIX_LEFT(x4, x5, x6, x7, 30);
+    UNMIX_RIGHT(x0, x1, x2, x3, 25);
 
-    /* subtract subkey */
-    sixty4_sub_inplace(block, subkeys[s+1]._0[0], subkeys[s+1]._0[1]);
-    sixty4_sub_inplace(block + 2, subkeys[s+1]._1[0], subkeys[s+1]._1[1]);
-    sixty4_sub_inplace(block + 4, subkeys[s+1]._2[0], subkeys[s+1]._2[1]);
-    sixty4_sub_inplace(block + 6, subkeys[s+1]._3[0], subkeys[s+1]._3[1]);
-    sixty4_sub_inplace(block + 8, subkeys[s+1]._4[0], subkeys[s+1]._4[1]);
-    sixty4_sub_inplace(block + 10, subkeys[s+1]._5[0], subkeys[s+1]._5[1]);
-    sixty4_sub_inplace(block + 12, subkeys[s+1]._6[0], subkeys[s+1]._6[1]);
-    sixty4_sub_inplace(block + 14, subkeys[s+1]._7[0], subkeys[s+1]._7[1]);
+    /* subtract round subkey a */
+    subkey = threefish_subkey(buf3f, s - 1, block_alt);
+    INJECT_SUBKEY(SIXTY4_SUB, subkey);
 
     /* round 4 */
-    block_alt[0] = block[12];
-    block_alt[1] = block[13];
-    block_alt[2] = block[2];
-    block_alt[3] = block[3];
-    block_alt[4] = block[0];
-    block_alt[5] = block[1];
-    block_alt[6] = block[14];
-    block_alt[7] = block[15];
-    block_alt[8] = block[4];
-    block_alt[9] = block[5];
-    block_alt[10] = block[10];
-    block_alt[11] = block[11];
-    block_alt[12] = block[8];
-    block_alt[13] = block[9];
-    block_alt[14] = block[6];
-    block_alt[15] = block[7];
-
-    sixty4_xor_rotleft_inplace(block_alt + 14, block_alt[12], block_alt[13], 8);
-    sixty4_xor_rotleft_inplace(block_alt + 10, block_alt[8], block_alt[9], 10);
-    sixty4_xor_rotright_inplace(block_alt + 6, block_alt[4], block_alt[5], 9);
-    sixty4_xor_rotleft_inplace(block_alt + 2, block_alt[0], block_alt[1], 20);
-    sixty4_sub_inplace(block_alt + 12, block_alt[14], block_alt[15]);
-    sixty4_sub_inplace(block_alt + 8, block_alt[10], block_alt[11]);
-    sixty4_sub_inplace(block_alt + 4, block_alt[6], block_alt[7]);
-    sixty4_sub_inplace(block_alt, block_alt[2], block_alt[3]);
+    UNMIX_RIGHT(x8, x9, x6, x7, 8);
+    UNMIX_RIGHT(x4, x5, x10, x11, 10);
+    UNMIX_LEFT(x0, x1, x14, x15, 9);
+    UNMIX_RIGHT(x12, x13, x2, x3, 20);
 
     /* round 3 */
-    block[0] = block_alt[12];
-    block[1] = block_alt[13];
-    block[2] = block_alt[2];
-    block[3] = block_alt[3];
-    block[4] = block_alt[0];
-    block[5] = block_alt[1];
-    block[6] = block_alt[14];
-    block[7] = block_alt[15];
-    block[8] = block_alt[4];
-    block[9] = block_alt[5];
-    block[10] = block_alt[10];
-    block[11] = block_alt[11];
-    block[12] = block_alt[8];
-    block[13] = block_alt[9];
-    block[14] = block_alt[6];
-    block[15] = block_alt[7];
-
-    sixty4_xor_rotleft_inplace(block + 14, block[12], block[13], 25);
-    sixty4_xor_rotleft_inplace(block + 10, block[8], block[9], 28);
-    sixty4_xor_rotleft_inplace(block + 6, block[4], block[5], 15);
-    sixty4_xor_rotright_inplace(block + 2, block[0], block[1], 17);
-    sixty4_sub_inplace(block + 12, block[14], block[15]);
-    sixty4_sub_inplace(block + 8, block[10], block[11]);
-    sixty4_sub_inplace(block + 4, block[6], block[7]);
-    sixty4_sub_inplace(block, block[2], block[3]);
-
-     /* round 2 */
-    block_alt[0] = block[12];
-    block_alt[1] = block[13];
-    block_alt[2] = block[2];
-    block_alt[3] = block[3];
-    block_alt[4] = block[0];
-    block_alt[5] = block[1];
-    block_alt[6] = block[14];
-    block_alt[7] = block[15];
-    block_alt[8] = block[4];
-    block_alt[9] = block[5];
-    block_alt[10] = block[10];
-    block_alt[11] = block[11];
-    block_alt[12] = block[8];
-    block_alt[13] = block[9];
-    block_alt[14] = block[6];
-    block_alt[15] = block[7];
-
-    sixty4_xor_rotleft_inplace(block_alt + 14, block_alt[12], block_alt[13], 22);
-    sixty4_xor_rotright_inplace(block_alt + 10, block_alt[8], block_alt[9], 14);
-    sixty4_xor_rotright_inplace(block_alt + 6, block_alt[4], block_alt[5], 27);
-    sixty4_xor_rotleft_inplace(block_alt + 2, block_alt[0], block_alt[1], 31);
-    sixty4_sub_inplace(block_alt + 12, block_alt[14], block_alt[15]);
-    sixty4_sub_inplace(block_alt + 8, block_alt[10], block_alt[11]);
-    sixty4_sub_inplace(block_alt + 4, block_alt[6], block_alt[7]);
-    sixty4_sub_inplace(block_alt, block_alt[2], block_alt[3]);
+    UNMIX_RIGHT(x4, x5, x14, x15, 25);
+    UNMIX_RIGHT(x0, x1, x10, x11, 28);
+    UNMIX_RIGHT(x12, x13, x6, x7, 15);
+    UNMIX_LEFT(x8, x9, x2, x3, 17);
+
+    /* round 2 */
+    UNMIX_RIGHT(x0, x1, x6, x7, 22);
+    UNMIX_LEFT(x12, x13, x10, x11, 14);
+    UNMIX_LEFT(x8, x9, x14, x15, 27);
+    UNMIX_RIGHT(x4, x5, x2, x3, 31);
 
     /* round 1 */
-    block[0] = block_alt[12];
-    block[1] = block_alt[13];
-    block[2] = block_alt[2];
-    block[3] = block_alt[3];
-    block[4] = block_alt[0];
-    block[5] = block_alt[1];
-    block[6] = block_alt[14];
-    block[7] = block_alt[15];
-    block[8] = block_alt[4];
-    block[9] = block_alt[5];
-    block[10] = block_alt[10];
-    block[11] = block_alt[11];
-    block[12] = block_alt[8];
-    block[13] = block_alt[9];
-    block[14] = block_alt[6];
-    block[15] = block_alt[7];
-
-    sixty4_xor_rotleft_inplace(block + 14, block[12], block[13], 27);
-    sixty4_xor_rotright_inplace(block + 10, block[8], block[9], 19);
-    sixty4_xor_rotleft_inplace(block + 6, block[4], block[5], 28);
-    sixty4_xor_rotleft_inplace(block + 2, block[0], block[1], 18);
-    sixty4_sub_inplace(block + 12, block[14], block[15]);
-    sixty4_sub_inplace(block + 8, block[10], block[11]);
-    sixty4_sub_inplace(block + 4, block[6], block[7]);
-    sixty4_sub_inplace(block, block[2], block[3]);
+    UNMIX_RIGHT(x12, x13, x14, x15, 27);
+    UNMIX_LEFT(x8, x9, x10, x11, 19);
+    UNMIX_RIGHT(x4, x5, x6, x7, 28);
+    UNMIX_RIGHT(x0, x1, x2, x3, 18);
 
     /* subtract subkey */
-    sixty4_sub_inplace(block, subkeys[s]._0[0], subkeys[s]._0[1]);
-    sixty4_sub_inplace(block + 2, subkeys[s]._1[0], subkeys[s]._1[1]);
-    sixty4_sub_inplace(block + 4, subkeys[s]._2[0], subkeys[s]._2[1]);
-    sixty4_sub_inplace(block + 6, subkeys[s]._3[0], subkeys[s]._3[1]);
-    sixty4_sub_inplace(block + 8, subkeys[s]._4[0], subkeys[s]._4[1]);
-    sixty4_sub_inplace(block + 10, subkeys[s]._5[0], subkeys[s]._5[1]);
-    sixty4_sub_inplace(block + 12, subkeys[s]._6[0], subkeys[s]._6[1]);
-    sixty4_sub_inplace(block + 14, subkeys[s]._7[0], subkeys[s]._7[1]);
+    subkey = threefish_subkey(buf3f, s - 2, block_alt);
+    INJECT_SUBKEY(SIXTY4_SUB, subkey);
   }
-  
+
+  block[0] = x0; block[1] = x1; block[2] = x2; block[3] = x3;
+  block[4] = x4; block[5] = x5; block[6] = x6; block[7] = x7;
+  block[8] = x8; block[9] = x9; block[10] = x10; block[11] = x11;
+  block[12] = x12; block[13] = x13; block[14] = x14; block[15] = x15;
 }
 
 #if defined(PPENC_64BIT)
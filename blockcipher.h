@@ -1,5 +1,5 @@
 #ifndef _PPENC_BLOCKCIPHER_H
-#define _PPENC_BLOCCIPHER_H
+#define _PPENC_BLOCKCIPHER_H
 
 #include <stdint.h>
 
@@ -18,11 +18,35 @@ struct ThreeFishKey {
   uint32_t lower, upper;
 };
 
+/* PPENC_LOW_RAM keeps only the 9 key words and the running  *
+ * tweak sums and derives each subkey as it is injected. 120 *
+ * bytes instead of 1312 at the cost of a few extra adds per *
+ * round group, there is no key schedule to cache or seek    */
+#if defined(PPENC_LOW_RAM)
+#if defined(PPENC_64BIT) || defined(PPENC_KEY_SCHEDULE_CACHE)
+#error "PPENC_LOW_RAM can't be combined with PPENC_64BIT or PPENC_KEY_SCHEDULE_CACHE"
+#endif
+
+struct ThreeFishBuffer {
+  struct ThreeFishKey keys[9];
+  uint32_t tweak_sums[6];
+  uint32_t tweaks[6];
+};
+#else
 struct ThreeFishBuffer {
   struct ThreeFishSubKeys subkeys[19];
   uint32_t tweaks[6];
   struct ThreeFishKey keys[9];
 };
+#endif
+
+/* where a chunk of a body picks up the tweak stream: the pcg32 *
+ * state after the tweaks of its first block and the sums of    *
+ * the tweaks of every block up to and including that one       */
+struct ThreeFishTweakPos {
+  uint32_t pcg32_state[2];
+  uint32_t tweak_sums[6];
+};
 
 #if defined(PPENC_64BIT)
 struct ThreeFishSubKeys64 {
@@ -35,37 +59,188 @@ struct ThreeFishBuffer64 {
   uint64_t keys[9];
 };
 
+struct ThreeFishTweakPos64 {
+  uint64_t pcg32_state;
+  uint64_t tweak_sums[3];
+};
+
 #endif
 
 #if defined(PPENC_64BIT)
 void ppenc_threefish512_encrypt_64bit(const uint8_t *const key,
                                       const uint8_t *const tweak_seed,
-			              uint8_t* const body,
-			              const uint32_t num_blocks,
-			              struct ThreeFishBuffer64 *const buf3f,
-				      uint8_t *const buf64);
+                                      uint8_t *const body,
+                                      const uint32_t num_blocks,
+                                      struct ThreeFishBuffer64 *const buf3f,
+                                      uint8_t *const buf64);
 
 void ppenc_threefish512_decrypt_64bit(const uint8_t *const key,
                                       const uint8_t *const tweak_seed,
-			              uint8_t* const body,
-			              const uint32_t num_blocks,
-			              struct ThreeFishBuffer64 *const buf3f,
-				      uint8_t *const buf64);
+                                      uint8_t *const body,
+                                      const uint32_t num_blocks,
+                                      struct ThreeFishBuffer64 *const buf3f,
+                                      uint8_t *const buf64);
+
+void ppenc_threefish512_encrypt_to_64bit(const uint8_t *const key,
+                                         const uint8_t *const tweak_seed,
+                                         uint8_t *const dst,
+                                         const uint8_t *const src,
+                                         const uint32_t src_len,
+                                         const uint32_t num_blocks,
+                                         struct ThreeFishBuffer64 *const buf3f,
+                                         uint8_t *const buf64);
+
+void ppenc_threefish512_decrypt_to_64bit(const uint8_t *const key,
+                                         const uint8_t *const tweak_seed,
+                                         uint8_t *const dst,
+                                         const uint8_t *const src,
+                                         const uint32_t num_blocks,
+                                         struct ThreeFishBuffer64 *const buf3f,
+                                         uint8_t *const buf64);
+
+void ppenc_threefish512_key_schedule_64bit(struct ThreeFishSubKeys64 *const key_schedule,
+                                           const uint8_t *const key,
+                                           uint64_t *const keys_buf);
+
+void ppenc_threefish512_encrypt_scheduled_64bit(const struct ThreeFishSubKeys64 *const key_schedule,
+                                                const uint8_t *const tweak_seed,
+                                                uint8_t *const dst,
+                                                const uint8_t *const src,
+                                                const uint32_t src_len,
+                                                const uint32_t num_blocks,
+                                                struct ThreeFishBuffer64 *const buf3f,
+                                                uint8_t *const buf64);
+
+void ppenc_threefish512_decrypt_scheduled_64bit(const struct ThreeFishSubKeys64 *const key_schedule,
+                                                const uint8_t *const tweak_seed,
+                                                uint8_t *const dst,
+                                                const uint8_t *const src,
+                                                const uint32_t num_blocks,
+                                                struct ThreeFishBuffer64 *const buf3f,
+                                                uint8_t *const buf64);
+
+void ppenc_threefish512_tweak_seek_64bit(struct ThreeFishTweakPos64 *const pos,
+                                         const uint8_t *const tweak_seed,
+                                         const uint32_t chunk_blocks,
+                                         const uint32_t num_chunks);
+
+void ppenc_threefish512_encrypt_chunk_64bit(const struct ThreeFishSubKeys64 *const key_schedule,
+                                            const struct ThreeFishTweakPos64 *const pos,
+                                            const uint32_t first_block,
+                                            uint8_t *const dst,
+                                            const uint8_t *const src,
+                                            const uint32_t src_len,
+                                            const uint32_t num_blocks,
+                                            struct ThreeFishBuffer64 *const buf3f,
+                                            uint8_t *const buf64);
+
+void ppenc_threefish512_decrypt_chunk_64bit(const struct ThreeFishSubKeys64 *const key_schedule,
+                                            const struct ThreeFishTweakPos64 *const pos,
+                                            const uint32_t first_block,
+                                            uint8_t *const dst,
+                                            const uint8_t *const src,
+                                            const uint32_t num_blocks,
+                                            struct ThreeFishBuffer64 *const buf3f,
+                                            uint8_t *const buf64);
 #endif
 
 void ppenc_threefish512_encrypt(const uint8_t *const key,
                                 const uint8_t *const tweak_seed,
-			        uint8_t* const body,
-			        const uint32_t num_blocks,
-			        struct ThreeFishBuffer *const buf3f,
-				uint8_t *const buf64);
+                                uint8_t *const body,
+                                const uint32_t num_blocks,
+                                struct ThreeFishBuffer *const buf3f,
+                                uint8_t *const buf64);
 
 void ppenc_threefish512_decrypt(const uint8_t *const key,
                                 const uint8_t *const tweak_seed,
-			        uint8_t* const body,
-			        const uint32_t num_blocks,
-			        struct ThreeFishBuffer *const buf3f,
-				uint8_t *const buf64);
+                                uint8_t *const body,
+                                const uint32_t num_blocks,
+                                struct ThreeFishBuffer *const buf3f,
+                                uint8_t *const buf64);
+
+/* out of place: blocks are read from src and written to dst, *
+ * which may be the same buffer. encrypt reads only src_len   *
+ * bytes of src, the rest of the last block(s) is whatever is *
+ * already in dst (the sender's padding)                      */
+void ppenc_threefish512_encrypt_to(const uint8_t *const key,
+                                   const uint8_t *const tweak_seed,
+                                   uint8_t *const dst,
+                                   const uint8_t *const src,
+                                   const uint32_t src_len,
+                                   const uint32_t num_blocks,
+                                   struct ThreeFishBuffer *const buf3f,
+                                   uint8_t *const buf64);
+
+void ppenc_threefish512_decrypt_to(const uint8_t *const key,
+                                   const uint8_t *const tweak_seed,
+                                   uint8_t *const dst,
+                                   const uint8_t *const src,
+                                   const uint32_t num_blocks,
+                                   struct ThreeFishBuffer *const buf3f,
+                                   uint8_t *const buf64);
+
+#if !defined(PPENC_LOW_RAM)
+/* the subkeys only depend on the key, key_schedule (19 entries) *
+ * can be computed once per key and passed to the _scheduled     *
+ * variants which then only apply the message's tweaks. keys_buf *
+ * is scratch for the 9 extended key words                       */
+void ppenc_threefish512_key_schedule(struct ThreeFishSubKeys *const key_schedule,
+                                     const uint8_t *const key,
+                                     struct ThreeFishKey *const keys_buf);
+
+void ppenc_threefish512_encrypt_scheduled(const struct ThreeFishSubKeys *const key_schedule,
+                                          const uint8_t *const tweak_seed,
+                                          uint8_t *const dst,
+                                          const uint8_t *const src,
+                                          const uint32_t src_len,
+                                          const uint32_t num_blocks,
+                                          struct ThreeFishBuffer *const buf3f,
+                                          uint8_t *const buf64);
+
+void ppenc_threefish512_decrypt_scheduled(const struct ThreeFishSubKeys *const key_schedule,
+                                          const uint8_t *const tweak_seed,
+                                          uint8_t *const dst,
+                                          const uint8_t *const src,
+                                          const uint32_t num_blocks,
+                                          struct ThreeFishBuffer *const buf3f,
+                                          uint8_t *const buf64);
+
+#endif
+
+/* bodies split into chunks of chunk_blocks blocks. The tweaks  *
+ * of block n depend on those of every block before it, so one  *
+ * cheap pass over the tweak stream (no Threefish rounds) fills *
+ * pos[0..num_chunks) for the chunks starting at blocks 0,      *
+ * chunk_blocks, 2 * chunk_blocks ... Each chunk can then be    *
+ * processed independently, eg. on its own thread with its own  *
+ * buf3f/buf64. dst/src point at the chunk, first_block is its  *
+ * index in the body and pos the entry seeked for it. buf3f's   *
+ * subkeys may be passed as the key_schedule                    */
+void ppenc_threefish512_tweak_seek(struct ThreeFishTweakPos *const pos,
+                                   const uint8_t *const tweak_seed,
+                                   const uint32_t chunk_blocks,
+                                   const uint32_t num_chunks);
+
+#if !defined(PPENC_LOW_RAM)
+void ppenc_threefish512_encrypt_chunk(const struct ThreeFishSubKeys *const key_schedule,
+                                      const struct ThreeFishTweakPos *const pos,
+                                      const uint32_t first_block,
+                                      uint8_t *const dst,
+                                      const uint8_t *const src,
+                                      const uint32_t src_len,
+                                      const uint32_t num_blocks,
+                                      struct ThreeFishBuffer *const buf3f,
+                                      uint8_t *const buf64);
+
+void ppenc_threefish512_decrypt_chunk(const struct ThreeFishSubKeys *const key_schedule,
+                                      const struct ThreeFishTweakPos *const pos,
+                                      const uint32_t first_block,
+                                      uint8_t *const dst,
+                                      const uint8_t *const src,
+                                      const uint32_t num_blocks,
+                                      struct ThreeFishBuffer *const buf3f,
+                                      uint8_t *const buf64);
+#endif
 
 /* header guard */
 #endif
@@ -12,7 +12,16 @@ fn main() {
         }
     }
 
-    cc::Build::new()
+    let mut build = cc::Build::new();
+    if env::var_os("CARGO_FEATURE_INSTRUMENT").is_some() {
+        // timings in nanoseconds from ppenc_instrument_clock in src/lib.rs
+        build
+            .define("PPENC_INSTRUMENT", None)
+            .define("PPENC_INSTRUMENT_CLOCK", None)
+            .define("PPENC_CLOCK_T", "uint64_t");
+    }
+
+    build
         .file("blockcipher.c")
         .file("hash.c")
         .file("cprng.c")
@@ -21,5 +30,6 @@ fn main() {
         .define("INLINE", inline)
         .define("STATIC", static_)
         .define("PPENC_64BIT", "")
+        .define("PPENC_KEY_SCHEDULE_CACHE", None)
         .compile("ppenc");
 }
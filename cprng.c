@@ -13,6 +13,9 @@ static const uint32_t CHACHA_CONST[4] = {\
 
 static void chacha8_compute(struct PPEncChaCha8 *const chacha8);
 static void chacha20_compute(struct PPEncChaCha20 *const chacha20);
+static void chacha20_block(const struct PPEncChaCha20 *const chacha20,
+                           const uint32_t counter,
+                           uint32_t *const buf);
 
 void
 ppenc_chacha8_init(struct PPEncChaCha8 *const chacha8,
@@ -67,21 +70,56 @@ ppenc_chacha8_nbytes(struct PPEncChaCha8 *const chacha8,
 
 void
 ppenc_chacha20_xor_header(struct PPEncChaCha20 *const chacha20, uint8_t *const header)
+{
+  ppenc_chacha20_xor_header_len(chacha20, header, 32);
+}
+
+void
+ppenc_chacha20_xor_header_len(struct PPEncChaCha20 *const chacha20,
+                              uint8_t *const header,
+                              const uint8_t len)
 {
   uint16_t i;
   uint8_t* key;
 
+  ppenc_chacha20_prepare_header(chacha20);
+
+  key = chacha20->block + (chacha20->pos * 32);
+
+  for (i = 0; i < len; i++)
+    header[i] ^= key[i];
+
+  chacha20->pos += 1;
+}
+
+void
+ppenc_chacha20_prepare_header(struct PPEncChaCha20 *const chacha20)
+{
   if (chacha20->pos == 2) {
     chacha20_compute(chacha20);
     chacha20->pos = 0;
   }
+}
 
-  key = chacha20->block + (chacha20->pos * 32);
+void
+ppenc_chacha20_headers_at(const struct PPEncChaCha20 *const chacha20,
+                          const uint32_t index,
+                          uint8_t *const block)
+{
+  chacha20_block(chacha20, index / 2, (uint32_t*) block);
+}
 
-  for (i = 0; i < 32; i++)
-    header[i] ^= key[i];
+void
+ppenc_chacha20_seek(struct PPEncChaCha20 *const chacha20,
+                    const uint32_t counter,
+                    const uint8_t pos)
+{
+  chacha20->counter = counter;
+  chacha20->pos = pos;
 
-  chacha20->pos += 1;
+  /* headers are still to come from the last block computed */
+  if (pos < 2)
+    chacha20_block(chacha20, counter - 1, (uint32_t*) chacha20->block);
 }
 
 static void
@@ -135,10 +173,16 @@ chacha8_compute(struct PPEncChaCha8 *const chacha8)
 static void
 chacha20_compute(struct PPEncChaCha20 *const chacha20)
 {
-  uint16_t i;
-  uint32_t *buf;
+  chacha20_block(chacha20, chacha20->counter, (uint32_t*) chacha20->block);
+  chacha20->counter += 1;
+}
 
-  buf = (uint32_t*) chacha20->block;
+static void
+chacha20_block(const struct PPEncChaCha20 *const chacha20,
+               const uint32_t counter,
+               uint32_t *const buf)
+{
+  uint16_t i;
 
   buf[0] = CHACHA_CONST[0];
   buf[1] = CHACHA_CONST[1];
@@ -148,7 +192,7 @@ chacha20_compute(struct PPEncChaCha20 *const chacha20)
   for (i = 0; i < 8; i++)
     buf[i + 4] = chacha20->key[i];
 
-  buf[12] = chacha20->counter;
+  buf[12] = counter;
   buf[13] = chacha20->nonce[0];
   buf[14] = chacha20->nonce[1];
   buf[15] = chacha20->nonce[2];
@@ -173,10 +217,8 @@ chacha20_compute(struct PPEncChaCha20 *const chacha20)
   for (i = 0; i < 8; i++)
     buf[i + 4] += chacha20->key[i];
 
-  buf[12] += chacha20->counter;
+  buf[12] += counter;
   buf[13] += chacha20->nonce[0];
   buf[14] += chacha20->nonce[1];
   buf[15] += chacha20->nonce[2];
-
-  chacha20->counter += 1;
 }
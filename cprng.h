@@ -36,4 +36,32 @@ ppenc_chacha20_init(struct PPEncChaCha20 *const chacha20,
 
 void
 ppenc_chacha20_xor_header(struct PPEncChaCha20 *const chacha20, uint8_t *const header);
+
+/* xor_header for headers shorter than 32 bytes (len <= 32), *
+ * the rest of the header's keystream is skipped             */
+void
+ppenc_chacha20_xor_header_len(struct PPEncChaCha20 *const chacha20,
+                              uint8_t *const header,
+                              const uint8_t len);
+
+/* computes the keystream of the next header now if needed, so *
+ * xor_header is only the xor                                  */
+void
+ppenc_chacha20_prepare_header(struct PPEncChaCha20 *const chacha20);
+
+/* the 64 byte keystream block (block aligned for uint32_t) *
+ * holding header number index, 0 being the first after     *
+ * init, at block + (index % 2) * 32. The stream is left as *
+ * it is                                                    */
+void
+ppenc_chacha20_headers_at(const struct PPEncChaCha20 *const chacha20,
+                          const uint32_t index,
+                          uint8_t *const block);
+
+/* puts a stream back at the counter and pos saved from another *
+ * with the same key and nonce, recomputing its current block   */
+void
+ppenc_chacha20_seek(struct PPEncChaCha20 *const chacha20,
+                    const uint32_t counter,
+                    const uint8_t pos);
 #endif
@@ -1,15 +1,25 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 
 #include "../ppenc.h"
 
 #include "msgs.h"
 
+/* messages sent per burst before waiting for their response macs */
+#define PIPELINE_DEPTH 4
+/* seconds to pause between bursts */
+#define BURST_INTERVAL 2
+/* seconds to wait for a response mac before giving up on a message */
+#define ACK_TIMEOUT 10
+
 const uint8_t SENDER_RNG_KEY[32] = {\
   114, 18, 249, 44, 237, 127, 113, 14, 198, 82, 79, 51, 96, 149, 117, 107, 151, 196, 229, 113, 69, 56, 237, 181, 45, 53, 173, 127, 248, 131, 254, 130
 };
@@ -52,10 +62,13 @@ int
 main()
 {
   struct PPEncSender sender;
+  struct PPEncWindow window;
   PPEncSenderRng RNG, *rng;
-  uint8_t header_rng_nonce[12], header_state_init[32], body_state0[32], buf1400[1400], response_mac[32];
+  uint8_t header_rng_nonce[12], header_state_init[32], body_state0[32], scratch[PPENC_SCRATCH_SIZE], response_mac[32], ack[32];
+  uint32_t expired[PPENC_WINDOW_LEN];
   struct sockaddr_in addr;
-  int sock;
+  struct timeval recv_timeout;
+  int sock, first_burst;
   ssize_t bytes_sent, bytes_recv;
   uint8_t msg_num;
   size_t body_len;
@@ -144,73 +157,108 @@ main()
                     header_rng_nonce,
                     BODY_SALT,
                     body_state0,
-                    buf1400);
+                    scratch);
 
   printf("session established\n");
 
+  /* recv returns every second so unanswered messages expire */
+  recv_timeout.tv_sec = 1;
+  recv_timeout.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+
+  ppenc_window_init(&window);
   msg_num = 0;
   bytes_recv = 0;
+  first_burst = 1;
   while(1) {
-    size_t i;
-    uint32_t body_padded_len;
+    size_t i, burst_len;
+    uint32_t body_padded_len, seq_num, sent_at;
+    uint16_t num_expired;
     ssize_t n;
 
-    body_len = MSG_LENS[msg_num];
-    msg_buf = (uint8_t*) malloc(body_len + 71 + 32);
-    for (i = 0; i < body_len; i++)
-      msg_buf[i + 32] = MSGS[msg_num][i];
-
-    /* encrypt the message */
-    printf("encrypting msg [%i]\n", msg_num);
-    body_padded_len = ppenc_sender_new_msg(&sender,
-                                           msg_buf,
-                                           msg_buf + 32,
-                                           body_len,
-                                           response_mac,
-                                           buf1400);
-
-    /* send the message */
-    printf("sending message [%i]\n", msg_num);
-    bytes_sent = 0;
-    while (bytes_sent < (body_padded_len + 32)) {
-      n = send(sock, msg_buf, (body_padded_len + 32) - bytes_sent, 0);
-      if (n < 0) {
-	perror("couldn't send message to server");
-	exit(2);
-      }
-      bytes_sent += n;
+    /* once the last burst is settled, pause and send the next        *
+     * PIPELINE_DEPTH messages back to back without waiting for each  *
+     * other's response macs                                          */
+    burst_len = 0;
+    if (ppenc_window_outstanding(&window) == 0) {
+      if (!first_burst)
+        sleep(BURST_INTERVAL);
+      first_burst = 0;
+      burst_len = PIPELINE_DEPTH;
     }
-    free(msg_buf);
+    while (burst_len > 0 && ppenc_window_space(&window) > 0) {
+      burst_len--;
+      body_len = MSG_LENS[msg_num];
+      msg_buf = (uint8_t*) malloc(body_len + 71 + 32);
+      for (i = 0; i < body_len; i++)
+        msg_buf[i + 32] = MSGS[msg_num][i];
+
+      /* encrypt the message */
+      printf("encrypting msg [%i]\n", msg_num);
+      body_padded_len = ppenc_sender_new_msg(&sender,
+                                             msg_buf,
+                                             msg_buf + 32,
+                                             body_len,
+                                             response_mac,
+                                             scratch);
+
+      /* send the message */
+      printf("sending message [%i]\n", msg_num);
+      bytes_sent = 0;
+      while (bytes_sent < (body_padded_len + 32)) {
+        n = send(sock, msg_buf + bytes_sent, (body_padded_len + 32) - bytes_sent, 0);
+        if (n < 0) {
+          perror("couldn't send message to server");
+          exit(2);
+        }
+        bytes_sent += n;
+      }
+      free(msg_buf);
+
+      /* we expect a response_mac */
+      ppenc_window_push(&window, &sender, response_mac, (uint32_t) time(NULL));
+      printf("expecting response_mac = ");
+      for(i = 0; i < 32; i++)
+        printf("%.2x", response_mac[i]);
+      printf("\n");
 
-    /* we expect a response_mac */
-    printf("expecting response_mac = ");
-    for(i = 0; i < 32; i++)
-      printf("%.2x", response_mac[i]);
-    printf("\n");
+      msg_num = (msg_num + 1) % 2;
+    }
 
-    /* while the message is on the wire, advance the keys */
-    /* ppenc_sender_new_body_key(&sender, buf1400); */
+    /* while the messages are on the wire, advance the keys */
+    /* ppenc_sender_new_body_key(&sender, scratch); */
 
     /* check if we have received any responses */
-    if ((n = recv(sock, response_mac + bytes_recv, 32 - bytes_recv, 0)) < 0) {
+    n = recv(sock, ack + bytes_recv, 32 - bytes_recv, 0);
+    if (n == 0) {
+      fprintf(stderr, "server closed the connection\n");
+      exit(2);
+    }
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
       perror("couldn't read response_mac from server");
       exit(2);
     }
-    bytes_recv += n;
+    if (n > 0)
+      bytes_recv += n;
 
     /* do we have a complete response? */
     if (bytes_recv == 32) {
       printf("received response_mac = ");
       for (i = 0; i < 32; i++)
-	printf("%.2x", response_mac[i]);
+	printf("%.2x", ack[i]);
       printf("\n");
       bytes_recv = 0;
-    }
 
-    /* sleep for 2 seconds */
-    sleep(2);
+      if (ppenc_window_ack(&window, ack, &seq_num, &sent_at) == PPENC_OK)
+        printf("message %u acked after %us\n", seq_num, (uint32_t) time(NULL) - sent_at);
+      else
+        printf("response_mac matches no message in flight\n");
+    }
 
-    msg_num = (msg_num + 1) % 2;
+    /* give up on messages the server didn't answer */
+    num_expired = ppenc_window_expire(&window, (uint32_t) time(NULL), ACK_TIMEOUT, expired);
+    for (i = 0; i < num_expired; i++)
+      printf("message %u expired without a response_mac\n", expired[i]);
   }
   return 0;
 }
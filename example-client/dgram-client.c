@@ -0,0 +1,238 @@
+/* example-client over UDP
+ *
+ * The handshake runs over TCP as in client.c, after which the server
+ * hands out a 4 byte session id and the messages travel as datagrams
+ *
+ *   session id (4, big endian) | header (32) | padded body
+ *
+ * each answered with a datagram holding the response mac. The setup
+ * connection is kept open for the lifetime of the session. To exercise
+ * the server's datagram window every run of messages is sent in reverse
+ * order and every DROP_EVERY'th message is never sent at all.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "../ppenc.h"
+
+#include "msgs.h"
+
+/* messages encrypted per run, sent last to first */
+#define PIPELINE_DEPTH 4
+/* seconds to wait for a response mac before giving up on a message */
+#define ACK_TIMEOUT 2
+/* seq_nums that are a multiple of this are "lost" on the way */
+#define DROP_EVERY 7
+#define DGRAM_PORT 8082
+/* session id + header + the longest padded body of MSGS */
+#define DGRAM_CAP (4 + 32 + 71 + 8)
+
+const uint8_t SENDER_RNG_KEY[32] = {\
+  114, 18, 249, 44, 237, 127, 113, 14, 198, 82, 79, 51, 96, 149, 117, 107, 151, 196, 229, 113, 69, 56, 237, 181, 45, 53, 173, 127, 248, 131, 254, 130
+};
+
+const uint8_t HEADER_SALT[16] = {\
+  69, 59, 193, 12, 6, 158, 6, 102, 159, 66, 169, 195, 243, 57, 49, 167
+};
+
+const uint8_t BODY_SALT[16] = {\
+  225, 47, 207, 136, 141, 36, 224, 15, 163, 142, 89, 53, 51, 97, 249, 149
+};
+
+const char TOKEN[100] = {\
+  "00.70f78f37bc36973269cd3b044ff15ec46f11c618ea6909452526c46d9173a059.e4f102910b3fea0cacba1923aad556ec"
+};
+
+PPEncSenderRng*
+seed_rng(PPEncSenderRng* rng)
+{
+  FILE *urandom;
+  uint8_t nonce[8];
+
+  if ((urandom = fopen("/dev/urandom", "rb")) == NULL) {
+    fprintf(stderr, "couldn't open /dev/urandom");
+    return NULL;
+  }
+
+  if (fread(nonce, 8, 1, urandom) != 1) {
+    fprintf(stderr, "couldn't read 8 bytes from /dev/urandom");
+    fclose(urandom);
+    return NULL;
+  }
+
+  fclose(urandom);
+
+  ppenc_sender_rng_init(rng, SENDER_RNG_KEY, nonce);
+  return rng;
+}
+
+static int
+send_all(int sock, const uint8_t *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = send(sock, buf, len, 0)) < 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int
+recv_all(int sock, uint8_t *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = recv(sock, buf, len, 0)) <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int
+main()
+{
+  struct PPEncSender sender;
+  struct PPEncWindow window;
+  PPEncSenderRng RNG, *rng;
+  uint8_t header_rng_nonce[12], header_state_init[32], body_state0[32], session_id[4], scratch[PPENC_SCRATCH_SIZE], response_mac[32], ack[32];
+  uint8_t dgrams[PIPELINE_DEPTH][DGRAM_CAP];
+  uint32_t dgram_lens[PIPELINE_DEPTH], dgram_seq_nums[PIPELINE_DEPTH];
+  uint32_t expired[PPENC_WINDOW_LEN];
+  struct sockaddr_in addr;
+  struct timeval recv_timeout;
+  int sock, dgram_sock;
+  uint8_t msg_num;
+
+  addr.sin_port = htons(DGRAM_PORT);
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_family = AF_INET;
+
+  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0
+      || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "couldn't connect to socket\n");
+    exit(1);
+  }
+
+  rng = seed_rng(&RNG);
+  if (rng == NULL) {
+    exit(1);
+  }
+
+  ppenc_sender_rng_nbytes(rng, header_rng_nonce, 12);
+
+  /* same handshake as client.c, followed by the session id */
+  printf("running handshake\n");
+  if (send_all(sock, (const uint8_t*) TOKEN, 100) < 0
+      || send_all(sock, header_rng_nonce, 12) < 0
+      || recv_all(sock, header_state_init, 32) < 0
+      || recv_all(sock, body_state0, 32) < 0
+      || recv_all(sock, session_id, 4) < 0) {
+    fprintf(stderr, "couldn't run handshake with server\n");
+    exit(2);
+  }
+
+  ppenc_sender_init(&sender,
+                    rng,
+                    HEADER_SALT,
+                    header_state_init,
+                    header_rng_nonce,
+                    BODY_SALT,
+                    body_state0,
+                    scratch);
+
+  printf("session established, id = %.2x%.2x%.2x%.2x\n",
+         session_id[0], session_id[1], session_id[2], session_id[3]);
+
+  /* connect()ing the datagram socket filters out anything but the server */
+  if ((dgram_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+      || connect(dgram_sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "couldn't connect datagram socket\n");
+    exit(1);
+  }
+
+  /* recv returns every second so unanswered messages expire */
+  recv_timeout.tv_sec = 1;
+  recv_timeout.tv_usec = 0;
+  setsockopt(dgram_sock, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+
+  ppenc_window_init(&window);
+  msg_num = 0;
+  while(1) {
+    size_t i, num_dgrams, run_len;
+    uint32_t seq_num, sent_at;
+    uint16_t num_expired;
+    ssize_t n;
+
+    /* encrypt a new run of messages once the last one is settled... */
+    num_dgrams = 0;
+    run_len = ppenc_window_outstanding(&window) == 0 ? PIPELINE_DEPTH : 0;
+    while (num_dgrams < run_len && ppenc_window_space(&window) > 0) {
+      uint8_t *dgram;
+
+      dgram = dgrams[num_dgrams];
+      memcpy(dgram, session_id, 4);
+      memcpy(dgram + 4 + 32, MSGS[msg_num], MSG_LENS[msg_num]);
+      dgram_lens[num_dgrams] = 4 + 32 + ppenc_sender_new_msg(&sender,
+                                                             dgram + 4,
+                                                             dgram + 4 + 32,
+                                                             MSG_LENS[msg_num],
+                                                             response_mac,
+                                                             scratch);
+      ppenc_window_push(&window, &sender, response_mac, (uint32_t) time(NULL));
+      /* new_msg has already moved on to the next seq_num */
+      dgram_seq_nums[num_dgrams] = sender.session.seq_num - 1;
+      num_dgrams++;
+
+      msg_num = (msg_num + 1) % 2;
+    }
+
+    /* ...and send it last to first, losing some on the way */
+    for (i = num_dgrams; i-- > 0;) {
+      if (dgram_seq_nums[i] % DROP_EVERY == 0) {
+        printf("dropping message %u\n", dgram_seq_nums[i]);
+        continue;
+      }
+
+      printf("sending message %u\n", dgram_seq_nums[i]);
+      if (send(dgram_sock, dgrams[i], dgram_lens[i], 0) < 0) {
+        perror("couldn't send message to server");
+        exit(2);
+      }
+    }
+
+    /* each datagram back is one whole response_mac */
+    n = recv(dgram_sock, ack, 32, 0);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+      perror("couldn't read response_mac from server");
+      exit(2);
+    }
+
+    if (n == 32) {
+      if (ppenc_window_ack(&window, ack, &seq_num, &sent_at) == PPENC_OK)
+        printf("message %u acked after %us\n", seq_num, (uint32_t) time(NULL) - sent_at);
+      else
+        printf("response_mac matches no message in flight\n");
+    }
+
+    /* give up on messages the server didn't answer */
+    num_expired = ppenc_window_expire(&window, (uint32_t) time(NULL), ACK_TIMEOUT, expired);
+    for (i = 0; i < num_expired; i++)
+      printf("message %u expired without a response_mac\n", expired[i]);
+  }
+  return 0;
+}
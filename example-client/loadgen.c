@@ -0,0 +1,685 @@
+/* Load generator for example-server.
+ *
+ * Simulates a fleet of devices, each with its own PPEncSender, sender rng
+ * and tcp connection, spread over a number of threads which multiplex
+ * their connections with poll(). Every device sends messages as a poisson
+ * process at the given rate, with body sizes drawn from a distribution,
+ * and rotates its body key every n messages. Response macs are checked
+ * against the sender's and their round trip latency recorded.
+ *
+ *   loadgen-bin [-n devices] [-j threads] [-r msgs/s per device]
+ *               [-s size] [-k msgs per body key] [-d seconds]
+ *               [-p server pid] [-a host] [-P port] [-t token file]
+ *
+ * size is either a fixed length "64", a uniform range "16-1024" or an
+ * exponential distribution with the given mean "exp:256".
+ *
+ * NOTE: each device holds a socket, raise the open file limit
+ * (ulimit -n) for large fleets.                                        */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ppenc.h"
+
+#define TOKEN_LEN 100
+#define MAX_TOKENS 4096
+/* log-linear latency histogram, 8 sub-buckets per power of two us */
+#define SUB_BUCKET_BITS 3
+#define NUM_BUCKETS ((64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS)
+
+/* same device keys as client.c */
+static const uint8_t SENDER_RNG_KEY[32] = {
+  114, 18, 249, 44, 237, 127, 113, 14, 198, 82, 79, 51, 96, 149, 117, 107, 151, 196, 229, 113, 69, 56, 237, 181, 45, 53, 173, 127, 248, 131, 254, 130
+};
+
+static const uint8_t HEADER_SALT[16] = {
+  69, 59, 193, 12, 6, 158, 6, 102, 159, 66, 169, 195, 243, 57, 49, 167
+};
+
+static const uint8_t BODY_SALT[16] = {
+  225, 47, 207, 136, 141, 36, 224, 15, 163, 142, 89, 53, 51, 97, 249, 149
+};
+
+static char DEFAULT_TOKEN[TOKEN_LEN + 1] =
+  "00.70f78f37bc36973269cd3b044ff15ec46f11c618ea6909452526c46d9173a059.e4f102910b3fea0cacba1923aad556ec";
+
+enum SizeDist { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+
+struct Config {
+  uint32_t num_devices;
+  uint32_t num_threads;
+  double rate;
+  enum SizeDist size_dist;
+  uint32_t size_min, size_max;
+  double size_mean;
+  uint32_t key_every;
+  uint32_t duration;
+  int server_pid;
+  struct sockaddr_in addr;
+  char (*tokens)[TOKEN_LEN];
+  uint32_t num_tokens;
+};
+
+struct Device {
+  int sock;
+  struct PPEncSender sender;
+  PPEncSenderRng rng;
+  uint64_t next_send;
+  uint32_t msgs_sent;
+  /* message being written to the socket */
+  uint8_t *out;
+  uint32_t out_len, out_pos;
+  /* response mac being read */
+  uint8_t in[32];
+  uint32_t in_pos;
+  /* macs we expect back, sent_at in (wrapping) us */
+  struct PPEncWindow window;
+};
+
+struct Counters {
+  uint64_t msgs_sent;
+  uint64_t msgs_acked;
+  uint64_t bytes_sent;
+  uint64_t bad_macs;
+  uint64_t throttled;
+  uint64_t errors;
+};
+
+struct Worker {
+  pthread_t thread;
+  const struct Config *cfg;
+  uint32_t first_device, num_devices;
+  struct Device *devices;
+  struct pollfd *pollfds;
+  uint8_t scratch[PPENC_SCRATCH_SIZE];
+  uint64_t rand_state;
+  struct Counters counters;
+  uint64_t latency[NUM_BUCKETS];
+};
+
+static volatile int running = 1;
+/* all workers connected, start sending */
+static pthread_barrier_t connected;
+
+static uint64_t
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, good enough for sizes and arrival times */
+static uint64_t
+rand64(uint64_t *state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static double
+rand_unit(uint64_t *state)
+{
+  return ((rand64(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static uint32_t
+body_len(const struct Config *cfg, uint64_t *state)
+{
+  double len;
+
+  switch (cfg->size_dist) {
+  case SIZE_UNIFORM:
+    return cfg->size_min + rand64(state) % (cfg->size_max - cfg->size_min + 1);
+  case SIZE_EXP:
+    len = -log(rand_unit(state)) * cfg->size_mean;
+    return len < 1 ? 1 : (len > cfg->size_max ? cfg->size_max : (uint32_t) len);
+  default:
+    return cfg->size_min;
+  }
+}
+
+/* poisson arrivals */
+static uint64_t
+next_interval(const struct Config *cfg, uint64_t *state)
+{
+  return (uint64_t) (-log(rand_unit(state)) * 1e6 / cfg->rate);
+}
+
+static unsigned
+bucket_index(uint64_t us)
+{
+  unsigned bits;
+
+  if (us < (1 << SUB_BUCKET_BITS))
+    return us;
+
+  bits = 63 - __builtin_clzll(us);
+  return ((bits - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS)
+    + ((us >> (bits - SUB_BUCKET_BITS)) & ((1 << SUB_BUCKET_BITS) - 1));
+}
+
+static uint64_t
+bucket_upper(unsigned index)
+{
+  unsigned shift;
+
+  if (index < (1 << SUB_BUCKET_BITS))
+    return index;
+
+  shift = (index >> SUB_BUCKET_BITS) - 1;
+  return ((uint64_t) ((index & ((1 << SUB_BUCKET_BITS) - 1)) | (1 << SUB_BUCKET_BITS)) << shift)
+    + ((uint64_t) 1 << shift) - 1;
+}
+
+static int
+send_all(int sock, const uint8_t *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = send(sock, buf, len, MSG_NOSIGNAL)) <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int
+recv_all(int sock, uint8_t *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = recv(sock, buf, len, 0)) <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* connect and run the handshake in blocking mode, as client.c does */
+static int
+device_connect(struct Worker *w, struct Device *d, uint32_t device_num)
+{
+  uint8_t nonce[8], header_rng_nonce[12], header_state_init[32], body_state0[32];
+  const struct Config *cfg;
+  int one;
+
+  cfg = w->cfg;
+  if ((d->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    perror("couldn't create socket");
+    return -1;
+  }
+
+  if (connect(d->sock, (const struct sockaddr*) &cfg->addr, sizeof(cfg->addr)) < 0) {
+    perror("couldn't connect to server");
+    return -1;
+  }
+
+  one = 1;
+  setsockopt(d->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (send_all(d->sock, (const uint8_t*) cfg->tokens[device_num % cfg->num_tokens], TOKEN_LEN) < 0)
+    return -1;
+
+  memcpy(nonce, &device_num, sizeof(device_num));
+  memcpy(nonce + 4, &w->rand_state, 4);
+  ppenc_sender_rng_init(&d->rng, SENDER_RNG_KEY, nonce);
+  ppenc_sender_rng_nbytes(&d->rng, header_rng_nonce, 12);
+
+  if (send_all(d->sock, header_rng_nonce, 12) < 0
+      || recv_all(d->sock, header_state_init, 32) < 0
+      || recv_all(d->sock, body_state0, 32) < 0)
+    return -1;
+
+  ppenc_sender_init(&d->sender,
+                    &d->rng,
+                    HEADER_SALT,
+                    header_state_init,
+                    header_rng_nonce,
+                    BODY_SALT,
+                    body_state0,
+                    w->scratch);
+  ppenc_window_init(&d->window);
+
+  d->out = malloc(32 + cfg->size_max + 71);
+  if (d->out == NULL)
+    return -1;
+
+  return 0;
+}
+
+static void
+device_new_msg(struct Worker *w, struct Device *d)
+{
+  uint32_t i, len, padded_len;
+  uint8_t response_mac[32];
+
+  if (ppenc_window_space(&d->window) == 0) {
+    __atomic_fetch_add(&w->counters.throttled, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  len = body_len(w->cfg, &w->rand_state);
+  for (i = 0; i < len; i++)
+    d->out[32 + i] = (uint8_t) rand64(&w->rand_state);
+
+  padded_len = ppenc_sender_new_msg(&d->sender,
+                                    d->out,
+                                    d->out + 32,
+                                    len,
+                                    response_mac,
+                                    w->scratch);
+
+  d->out_len = 32 + padded_len;
+  d->out_pos = 0;
+  ppenc_window_push(&d->window, &d->sender, response_mac, (uint32_t) now_us());
+  d->msgs_sent++;
+
+  /* while the message is on the wire, advance the keys */
+  if (w->cfg->key_every != 0 && d->msgs_sent % w->cfg->key_every == 0)
+    ppenc_sender_new_body_key(&d->sender, w->scratch);
+
+  __atomic_fetch_add(&w->counters.msgs_sent, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&w->counters.bytes_sent, len, __ATOMIC_RELAXED);
+}
+
+static int
+device_write(struct Device *d)
+{
+  ssize_t n;
+
+  while (d->out_pos < d->out_len) {
+    n = send(d->sock, d->out + d->out_pos, d->out_len - d->out_pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    d->out_pos += n;
+  }
+
+  d->out_len = d->out_pos = 0;
+  return 0;
+}
+
+static int
+device_read(struct Worker *w, struct Device *d)
+{
+  ssize_t n;
+  uint32_t sent_at;
+
+  while (1) {
+    n = recv(d->sock, d->in + d->in_pos, 32 - d->in_pos, MSG_DONTWAIT);
+    if (n == 0)
+      return -1;
+    if (n < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    d->in_pos += n;
+    if (d->in_pos < 32)
+      continue;
+
+    d->in_pos = 0;
+    if (ppenc_window_outstanding(&d->window) == 0)
+      return -1;
+
+    if (ppenc_window_ack(&d->window, d->in, NULL, &sent_at) != PPENC_OK) {
+      __atomic_fetch_add(&w->counters.bad_macs, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    w->latency[bucket_index((uint32_t) now_us() - sent_at)]++;
+    __atomic_fetch_add(&w->counters.msgs_acked, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void
+device_close(struct Worker *w, struct Device *d)
+{
+  __atomic_fetch_add(&w->counters.errors, 1, __ATOMIC_RELAXED);
+  close(d->sock);
+  d->sock = -1;
+}
+
+static void*
+worker_run(void *arg)
+{
+  struct Worker *w;
+  struct Device *d;
+  uint64_t now, wake;
+  uint32_t i;
+  int timeout;
+
+  w = (struct Worker*) arg;
+
+  for (i = 0; i < w->num_devices; i++) {
+    d = &w->devices[i];
+    if (device_connect(w, d, w->first_device + i) < 0) {
+      fprintf(stderr, "device %u couldn't connect\n", w->first_device + i);
+      if (d->sock >= 0)
+        device_close(w, d);
+    }
+  }
+
+  pthread_barrier_wait(&connected);
+  now = now_us();
+  for (i = 0; i < w->num_devices; i++)
+    w->devices[i].next_send = now + next_interval(w->cfg, &w->rand_state);
+
+  while (running) {
+    now = now_us();
+    wake = now + 10000;
+
+    for (i = 0; i < w->num_devices; i++) {
+      d = &w->devices[i];
+      w->pollfds[i].fd = d->sock;
+      w->pollfds[i].events = 0;
+      w->pollfds[i].revents = 0;
+      if (d->sock < 0)
+        continue;
+
+      if (d->out_len == 0 && now >= d->next_send) {
+        device_new_msg(w, d);
+        d->next_send += next_interval(w->cfg, &w->rand_state);
+        if (d->next_send < now)
+          d->next_send = now;
+        if (d->out_len != 0 && device_write(d) < 0) {
+          device_close(w, d);
+          continue;
+        }
+      }
+
+      if (d->next_send < wake)
+        wake = d->next_send;
+
+      w->pollfds[i].events = POLLIN | (d->out_len != 0 ? POLLOUT : 0);
+    }
+
+    timeout = wake > now ? (int) ((wake - now + 999) / 1000) : 0;
+    if (poll(w->pollfds, w->num_devices, timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+
+    for (i = 0; i < w->num_devices; i++) {
+      d = &w->devices[i];
+      if (d->sock < 0 || w->pollfds[i].revents == 0)
+        continue;
+
+      if ((w->pollfds[i].revents & (POLLERR | POLLHUP)) != 0
+          || ((w->pollfds[i].revents & POLLIN) != 0 && device_read(w, d) < 0)
+          || ((w->pollfds[i].revents & POLLOUT) != 0 && device_write(d) < 0))
+        device_close(w, d);
+    }
+  }
+
+  return NULL;
+}
+
+/* utime + stime of pid in clock ticks, -1 if unavailable */
+static long
+proc_cpu_ticks(int pid)
+{
+  char path[64], buf[1024], *p;
+  unsigned long utime, stime;
+  FILE *f;
+  size_t n;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if ((f = fopen(path, "r")) == NULL)
+    return -1;
+  n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = 0;
+
+  /* skip past the command name, which may contain spaces */
+  if ((p = strrchr(buf, ')')) == NULL)
+    return -1;
+  if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return -1;
+
+  return (long) (utime + stime);
+}
+
+static void
+sum_counters(struct Worker *workers, uint32_t num_workers, struct Counters *c)
+{
+  uint32_t i;
+
+  memset(c, 0, sizeof(*c));
+  for (i = 0; i < num_workers; i++) {
+    c->msgs_sent += __atomic_load_n(&workers[i].counters.msgs_sent, __ATOMIC_RELAXED);
+    c->msgs_acked += __atomic_load_n(&workers[i].counters.msgs_acked, __ATOMIC_RELAXED);
+    c->bytes_sent += __atomic_load_n(&workers[i].counters.bytes_sent, __ATOMIC_RELAXED);
+    c->bad_macs += __atomic_load_n(&workers[i].counters.bad_macs, __ATOMIC_RELAXED);
+    c->errors += __atomic_load_n(&workers[i].counters.errors, __ATOMIC_RELAXED);
+    c->throttled += __atomic_load_n(&workers[i].counters.throttled, __ATOMIC_RELAXED);
+  }
+}
+
+static void
+report_latency(struct Worker *workers, uint32_t num_workers)
+{
+  static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+  uint64_t buckets[NUM_BUCKETS], total, seen;
+  uint32_t i, q;
+
+  memset(buckets, 0, sizeof(buckets));
+  total = 0;
+  for (i = 0; i < num_workers; i++) {
+    for (q = 0; q < NUM_BUCKETS; q++) {
+      buckets[q] += workers[i].latency[q];
+      total += workers[i].latency[q];
+    }
+  }
+
+  if (total == 0)
+    return;
+
+  printf("mac round trip latency (us):");
+  for (q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++) {
+    uint64_t rank;
+
+    rank = (uint64_t) ceil(QUANTILES[q] * total);
+    seen = 0;
+    for (i = 0; i < NUM_BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen >= rank)
+        break;
+    }
+    printf(" p%g=%llu", QUANTILES[q] * 100, (unsigned long long) bucket_upper(i));
+  }
+  printf("\n");
+}
+
+static int
+parse_size(struct Config *cfg, const char *arg)
+{
+  unsigned a, b;
+
+  if (sscanf(arg, "exp:%u", &a) == 1 && a > 0) {
+    cfg->size_dist = SIZE_EXP;
+    cfg->size_mean = a;
+    cfg->size_min = 1;
+    cfg->size_max = a * 16;
+  } else if (sscanf(arg, "%u-%u", &a, &b) == 2 && a > 0 && b >= a) {
+    cfg->size_dist = SIZE_UNIFORM;
+    cfg->size_min = a;
+    cfg->size_max = b;
+  } else if (sscanf(arg, "%u", &a) == 1 && a > 0) {
+    cfg->size_dist = SIZE_FIXED;
+    cfg->size_min = cfg->size_max = a;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int
+read_tokens(struct Config *cfg, const char *path)
+{
+  char line[256];
+  FILE *f;
+
+  if ((f = fopen(path, "r")) == NULL)
+    return -1;
+
+  cfg->tokens = malloc(MAX_TOKENS * TOKEN_LEN);
+  cfg->num_tokens = 0;
+  while (cfg->num_tokens < MAX_TOKENS && fgets(line, sizeof(line), f) != NULL) {
+    if (strlen(line) < TOKEN_LEN)
+      continue;
+    memcpy(cfg->tokens[cfg->num_tokens++], line, TOKEN_LEN);
+  }
+  fclose(f);
+
+  return cfg->num_tokens == 0 ? -1 : 0;
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr,
+          "usage: loadgen-bin [-n devices] [-j threads] [-r msgs/s per device]\n"
+          "                   [-s size|lo-hi|exp:mean] [-k msgs per body key]\n"
+          "                   [-d seconds] [-p server pid] [-a host] [-P port]\n"
+          "                   [-t token file]\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct Config cfg;
+  struct Worker *workers;
+  struct Counters prev, cur;
+  uint64_t start, elapsed;
+  long cpu_start, cpu_end;
+  uint32_t i, per_worker, sec;
+  int opt, port;
+  const char *host;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.num_devices = 1000;
+  cfg.num_threads = 4;
+  cfg.rate = 1;
+  cfg.size_dist = SIZE_FIXED;
+  cfg.size_min = cfg.size_max = 64;
+  cfg.key_every = 16;
+  cfg.duration = 10;
+  cfg.tokens = (char (*)[TOKEN_LEN]) DEFAULT_TOKEN;
+  cfg.num_tokens = 1;
+  host = "127.0.0.1";
+  port = 8080;
+
+  while ((opt = getopt(argc, argv, "n:j:r:s:k:d:p:a:P:t:")) != -1) {
+    switch (opt) {
+    case 'n': cfg.num_devices = strtoul(optarg, NULL, 10); break;
+    case 'j': cfg.num_threads = strtoul(optarg, NULL, 10); break;
+    case 'r': cfg.rate = strtod(optarg, NULL); break;
+    case 's': if (parse_size(&cfg, optarg) < 0) usage(); break;
+    case 'k': cfg.key_every = strtoul(optarg, NULL, 10); break;
+    case 'd': cfg.duration = strtoul(optarg, NULL, 10); break;
+    case 'p': cfg.server_pid = atoi(optarg); break;
+    case 'a': host = optarg; break;
+    case 'P': port = atoi(optarg); break;
+    case 't':
+      if (read_tokens(&cfg, optarg) < 0) {
+        fprintf(stderr, "couldn't read tokens from %s\n", optarg);
+        exit(1);
+      }
+      break;
+    default: usage();
+    }
+  }
+
+  if (cfg.num_devices == 0 || cfg.num_threads == 0 || cfg.rate <= 0)
+    usage();
+  if (cfg.num_threads > cfg.num_devices)
+    cfg.num_threads = cfg.num_devices;
+
+  cfg.addr.sin_family = AF_INET;
+  cfg.addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &cfg.addr.sin_addr) != 1) {
+    fprintf(stderr, "bad address %s\n", host);
+    exit(1);
+  }
+
+  workers = calloc(cfg.num_threads, sizeof(struct Worker));
+  pthread_barrier_init(&connected, NULL, cfg.num_threads + 1);
+  per_worker = (cfg.num_devices + cfg.num_threads - 1) / cfg.num_threads;
+  for (i = 0; i < cfg.num_threads; i++) {
+    struct Worker *w;
+
+    w = &workers[i];
+    w->cfg = &cfg;
+    w->first_device = i * per_worker;
+    w->num_devices = i * per_worker >= cfg.num_devices ? 0
+      : (cfg.num_devices - i * per_worker < per_worker ? cfg.num_devices - i * per_worker : per_worker);
+    w->devices = calloc(w->num_devices, sizeof(struct Device));
+    w->pollfds = calloc(w->num_devices, sizeof(struct pollfd));
+    w->rand_state = (now_us() ^ ((uint64_t) getpid() << 32)) * (i + 1) | 1;
+    if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+      perror("couldn't create thread");
+      exit(1);
+    }
+  }
+
+  pthread_barrier_wait(&connected);
+  printf("%u devices on %u threads, %g msgs/s each\n", cfg.num_devices, cfg.num_threads, cfg.rate);
+
+  start = now_us();
+  cpu_start = cfg.server_pid != 0 ? proc_cpu_ticks(cfg.server_pid) : -1;
+  memset(&prev, 0, sizeof(prev));
+  for (sec = 1; sec <= cfg.duration; sec++) {
+    sleep(1);
+    sum_counters(workers, cfg.num_threads, &cur);
+    printf("[%3us] sent %llu/s acked %llu/s errors %llu\n",
+           sec,
+           (unsigned long long) (cur.msgs_sent - prev.msgs_sent),
+           (unsigned long long) (cur.msgs_acked - prev.msgs_acked),
+           (unsigned long long) cur.errors);
+    fflush(stdout);
+    prev = cur;
+  }
+
+  running = 0;
+  elapsed = now_us() - start;
+  cpu_end = cfg.server_pid != 0 ? proc_cpu_ticks(cfg.server_pid) : -1;
+  for (i = 0; i < cfg.num_threads; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  sum_counters(workers, cfg.num_threads, &cur);
+  printf("sent %llu msgs (%llu body bytes), acked %llu, bad macs %llu, throttled %llu, errors %llu\n",
+         (unsigned long long) cur.msgs_sent,
+         (unsigned long long) cur.bytes_sent,
+         (unsigned long long) cur.msgs_acked,
+         (unsigned long long) cur.bad_macs,
+         (unsigned long long) cur.throttled,
+         (unsigned long long) cur.errors);
+  printf("server msgs/s: %.1f\n", cur.msgs_acked / (elapsed / 1e6));
+  report_latency(workers, cfg.num_threads);
+
+  if (cpu_start >= 0 && cpu_end >= 0 && cur.msgs_acked != 0)
+    printf("server cpu: %.2f%% of one core, %.1f us/msg\n",
+           100.0 * (cpu_end - cpu_start) / sysconf(_SC_CLK_TCK) / (elapsed / 1e6),
+           1e6 * (cpu_end - cpu_start) / sysconf(_SC_CLK_TCK) / cur.msgs_acked);
+
+  return cur.bad_macs != 0;
+}
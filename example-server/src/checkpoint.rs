@@ -0,0 +1,132 @@
+// Checkpoints of the datagram session table, so a restarted server picks
+// its sessions up again instead of every device redoing the handshake (and
+// its monstermac call) at once.
+//
+// The table is written through a memory map to a file next to the
+// checkpoint and renamed over it, laid out as
+//
+//   "ppencckp" | next session id (4) | count (4) | count records of
+//     session id (4) | seen (4) | lost (4) | device id (32) | snapshot
+//
+// with numbers big endian. Snapshots hold session keys, so the file is
+// created readable by its owner only.
+use std::fs::{self, File, OpenOptions};
+use std::io;
+use std::os::unix::fs::OpenOptionsExt;
+use std::result;
+use std::sync::atomic::AtomicBool;
+use std::sync::Arc;
+
+use memmap2::{Mmap, MmapMut};
+use signal_hook::consts::{SIGINT, SIGTERM};
+use signal_hook::flag;
+
+type Result<T> = result::Result<T, &'static str>;
+
+const MAGIC: &[u8; 8] = b"ppencckp";
+const HEAD_LEN: usize = 16;
+const DEVICE_ID_LEN: usize = 32;
+const RECORD_LEN: usize = 12 + DEVICE_ID_LEN + ppenc::SNAPSHOT_LEN;
+
+pub struct Record {
+    pub session_id: u32,
+    pub seen: u32,
+    pub lost: u32,
+    pub device_id: String,
+    pub snapshot: [u8; ppenc::SNAPSHOT_LEN],
+}
+
+// SIGINT and SIGTERM only set shutdown, the checkpoint thread writes the
+// final checkpoint and exits
+pub fn catch_shutdown(shutdown: &Arc<AtomicBool>) -> Result<()> {
+    for signal in [SIGINT, SIGTERM] {
+        flag::register(signal, Arc::clone(shutdown))
+            .map_err(|_| "couldn't catch shutdown signals")?;
+    }
+    Ok(())
+}
+
+pub fn write(path: &str, next_session_id: u32, records: &[Record]) -> Result<()> {
+    let tmp_path = format!("{}.tmp", path);
+    let file = OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create(true)
+        .truncate(true)
+        .mode(0o600)
+        .open(&tmp_path)
+        .map_err(|_| "couldn't create checkpoint")?;
+    let len = HEAD_LEN + records.len() * RECORD_LEN;
+    file.set_len(len as u64)
+        .map_err(|_| "couldn't size checkpoint")?;
+
+    {
+        let mut map = unsafe { MmapMut::map_mut(&file) }.map_err(|_| "couldn't map checkpoint")?;
+        let buf = &mut map[..];
+        buf[..8].copy_from_slice(MAGIC);
+        buf[8..12].copy_from_slice(&next_session_id.to_be_bytes());
+        buf[12..16].copy_from_slice(&(records.len() as u32).to_be_bytes());
+
+        for (r, out) in records.iter().zip(buf[HEAD_LEN..].chunks_mut(RECORD_LEN)) {
+            out[0..4].copy_from_slice(&r.session_id.to_be_bytes());
+            out[4..8].copy_from_slice(&r.seen.to_be_bytes());
+            out[8..12].copy_from_slice(&r.lost.to_be_bytes());
+            out[12..12 + DEVICE_ID_LEN].fill(b' ');
+            let id = r.device_id.as_bytes();
+            let id_len = id.len().min(DEVICE_ID_LEN);
+            out[12..12 + id_len].copy_from_slice(&id[..id_len]);
+            out[12 + DEVICE_ID_LEN..].copy_from_slice(&r.snapshot);
+        }
+
+        map.flush().map_err(|_| "couldn't sync checkpoint")?;
+    }
+
+    fs::rename(&tmp_path, path).map_err(|_| "couldn't replace checkpoint")
+}
+
+// No checkpoint yet reads as an empty table
+pub fn read(path: &str) -> Result<(u32, Vec<Record>)> {
+    let file = match File::open(path) {
+        Ok(f) => f,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok((1, Vec::new())),
+        Err(_) => return Err("couldn't open checkpoint"),
+    };
+    let len = file
+        .metadata()
+        .map_err(|_| "couldn't open checkpoint")?
+        .len() as usize;
+    if len < HEAD_LEN {
+        return Err("checkpoint too short");
+    }
+
+    let map = unsafe { Mmap::map(&file) }.map_err(|_| "couldn't map checkpoint")?;
+    let buf = &map[..];
+    if &buf[..8] != MAGIC {
+        return Err("not a checkpoint");
+    }
+    let next_session_id = u32::from_be_bytes([buf[8], buf[9], buf[10], buf[11]]);
+    let count = u32::from_be_bytes([buf[12], buf[13], buf[14], buf[15]]) as usize;
+    if len != HEAD_LEN + count * RECORD_LEN {
+        return Err("checkpoint truncated");
+    }
+
+    let be32 = |b: &[u8]| u32::from_be_bytes([b[0], b[1], b[2], b[3]]);
+    let records = buf[HEAD_LEN..]
+        .chunks(RECORD_LEN)
+        .map(|r| {
+            let mut snapshot = [0u8; ppenc::SNAPSHOT_LEN];
+            snapshot.copy_from_slice(&r[12 + DEVICE_ID_LEN..]);
+            Record {
+                session_id: be32(&r[0..4]),
+                seen: be32(&r[4..8]),
+                lost: be32(&r[8..12]),
+                device_id: String::from_utf8_lossy(&r[12..12 + DEVICE_ID_LEN])
+                    .trim_end()
+                    .to_string(),
+                snapshot,
+            }
+        })
+        .collect();
+
+    Ok((next_session_id, records))
+}
@@ -1,14 +1,75 @@
 use hmac_sha256::Hash as Sha256;
 use hmac_sha512::Hash as Sha512;
+use std::collections::HashMap;
 use std::io::{Read, Write};
-use std::net::{TcpListener, TcpStream};
+use std::net::{TcpListener, TcpStream, UdpSocket};
 use std::result;
-use std::thread::Builder as ThreadBuilder;
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread::{self, Builder as ThreadBuilder};
+use std::time::{Duration, Instant};
 
 use rand::Rng;
 
+mod checkpoint;
+mod monstermac;
+
 type Result<T> = result::Result<T, &'static str>;
 
+// Longest body a device may send, override with MAX_BODY_LEN
+const DEFAULT_MAX_BODY_LEN: u32 = 64 * 1024;
+const INITIAL_BODY_CAP: usize = 512;
+
+// Devices sending over UDP run the handshake on DGRAM_ADDR over TCP and
+// get back a 4 byte session id, then send datagrams to DGRAM_ADDR of
+//
+//   session id (4, big endian) | header (32) | padded body
+//
+// each answered with a datagram holding the response mac. A session lasts
+// as long as its setup connection stays open, sessions restored from a
+// checkpoint until they go idle.
+const DGRAM_ADDR: &str = "127.0.0.1:8082";
+const MAX_DGRAM_LEN: usize = 1500;
+const RESTORED_IDLE_TIMEOUT: Duration = Duration::from_secs(600);
+
+// Where the datagram sessions are checkpointed and how often, override
+// with CHECKPOINT_PATH and CHECKPOINT_SECS
+const DEFAULT_CHECKPOINT_PATH: &str = "dgram-sessions.ckpt";
+const DEFAULT_CHECKPOINT_SECS: u64 = 10;
+
+static NEXT_DGRAM_SESSION_ID: AtomicU32 = AtomicU32::new(1);
+
+struct DgramSession {
+    device_id: String,
+    receiver: ppenc::Receiver,
+    window: ppenc::DgramWindow,
+    // set for sessions from a checkpoint, whose setup connection is gone
+    last_active: Option<Instant>,
+}
+
+type DgramSessions = Arc<Mutex<HashMap<u32, DgramSession>>>;
+
+// Headers rejected for a body over the limit, across all streams
+static OVERSIZE_HEADERS: AtomicU64 = AtomicU64::new(0);
+
+fn max_body_len() -> u32 {
+    std::env::var("MAX_BODY_LEN")
+        .ok()
+        .and_then(|v| v.parse().ok())
+        .unwrap_or(DEFAULT_MAX_BODY_LEN)
+}
+
+// Sizes the reusable body buffer to len, doubling its capacity when it
+// has to grow but never past cap, which the receiver guarantees len is under
+fn body_buf(body: &mut Vec<u8>, len: usize, cap: usize) -> &mut Vec<u8> {
+    if len > body.capacity() {
+        let new_cap = (body.capacity() * 2).max(len).min(cap);
+        body.reserve_exact(new_cap - body.len());
+    }
+    body.resize(len, 0);
+    body
+}
+
 fn read_token(tk: &[u8]) -> Result<(String, [u8; 16], [u8; 16])> {
     let tk = std::str::from_utf8(tk).map_err(|_| "badly formed token")?;
 
@@ -31,19 +92,13 @@ fn read_token(tk: &[u8]) -> Result<(String, [u8; 16], [u8; 16])> {
     let token_mac = hex::decode(&parts[2]).map_err(|_| "badly formed token")?;
 
     // Compute MonsterMac(name)
-    let mmac = idcurl::Request::post("http://127.0.0.1:8081".to_string())
-        .body(std::io::Cursor::new(&name))
-        .send()
-        .map_err(|_| "couldn't call monster mac")?
-        .data()
-        .map_err(|_| "couldn't read monstermac response body")
-        .and_then(|m| {
-            if m.len() == 32 {
-                Ok(m)
-            } else {
-                Err("invalid monster mac response body")
-            }
-        })?;
+    let mmac = monstermac::mac(&name).and_then(|m| {
+        if m.len() == 32 {
+            Ok(m)
+        } else {
+            Err("invalid monster mac response body")
+        }
+    })?;
 
     // Check the mac
     if &md5::compute(hmac_sha256::HMAC::mac(&name, &mmac))[..] != &token_mac[..] {
@@ -113,27 +168,38 @@ fn run_stream_with_res(mut stream: TcpStream) -> Result<()> {
 
     println!("new stream device_id={}", device_id);
 
+    let max_body_len = max_body_len();
+    receiver.set_max_body_len(max_body_len);
+    let body_cap = max_body_len as usize + ppenc::BODY_SLACK;
+
     let mut header_buf = [0u8; 32];
-    let mut body = vec![0u8; 512];
+    let mut body = Vec::with_capacity(INITIAL_BODY_CAP.min(body_cap));
 
     loop {
         stream
             .read_exact(&mut header_buf)
             .map_err(|_| "couldn't read header")?;
 
-        let header = receiver
-            .read_header(&mut header_buf)
-            .map_err(|_| "bad header in stream")?;
+        let header = match receiver.read_header(&mut header_buf) {
+            Ok(h) => h,
+            Err(ppenc::Error::BodyTooLong) => {
+                let total = OVERSIZE_HEADERS.fetch_add(1, Ordering::Relaxed) + 1;
+                println!(
+                    "oversize_header\tdevice_id={}\tmax_body_len={}\ttotal={}",
+                    device_id, max_body_len, total
+                );
+                return Err("body too long in stream");
+            }
+            Err(_) => return Err("bad header in stream"),
+        };
 
-        body.resize(header.body_padded_len(), 0);
+        let body = body_buf(&mut body, header.body_padded_len(), body_cap);
 
-        stream
-            .read_exact(&mut body)
-            .map_err(|_| "couldn't read body")?;
+        stream.read_exact(body).map_err(|_| "couldn't read body")?;
 
         println!("{}", hex::encode(&header_buf));
 
-        let resp_mac = match receiver.read_body(header, &mut body) {
+        let resp_mac = match receiver.read_body(header, body) {
             Err(e) => {
                 eprintln!("{}", e);
                 return Err("bad body in stream");
@@ -141,7 +207,7 @@ fn run_stream_with_res(mut stream: TcpStream) -> Result<()> {
             Ok(m) => m,
         };
 
-        match std::str::from_utf8(&body) {
+        match std::str::from_utf8(body) {
             Ok(s) => println!(
                 "message\tdevice_id={}\tmessage={}\tmac={}",
                 device_id,
@@ -190,7 +256,263 @@ fn run() -> Result<()> {
     Ok(())
 }
 
+fn run_dgram_setup_with_res(mut stream: TcpStream, sessions: DgramSessions, id: u32) -> Result<()> {
+    let (device_id, mut receiver) = stream_setup(&mut stream)?;
+
+    // Bodies have to fit one datagram
+    receiver.set_max_body_len((MAX_DGRAM_LEN - 4 - 32 - ppenc::BODY_SLACK) as u32);
+    let window = ppenc::DgramWindow::new(&receiver);
+
+    println!(
+        "new dgram session device_id={}\tsession_id={}",
+        device_id, id
+    );
+    sessions.lock().unwrap().insert(
+        id,
+        DgramSession {
+            device_id,
+            receiver,
+            window,
+            last_active: None,
+        },
+    );
+
+    let res = stream
+        .write_all(&id.to_be_bytes())
+        .map_err(|_| "couldn't write session id");
+
+    // Nothing more is read, this returns once the device hangs up
+    if res.is_ok() {
+        let _ = stream.read(&mut [0u8; 1]);
+    }
+
+    sessions.lock().unwrap().remove(&id);
+    res
+}
+
+fn run_dgram_setup(stream: TcpStream, sessions: DgramSessions, id: u32) {
+    if let Err(e) = run_dgram_setup_with_res(stream, sessions, id) {
+        eprintln!("dgram session closed {}", e);
+    }
+}
+
+fn run_dgram(socket: UdpSocket, sessions: DgramSessions) {
+    let mut buf = [0u8; MAX_DGRAM_LEN];
+    let mut header_buf = [0u8; 32];
+    let mut body = Vec::with_capacity(MAX_DGRAM_LEN);
+
+    loop {
+        let (len, from) = match socket.recv_from(&mut buf) {
+            Ok(r) => r,
+            Err(e) => {
+                eprintln!("problem receiving datagram {}", e);
+                continue;
+            }
+        };
+        if len < 4 + 32 {
+            continue;
+        }
+
+        let id = u32::from_be_bytes([buf[0], buf[1], buf[2], buf[3]]);
+        let mut sessions = sessions.lock().unwrap();
+        let session = match sessions.get_mut(&id) {
+            Some(s) => s,
+            None => continue,
+        };
+
+        // Late, duplicated and forged datagrams are dropped, the device
+        // resends whatever goes unanswered
+        header_buf.copy_from_slice(&buf[4..36]);
+        let header = match session
+            .receiver
+            .read_header_dgram(&session.window, &mut header_buf)
+        {
+            Ok(h) => h,
+            Err(e) => {
+                println!("dropped\tdevice_id={}\t{}", session.device_id, e);
+                continue;
+            }
+        };
+        let seq_num = header.seq_num();
+        if header.body_padded_len() != len - 36 {
+            println!(
+                "dropped\tdevice_id={}\ttruncated datagram",
+                session.device_id
+            );
+            continue;
+        }
+
+        let resp_mac = match session.receiver.read_body_dgram(
+            &mut session.window,
+            header,
+            &buf[36..len],
+            &mut body,
+        ) {
+            Ok(m) => m,
+            Err(e) => {
+                println!("dropped\tdevice_id={}\t{}", session.device_id, e);
+                continue;
+            }
+        };
+
+        if session.last_active.is_some() {
+            session.last_active = Some(Instant::now());
+        }
+
+        println!(
+            "message\tdevice_id={}\tseq_num={}\tmessage={:?}\tmac={}\tlost={}",
+            session.device_id,
+            seq_num,
+            body,
+            &hex::encode(&resp_mac[..])[..10],
+            session.window.lost()
+        );
+
+        if let Err(e) = socket.send_to(&resp_mac, from) {
+            eprintln!("couldn't send response_mac {}", e);
+        }
+    }
+}
+
+fn checkpoint_path() -> String {
+    std::env::var("CHECKPOINT_PATH").unwrap_or_else(|_| DEFAULT_CHECKPOINT_PATH.to_string())
+}
+
+fn checkpoint_secs() -> u64 {
+    std::env::var("CHECKPOINT_SECS")
+        .ok()
+        .and_then(|v| v.parse().ok())
+        .unwrap_or(DEFAULT_CHECKPOINT_SECS)
+}
+
+// Devices of restored sessions carry on sending datagrams as if nothing
+// happened, no handshake needed
+fn restore_dgram_sessions(path: &str) -> Result<DgramSessions> {
+    let (next_session_id, records) = checkpoint::read(path)?;
+    NEXT_DGRAM_SESSION_ID.store(next_session_id, Ordering::Relaxed);
+
+    let mut sessions = HashMap::with_capacity(records.len());
+    for r in records {
+        let receiver = match ppenc::Receiver::restore(&r.snapshot) {
+            Ok(receiver) => receiver,
+            Err(e) => {
+                eprintln!("couldn't restore session_id={} {}", r.session_id, e);
+                continue;
+            }
+        };
+        let window = ppenc::DgramWindow::restore(&receiver, r.seen, r.lost);
+        sessions.insert(
+            r.session_id,
+            DgramSession {
+                device_id: r.device_id,
+                receiver,
+                window,
+                last_active: Some(Instant::now()),
+            },
+        );
+    }
+
+    println!("restored {} dgram sessions from {}", sessions.len(), path);
+    Ok(Arc::new(Mutex::new(sessions)))
+}
+
+// Writes the session table every checkpoint_secs and once more on SIGINT
+// or SIGTERM, then exits. Datagrams wait on the lock meanwhile, so no
+// message is read after the last checkpoint. After a crash the sessions
+// come back as of the checkpoint before it, devices which sent more than
+// the datagram window since then have to set up again.
+fn run_checkpoints(sessions: DgramSessions, path: String, shutdown: Arc<AtomicBool>) {
+    let interval = Duration::from_secs(checkpoint_secs());
+    let mut last = Instant::now();
+
+    loop {
+        thread::sleep(Duration::from_millis(100));
+        let shutdown = shutdown.load(Ordering::Relaxed);
+        if !shutdown && last.elapsed() < interval {
+            continue;
+        }
+        last = Instant::now();
+
+        let mut sessions = sessions.lock().unwrap();
+        sessions.retain(|_, s| match s.last_active {
+            Some(t) => t.elapsed() < RESTORED_IDLE_TIMEOUT,
+            None => true,
+        });
+
+        let records = sessions
+            .iter()
+            .map(|(&session_id, s)| checkpoint::Record {
+                session_id,
+                seen: s.window.seen(),
+                lost: s.window.lost(),
+                device_id: s.device_id.clone(),
+                snapshot: s.receiver.snapshot(),
+            })
+            .collect::<Vec<_>>();
+        let next_session_id = NEXT_DGRAM_SESSION_ID.load(Ordering::Relaxed);
+        if let Err(e) = checkpoint::write(&path, next_session_id, &records) {
+            eprintln!("couldn't checkpoint dgram sessions {}", e);
+        }
+
+        if shutdown {
+            println!("checkpointed {} dgram sessions to {}", records.len(), path);
+            std::process::exit(0);
+        }
+    }
+}
+
+fn run_dgram_listener() -> Result<()> {
+    let socket = UdpSocket::bind(DGRAM_ADDR).map_err(|_| "couldn't bind to udp port 8082")?;
+    let listener = TcpListener::bind(DGRAM_ADDR).map_err(|_| "couldn't bind to port 8082")?;
+    let path = checkpoint_path();
+    let sessions = restore_dgram_sessions(&path)?;
+
+    {
+        let sessions = sessions.clone();
+        ThreadBuilder::new()
+            .name("dgram".to_string())
+            .spawn(move || run_dgram(socket, sessions))
+            .map_err(|_| "couldn't create dgram thread")?;
+    }
+    let shutdown = Arc::new(AtomicBool::new(false));
+    {
+        let sessions = sessions.clone();
+        let shutdown = shutdown.clone();
+        ThreadBuilder::new()
+            .name("checkpoint".to_string())
+            .spawn(move || run_checkpoints(sessions, path, shutdown))
+            .map_err(|_| "couldn't create checkpoint thread")?;
+    }
+    checkpoint::catch_shutdown(&shutdown)?;
+
+    for stream in listener.incoming() {
+        match stream {
+            Ok(stream) => {
+                let id = NEXT_DGRAM_SESSION_ID.fetch_add(1, Ordering::Relaxed);
+                let sessions = sessions.clone();
+                ThreadBuilder::new()
+                    .name(format!("dgram_session_{}", id))
+                    .spawn(move || run_dgram_setup(stream, sessions, id))
+                    .map_err(|_| "couldn't create dgram session thread")?;
+            }
+            Err(e) => {
+                eprintln!("problem dgram setup stream {}", e);
+            }
+        }
+    }
+
+    Ok(())
+}
+
 fn main() {
+    let _ = ThreadBuilder::new()
+        .name("dgram_listener".to_string())
+        .spawn(|| {
+            if let Err(e) = run_dgram_listener() {
+                eprintln!("dgram listener crashed {}", e);
+            }
+        });
+
     while let Err(e) = run() {
         eprintln!("server crashed {}", e);
     }
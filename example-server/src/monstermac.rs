@@ -0,0 +1,133 @@
+// Keep-alive client for the monstermac service.
+// Connections are kept in a pool and re-used across streams so a burst of
+// device handshakes does not pay a tcp connect per monstermac call.
+use std::io::{BufRead, BufReader, Read, Write};
+use std::net::TcpStream;
+use std::result;
+use std::sync::Mutex;
+use std::time::Duration;
+
+type Result<T> = result::Result<T, &'static str>;
+
+const MONSTERMAC_ADDR: &str = "127.0.0.1:8081";
+const MAX_IDLE_CONNS: usize = 64;
+const TIMEOUT: Duration = Duration::from_secs(5);
+const MAC_LEN: usize = 32;
+
+static POOL: Mutex<Vec<BufReader<TcpStream>>> = Mutex::new(Vec::new());
+
+// Compute MonsterMac(name)
+pub fn mac(name: &[u8]) -> Result<Vec<u8>> {
+    // A pooled connection may have been closed by the server while idle,
+    // in that case retry once on a fresh connection. A response, even an
+    // error status, is never retried.
+    let (status, mac) = match take_conn().map(|conn| call(conn, name)) {
+        Some(Ok(resp)) => resp,
+        _ => call(connect()?, name)?,
+    };
+
+    if status != 200 {
+        return Err("monster mac did not return 200 OK");
+    }
+
+    Ok(mac)
+}
+
+// Err only for connection and framing errors, the mac is empty unless the
+// status is 200
+fn call(mut conn: BufReader<TcpStream>, name: &[u8]) -> Result<(u16, Vec<u8>)> {
+    let head = format!(
+        "POST / HTTP/1.1\r\nhost: {}\r\ncontent-length: {}\r\n\r\n",
+        MONSTERMAC_ADDR,
+        name.len()
+    );
+
+    let stream = conn.get_mut();
+    stream
+        .write_all(head.as_bytes())
+        .and_then(|_| stream.write_all(name))
+        .map_err(|_| "couldn't call monster mac")?;
+
+    let (status, keep_alive, content_len) = read_response_head(&mut conn)?;
+    if status != 200 {
+        // The body is left unread, so the connection can't be reused
+        return Ok((status, vec![]));
+    }
+
+    // Checked before allocating, the server can't make us buffer more
+    if content_len != MAC_LEN {
+        return Err("badly formed monstermac response");
+    }
+    let mut mac = vec![0; MAC_LEN];
+    conn.read_exact(&mut mac)
+        .map_err(|_| "couldn't read monstermac response body")?;
+
+    if keep_alive {
+        put_conn(conn);
+    }
+
+    Ok((status, mac))
+}
+
+// Status, whether the connection stays open and the body length
+fn read_response_head(conn: &mut BufReader<TcpStream>) -> Result<(u16, bool, usize)> {
+    let mut line = String::new();
+    conn.read_line(&mut line)
+        .map_err(|_| "couldn't read monstermac response")?;
+
+    let status = line
+        .split_ascii_whitespace()
+        .nth(1)
+        .and_then(|s| s.parse::<u16>().ok())
+        .ok_or("badly formed monstermac response")?;
+
+    let mut content_len = 0;
+    let mut keep_alive = true;
+    loop {
+        line.clear();
+        conn.read_line(&mut line)
+            .map_err(|_| "couldn't read monstermac response")?;
+
+        let header = line.trim_end();
+        if header.is_empty() {
+            break;
+        }
+
+        if let Some((name, value)) = header.split_once(':') {
+            let value = value.trim();
+            if name.eq_ignore_ascii_case("content-length") {
+                content_len = value
+                    .parse()
+                    .map_err(|_| "badly formed monstermac response")?;
+            } else if name.eq_ignore_ascii_case("connection") && value.eq_ignore_ascii_case("close")
+            {
+                keep_alive = false;
+            }
+        }
+    }
+
+    Ok((status, keep_alive, content_len))
+}
+
+fn connect() -> Result<BufReader<TcpStream>> {
+    let stream = TcpStream::connect(MONSTERMAC_ADDR).map_err(|_| "couldn't call monster mac")?;
+    stream
+        .set_read_timeout(Some(TIMEOUT))
+        .and_then(|_| stream.set_write_timeout(Some(TIMEOUT)))
+        .and_then(|_| stream.set_nodelay(true))
+        .map_err(|_| "couldn't configure monster mac connection")?;
+
+    Ok(BufReader::new(stream))
+}
+
+fn take_conn() -> Option<BufReader<TcpStream>> {
+    POOL.lock().ok()?.pop()
+}
+
+fn put_conn(conn: BufReader<TcpStream>) {
+    if let Ok(mut pool) = POOL.lock() {
+        if pool.len() < MAX_IDLE_CONNS {
+            pool.push(conn);
+        }
+    }
+}
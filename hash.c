@@ -90,37 +90,50 @@ ppenc_sha256_len48(uint8_t *const hash_value,
 
 void
 ppenc_cubehash(uint8_t *const hash_value,
-               uint8_t* const msg,
-               uint32_t msg_len)
+               const uint8_t *const msg,
+               const uint32_t msg_len)
 {
-  uint16_t i, j, num_bytes, num_blocks;
-  uint32_t *cubehash, *msg32;
+  ppenc_cubehash_salted(hash_value, msg, msg_len, 0, 0);
+}
+
+void
+ppenc_cubehash_salted(uint8_t *const hash_value,
+                      const uint8_t *const msg,
+                      const uint32_t msg_len,
+                      const uint8_t *const salt,
+                      const uint8_t salt_len)
+{
+  uint32_t i, block[8];
+  uint16_t j;
+  uint32_t *cubehash;
+  uint8_t *block8;
 
   cubehash = (uint32_t*) hash_value;
   for (i = 0; i < 32; i++)
     cubehash[i] = CUBEHASH_INIT[i];
 
-  /* leading padding 0x80 */
-  msg[msg_len++] = 0x80;
-
-  num_bytes = 0;
-  num_blocks = 0;
-  while (num_bytes < msg_len) {
-    num_bytes += 32;
-    num_blocks += 1;
-  }
+  /* hash in the message a block at a time, the last block *
+   * (which may be only padding) gets the 0x80 0x00.. pad  */
+  block8 = (uint8_t*) block;
+  for (i = 0; i <= msg_len; i += 32) {
+    if (msg_len - i >= 32) {
+      for (j = 0; j < 32; j++)
+        block8[j] = msg[i + j];
+    } else {
+      for (j = 0; i + j < msg_len; j++)
+        block8[j] = msg[i + j];
+      block8[j++] = 0x80;
+      for (; j < 32; j++)
+        block8[j] = 0;
+    }
 
-  /* pad msg */
-  for(i = msg_len; i < num_bytes; i++)
-    msg[i] = 0;
+    if (i == 0)
+      for (j = 0; j < salt_len && j < msg_len; j++)
+        block8[j] ^= salt[j];
 
-  /* hash in the message */
-  msg32 = (uint32_t*) msg;
-  for(i = 0; i < num_blocks; i++) {
     for (j = 0; j < 8; j++)
-      cubehash[j] ^= msg32[j];
+      cubehash[j] ^= block[j];
     cubehash_rounds(cubehash, 16);
-    msg32 = msg32 + 8;
   }
 
   /* finalize */
@@ -8,7 +8,15 @@ void ppenc_sha256_len48(uint8_t *const hash_value,
                         uint32_t *const message_schedule_buf);
 
 void ppenc_cubehash(uint8_t *const hash_value,
-                    uint8_t* const msg,
-		    const uint32_t msg_len);
+                    const uint8_t *const msg,
+                    const uint32_t msg_len);
+
+/* cubehash of msg with salt XORed into its first salt_len bytes, *
+ * msg is only read                                              */
+void ppenc_cubehash_salted(uint8_t *const hash_value,
+                           const uint8_t *const msg,
+                           const uint32_t msg_len,
+                           const uint8_t *const salt,
+                           const uint8_t salt_len);
 
 #endif
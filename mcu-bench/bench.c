@@ -0,0 +1,307 @@
+/* Cycle and stack benchmark for an AVR target, run under simavr.
+ *
+ * Timer1 runs at the cpu clock (no prescaler) and counts overflows in an
+ * interrupt, giving a 32 bit cycle counter. Stack usage is measured by
+ * painting the free ram below the stack pointer with a pattern before
+ * each call and finding the lowest byte that was overwritten afterwards.
+ *
+ * Results are written one per line to the simavr console:
+ *   <name> <param> cycles=<n> stack=<bytes> [wire=<bytes>]
+ * new_msg lines add the bytes the message takes on the wire.            */
+#include <stdint.h>
+#include <stdio.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+
+#include "avr_mcu_section.h"
+
+#include "../ppenc.h"
+
+AVR_MCU(F_CPU, MCU_NAME);
+AVR_MCU_SIMAVR_CONSOLE(&GPIOR0);
+
+#define STACK_PAINT 0xa5
+#define MAX_BODY_LEN 1024
+#define NUM_RUNS 4
+
+static const uint16_t BODY_LENS[] = {1, 16, 64, 256, 1024};
+static const uint16_t THREEFISH_BLOCKS[] = {1, 4};
+
+/* body needs 71 bytes slack for padding/hash padding */
+static uint8_t body[MAX_BODY_LEN + 71];
+static uint8_t header[32];
+static uint8_t response_mac[32];
+static uint8_t scratch[PPENC_SCRATCH_SIZE];
+static struct PPEncSender sender;
+static PPEncSenderRng sender_rng;
+
+static volatile uint16_t timer1_overflows;
+
+extern uint8_t __heap_start;
+
+ISR(TIMER1_OVF_vect)
+{
+  timer1_overflows++;
+}
+
+static int
+console_putchar(char c, FILE *stream)
+{
+  (void) stream;
+  GPIOR0 = c;
+  return 0;
+}
+
+static FILE console = FDEV_SETUP_STREAM(console_putchar, NULL, _FDEV_SETUP_WRITE);
+
+static void
+timer_start(void)
+{
+  TCCR1A = 0;
+  TCCR1B = 0;
+  TCNT1 = 0;
+  timer1_overflows = 0;
+  TIFR1 = _BV(TOV1);
+  TIMSK1 = _BV(TOIE1);
+  TCCR1B = _BV(CS10);
+}
+
+static uint32_t
+timer_stop(void)
+{
+  uint16_t lower, upper;
+
+  TCCR1B = 0;
+  cli();
+  lower = TCNT1;
+  upper = timer1_overflows;
+  if (TIFR1 & _BV(TOV1))
+    upper++;
+  sei();
+
+  return ((uint32_t) upper << 16) | lower;
+}
+
+/* Paint from the end of .bss up to just below our own frame */
+static void __attribute__((noinline))
+stack_paint(void)
+{
+  uint8_t *p;
+
+  for (p = &__heap_start; p < (uint8_t*) SP - 16; p++)
+    *p = STACK_PAINT;
+}
+
+/* Bytes of stack used below sp by the measured call */
+static uint16_t
+stack_used(uint16_t sp)
+{
+  uint8_t *p;
+
+  for (p = &__heap_start; p < (uint8_t*) sp; p++)
+    if (*p != STACK_PAINT)
+      break;
+
+  return sp - (uint16_t) p;
+}
+
+static void
+fill(uint8_t *buf, uint16_t len, uint8_t seed)
+{
+  uint16_t i;
+
+  for (i = 0; i < len; i++)
+    buf[i] = (uint8_t) (i * 31 + seed);
+}
+
+static void
+bench_init(void)
+{
+  uint8_t rng_key[32], rng_nonce[8], header_salt[16], header_state_init[32];
+  uint8_t header_rng_nonce[12], body_salt[16], body_state0[32];
+  uint16_t sp;
+  uint32_t cycles;
+
+  fill(rng_key, 32, 1);
+  fill(rng_nonce, 8, 2);
+  fill(header_salt, 16, 3);
+  fill(header_state_init, 32, 4);
+  fill(header_rng_nonce, 12, 5);
+  fill(body_salt, 16, 6);
+  fill(body_state0, 32, 7);
+
+  ppenc_sender_rng_init(&sender_rng, rng_key, rng_nonce);
+
+  stack_paint();
+  sp = SP;
+  timer_start();
+  ppenc_sender_init(&sender, &sender_rng, header_salt, header_state_init,
+                    header_rng_nonce, body_salt, body_state0, scratch);
+  cycles = timer_stop();
+
+  fprintf(&console, "sender_init 0 cycles=%lu stack=%u\n",
+          (unsigned long) cycles, stack_used(sp));
+}
+
+/* prepared: ppenc_sender_prepare runs untimed before each new_msg. *
+ * name tells the sender's wire format versions apart               */
+static void
+bench_new_msg(const char *name, uint16_t body_len, uint8_t prepared)
+{
+  uint16_t i, sp, stack, max_stack;
+  uint32_t cycles, min_cycles, wire_len;
+
+  min_cycles = UINT32_MAX;
+  max_stack = 0;
+
+  for (i = 0; i < NUM_RUNS; i++) {
+    fill(body, body_len, (uint8_t) i);
+    if (prepared)
+      ppenc_sender_prepare(&sender);
+
+    stack_paint();
+    sp = SP;
+    timer_start();
+    wire_len = ppenc_sender_new_msg(&sender, header, body, body_len, response_mac, scratch);
+    cycles = timer_stop();
+    stack = stack_used(sp);
+
+    if (cycles < min_cycles)
+      min_cycles = cycles;
+    if (stack > max_stack)
+      max_stack = stack;
+  }
+
+  wire_len += ppenc_header_len(sender.session.version);
+  fprintf(&console, "%s%s %u cycles=%lu stack=%u wire=%lu\n",
+          name, prepared ? "_prepared" : "", body_len, (unsigned long) min_cycles, max_stack,
+          (unsigned long) wire_len);
+}
+
+static void
+bench_prepare(void)
+{
+  uint16_t i, sp, stack, max_stack;
+  uint32_t cycles, min_cycles;
+
+  min_cycles = UINT32_MAX;
+  max_stack = 0;
+
+  for (i = 0; i < NUM_RUNS; i++) {
+    stack_paint();
+    sp = SP;
+    timer_start();
+    ppenc_sender_prepare(&sender);
+    cycles = timer_stop();
+    stack = stack_used(sp);
+
+    /* use it up so the next prepare does the work again */
+    ppenc_sender_new_msg(&sender, header, body, 1, response_mac, scratch);
+
+    if (cycles < min_cycles)
+      min_cycles = cycles;
+    if (stack > max_stack)
+      max_stack = stack;
+  }
+
+  fprintf(&console, "sender_prepare 0 cycles=%lu stack=%u\n",
+          (unsigned long) min_cycles, max_stack);
+}
+
+static void
+bench_new_body_key(void)
+{
+  uint16_t i, sp, stack, max_stack;
+  uint32_t cycles, min_cycles;
+
+  min_cycles = UINT32_MAX;
+  max_stack = 0;
+
+  for (i = 0; i < NUM_RUNS; i++) {
+    stack_paint();
+    sp = SP;
+    timer_start();
+    ppenc_sender_new_body_key(&sender, scratch);
+    cycles = timer_stop();
+    stack = stack_used(sp);
+
+    if (cycles < min_cycles)
+      min_cycles = cycles;
+    if (stack > max_stack)
+      max_stack = stack;
+  }
+
+  fprintf(&console, "sender_new_body_key 0 cycles=%lu stack=%u\n",
+          (unsigned long) min_cycles, max_stack);
+}
+
+/* Threefish alone, out of the first blocks of body */
+static void
+bench_threefish(uint16_t num_blocks, uint8_t decrypt)
+{
+  uint8_t key[64], tweak_seed[8];
+  uint16_t i, sp, stack, max_stack;
+  uint32_t cycles, min_cycles;
+
+  fill(key, 64, 8);
+  fill(tweak_seed, 8, 9);
+  min_cycles = UINT32_MAX;
+  max_stack = 0;
+
+  for (i = 0; i < NUM_RUNS; i++) {
+    fill(body, num_blocks * 64, (uint8_t) i);
+
+    stack_paint();
+    sp = SP;
+    timer_start();
+    if (decrypt)
+      ppenc_threefish512_decrypt(key, tweak_seed, body, num_blocks,
+                                 (struct ThreeFishBuffer*) (scratch + 64), scratch);
+    else
+      ppenc_threefish512_encrypt(key, tweak_seed, body, num_blocks,
+                                 (struct ThreeFishBuffer*) (scratch + 64), scratch);
+    cycles = timer_stop();
+    stack = stack_used(sp);
+
+    if (cycles < min_cycles)
+      min_cycles = cycles;
+    if (stack > max_stack)
+      max_stack = stack;
+  }
+
+  fprintf(&console, "threefish_%s %u cycles=%lu stack=%u\n",
+          decrypt ? "decrypt" : "encrypt", num_blocks, (unsigned long) min_cycles, max_stack);
+}
+
+int
+main(void)
+{
+  uint8_t i;
+
+  sei();
+
+  bench_init();
+  for (i = 0; i < sizeof(BODY_LENS) / sizeof(BODY_LENS[0]); i++)
+    bench_new_msg("sender_new_msg", BODY_LENS[i], 0);
+  bench_new_body_key();
+  bench_prepare();
+  for (i = 0; i < sizeof(BODY_LENS) / sizeof(BODY_LENS[0]); i++)
+    bench_new_msg("sender_new_msg", BODY_LENS[i], 1);
+  /* the same bodies in the compact format */
+  ppenc_sender_set_version(&sender, PPENC_VERSION_COMPACT);
+  for (i = 0; i < sizeof(BODY_LENS) / sizeof(BODY_LENS[0]); i++)
+    bench_new_msg("sender_new_msg_compact", BODY_LENS[i], 0);
+  for (i = 0; i < sizeof(THREEFISH_BLOCKS) / sizeof(THREEFISH_BLOCKS[0]); i++) {
+    bench_threefish(THREEFISH_BLOCKS[i], 0);
+    bench_threefish(THREEFISH_BLOCKS[i], 1);
+  }
+
+  /* simavr exits when sleeping with interrupts disabled */
+  cli();
+  sleep_enable();
+  sleep_cpu();
+
+  return 0;
+}
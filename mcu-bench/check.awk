@@ -0,0 +1,34 @@
+# Compare results.txt against baseline.txt, both lines of
+#   <name> <param> cycles=<n> stack=<bytes>
+# exit 1 if any cycle count or stack size grew by more than tol percent
+
+function value(field) {
+  sub(/^[a-z]*=/, "", field);
+  return field + 0;
+}
+
+FNR == NR {
+  cycles[$1 " " $2] = value($3);
+  stack[$1 " " $2] = value($4);
+  next;
+}
+
+{
+  key = $1 " " $2;
+  if (!(key in cycles)) {
+    printf("%s: not in baseline\n", key);
+    next;
+  }
+
+  c = value($3);
+  s = value($4);
+  printf("%-24s cycles %9d -> %9d (%+.1f%%)  stack %5d -> %5d\n",
+         key, cycles[key], c, 100.0 * (c - cycles[key]) / cycles[key], stack[key], s);
+
+  if (c > cycles[key] * (1 + tol / 100.0) || s > stack[key] * (1 + tol / 100.0))
+    failed = 1;
+}
+
+END {
+  exit failed;
+}
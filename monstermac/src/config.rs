@@ -3,17 +3,40 @@ use std::fs;
 use std::io::Read;
 use std::path;
 use std::result;
+use std::time;
 
 use lazy_static::lazy_static;
 
 pub struct Config {
     pub bind_addr: String,
+    pub secret_reload: Option<time::Duration>,
 }
 
 impl Config {
     pub fn from_env() -> result::Result<Self, String> {
         let bind_addr = String::from("0.0.0.0:8081");
-        Ok(Self { bind_addr })
+        let mut secret_reload = Some(time::Duration::from_secs(30));
+
+        for (k, v) in env::vars() {
+            if k == "MONSTERMAC_SECRET_RELOAD_SECS" {
+                let secs = v
+                    .parse::<u64>()
+                    .map_err(|_| format!("invalid MONSTERMAC_SECRET_RELOAD_SECS [{}]", v))?;
+                secret_reload = match secs {
+                    0 => None,
+                    s => Some(time::Duration::from_secs(s)),
+                };
+            } else if k == "MONSTERMAC_HMAC_CACHE_SIZE" {
+                // Read again by HMAC_CACHE_SIZE, checked here so a typo
+                // stops startup instead of panicking on first use
+                parse_hmac_cache_size(&v)?;
+            }
+        }
+
+        Ok(Self {
+            bind_addr,
+            secret_reload,
+        })
     }
 }
 
@@ -28,6 +51,7 @@ lazy_static! {
     pub static ref MODE: Mode = get_mode();
     pub static ref SECRET0: Vec<u8> = get_secret0();
     pub static ref SECRET_PATH: path::PathBuf = get_secret_path();
+    pub static ref HMAC_CACHE_SIZE: usize = get_hmac_cache_size();
 }
 
 fn get_mode() -> Mode {
@@ -73,3 +97,23 @@ fn get_secret_path() -> path::PathBuf {
 
     spath
 }
+
+// Number of secrets whose hmac midstates are cached in MODE16/MODE32,
+// 0 disables the cache
+fn get_hmac_cache_size() -> usize {
+    let mut size = 4096;
+
+    for (k, v) in env::vars() {
+        if k == "MONSTERMAC_HMAC_CACHE_SIZE" {
+            // Config::from_env has already rejected a bad value
+            size = parse_hmac_cache_size(&v).unwrap_or(size);
+        }
+    }
+
+    size
+}
+
+fn parse_hmac_cache_size(v: &str) -> result::Result<usize, String> {
+    v.parse::<usize>()
+        .map_err(|_| format!("invalid MONSTERMAC_HMAC_CACHE_SIZE [{}]", v))
+}
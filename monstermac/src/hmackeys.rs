@@ -0,0 +1,143 @@
+// HMAC-SHA256 keyed midstates.
+// HMAC(k, m) = H((k ^ opad) || H((k ^ ipad) || m)), the two pad blocks only
+// depend on the secret, so the hash state after absorbing each one is
+// computed once per secret and cloned for every request. This saves two
+// SHA-256 compressions per mac.
+//
+// MODE0 has a single secret whose midstates are computed at startup,
+// MODE16/MODE32 keep a bounded direct mapped cache indexed by secret id.
+use std::result;
+use std::sync::Mutex;
+
+use hmac_sha256::Hash;
+use lazy_static::lazy_static;
+
+use crate::config;
+use crate::secrets;
+
+type Result<T> = result::Result<T, &'static str>;
+
+lazy_static! {
+    static ref SECRET0_KEY: HmacKey = HmacKey::new(&config::SECRET0);
+    pub static ref CACHE: KeyCache = KeyCache::new(*config::HMAC_CACHE_SIZE);
+}
+
+#[derive(Clone)]
+pub struct HmacKey {
+    inner: Hash,
+    outer: Hash,
+}
+
+impl HmacKey {
+    pub fn new(secret: &[u8]) -> Self {
+        // Keys longer than the block size are hashed first, as in RFC 2104
+        let mut k = [0u8; 64];
+        if secret.len() > 64 {
+            k[..32].copy_from_slice(&Hash::hash(secret));
+        } else {
+            k[..secret.len()].copy_from_slice(secret);
+        }
+
+        let mut pad = [0u8; 64];
+        for (p, b) in pad.iter_mut().zip(k.iter()) {
+            *p = b ^ 0x36;
+        }
+        let mut inner = Hash::new();
+        inner.update(&pad[..]);
+
+        for (p, b) in pad.iter_mut().zip(k.iter()) {
+            *p = b ^ 0x5c;
+        }
+        let mut outer = Hash::new();
+        outer.update(&pad[..]);
+
+        Self { inner, outer }
+    }
+
+    pub fn mac(&self, val: &[u8]) -> [u8; 32] {
+        let mut ih = self.inner.clone();
+        ih.update(val);
+
+        let mut oh = self.outer.clone();
+        oh.update(&ih.finalize()[..]);
+        oh.finalize()
+    }
+}
+
+struct Entry {
+    secret_id: u32,
+    generation: u64,
+    key: HmacKey,
+}
+
+// Direct mapped, a slot holds the most recent secret id hashing to it.
+// Entries are tagged with the secret store generation so a reload of the
+// secret files invalidates every cached midstate.
+pub struct KeyCache {
+    slots: Vec<Mutex<Option<Entry>>>,
+}
+
+impl KeyCache {
+    fn new(size: usize) -> Self {
+        Self {
+            slots: (0..size).map(|_| Mutex::new(None)).collect(),
+        }
+    }
+
+    fn get(&self, secret_id: u32) -> Result<HmacKey> {
+        // Read the generation before the secret so a concurrent reload can
+        // only make an entry look older than it is, never newer
+        let generation = secrets::STORE.generation();
+
+        let slot = match self.slot(secret_id) {
+            Some(s) => s,
+            None => return Ok(HmacKey::new(&secrets::STORE.get_secret32(secret_id)?)),
+        };
+
+        if let Ok(entry) = slot.lock() {
+            if let Some(e) = entry.as_ref() {
+                if e.secret_id == secret_id && e.generation == generation {
+                    return Ok(e.key.clone());
+                }
+            }
+        }
+
+        let key = HmacKey::new(&secrets::STORE.get_secret32(secret_id)?);
+        if let Ok(mut entry) = slot.lock() {
+            *entry = Some(Entry {
+                secret_id,
+                generation,
+                key: key.clone(),
+            });
+        }
+
+        Ok(key)
+    }
+
+    fn slot(&self, secret_id: u32) -> Option<&Mutex<Option<Entry>>> {
+        if self.slots.is_empty() {
+            return None;
+        }
+
+        // Secret ids are already uniformly distributed murmur2 output
+        Some(&self.slots[secret_id as usize % self.slots.len()])
+    }
+}
+
+// Keyed hmac state for secret_id
+pub fn get_key(secret_id: u32) -> Result<HmacKey> {
+    use config::Mode::*;
+    match *config::MODE {
+        Mode0 => Ok(SECRET0_KEY.clone()),
+        Mode16 | Mode32 => CACHE.get(secret_id),
+    }
+}
+
+// Compute the midstates for MODE0's secret before serving
+pub fn init() {
+    if *config::MODE == config::Mode::Mode0 {
+        lazy_static::initialize(&SECRET0_KEY);
+    } else {
+        lazy_static::initialize(&CACHE);
+    }
+}
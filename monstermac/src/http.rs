@@ -0,0 +1,208 @@
+// Minimal HTTP/1.1 server side framing.
+// Only what monstermac needs: a request line, Content-Length bodies,
+// Expect: 100-continue and persistent connections. Requests are read from
+// a BufReader that lives as long as the connection, so pipelined requests
+// already buffered are kept for the next call to read_request.
+use std::result;
+
+use async_std::io::{self, BufRead, Write};
+use async_std::prelude::*;
+
+type Result<T> = result::Result<T, &'static str>;
+
+const MAX_LINE_LEN: u64 = 8192;
+const MAX_NUM_HEADERS: usize = 64;
+// Room for a /batch of ~30k 32 byte names, provision sends 1024 at a time
+const MAX_BODY_LEN: usize = 1024 * 1024;
+
+#[derive(Copy, Clone, PartialEq, Eq)]
+pub enum Method {
+    Get,
+    Post,
+    Other,
+}
+
+#[derive(Copy, Clone, PartialEq, Eq)]
+pub enum Version {
+    Http10,
+    Http11,
+}
+
+pub struct Request {
+    pub method: Method,
+    pub path: String,
+    pub version: Version,
+    pub body: Vec<u8>,
+    pub keep_alive: bool,
+}
+
+pub struct Response {
+    pub status: u16,
+    pub body: Vec<u8>,
+}
+
+impl Response {
+    pub fn new(status: u16) -> Self {
+        Self {
+            status,
+            body: vec![],
+        }
+    }
+
+    pub fn ok(body: Vec<u8>) -> Self {
+        Self { status: 200, body }
+    }
+}
+
+// Ok(None) is a clean close between requests. A client which asked for
+// 100-continue is told to go ahead on writer before its body is read.
+pub async fn read_request<R: BufRead + Unpin, W: Write + Unpin>(
+    reader: &mut R,
+    writer: &mut W,
+) -> Result<Option<Request>> {
+    let mut line = Vec::new();
+    if read_line(reader, &mut line).await? == 0 {
+        return Ok(None);
+    }
+
+    let line = std::str::from_utf8(&line).map_err(|_| "request line not utf8")?;
+    let mut parts = line.split_ascii_whitespace();
+    let method = match parts.next() {
+        Some("GET") => Method::Get,
+        Some("POST") => Method::Post,
+        Some(_) => Method::Other,
+        None => return Err("empty request line"),
+    };
+    let path = parts.next().ok_or("request line missing path")?.to_string();
+    let version = match parts.next() {
+        Some("HTTP/1.1") => Version::Http11,
+        Some("HTTP/1.0") => Version::Http10,
+        _ => return Err("unsupported http version"),
+    };
+    let mut keep_alive = version == Version::Http11;
+
+    let mut content_len = 0;
+    let mut expect_continue = false;
+    for i in 0.. {
+        if i == MAX_NUM_HEADERS {
+            return Err("too many headers");
+        }
+
+        let mut header = Vec::new();
+        if read_line(reader, &mut header).await? == 0 {
+            return Err("connection closed in headers");
+        }
+        if header.is_empty() {
+            break;
+        }
+
+        let header = std::str::from_utf8(&header).map_err(|_| "header not utf8")?;
+        let (name, value) = header.split_once(':').ok_or("badly formed header")?;
+        let value = value.trim();
+
+        if name.eq_ignore_ascii_case("content-length") {
+            content_len = value.parse().map_err(|_| "invalid content-length")?;
+        } else if name.eq_ignore_ascii_case("connection") {
+            if value.eq_ignore_ascii_case("close") {
+                keep_alive = false;
+            } else if value.eq_ignore_ascii_case("keep-alive") {
+                keep_alive = true;
+            }
+        } else if name.eq_ignore_ascii_case("expect") {
+            if !value.eq_ignore_ascii_case("100-continue") {
+                return Err("unsupported expectation");
+            }
+            expect_continue = version == Version::Http11;
+        } else if name.eq_ignore_ascii_case("transfer-encoding") {
+            return Err("transfer-encoding not supported");
+        }
+    }
+
+    if content_len > MAX_BODY_LEN {
+        return Err("request body too large");
+    }
+
+    if expect_continue && content_len > 0 {
+        // Flushes any pipelined responses still buffered ahead of it
+        writer
+            .write_all(b"HTTP/1.1 100 Continue\r\n\r\n")
+            .await
+            .map_err(|_| "couldn't send 100 continue")?;
+        writer
+            .flush()
+            .await
+            .map_err(|_| "couldn't send 100 continue")?;
+    }
+
+    // Grown as the body arrives, a content-length alone doesn't commit memory
+    let mut body = Vec::new();
+    (&mut *reader)
+        .take(content_len as u64)
+        .read_to_end(&mut body)
+        .await
+        .map_err(|_| "couldn't read request body")?;
+    if body.len() != content_len {
+        return Err("connection closed in body");
+    }
+
+    Ok(Some(Request {
+        method,
+        path,
+        version,
+        body,
+        keep_alive,
+    }))
+}
+
+// Persistence is only announced where it differs from the default of the
+// request's version
+pub async fn write_response<W: Write + Unpin>(
+    writer: &mut W,
+    resp: &Response,
+    version: Version,
+    keep_alive: bool,
+) -> io::Result<()> {
+    let head = format!(
+        "HTTP/1.1 {} {}\r\ncontent-length: {}\r\n{}\r\n",
+        resp.status,
+        reason(resp.status),
+        resp.body.len(),
+        match (version, keep_alive) {
+            (Version::Http11, true) => "",
+            (Version::Http10, true) => "connection: keep-alive\r\n",
+            (_, false) => "connection: close\r\n",
+        },
+    );
+
+    writer.write_all(head.as_bytes()).await?;
+    writer.write_all(&resp.body).await
+}
+
+// Reads a CRLF terminated line without the CRLF, returns bytes consumed
+async fn read_line<R: BufRead + Unpin>(reader: &mut R, line: &mut Vec<u8>) -> Result<usize> {
+    let n = (&mut *reader)
+        .take(MAX_LINE_LEN)
+        .read_until(b'\n', line)
+        .await
+        .map_err(|_| "couldn't read from connection")?;
+
+    if n != 0 && line.last() != Some(&b'\n') {
+        return Err("line too long");
+    }
+
+    while let Some(b'\n') | Some(b'\r') = line.last() {
+        line.pop();
+    }
+
+    Ok(n)
+}
+
+fn reason(status: u16) -> &'static str {
+    match status {
+        200 => "OK",
+        400 => "Bad Request",
+        404 => "Not Found",
+        500 => "Internal Server Error",
+        _ => "",
+    }
+}
@@ -0,0 +1,82 @@
+// Load generator for POST /, to compare monstermac builds.
+//
+//   monstermac loadgen [seconds] [connections]
+//
+// Each connection posts random 32 byte names one at a time, keep-alive, to
+// MONSTERMAC_URL (default http://127.0.0.1:8081) for the given number of
+// seconds (default 10) and the total is reported as requests/s. Random
+// names spread requests over every secret, run the server with
+// MONSTERMAC_HMAC_CACHE_SIZE=0 to measure secret lookups rather than hits
+// in the midstate cache.
+use std::env;
+use std::result;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use rand::RngCore;
+
+use crate::provision;
+
+const NAME_LEN: usize = 32;
+
+pub fn run(args: &[String]) -> result::Result<(), String> {
+    let usage = "usage: monstermac loadgen [seconds] [connections]";
+    let secs = match args.first() {
+        Some(s) => s.parse::<u64>().map_err(|_| usage)?,
+        None => 10,
+    };
+    let num_conns = match args.get(1) {
+        Some(c) => c.parse::<usize>().map_err(|_| usage)?,
+        None => 8,
+    };
+
+    let url = env::var("MONSTERMAC_URL").unwrap_or_else(|_| "http://127.0.0.1:8081".to_string());
+    let addr = provision::host_port(&url)?;
+
+    let stop = AtomicBool::new(false);
+    let num_reqs = AtomicU64::new(0);
+    let start = Instant::now();
+
+    let res = thread::scope(|scope| {
+        let workers = (0..num_conns)
+            .map(|_| {
+                let (addr, stop, num_reqs) = (&addr, &stop, &num_reqs);
+                scope.spawn(move || {
+                    let mut rng = rand::thread_rng();
+                    let mut name = [0u8; NAME_LEN];
+                    let mut conn = provision::connect(addr)?;
+                    while !stop.load(Ordering::Relaxed) {
+                        rng.fill_bytes(&mut name);
+                        if provision::post(&mut conn, addr, "/", &name, 32)?.0 != 200 {
+                            return Err("monster mac did not return 200 OK");
+                        }
+                        num_reqs.fetch_add(1, Ordering::Relaxed);
+                    }
+                    Ok(())
+                })
+            })
+            .collect::<Vec<_>>();
+
+        thread::sleep(Duration::from_secs(secs));
+        stop.store(true, Ordering::Relaxed);
+
+        workers
+            .into_iter()
+            .map(|w| w.join().unwrap_or(Err("loadgen thread panicked")))
+            .collect::<Result<Vec<_>, &'static str>>()
+    });
+    res?;
+
+    let secs = start.elapsed().as_secs_f64();
+    let num_reqs = num_reqs.load(Ordering::Relaxed);
+    eprintln!(
+        "{} requests in {:.3}s ({:.0} requests/s, {} connections)",
+        num_reqs,
+        secs,
+        num_reqs as f64 / secs.max(1e-9),
+        num_conns
+    );
+
+    Ok(())
+}
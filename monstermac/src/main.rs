@@ -1,14 +1,28 @@
+use std::env;
 use std::net::TcpListener;
 use std::result;
 
 use kv_log_macro::info;
 
 mod config;
+mod hmackeys;
+mod http;
+mod loadgen;
+mod metrics;
+mod provision;
+mod secrets;
 mod server;
 
 fn main() -> result::Result<(), String> {
     json_env_logger::init();
 
+    let args = env::args().collect::<Vec<String>>();
+    match args.get(1).map(String::as_str) {
+        Some("provision") => return provision::run(&args[2..]),
+        Some("loadgen") => return loadgen::run(&args[2..]),
+        _ => {}
+    }
+
     // Load config
     let cfg = config::Config::from_env()?;
 
@@ -16,6 +30,16 @@ fn main() -> result::Result<(), String> {
     let listener =
         TcpListener::bind(&cfg.bind_addr).map_err(|e| format!("couldn't bind to port [{}]", e))?;
 
+    // Map the secret files before accepting any connections
+    lazy_static::initialize(&secrets::STORE);
+    if *config::MODE != config::Mode::Mode0 {
+        if let Some(interval) = cfg.secret_reload {
+            secrets::spawn_reloader(interval);
+        }
+    }
+
+    hmackeys::init();
+
     info!("monstermac started");
 
     server::run_forever(listener);
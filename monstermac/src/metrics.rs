@@ -0,0 +1,114 @@
+// Request latency histograms exposed on GET /metrics.
+// Buckets are log-linear: 8 sub-buckets per power of two microseconds,
+// so a reported quantile is within 12.5% of the true latency.
+use std::fmt::Write;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Duration;
+
+use lazy_static::lazy_static;
+
+const SUB_BUCKET_BITS: u32 = 3;
+const NUM_BUCKETS: usize = (64 - SUB_BUCKET_BITS as usize + 1) << SUB_BUCKET_BITS;
+
+lazy_static! {
+    pub static ref MAC_LATENCY: Histogram = Histogram::new();
+    pub static ref BATCH_LATENCY: Histogram = Histogram::new();
+}
+
+pub struct Histogram {
+    buckets: Vec<AtomicU64>,
+    count: AtomicU64,
+    sum_us: AtomicU64,
+}
+
+impl Histogram {
+    fn new() -> Self {
+        Self {
+            buckets: (0..NUM_BUCKETS).map(|_| AtomicU64::new(0)).collect(),
+            count: AtomicU64::new(0),
+            sum_us: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record(&self, latency: Duration) {
+        let us = latency.as_micros().min(u64::MAX as u128) as u64;
+        self.buckets[bucket_index(us)].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum_us.fetch_add(us, Ordering::Relaxed);
+    }
+
+    // Upper bound (in microseconds) of the bucket holding quantile q
+    pub fn quantile(&self, q: f64) -> u64 {
+        let count = self.count.load(Ordering::Relaxed);
+        if count == 0 {
+            return 0;
+        }
+
+        let target = ((count as f64 * q).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (i, b) in self.buckets.iter().enumerate() {
+            seen += b.load(Ordering::Relaxed);
+            if seen >= target {
+                return bucket_upper(i);
+            }
+        }
+
+        bucket_upper(NUM_BUCKETS - 1)
+    }
+}
+
+pub fn render() -> Vec<u8> {
+    let mut out = String::new();
+
+    for (path, hist) in [("/", &*MAC_LATENCY), ("/batch", &*BATCH_LATENCY)] {
+        let _ = writeln!(
+            out,
+            "monstermac_requests_total{{path=\"{}\"}} {}",
+            path,
+            hist.count.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(
+            out,
+            "monstermac_request_latency_us_sum{{path=\"{}\"}} {}",
+            path,
+            hist.sum_us.load(Ordering::Relaxed)
+        );
+        for q in [0.5, 0.9, 0.99, 0.999] {
+            let _ = writeln!(
+                out,
+                "monstermac_request_latency_us{{path=\"{}\",quantile=\"{}\"}} {}",
+                path,
+                q,
+                hist.quantile(q)
+            );
+        }
+    }
+
+    out.into_bytes()
+}
+
+fn bucket_index(us: u64) -> usize {
+    let sub_buckets = 1u64 << SUB_BUCKET_BITS;
+    if us < sub_buckets {
+        return us as usize;
+    }
+
+    // position of the highest set bit selects the power of two,
+    // the next SUB_BUCKET_BITS bits select the sub bucket
+    let msb = 63 - us.leading_zeros();
+    let shift = msb - SUB_BUCKET_BITS;
+    let sub = (us >> shift) & (sub_buckets - 1);
+    (((shift + 1) as u64) << SUB_BUCKET_BITS | sub) as usize
+}
+
+fn bucket_upper(i: usize) -> u64 {
+    let sub_buckets = 1usize << SUB_BUCKET_BITS;
+    if i < sub_buckets {
+        return i as u64;
+    }
+
+    let shift = (i >> SUB_BUCKET_BITS) as u32 - 1;
+    let sub = (i & (sub_buckets - 1)) as u64;
+    let lower = (sub_buckets as u64 | sub) << shift;
+    lower.saturating_add((1u64 << shift) - 1)
+}
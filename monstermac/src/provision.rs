@@ -0,0 +1,274 @@
+// Bulk device provisioning, the native counterpart of the newdevice script.
+//
+//   monstermac provision <count> [out.jsonl]
+//
+// Generates count random 32 byte device names, obtains their monster macs
+// and writes one JSON object per line with the same fields as newdevice's
+// devicedata.json. MACs come from the monstermac service's POST /batch when
+// MONSTERMAC_URL is set, otherwise they are computed in process from the
+// local secrets (same MONSTERMAC_MODE / secret files as the server).
+use std::env;
+use std::fmt::Write as FmtWrite;
+use std::fs;
+use std::io::{self, BufRead, BufReader, Read, Write};
+use std::net::TcpStream;
+use std::result;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc;
+use std::thread;
+use std::time::Instant;
+
+use hmac_sha256::Hash as Sha256;
+use hmac_sha512::Hash as Sha512;
+use rand::RngCore;
+
+use crate::hmackeys;
+use crate::secrets;
+use crate::server;
+
+type Result<T> = result::Result<T, &'static str>;
+
+const NAME_LEN: usize = 32;
+// Devices per unit of work, also the size of a single /batch request
+const CHUNK_LEN: usize = 1024;
+
+pub fn run(args: &[String]) -> result::Result<(), String> {
+    let count = args
+        .first()
+        .and_then(|c| c.parse::<usize>().ok())
+        .ok_or("usage: monstermac provision <count> [out.jsonl]")?;
+
+    let out: Box<dyn Write> = match args.get(1) {
+        Some(p) => {
+            Box::new(fs::File::create(p).map_err(|e| format!("couldn't create {} [{}]", p, e))?)
+        }
+        None => Box::new(io::stdout()),
+    };
+    let mut out = io::BufWriter::new(out);
+
+    let remote = env::var("MONSTERMAC_URL")
+        .ok()
+        .map(|u| host_port(&u))
+        .transpose()?;
+    if remote.is_none() {
+        lazy_static::initialize(&secrets::STORE);
+        hmackeys::init();
+    }
+
+    let num_threads = thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1);
+    let num_chunks = (count + CHUNK_LEN - 1) / CHUNK_LEN;
+    let next_chunk = AtomicUsize::new(0);
+    let start = Instant::now();
+
+    let res = thread::scope(|scope| {
+        let (tx, rx) = mpsc::sync_channel::<Result<String>>(num_threads * 2);
+
+        for _ in 0..num_threads {
+            let tx = tx.clone();
+            let next_chunk = &next_chunk;
+            let remote = remote.as_deref();
+            scope.spawn(move || {
+                let mut conn = None;
+                loop {
+                    let chunk = next_chunk.fetch_add(1, Ordering::Relaxed);
+                    if chunk >= num_chunks {
+                        break;
+                    }
+
+                    let len = CHUNK_LEN.min(count - chunk * CHUNK_LEN);
+                    let lines = provision_chunk(len, remote, &mut conn);
+                    let failed = lines.is_err();
+                    if tx.send(lines).is_err() || failed {
+                        break;
+                    }
+                }
+            });
+        }
+        drop(tx);
+
+        // Lines from each chunk are written whole, in completion order
+        for lines in rx {
+            let lines = lines.map_err(|s| s.to_string())?;
+            out.write_all(lines.as_bytes())
+                .map_err(|e| format!("couldn't write devices [{}]", e))?;
+        }
+
+        out.flush()
+            .map_err(|e| format!("couldn't write devices [{}]", e))
+    });
+    res?;
+
+    let secs = start.elapsed().as_secs_f64();
+    eprintln!(
+        "provisioned {} devices in {:.3}s ({:.0} devices/s, {} threads)",
+        count,
+        secs,
+        count as f64 / secs.max(1e-9),
+        num_threads
+    );
+
+    Ok(())
+}
+
+fn provision_chunk(
+    len: usize,
+    remote: Option<&str>,
+    conn: &mut Option<BufReader<TcpStream>>,
+) -> Result<String> {
+    let mut rng = rand::thread_rng();
+    let mut names = vec![0u8; len * NAME_LEN];
+    rng.fill_bytes(&mut names);
+
+    let macs = match remote {
+        Some(addr) => remote_macs(addr, conn, &names)?,
+        None => {
+            let mut macs = Vec::with_capacity(len * 32);
+            for name in names.chunks(NAME_LEN) {
+                macs.extend_from_slice(&server::compute_mac(name)?);
+            }
+            macs
+        }
+    };
+
+    let mut lines = String::with_capacity(len * 512);
+    for (name, mac) in names.chunks(NAME_LEN).zip(macs.chunks(32)) {
+        let mut sender_rng_key = [0u8; 32];
+        rng.fill_bytes(&mut sender_rng_key);
+        device_line(&mut lines, name, mac, &sender_rng_key);
+    }
+
+    Ok(lines)
+}
+
+// Same derivations as the MonsterMac class in newdevice
+fn device_line(out: &mut String, name: &[u8], mac: &[u8], sender_rng_key: &[u8; 32]) {
+    let device_id = md5::compute(Sha512::hash(mac));
+    let device_salt = Sha256::hash(&Sha256::hash(mac));
+    let token_mac = md5::compute(hmac_sha256::HMAC::mac(name, mac));
+
+    let _ = write!(
+        out,
+        "{{\"deviceId\": \"{}\", \"headerKeySalt\": {:?}, \"bodyKeySalt\": {:?}, \
+         \"senderRngKey\": {:?}, \"deviceToken\": \"00.{}.{}\"}}\n",
+        hex::encode(&device_id[..]),
+        &device_salt[..16],
+        &device_salt[16..],
+        &sender_rng_key[..],
+        hex::encode(name),
+        hex::encode(&token_mac[..]),
+    );
+}
+
+// One POST /batch on a keep-alive connection, reconnecting once if the
+// connection was dropped since the last chunk. A response, even an error
+// status, is never retried.
+fn remote_macs(
+    addr: &str,
+    conn: &mut Option<BufReader<TcpStream>>,
+    names: &[u8],
+) -> Result<Vec<u8>> {
+    let mut body = Vec::with_capacity(names.len() / NAME_LEN * (NAME_LEN + 2));
+    for name in names.chunks(NAME_LEN) {
+        body.extend_from_slice(&(NAME_LEN as u16).to_be_bytes());
+        body.extend_from_slice(name);
+    }
+
+    let resp_len = names.len() / NAME_LEN * 32;
+    let (status, macs) = match conn
+        .as_mut()
+        .map(|c| post(c, addr, "/batch", &body, resp_len))
+    {
+        Some(Ok(resp)) => resp,
+        _ => post(conn.insert(connect(addr)?), addr, "/batch", &body, resp_len)?,
+    };
+
+    if status != 200 {
+        // The body was left unread, so the connection can't be reused
+        *conn = None;
+        return Err("monster mac did not return 200 OK");
+    }
+
+    Ok(macs)
+}
+
+pub fn connect(addr: &str) -> Result<BufReader<TcpStream>> {
+    let stream = TcpStream::connect(addr).map_err(|_| "couldn't connect to monstermac")?;
+    let _ = stream.set_nodelay(true);
+    Ok(BufReader::new(stream))
+}
+
+// One POST on a keep-alive connection. Err only for connection and framing
+// errors, a 200 body must be resp_len bytes and any other status is
+// returned with its body unread.
+pub fn post(
+    conn: &mut BufReader<TcpStream>,
+    addr: &str,
+    path: &str,
+    body: &[u8],
+    resp_len: usize,
+) -> Result<(u16, Vec<u8>)> {
+    let head = format!(
+        "POST {} HTTP/1.1\r\nhost: {}\r\ncontent-length: {}\r\n\r\n",
+        path,
+        addr,
+        body.len()
+    );
+    let stream = conn.get_mut();
+    stream
+        .write_all(head.as_bytes())
+        .and_then(|_| stream.write_all(body))
+        .map_err(|_| "couldn't send request to monstermac")?;
+
+    let mut line = String::new();
+    conn.read_line(&mut line)
+        .map_err(|_| "couldn't read monstermac response")?;
+    let status = line
+        .split_ascii_whitespace()
+        .nth(1)
+        .and_then(|s| s.parse::<u16>().ok())
+        .ok_or("invalid monster mac response")?;
+
+    let mut content_len = None;
+    loop {
+        line.clear();
+        conn.read_line(&mut line)
+            .map_err(|_| "couldn't read monstermac response")?;
+        let header = line.trim_end();
+        if header.is_empty() {
+            break;
+        }
+        if let Some((name, value)) = header.split_once(':') {
+            if name.eq_ignore_ascii_case("content-length") {
+                content_len = value.trim().parse::<usize>().ok();
+            }
+        }
+    }
+
+    if status != 200 {
+        return Ok((status, vec![]));
+    }
+    if content_len != Some(resp_len) {
+        return Err("invalid monster mac response");
+    }
+
+    let mut resp = vec![0u8; resp_len];
+    conn.read_exact(&mut resp)
+        .map_err(|_| "couldn't read monstermac response body")?;
+    Ok((status, resp))
+}
+
+// http://host:port -> host:port
+pub fn host_port(url: &str) -> result::Result<String, String> {
+    let rest = url
+        .strip_prefix("http://")
+        .ok_or_else(|| format!("MONSTERMAC_URL must be http:// [{}]", url))?;
+    let host = rest.split('/').next().unwrap_or(rest);
+
+    if host.contains(':') {
+        Ok(host.to_string())
+    } else {
+        Ok(format!("{}:80", host))
+    }
+}
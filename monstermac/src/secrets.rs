@@ -0,0 +1,189 @@
+use std::collections::HashMap;
+use std::fs;
+use std::path;
+use std::result;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, RwLock};
+use std::thread;
+use std::time::{Duration, SystemTime};
+
+use kv_log_macro::{error, info};
+use lazy_static::lazy_static;
+use memmap2::{Advice, Mmap};
+
+use crate::config;
+
+type Result<T> = result::Result<T, &'static str>;
+
+const SECRET_LEN: usize = 32;
+
+lazy_static! {
+    pub static ref STORE: SecretStore = SecretStore::open(&config::SECRET_PATH);
+}
+
+// A secret file mapped into memory.
+// NOTE: secret files must be replaced atomically (write new file + rename)
+// truncating a mapped file in place will SIGBUS the server.
+struct SecretFile {
+    mmap: Mmap,
+    modified: SystemTime,
+    len: u64,
+}
+
+pub struct SecretStore {
+    dir: path::PathBuf,
+    files: RwLock<Arc<HashMap<u16, Arc<SecretFile>>>>,
+    // Bumped whenever a reload changes the set of secrets
+    generation: AtomicU64,
+}
+
+impl SecretStore {
+    fn open(dir: &path::Path) -> Self {
+        let store = Self {
+            dir: dir.to_owned(),
+            files: RwLock::new(Arc::new(HashMap::new())),
+            generation: AtomicU64::new(0),
+        };
+
+        if *config::MODE != config::Mode::Mode0 {
+            store.reload();
+        }
+
+        store
+    }
+
+    pub fn get_secret32(&self, key_id: u32) -> Result<[u8; 32]> {
+        let filename = ((key_id & 0xffff0000) >> 16) as u16;
+        let offset = (key_id & 0xffff) as usize * SECRET_LEN;
+
+        let files = self
+            .files
+            .read()
+            .map_err(|_| "secret store lock poisoned")?
+            .clone();
+        let file = files.get(&filename).ok_or("couldn't open secret file")?;
+
+        let secret = file
+            .mmap
+            .get(offset..offset + SECRET_LEN)
+            .ok_or("couldn't read secret from file")?;
+
+        let mut ans = [0u8; 32];
+        ans.copy_from_slice(secret);
+        Ok(ans)
+    }
+
+    pub fn generation(&self) -> u64 {
+        self.generation.load(Ordering::Acquire)
+    }
+
+    // Map any new or changed secret files, drop removed ones.
+    // Unchanged files keep their existing mapping.
+    pub fn reload(&self) -> usize {
+        let old = match self.files.read() {
+            Ok(f) => f.clone(),
+            Err(_) => return 0,
+        };
+
+        let entries = match fs::read_dir(&self.dir) {
+            Ok(e) => e,
+            Err(e) => {
+                error!("couldn't read secret directory", {
+                    error: format!("{}", e),
+                });
+                return 0;
+            }
+        };
+
+        let mut files = HashMap::new();
+        let mut num_mapped = 0;
+
+        for entry in entries.flatten() {
+            let filename = match parse_filename(&entry.file_name()) {
+                Some(f) => f,
+                None => continue,
+            };
+
+            let meta = match entry.metadata() {
+                Ok(m) => m,
+                Err(_) => continue,
+            };
+            let modified = meta.modified().unwrap_or(SystemTime::UNIX_EPOCH);
+
+            if let Some(f) = old.get(&filename) {
+                if f.modified == modified && f.len == meta.len() {
+                    files.insert(filename, f.clone());
+                    continue;
+                }
+            }
+
+            match map_new_file(&entry.path(), modified) {
+                Ok(f) => {
+                    files.insert(filename, Arc::new(f));
+                    num_mapped += 1;
+                }
+                Err(s) => {
+                    error!("couldn't map secret file", {
+                        error: s,
+                        file: format!("{}", entry.path().display()),
+                    });
+                }
+            }
+        }
+
+        if num_mapped != 0 || files.len() != old.len() {
+            info!("secret files mapped", {
+                num_files: files.len(),
+                num_changed: num_mapped,
+            });
+        }
+
+        let changed = num_mapped != 0 || files.len() != old.len();
+        if let Ok(mut f) = self.files.write() {
+            *f = Arc::new(files);
+        }
+
+        // Only after the new files are visible, see hmackeys::KeyCache
+        if changed {
+            self.generation.fetch_add(1, Ordering::AcqRel);
+        }
+
+        num_mapped
+    }
+}
+
+// Poll the secret directory for changes every interval
+pub fn spawn_reloader(interval: Duration) {
+    thread::Builder::new()
+        .name("secret_reloader".to_string())
+        .spawn(move || loop {
+            thread::sleep(interval);
+            STORE.reload();
+        })
+        .expect("couldn't spawn secret reloader thread");
+}
+
+fn parse_filename(name: &std::ffi::OsStr) -> Option<u16> {
+    let name = name.to_str()?;
+    if name.len() != 4 {
+        return None;
+    }
+
+    let bytes = hex::decode(name).ok()?;
+    Some(u16::from_le_bytes([bytes[0], bytes[1]]))
+}
+
+fn map_new_file(p: &path::Path, modified: SystemTime) -> Result<SecretFile> {
+    let file = fs::File::open(p).map_err(|_| "couldn't open secret file")?;
+    let mmap = unsafe { Mmap::map(&file) }.map_err(|_| "couldn't mmap secret file")?;
+
+    // Fault the (small) file in now, then tell the kernel lookups are random
+    let _ = mmap.advise(Advice::WillNeed);
+    let _ = mmap.advise(Advice::Random);
+
+    Ok(SecretFile {
+        len: mmap.len() as u64,
+        mmap,
+        modified,
+    })
+}
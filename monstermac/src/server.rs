@@ -1,17 +1,26 @@
+use std::ops;
 use std::result;
+use std::thread;
+use std::time::Instant;
 
-use async_std::fs;
-use async_std::io;
+use async_std::io::{BufReader, BufWriter};
 use async_std::net::{TcpListener, TcpStream};
 use async_std::prelude::*;
 use async_std::task;
-use http_types::{Method, Request, Response, StatusCode};
 use kv_log_macro::{debug, error};
 
 use crate::config;
+use crate::hmackeys;
+use crate::http;
+use crate::metrics;
 
 type Result<T> = result::Result<T, &'static str>;
 
+// Upper bound on the number of names in a single batch request
+const MAX_BATCH_LEN: usize = 1 << 20;
+// Minimum number of names per thread before a batch is split across cores
+const BATCH_PARALLEL_MIN: usize = 64;
+
 pub fn run_forever(listener: std::net::TcpListener) {
     let listener = TcpListener::from(listener);
 
@@ -33,73 +42,180 @@ async fn serve_forever(listener: TcpListener) {
     }
 }
 
+// Serve requests on a connection until the client closes it.
+// Requests are answered in order on the connection's own task. Responses
+// are only flushed once no further pipelined request is already buffered,
+// so a pipelined burst is answered with as few writes as possible.
 async fn handle_stream(stream: TcpStream) {
-    if let Err(e) = async_h1::accept(stream.clone(), handle_req).await {
-        debug!("couldn't send response to client", {
-            error: format!("{}", e),
-        });
-    }
-}
+    let mut reader = BufReader::new(stream.clone());
+    let mut writer = BufWriter::new(stream);
+
+    loop {
+        let mut req = match http::read_request(&mut reader, &mut writer).await {
+            Ok(Some(r)) => r,
+            Ok(None) => break,
+            Err(s) => {
+                debug!("bad request", {
+                    error: s,
+                });
+                let resp = http::Response::new(400);
+                let _ =
+                    http::write_response(&mut writer, &resp, http::Version::Http11, false).await;
+                let _ = writer.flush().await;
+                break;
+            }
+        };
+
+        let start = Instant::now();
+        let resp = handle_req(&mut req).await;
+        match req.path.as_str() {
+            "/" => metrics::MAC_LATENCY.record(start.elapsed()),
+            "/batch" => metrics::BATCH_LATENCY.record(start.elapsed()),
+            _ => {}
+        }
 
-async fn handle_req(mut req: Request) -> http_types::Result<Response> {
-    if req.method() != Method::Post {
-        return Ok(Response::new(StatusCode::BadRequest));
-    }
+        let mut res = http::write_response(&mut writer, &resp, req.version, req.keep_alive).await;
+        if res.is_ok() && (!req.keep_alive || reader.buffer().is_empty()) {
+            res = writer.flush().await;
+        }
 
-    let body = req.body_bytes().await?;
+        if let Err(e) = res {
+            debug!("couldn't send response to client", {
+                error: format!("{}", e),
+            });
+            break;
+        }
+
+        if !req.keep_alive {
+            break;
+        }
+    }
+}
 
-    match compute_mac(body).await {
-        Ok(mac) => {
-            let mut resp = Response::new(StatusCode::Ok);
-            resp.set_body(&mac[..32]);
-            Ok(resp)
+// POST /         body is a single name, responds with its 32 byte mac
+// POST /batch    body is a sequence of names each prefixed with a
+//                big endian u16 length, responds with the 32 byte macs
+//                concatenated in request order
+// GET  /metrics  request counts and latency quantiles
+async fn handle_req(req: &mut http::Request) -> http::Response {
+    use http::Method::*;
+
+    let macs = match (req.method, req.path.as_str()) {
+        (Get, "/metrics") => return http::Response::ok(metrics::render()),
+        (Post, "/batch") => {
+            let names = match parse_batch(&req.body) {
+                Some(n) => n,
+                None => return http::Response::new(400),
+            };
+            let body = std::mem::take(&mut req.body);
+            task::spawn_blocking(move || compute_batch_macs(&body, &names)).await
         }
+        (Post, "/") => compute_mac(&req.body).map(|m| m.to_vec()),
+        (Post, _) => return http::Response::new(404),
+        _ => return http::Response::new(400),
+    };
+
+    match macs {
+        Ok(macs) => http::Response::ok(macs),
         Err(s) => {
             error!("internal server error", {
                 error: s,
             });
-            Ok(Response::new(StatusCode::InternalServerError))
+            http::Response::new(500)
         }
     }
 }
 
-async fn compute_mac(val: Vec<u8>) -> Result<[u8; 32]> {
-    let mut hasher = hmac_sha256::Hash::new();
-    hasher.update(&val);
-    let key_id = fasthash::murmur2::hash32(hasher.finalize());
-    let secret = get_secret(key_id).await?;
-
-    // Perform the mac
-    let mut maccer = hmac_sha256::HMAC::new(secret);
-    maccer.update(val);
-    Ok(maccer.finalize())
-}
+// Returns the range of each name within the batch body
+fn parse_batch(body: &[u8]) -> Option<Vec<ops::Range<usize>>> {
+    let mut names = Vec::new();
+    let mut pos = 0;
 
-async fn get_secret(key_id: u32) -> Result<Vec<u8>> {
-    use config::Mode::*;
-    match *config::MODE {
-        Mode0 => Ok(config::SECRET0.clone()),
-        Mode16 => get_secret32(key_id & 0xffff).await,
-        Mode32 => get_secret32(key_id).await,
+    while pos < body.len() {
+        let len_bytes = body.get(pos..pos + 2)?;
+        let len = u16::from_be_bytes([len_bytes[0], len_bytes[1]]) as usize;
+        pos += 2;
+
+        if body.len() - pos < len || names.len() == MAX_BATCH_LEN {
+            return None;
+        }
+
+        names.push(pos..pos + len);
+        pos += len;
+    }
+
+    if names.is_empty() {
+        None
+    } else {
+        Some(names)
     }
 }
 
-async fn get_secret32(key_id: u32) -> Result<Vec<u8>> {
-    let mut path = config::SECRET_PATH.clone();
-    let filename = ((key_id & 0xffff0000) >> 16) as u16;
-    path.push(&hex::encode(filename.to_le_bytes()));
-    let mut file = fs::File::open(&path)
-        .await
-        .map_err(|_| "couldn't open secret file")?;
+fn compute_batch_macs(body: &[u8], names: &[ops::Range<usize>]) -> Result<Vec<u8>> {
+    // Sort by secret so names sharing a secret file are looked up together
+    let mut jobs = names
+        .iter()
+        .enumerate()
+        .map(|(i, r)| (secret_id(key_id(&body[r.clone()])), i))
+        .collect::<Vec<(u32, usize)>>();
+    jobs.sort_unstable_by_key(|j| j.0);
+
+    let num_threads = thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1)
+        .min(jobs.len() / BATCH_PARALLEL_MIN)
+        .max(1);
+    let chunk_len = (jobs.len() + num_threads - 1) / num_threads;
+
+    let results = thread::scope(|scope| {
+        let workers = jobs
+            .chunks(chunk_len)
+            .map(|chunk| {
+                scope.spawn(move || {
+                    chunk
+                        .iter()
+                        .map(|&(id, i)| {
+                            let key = hmackeys::get_key(id)?;
+                            Ok((i, key.mac(&body[names[i].clone()])))
+                        })
+                        .collect::<Result<Vec<(usize, [u8; 32])>>>()
+                })
+            })
+            .collect::<Vec<_>>();
+
+        workers
+            .into_iter()
+            .map(|w| w.join().unwrap_or(Err("batch mac thread panicked")))
+            .collect::<Vec<_>>()
+    });
+
+    let mut macs = vec![0u8; names.len() * 32];
+    for res in results {
+        for (i, mac) in res? {
+            macs[i * 32..(i + 1) * 32].copy_from_slice(&mac);
+        }
+    }
 
-    let seek = (key_id & 0xffff) as u64 * 32;
-    let seek = io::SeekFrom::Start(seek);
-    file.seek(seek).await.map_err(|_| "couldn't seek in file")?;
+    Ok(macs)
+}
+
+pub fn compute_mac(val: &[u8]) -> Result<[u8; 32]> {
+    let key = hmackeys::get_key(secret_id(key_id(val)))?;
+    Ok(key.mac(val))
+}
 
-    let mut secret = vec![0; 32];
-    file.read_exact(&mut secret)
-        .await
-        .map_err(|_| "couldn't read secret from file")?;
+fn key_id(val: &[u8]) -> u32 {
+    let mut hasher = hmac_sha256::Hash::new();
+    hasher.update(val);
+    fasthash::murmur2::hash32(hasher.finalize())
+}
 
-    Ok(secret)
+// The part of key_id which selects the secret
+fn secret_id(key_id: u32) -> u32 {
+    use config::Mode::*;
+    match *config::MODE {
+        Mode0 => 0,
+        Mode16 => key_id & 0xffff,
+        Mode32 => key_id,
+    }
 }
@@ -1,8 +1,32 @@
+#include <stddef.h>
+
 #include "ppenc.h"
 #include "hash.h"
 #include "blockcipher.h"
 #include "cprng.h"
 
+#if defined(PPENC_INSTRUMENT)
+#define STATS_CLOCK PPENC_CLOCK_T stats_clock;
+#define STATS_START() stats_clock = PPENC_CLOCK()
+#define STATS_STOP(session, stage)                                  \
+  do {                                                              \
+    (session)->stats.stage.calls += 1;                              \
+    (session)->stats.stage.ticks += PPENC_CLOCK() - stats_clock;    \
+  } while (0)
+#define STATS_INC(session, field) (session)->stats.field += 1
+#else
+#define STATS_CLOCK
+#define STATS_START()
+#define STATS_STOP(session, stage)
+#define STATS_INC(session, field)
+#endif
+
+/* the compact tail's keystream and tag blocks are encrypted under *
+ * the message's tweak seed with one of these bits of its first    *
+ * (most significant) byte flipped, giving each its own tweaks     */
+#define COMPACT_KEY_SEED_BIT 0x80
+#define COMPACT_TAG_SEED_BIT 0x40
+
 static void
 session_init(struct PPEncSession *const session,
              const uint8_t *const header_salt,
@@ -10,27 +34,104 @@ session_init(struct PPEncSession *const session,
              const uint8_t *const header_rng_nonce,
              const uint8_t *const body_salt,
              const uint8_t *const body_state0,
-             uint8_t *const buf1400);
+             uint8_t *const scratch);
 
 static void
 session_body_key_next(struct PPEncSession *const session,
                       uint8_t *const buf320);
 
+static void
+session_body_key_derive(struct PPEncSession *const session,
+                        uint8_t *const buf320);
+
+static void
+session_snapshot(const struct PPEncSession *const session,
+                 uint8_t *const snapshot);
+
+static ppenc_err_t
+session_restore(struct PPEncSession *const session,
+                const uint8_t *const snapshot,
+                uint8_t *const scratch);
+
 static void session_compute_response_mac(struct PPEncSession *const session,
                                          uint8_t *const response_mac,
-                                         uint8_t *const inner_salt,
-                                         uint8_t *const body,
+                                         const uint8_t *const inner_salt,
+                                         const uint8_t *const body,
                                          const uint32_t body_len,
                                          uint8_t *const buf256,
                                          uint8_t *const buf64);
-					 
+
+
+static void session_encrypt_to(const struct PPEncSession *const session,
+                               const uint8_t *const tweak_seed,
+                               uint8_t *const dst,
+                               const uint8_t *const src,
+                               const uint32_t src_len,
+                               const uint32_t num_blocks,
+                               uint8_t *const scratch);
+static void session_decrypt_to(const struct PPEncSession *const session,
+                               const uint8_t *const tweak_seed,
+                               uint8_t *const dst,
+                               const uint8_t *const src,
+                               const uint32_t num_blocks,
+                               uint8_t *const scratch);
+static void session_compact_block(const struct PPEncSession *const session,
+                                  const uint8_t *const tweak_seed,
+                                  const uint8_t seed_bit,
+                                  uint8_t *const scratch);
 
 static INLINE void header_scramble_and_encrypt(struct PPEncSession *const session, uint8_t *const header_buf);
-STATIC INLINE void header_scramble(uint8_t *const header_buf);
-STATIC INLINE void header_scramble_inverse(uint8_t *const header_buf);
+STATIC INLINE void header_scramble(uint8_t *const header_buf, const uint8_t len);
+STATIC INLINE void header_scramble_inverse(uint8_t *const header_buf, const uint8_t len);
+static uint32_t sender_new_msg_compact(struct PPEncSender *const sender,
+                                       uint8_t *const header_buf,
+                                       uint8_t *const dst,
+                                       const uint8_t *const src,
+                                       const uint32_t body_len,
+                                       uint8_t *const response_mac,
+                                       uint8_t *const scratch);
+#if !defined(PPENC_LOW_RAM)
+static void sender_encrypt_prepared(struct PPEncSender *const sender,
+                                    uint8_t *const dst,
+                                    const uint8_t *const src,
+                                    const uint32_t src_len,
+                                    const uint32_t num_blocks,
+                                    uint8_t *const scratch);
+#endif
+static ppenc_err_t receiver_parse_header(struct PPEncReceiver *const receiver,
+                                         struct PPEncHeader *const header,
+                                         uint8_t *const raw_header);
+static void dgram_window_fill(struct PPEncDgramWindow *const window,
+                              const struct PPEncReceiver *const receiver,
+                              const uint32_t start,
+                              const uint32_t end,
+                              uint8_t *const scratch);
+static ppenc_err_t receiver_body_key(struct PPEncReceiver *const receiver,
+                                     struct PPEncHeader *const header,
+                                     uint8_t *const scratch);
+static ppenc_err_t receiver_body_check(struct PPEncReceiver *const receiver,
+                                       struct PPEncHeader *const header,
+                                       uint8_t *const body,
+                                       uint8_t *const response_mac,
+                                       uint8_t *const scratch);
+static ppenc_err_t receiver_read_body_compact(struct PPEncReceiver *const receiver,
+                                              struct PPEncHeader *const header,
+                                              uint8_t *const dst,
+                                              const uint8_t *const src,
+                                              uint8_t *const response_mac,
+                                              uint8_t *const scratch);
+static void compact_tag_block(uint8_t *const block,
+                              const uint8_t *const body,
+                              const uint8_t *const padded,
+                              const uint32_t body_len,
+                              const uint32_t body_wire_len);
 static void compute_body_checksum(uint8_t *const body_checksum,
                                   const uint8_t *const body,
+                                  const uint8_t *const padded,
+                                  const uint32_t body_len,
                                   const uint32_t body_padded_len);
+static INLINE void compute_block_checksum(uint8_t *const body_checksum,
+                                          const uint8_t *const block);
 static void write_be32(uint8_t *const dst, const uint32_t val);
 static void write_be24(uint8_t *const dst, const uint32_t val);
 static void write_be16(uint8_t *const dst, const uint16_t val);
@@ -46,16 +147,59 @@ ppenc_sender_init(struct PPEncSender *const sender,
                   const uint8_t *const header_rng_nonce,
                   const uint8_t *const body_salt,
                   const uint8_t *const body_state0,
-                  uint8_t *const buf1400)
+                  uint8_t *const scratch)
 {
   sender->sender_rng = (struct PPEncChaCha8*) sender_rng;
+  sender->prepared.ready = 0;
   session_init(&(sender->session),
                header_salt,
                header_state_init,
                header_rng_nonce,
                body_salt,
                body_state0,
-               buf1400);
+               scratch);
+}
+
+uint32_t
+ppenc_scratch_size()
+{
+  return PPENC_SCRATCH_SIZE;
+}
+
+uint32_t
+ppenc_scratch_size_init()
+{
+  return PPENC_SCRATCH_INIT;
+}
+
+uint32_t
+ppenc_scratch_size_hash()
+{
+  return PPENC_SCRATCH_HASH;
+}
+
+uint32_t
+ppenc_scratch_size_threefish()
+{
+  return PPENC_SCRATCH_THREEFISH;
+}
+
+uint32_t
+ppenc_scratch_size_msg()
+{
+  return PPENC_SCRATCH_MSG;
+}
+
+uint32_t
+ppenc_window_len()
+{
+  return PPENC_WINDOW_LEN;
+}
+
+uint32_t
+ppenc_dgram_window_len()
+{
+  return PPENC_DGRAM_WINDOW_LEN;
 }
 
 uint32_t
@@ -64,10 +208,48 @@ ppenc_sizeof_sender()
   return sizeof(struct PPEncSender);
 }
 
+ppenc_err_t
+ppenc_sender_set_version(struct PPEncSender *const sender, const uint8_t version)
+{
+  if (ppenc_header_len(version) == 0)
+    return PPENC_ERR_BAD_VERSION;
+
+  sender->session.version = version;
+  return PPENC_OK;
+}
+
+uint8_t
+ppenc_header_len(const uint8_t version)
+{
+  switch (version) {
+  case PPENC_VERSION_DEFAULT:
+    return 32;
+  case PPENC_VERSION_COMPACT:
+    return 24;
+  default:
+    return 0;
+  }
+}
+
+uint32_t
+ppenc_body_wire_len(const uint8_t version, const uint32_t body_len)
+{
+  if (version != PPENC_VERSION_COMPACT)
+    return ppenc_body_padded_len(body_len);
+
+  if (body_len > PPENC_COMPACT_MAX_BODY_LEN || body_len > PPENC_MAX_BODY_LEN)
+    return 0;
+
+  /* rounded up to 8 bytes, an empty body still sends 8 */
+  if (body_len == 0)
+    return 8;
+  return (body_len + 7) & ~((uint32_t) 7);
+}
+
 void
-ppenc_sender_new_body_key(struct PPEncSender *const sender, uint8_t *const buf1400)
+ppenc_sender_new_body_key(struct PPEncSender *const sender, uint8_t *const scratch)
 {
-  session_body_key_next(&(sender->session), buf1400);
+  session_body_key_next(&(sender->session), scratch);
 }
 
 uint32_t
@@ -76,12 +258,31 @@ ppenc_sender_new_msg(struct PPEncSender *const sender,
                      uint8_t *const body,
                      const uint32_t body_len,
                      uint8_t *const response_mac,
-                     uint8_t *const buf1400)
+                     uint8_t *const scratch)
 {
-  uint32_t body_len_padded;
+  return ppenc_sender_new_msg_to(sender, header_buf, body, body, body_len, response_mac, scratch);
+}
+
+uint32_t
+ppenc_sender_new_msg_to(struct PPEncSender *const sender,
+                        uint8_t *const header_buf,
+                        uint8_t *const dst,
+                        const uint8_t *const src,
+                        const uint32_t body_len,
+                        uint8_t *const response_mac,
+                        uint8_t *const scratch)
+{
+  uint32_t body_len_padded, i;
   uint8_t *tweek_seed, *body_checksum, *inner_salt;
+  const uint8_t *plain;
+  STATS_CLOCK
+
+  if (sender->session.version == PPENC_VERSION_COMPACT)
+    return sender_new_msg_compact(sender, header_buf, dst, src, body_len, response_mac, scratch);
 
   body_len_padded = ppenc_body_padded_len(body_len);
+  if (body_len_padded == 0)
+    return 0;
 
   /* populate the header_buf (in rows of 8 bytes) *
    * version(1) seq_numn(3) body_length(4)       *
@@ -97,52 +298,488 @@ ppenc_sender_new_msg(struct PPEncSender *const sender,
   body_checksum = header_buf + 24;
  
   /* generate inner salt */
-  ppenc_chacha8_nbytes(sender->sender_rng, inner_salt, 6);
+  STATS_START();
+  if (sender->prepared.ready)
+    for (i = 0; i < 6; i++)
+      inner_salt[i] = sender->prepared.inner_salt[i];
+  else
+    ppenc_chacha8_nbytes(sender->sender_rng, inner_salt, 6);
+  STATS_STOP(&(sender->session), sender_rng);
 
   /* compute the response mac (sha256(response_mac_salt + cubehash(inner_salt XOR body))) */
   session_compute_response_mac(&(sender->session),
                                response_mac,
                                inner_salt,
-                               body,
+                               src,
                                body_len,
-                               buf1400,
-                               buf1400 + 256);
+                               scratch,
+                               scratch + 256);
 
-  /* append our padding */
+  /* append our padding (straight into dst, src is only read) */
+  STATS_START();
   ppenc_chacha8_nbytes(sender->sender_rng,
-                       body + body_len,
+                       dst + body_len,
                        body_len_padded - body_len);
 
   /* generate + write tweek_seed into header */
-  ppenc_chacha8_nbytes(sender->sender_rng, tweek_seed, 8);
-
-  /* compute + write body_checksum into header */
-  compute_body_checksum(body_checksum, body, body_len_padded);
+  if (sender->prepared.ready)
+    for (i = 0; i < 8; i++)
+      tweek_seed[i] = sender->prepared.tweak_seed[i];
+  else
+    ppenc_chacha8_nbytes(sender->sender_rng, tweek_seed, 8);
+  STATS_STOP(&(sender->session), sender_rng);
+
+  /* compute + write body_checksum into header, a single block *
+   * body (most messages) is put together in dst, checksummed   *
+   * with fixed size code and then encrypted in place           */
+  STATS_START();
+  if (body_len_padded == 64) {
+    for (i = 0; src != dst && i < body_len; i++)
+      dst[i] = src[i];
+    compute_block_checksum(body_checksum, dst);
+    plain = dst;
+  } else {
+    compute_body_checksum(body_checksum, src, dst, body_len, body_len_padded);
+    plain = src;
+  }
+  STATS_STOP(&(sender->session), checksum);
 
-#if defined(PPENC_64BIT)
-  ppenc_threefish512_encrypt_64bit(sender->session.body_key,
-                                   tweek_seed,
-                                   body,
-                                   body_len_padded / 64,
-                                   (struct ThreeFishBuffer64*) (buf1400 + 64),
-                                   buf1400);
-#else
-  ppenc_threefish512_encrypt(sender->session.body_key,
-                             tweek_seed,
-                             body,
-                             body_len_padded / 64,
-                             (struct ThreeFishBuffer*) (buf1400 + 64),
-                             buf1400);
+  STATS_START();
+#if !defined(PPENC_LOW_RAM)
+  if (sender->prepared.ready)
+    sender_encrypt_prepared(sender, dst, plain, body_len, body_len_padded / 64, scratch);
+  else
 #endif
+  session_encrypt_to(&(sender->session), tweek_seed, dst, plain, body_len, body_len_padded / 64, scratch);
+  STATS_STOP(&(sender->session), threefish);
 
   /* scramble and encrypt the header */
+  STATS_START();
   header_scramble_and_encrypt(&(sender->session), header_buf);
+  STATS_STOP(&(sender->session), header);
 
+  STATS_INC(&(sender->session), msgs);
   sender->session.seq_num += 1;
+  sender->prepared.ready = 0;
 
   return body_len_padded;
 }
 
+/* version 1, populates header_buf (in rows of 8 bytes) *
+ * version(1) seq_num(3) body_len(2) body_key_num(2)    *
+ * inner_salt(4) body_tag(4)                            *
+ * tweek_seed(8)                                        */
+static uint32_t
+sender_new_msg_compact(struct PPEncSender *const sender,
+                       uint8_t *const header_buf,
+                       uint8_t *const dst,
+                       const uint8_t *const src,
+                       const uint32_t body_len,
+                       uint8_t *const response_mac,
+                       uint8_t *const scratch)
+{
+  uint32_t body_wire_len, full_len, i;
+  uint8_t inner_salt[6], body_checksum[8];
+  uint8_t *tweek_seed, *block;
+  STATS_CLOCK
+
+  body_wire_len = ppenc_body_wire_len(PPENC_VERSION_COMPACT, body_len);
+  if (body_wire_len == 0)
+    return 0;
+  /* the whole blocks go through Threefish as in version 0 */
+  full_len = body_wire_len & ~((uint32_t) 63);
+  block = scratch + PPENC_SCRATCH_THREEFISH;
+
+  header_buf[0] = PPENC_VERSION_COMPACT;
+  write_be24(header_buf + 1, sender->session.seq_num);
+  write_be16(header_buf + 4, (uint16_t) body_len);
+  write_be16(header_buf + 6, sender->session.body_key_num);
+  tweek_seed = header_buf + 16;
+
+  /* generate inner salt, the response mac still takes 6 bytes */
+  STATS_START();
+  if (sender->prepared.ready)
+    for (i = 0; i < 4; i++)
+      inner_salt[i] = sender->prepared.inner_salt[i];
+  else
+    ppenc_chacha8_nbytes(sender->sender_rng, inner_salt, 4);
+  inner_salt[4] = 0;
+  inner_salt[5] = 0;
+  for (i = 0; i < 4; i++)
+    header_buf[8 + i] = inner_salt[i];
+  STATS_STOP(&(sender->session), sender_rng);
+
+  session_compute_response_mac(&(sender->session),
+                               response_mac,
+                               inner_salt,
+                               src,
+                               body_len,
+                               scratch,
+                               scratch + 256);
+
+  /* padding up to 8 bytes, then the tweek_seed */
+  STATS_START();
+  if (body_wire_len > body_len)
+    ppenc_chacha8_nbytes(sender->sender_rng,
+                         dst + body_len,
+                         body_wire_len - body_len);
+  if (sender->prepared.ready)
+    for (i = 0; i < 8; i++)
+      tweek_seed[i] = sender->prepared.tweak_seed[i];
+  else
+    ppenc_chacha8_nbytes(sender->sender_rng, tweek_seed, 8);
+  STATS_STOP(&(sender->session), sender_rng);
+
+  /* checksum the whole blocks, the tag block covers the checksum *
+   * and the tail                                                 */
+  STATS_START();
+  compute_body_checksum(body_checksum, src, dst, body_len < full_len ? body_len : full_len, full_len);
+  compact_tag_block(block, src, dst, body_len, body_wire_len);
+  for (i = 0; i < 8; i++)
+    block[56 + i] = body_checksum[i];
+  STATS_STOP(&(sender->session), checksum);
+
+  STATS_START();
+  session_compact_block(&(sender->session), tweek_seed, COMPACT_TAG_SEED_BIT, scratch);
+  for (i = 0; i < 4; i++)
+    header_buf[12 + i] = block[i];
+
+  if (full_len != 0) {
+#if !defined(PPENC_LOW_RAM)
+    if (sender->prepared.ready)
+      sender_encrypt_prepared(sender, dst, src, body_len, full_len / 64, scratch);
+    else
+#endif
+    session_encrypt_to(&(sender->session), tweek_seed, dst, src, body_len, full_len / 64, scratch);
+  }
+
+  /* the tail is xored with a keystream block */
+  if (body_wire_len != full_len) {
+    for (i = 0; i < 64; i++)
+      block[i] = 0;
+    session_compact_block(&(sender->session), tweek_seed, COMPACT_KEY_SEED_BIT, scratch);
+    for (i = full_len; i < body_wire_len; i++)
+      dst[i] = (i < body_len ? src[i] : dst[i]) ^ block[i - full_len];
+  }
+  STATS_STOP(&(sender->session), threefish);
+
+  /* scramble and encrypt the header */
+  STATS_START();
+  header_scramble_and_encrypt(&(sender->session), header_buf);
+  STATS_STOP(&(sender->session), header);
+
+  STATS_INC(&(sender->session), msgs);
+  sender->session.seq_num += 1;
+  sender->prepared.ready = 0;
+
+  return body_wire_len;
+}
+
+void
+ppenc_sender_prepare(struct PPEncSender *const sender)
+{
+  STATS_CLOCK
+
+  if (sender->prepared.ready)
+    return;
+
+  /* same draws as new_msg, padding is drawn by new_msg itself */
+  STATS_START();
+  ppenc_chacha8_nbytes(sender->sender_rng, sender->prepared.inner_salt, 6);
+  ppenc_chacha8_nbytes(sender->sender_rng, sender->prepared.tweak_seed, 8);
+  STATS_STOP(&(sender->session), sender_rng);
+
+  STATS_START();
+#if defined(PPENC_64BIT)
+  ppenc_threefish512_tweak_seek_64bit(&(sender->prepared.tweak_pos), sender->prepared.tweak_seed, 1, 1);
+#elif !defined(PPENC_LOW_RAM)
+  ppenc_threefish512_tweak_seek(&(sender->prepared.tweak_pos), sender->prepared.tweak_seed, 1, 1);
+#endif
+  STATS_STOP(&(sender->session), threefish);
+
+  STATS_START();
+  ppenc_chacha20_prepare_header(&(sender->session.header_key_rng));
+  STATS_STOP(&(sender->session), header);
+
+  sender->prepared.ready = 1;
+}
+
+#if !defined(PPENC_LOW_RAM)
+/* encrypts from the prepared tweak position instead of the seed */
+static void
+sender_encrypt_prepared(struct PPEncSender *const sender,
+                        uint8_t *const dst,
+                        const uint8_t *const src,
+                        const uint32_t src_len,
+                        const uint32_t num_blocks,
+                        uint8_t *const scratch)
+{
+#if defined(PPENC_64BIT)
+  struct ThreeFishBuffer64 *const buf3f = (struct ThreeFishBuffer64*) (scratch + 64);
+#else
+  struct ThreeFishBuffer *const buf3f = (struct ThreeFishBuffer*) (scratch + 64);
+#endif
+
+#if defined(PPENC_KEY_SCHEDULE_CACHE) && defined(PPENC_64BIT)
+  ppenc_threefish512_encrypt_chunk_64bit(sender->session.key_schedule, &(sender->prepared.tweak_pos), 0,
+                                         dst, src, src_len, num_blocks, buf3f, scratch);
+#elif defined(PPENC_KEY_SCHEDULE_CACHE)
+  ppenc_threefish512_encrypt_chunk(sender->session.key_schedule, &(sender->prepared.tweak_pos), 0,
+                                   dst, src, src_len, num_blocks, buf3f, scratch);
+#elif defined(PPENC_64BIT)
+  ppenc_threefish512_key_schedule_64bit(buf3f->subkeys, sender->session.body_key, buf3f->keys);
+  ppenc_threefish512_encrypt_chunk_64bit(buf3f->subkeys, &(sender->prepared.tweak_pos), 0,
+                                         dst, src, src_len, num_blocks, buf3f, scratch);
+#else
+  ppenc_threefish512_key_schedule(buf3f->subkeys, sender->session.body_key, buf3f->keys);
+  ppenc_threefish512_encrypt_chunk(buf3f->subkeys, &(sender->prepared.tweak_pos), 0,
+                                   dst, src, src_len, num_blocks, buf3f, scratch);
+#endif
+}
+#endif
+
+void
+ppenc_window_init(struct PPEncWindow *const window)
+{
+  window->head = 0;
+  window->len = 0;
+}
+
+uint32_t
+ppenc_sizeof_window()
+{
+  return sizeof(struct PPEncWindow);
+}
+
+uint16_t
+ppenc_window_outstanding(const struct PPEncWindow *const window)
+{
+  uint16_t i, n;
+
+  n = 0;
+  for (i = 0; i < window->len; i++)
+    n += !window->entries[(window->head + i) % PPENC_WINDOW_LEN].acked;
+
+  return n;
+}
+
+uint16_t
+ppenc_window_space(const struct PPEncWindow *const window)
+{
+  return PPENC_WINDOW_LEN - window->len;
+}
+
+ppenc_err_t
+ppenc_window_push(struct PPEncWindow *const window,
+                  const struct PPEncSender *const sender,
+                  const uint8_t *const response_mac,
+                  const uint32_t sent_at)
+{
+  struct PPEncWindowEntry *entry;
+  uint8_t i;
+
+  if (window->len == PPENC_WINDOW_LEN)
+    return PPENC_ERR_WINDOW_FULL;
+
+  entry = &(window->entries[(window->head + window->len) % PPENC_WINDOW_LEN]);
+  for (i = 0; i < 32; i++)
+    entry->response_mac[i] = response_mac[i];
+  /* new_msg has already moved on to the next seq_num */
+  entry->seq_num = sender->session.seq_num - 1;
+  entry->sent_at = sent_at;
+  entry->acked = 0;
+  window->len += 1;
+
+  return PPENC_OK;
+}
+
+ppenc_err_t
+ppenc_window_ack(struct PPEncWindow *const window,
+                 const uint8_t *const response_mac,
+                 uint32_t *const seq_num,
+                 uint32_t *const sent_at)
+{
+  struct PPEncWindowEntry *entry;
+  uint16_t i;
+  uint8_t j, diff;
+
+  for (i = 0; i < window->len; i++) {
+    entry = &(window->entries[(window->head + i) % PPENC_WINDOW_LEN]);
+    if (entry->acked)
+      continue;
+
+    /* all 32 bytes are compared whatever the first difference */
+    diff = 0;
+    for (j = 0; j < 32; j++)
+      diff |= entry->response_mac[j] ^ response_mac[j];
+    if (diff != 0)
+      continue;
+
+    entry->acked = 1;
+    if (seq_num != NULL)
+      *seq_num = entry->seq_num;
+    if (sent_at != NULL)
+      *sent_at = entry->sent_at;
+
+    /* acks usually come in order, free the slots they leave at the head */
+    while (window->len > 0 && window->entries[window->head].acked) {
+      window->head = (window->head + 1) % PPENC_WINDOW_LEN;
+      window->len -= 1;
+    }
+
+    return PPENC_OK;
+  }
+
+  return PPENC_ERR_UNKNOWN_RESPONSE_MAC;
+}
+
+uint16_t
+ppenc_window_expire(struct PPEncWindow *const window,
+                    const uint32_t now,
+                    const uint32_t timeout,
+                    uint32_t *const seq_nums)
+{
+  struct PPEncWindowEntry *entry;
+  uint16_t n;
+
+  n = 0;
+  while (window->len > 0) {
+    entry = &(window->entries[window->head]);
+    /* messages are sent in order, the oldest is at the head */
+    if (!entry->acked && (uint32_t) (now - entry->sent_at) < timeout)
+      break;
+
+    if (!entry->acked) {
+      if (seq_nums != NULL)
+        seq_nums[n] = entry->seq_num;
+      n++;
+    }
+    window->head = (window->head + 1) % PPENC_WINDOW_LEN;
+    window->len -= 1;
+  }
+
+  return n;
+}
+
+void
+ppenc_batch_init(struct PPEncBatch *const batch,
+                 uint8_t *const body,
+                 const uint32_t max_len,
+                 const uint32_t flush_len,
+                 const uint32_t max_delay)
+{
+  batch->body = body;
+  batch->max_len = max_len;
+  batch->flush_len = flush_len;
+  batch->max_delay = max_delay;
+  batch->first_at = 0;
+  batch->len = 0;
+  batch->num_records = 0;
+}
+
+uint32_t
+ppenc_sizeof_batch()
+{
+  return sizeof(struct PPEncBatch);
+}
+
+ppenc_err_t
+ppenc_batch_add(struct PPEncBatch *const batch,
+                const uint8_t *const record,
+                const uint16_t record_len,
+                const uint32_t now)
+{
+  uint8_t *dst;
+  uint16_t i;
+
+  if ((uint32_t) record_len + PPENC_RECORD_PREFIX_LEN > batch->max_len - batch->len)
+    return PPENC_ERR_BATCH_FULL;
+
+  if (batch->num_records == 0)
+    batch->first_at = now;
+
+  dst = batch->body + batch->len;
+  write_be16(dst, record_len);
+  dst += PPENC_RECORD_PREFIX_LEN;
+  for (i = 0; i < record_len; i++)
+    dst[i] = record[i];
+
+  batch->len += PPENC_RECORD_PREFIX_LEN + record_len;
+  batch->num_records += 1;
+  return PPENC_OK;
+}
+
+uint8_t
+ppenc_batch_due(const struct PPEncBatch *const batch, const uint32_t now)
+{
+  if (batch->num_records == 0)
+    return 0;
+
+  return batch->len >= batch->flush_len ||
+    (uint32_t) (now - batch->first_at) >= batch->max_delay;
+}
+
+uint32_t
+ppenc_batch_len(const struct PPEncBatch *const batch)
+{
+  return batch->len;
+}
+
+uint16_t
+ppenc_batch_num_records(const struct PPEncBatch *const batch)
+{
+  return batch->num_records;
+}
+
+void
+ppenc_batch_clear(struct PPEncBatch *const batch)
+{
+  batch->len = 0;
+  batch->num_records = 0;
+}
+
+uint32_t
+ppenc_batch_flush(struct PPEncBatch *const batch,
+                  struct PPEncSender *const sender,
+                  uint8_t *const header_buf,
+                  uint8_t *const response_mac,
+                  uint8_t *const scratch)
+{
+  uint32_t body_padded_len;
+
+  if (batch->num_records == 0)
+    return 0;
+
+  body_padded_len = ppenc_sender_new_msg(sender, header_buf, batch->body, batch->len,
+                                         response_mac, scratch);
+  ppenc_batch_clear(batch);
+  return body_padded_len;
+}
+
+ppenc_err_t
+ppenc_record_next(const uint8_t *const body,
+                  const uint32_t body_len,
+                  uint32_t *const pos,
+                  const uint8_t **const record,
+                  uint16_t *const record_len)
+{
+  uint32_t start, len;
+
+  start = *pos;
+  if (start > body_len || body_len - start < PPENC_RECORD_PREFIX_LEN)
+    return PPENC_ERR_BAD_RECORD;
+
+  len = ((uint32_t) body[start] << 8) | body[start + 1];
+  start += PPENC_RECORD_PREFIX_LEN;
+  if (len > body_len - start)
+    return PPENC_ERR_BAD_RECORD;
+
+  *record = body + start;
+  *record_len = (uint16_t) len;
+  *pos = start + len;
+  return PPENC_OK;
+}
+
 void
 ppenc_sender_rng_init(PPEncSenderRng *const rng,
                       const uint8_t *const key,
@@ -168,14 +805,11 @@ ppenc_sender_rng_nbytes(PPEncSenderRng *const sender_rng,
 uint32_t
 ppenc_body_padded_len(uint32_t body_len)
 {
-  uint32_t body_len_padded;
+  if (body_len > PPENC_MAX_BODY_LEN)
+    return 0;
 
-  body_len_padded = 0;
-  body_len += 8;
-  while (body_len_padded < body_len)
-    body_len_padded += 64;
-
-  return body_len_padded;
+  /* at least 8 bytes of padding, rounded up to whole blocks */
+  return (body_len + 8 + 63) & ~((uint32_t) 63);
 }
 
 void
@@ -185,7 +819,7 @@ ppenc_receiver_init(struct PPEncReceiver *const receiver,
                     const uint8_t *const header_rng_nonce,
                     const uint8_t *const body_salt,
                     const uint8_t *const body_state0,
-                    uint8_t *const buf1400)
+                    uint8_t *const scratch)
 {
   session_init(&(receiver->session),
                header_salt,
@@ -193,7 +827,9 @@ ppenc_receiver_init(struct PPEncReceiver *const receiver,
                header_rng_nonce,
                body_salt,
                body_state0,
-               buf1400);
+               scratch);
+  receiver->max_body_len = PPENC_MAX_BODY_LEN;
+  receiver->oversize_headers = 0;
 }
 
 uint32_t
@@ -202,25 +838,139 @@ ppenc_sizeof_receiver()
   return sizeof(struct PPEncReceiver);
 }
 
+ppenc_err_t
+ppenc_receiver_set_version(struct PPEncReceiver *const receiver, const uint8_t version)
+{
+  if (ppenc_header_len(version) == 0)
+    return PPENC_ERR_BAD_VERSION;
+
+  receiver->session.version = version;
+  return PPENC_OK;
+}
+
+void
+ppenc_receiver_set_max_body_len(struct PPEncReceiver *const receiver,
+                                const uint32_t max_body_len)
+{
+  if (max_body_len > PPENC_MAX_BODY_LEN)
+    receiver->max_body_len = PPENC_MAX_BODY_LEN;
+  else
+    receiver->max_body_len = max_body_len;
+}
+
+uint32_t
+ppenc_receiver_oversize_headers(const struct PPEncReceiver *const receiver)
+{
+  return receiver->oversize_headers;
+}
+
+void
+ppenc_receiver_snapshot(const struct PPEncReceiver *const receiver,
+                        uint8_t *const snapshot)
+{
+  snapshot[0] = PPENC_SNAPSHOT_FORMAT;
+  session_snapshot(&(receiver->session), snapshot);
+  write_be32(snapshot + 8, receiver->max_body_len);
+  write_be32(snapshot + 12, receiver->oversize_headers);
+}
+
+ppenc_err_t
+ppenc_receiver_restore(struct PPEncReceiver *const receiver,
+                       const uint8_t *const snapshot,
+                       uint8_t *const scratch)
+{
+  uint32_t max_body_len;
+  ppenc_err_t err;
+
+  max_body_len = read_be32((uint8_t*) snapshot + 8);
+  if (snapshot[0] != PPENC_SNAPSHOT_FORMAT || max_body_len > PPENC_MAX_BODY_LEN)
+    return PPENC_ERR_BAD_SNAPSHOT;
+
+  err = session_restore(&(receiver->session), snapshot, scratch);
+  if (err != PPENC_OK)
+    return err;
+
+  receiver->max_body_len = max_body_len;
+  receiver->oversize_headers = read_be32((uint8_t*) snapshot + 12);
+  return PPENC_OK;
+}
+
+#if defined(PPENC_INSTRUMENT)
+const struct PPEncStats*
+ppenc_sender_stats(const struct PPEncSender *const sender)
+{
+  return &(sender->session.stats);
+}
+
+const struct PPEncStats*
+ppenc_receiver_stats(const struct PPEncReceiver *const receiver)
+{
+  return &(receiver->session.stats);
+}
+#endif
+
 ppenc_err_t
 ppenc_receiver_read_header(struct PPEncReceiver *const receiver,
                            struct PPEncHeader *const header,
                            uint8_t *const raw_header)
 {
+  uint8_t header_len;
+  STATS_CLOCK
+
+  header_len = ppenc_header_len(receiver->session.version);
+
   /* decrypt the header */
-  ppenc_chacha20_xor_header(&(receiver->session.header_key_rng), raw_header);
-  header_scramble_inverse(raw_header);
+  STATS_START();
+  ppenc_chacha20_xor_header_len(&(receiver->session.header_key_rng), raw_header, header_len);
+  header_scramble_inverse(raw_header, header_len);
+  STATS_STOP(&(receiver->session), header);
 
-  /* check the version is correct */
-  if (raw_header[0] != 0)
+  /* check the version is the session's */
+  if (raw_header[0] != receiver->session.version)
     return PPENC_ERR_BAD_VERSION;
+  header->version = raw_header[0];
 
   header->seq_num = read_be24(raw_header + 1);
   if (header->seq_num != receiver->session.seq_num)
     return PPENC_ERR_BAD_SEQ_NUM;
 
-  header->body_len = read_be32(raw_header + 4);
-  header->body_key_num = read_be16(raw_header + 8);
+  return receiver_parse_header(receiver, header, raw_header);
+}
+
+/* the rest of a decrypted header once its version and seq_num *
+ * are known to be good                                        */
+static ppenc_err_t
+receiver_parse_header(struct PPEncReceiver *const receiver,
+                      struct PPEncHeader *const header,
+                      uint8_t *const raw_header)
+{
+  uint8_t i;
+
+  /* reject before the caller sizes a buffer from body_len */
+  if (header->version == PPENC_VERSION_COMPACT)
+    header->body_len = read_be16(raw_header + 4);
+  else
+    header->body_len = read_be32(raw_header + 4);
+  if (header->body_len > receiver->max_body_len) {
+    receiver->oversize_headers++;
+    return PPENC_ERR_BODY_TOO_LONG;
+  }
+
+  /* spread a compact header out to the version 0 offsets, the *
+   * missing inner_salt and checksum bytes are zero            */
+  if (header->version == PPENC_VERSION_COMPACT) {
+    header->body_key_num = read_be16(raw_header + 6);
+    for (i = 0; i < 4; i++) {
+      raw_header[24 + i] = raw_header[12 + i];
+      raw_header[28 + i] = 0;
+    }
+    for (i = 4; i > 0; i--)
+      raw_header[9 + i] = raw_header[7 + i];
+    raw_header[14] = 0;
+    raw_header[15] = 0;
+  } else {
+    header->body_key_num = read_be16(raw_header + 8);
+  }
   header->inner_salt = raw_header + 10;
   header->tweek_seed = raw_header + 16;
   header->body_checksum = raw_header + 24;
@@ -228,46 +978,390 @@ ppenc_receiver_read_header(struct PPEncReceiver *const receiver,
   return PPENC_OK;
 }
 
+void
+ppenc_dgram_window_init(struct PPEncDgramWindow *const window,
+                        const struct PPEncReceiver *const receiver,
+                        uint8_t *const scratch)
+{
+  window->base = receiver->session.seq_num;
+  window->seen = 0;
+  window->lost = 0;
+  dgram_window_fill(window, receiver, window->base, window->base + PPENC_DGRAM_WINDOW_LEN, scratch);
+}
+
+uint32_t
+ppenc_sizeof_dgram_window()
+{
+  return sizeof(struct PPEncDgramWindow);
+}
+
+uint32_t
+ppenc_dgram_window_lost(const struct PPEncDgramWindow *const window)
+{
+  return window->lost;
+}
+
+uint32_t
+ppenc_dgram_window_seen(const struct PPEncDgramWindow *const window)
+{
+  return window->seen;
+}
+
+void
+ppenc_dgram_window_restore(struct PPEncDgramWindow *const window,
+                           const struct PPEncReceiver *const receiver,
+                           const uint32_t seen,
+                           const uint32_t lost,
+                           uint8_t *const scratch)
+{
+  ppenc_dgram_window_init(window, receiver, scratch);
+  window->seen = seen;
+  window->lost = lost;
+}
+
+ppenc_err_t
+ppenc_receiver_read_header_dgram(struct PPEncReceiver *const receiver,
+                                 const struct PPEncDgramWindow *const window,
+                                 struct PPEncHeader *const header,
+                                 uint8_t *const raw_header)
+{
+  uint32_t candidate32[8], seq_num;
+  const uint8_t *key;
+  uint8_t *candidate, header_len, i, j;
+  STATS_CLOCK
+
+  header_len = ppenc_header_len(receiver->session.version);
+  candidate = (uint8_t*) candidate32;
+  seq_num = 0;
+
+  /* decrypt the header as each seq_num not yet read, it is the one *
+   * whose version and seq_num come out right                       */
+  STATS_START();
+  for (i = 0; i < PPENC_DGRAM_WINDOW_LEN; i++) {
+    if ((window->seen >> i) & 1)
+      continue;
+
+    seq_num = window->base + i;
+    key = window->keystream[seq_num % PPENC_DGRAM_WINDOW_LEN];
+    for (j = 0; j < header_len; j++)
+      candidate[j] = raw_header[j] ^ key[j];
+    header_scramble_inverse(candidate, header_len);
+
+    if (candidate[0] == receiver->session.version &&
+        read_be24(candidate + 1) == (seq_num & 0xffffff))
+      break;
+  }
+  STATS_STOP(&(receiver->session), header);
+
+  if (i == PPENC_DGRAM_WINDOW_LEN)
+    return PPENC_ERR_BAD_SEQ_NUM;
+
+  for (j = 0; j < header_len; j++)
+    raw_header[j] = candidate[j];
+  header->version = candidate[0];
+  header->seq_num = seq_num;
+
+  return receiver_parse_header(receiver, header, raw_header);
+}
+
+ppenc_err_t
+ppenc_receiver_read_body_dgram(struct PPEncReceiver *const receiver,
+                               struct PPEncDgramWindow *const window,
+                               struct PPEncHeader *const header,
+                               uint8_t *const dst,
+                               const uint8_t *const src,
+                               uint8_t *const response_mac,
+                               uint8_t *const scratch)
+{
+  uint32_t offset, shift, i;
+  ppenc_err_t err;
+
+  /* the header may be stale if another body was read since */
+  offset = header->seq_num - window->base;
+  if (offset >= PPENC_DGRAM_WINDOW_LEN || ((window->seen >> offset) & 1) != 0)
+    return PPENC_ERR_BAD_SEQ_NUM;
+
+  err = ppenc_receiver_read_body_to(receiver, header, dst, src, response_mac, scratch);
+  if (err != PPENC_OK)
+    return err;
+  window->seen |= (uint32_t) 1 << offset;
+
+  /* keep the half of the window behind the newest message for late *
+   * arrivals, those further behind are given up on                 */
+  shift = 0;
+  if (offset >= PPENC_DGRAM_WINDOW_LEN / 2)
+    shift = offset - PPENC_DGRAM_WINDOW_LEN / 2 + 1;
+  for (i = 0; i < shift; i++)
+    if (((window->seen >> i) & 1) == 0)
+      window->lost++;
+
+  /* and move past everything read in order */
+  while (shift < PPENC_DGRAM_WINDOW_LEN && ((window->seen >> shift) & 1) != 0)
+    shift++;
+
+  if (shift != 0) {
+    window->seen = shift < PPENC_DGRAM_WINDOW_LEN ? window->seen >> shift : 0;
+    dgram_window_fill(window,
+                      receiver,
+                      window->base + PPENC_DGRAM_WINDOW_LEN,
+                      window->base + PPENC_DGRAM_WINDOW_LEN + shift,
+                      scratch);
+    window->base += shift;
+  }
+
+  /* read_body_to counted this message in order */
+  receiver->session.seq_num = window->base;
+  return PPENC_OK;
+}
+
+/* header keystreams of seq_nums start up to end into their slots */
+static void
+dgram_window_fill(struct PPEncDgramWindow *const window,
+                  const struct PPEncReceiver *const receiver,
+                  const uint32_t start,
+                  const uint32_t end,
+                  uint8_t *const scratch)
+{
+  uint32_t seq_num;
+  uint8_t *key, i;
+
+  for (seq_num = start; seq_num != end; seq_num++) {
+    /* one keystream block holds two headers, seq_num 1 is header 0 */
+    if (seq_num == start || ((seq_num - 1) & 1) == 0)
+      ppenc_chacha20_headers_at(&(receiver->session.header_key_rng), seq_num - 1, scratch);
+
+    key = scratch + ((seq_num - 1) & 1) * 32;
+    for (i = 0; i < 32; i++)
+      window->keystream[seq_num % PPENC_DGRAM_WINDOW_LEN][i] = key[i];
+  }
+}
+
 ppenc_err_t
 ppenc_receiver_read_body(struct PPEncReceiver *const receiver,
                          struct PPEncHeader *const header,
                          uint8_t *const body,
                          uint8_t *const response_mac,
-                         uint8_t *const buf1400)
+                         uint8_t *const scratch)
 {
-  uint32_t body_len_padded;
-  uint16_t i;
-  uint8_t body_checksum[8];
+  return ppenc_receiver_read_body_to(receiver, header, body, body, response_mac, scratch);
+}
 
-  body_len_padded = ppenc_body_padded_len(header->body_len);
+ppenc_err_t
+ppenc_receiver_read_body_to(struct PPEncReceiver *const receiver,
+                            struct PPEncHeader *const header,
+                            uint8_t *const dst,
+                            const uint8_t *const src,
+                            uint8_t *const response_mac,
+                            uint8_t *const scratch)
+{
+  uint32_t num_blocks;
+  ppenc_err_t err;
+  STATS_CLOCK
+
+  err = receiver_body_key(receiver, header, scratch);
+  if (err != PPENC_OK)
+    return err;
+  if (receiver->session.version == PPENC_VERSION_COMPACT)
+    return receiver_read_body_compact(receiver, header, dst, src, response_mac, scratch);
+  num_blocks = ppenc_body_padded_len(header->body_len) / 64;
+
+  /* decrypt the body */
+  STATS_START();
+  session_decrypt_to(&(receiver->session), header->tweek_seed, dst, src, num_blocks, scratch);
+  STATS_STOP(&(receiver->session), threefish);
+
+  return receiver_body_check(receiver, header, dst, response_mac, scratch);
+}
+
+/* version 1: the whole blocks are decrypted, the tail xored with *
+ * its keystream block and the tag block recomputed from both     */
+static ppenc_err_t
+receiver_read_body_compact(struct PPEncReceiver *const receiver,
+                           struct PPEncHeader *const header,
+                           uint8_t *const dst,
+                           const uint8_t *const src,
+                           uint8_t *const response_mac,
+                           uint8_t *const scratch)
+{
+  uint32_t body_wire_len, full_len, i;
+  uint8_t body_checksum[8], diff;
+  uint8_t *block;
+  STATS_CLOCK
+
+  body_wire_len = ppenc_body_wire_len(PPENC_VERSION_COMPACT, header->body_len);
+  full_len = body_wire_len & ~((uint32_t) 63);
+  block = scratch + PPENC_SCRATCH_THREEFISH;
+
+  STATS_START();
+  if (full_len != 0)
+    session_decrypt_to(&(receiver->session), header->tweek_seed, dst, src, full_len / 64, scratch);
+
+  if (body_wire_len != full_len) {
+    for (i = 0; i < 64; i++)
+      block[i] = 0;
+    session_compact_block(&(receiver->session), header->tweek_seed, COMPACT_KEY_SEED_BIT, scratch);
+    for (i = full_len; i < body_wire_len; i++)
+      dst[i] = src[i] ^ block[i - full_len];
+  }
+  STATS_STOP(&(receiver->session), threefish);
+
+  /* check the tag, it covers the whole blocks' checksum and the tail */
+  STATS_START();
+  compute_body_checksum(body_checksum, dst, dst, full_len, full_len);
+  compact_tag_block(block, dst, dst, body_wire_len, body_wire_len);
+  for (i = 0; i < 8; i++)
+    block[56 + i] = body_checksum[i];
+  STATS_STOP(&(receiver->session), checksum);
+
+  STATS_START();
+  session_compact_block(&(receiver->session), header->tweek_seed, COMPACT_TAG_SEED_BIT, scratch);
+  STATS_STOP(&(receiver->session), threefish);
+  diff = 0;
+  for (i = 0; i < 4; i++)
+    diff |= block[i] ^ header->body_checksum[i];
+  if (diff != 0)
+    return PPENC_ERR_BAD_BODY_CHECKSUM;
+
+  /* compute the response mac */
+  session_compute_response_mac(&(receiver->session),
+                               response_mac,
+                               header->inner_salt,
+                               dst,
+                               header->body_len,
+                               scratch,
+                               scratch + 256);
+
+  /* expect next seq_num next time */
+  STATS_INC(&(receiver->session), msgs);
+  receiver->session.seq_num += 1;
+  return PPENC_OK;
+}
+
+#if !defined(PPENC_LOW_RAM)
+uint32_t
+ppenc_sizeof_tweak_pos()
+{
+  return sizeof(PPEncTweakPos);
+}
+
+ppenc_err_t
+ppenc_receiver_read_body_begin(struct PPEncReceiver *const receiver,
+                               struct PPEncHeader *const header,
+                               PPEncTweakPos *const pos,
+                               const uint32_t chunk_blocks,
+                               const uint32_t num_chunks,
+                               uint8_t *const scratch)
+{
+  ppenc_err_t err;
+
+  if (receiver->session.version != PPENC_VERSION_DEFAULT)
+    return PPENC_ERR_BAD_VERSION;
+
+  err = receiver_body_key(receiver, header, scratch);
+  if (err != PPENC_OK)
+    return err;
+
+#if defined(PPENC_64BIT)
+  ppenc_threefish512_tweak_seek_64bit(pos, header->tweek_seed, chunk_blocks, num_chunks);
+#else
+  ppenc_threefish512_tweak_seek(pos, header->tweek_seed, chunk_blocks, num_chunks);
+#endif
+  return PPENC_OK;
+}
+
+void
+ppenc_receiver_read_body_chunk(const struct PPEncReceiver *const receiver,
+                               const PPEncTweakPos *const pos,
+                               const uint32_t first_block,
+                               uint8_t *const dst,
+                               const uint8_t *const src,
+                               const uint32_t num_blocks,
+                               uint8_t *const scratch)
+{
+#if defined(PPENC_64BIT)
+  struct ThreeFishBuffer64 *const buf3f = (struct ThreeFishBuffer64*) (scratch + 64);
+#else
+  struct ThreeFishBuffer *const buf3f = (struct ThreeFishBuffer*) (scratch + 64);
+#endif
+
+#if defined(PPENC_KEY_SCHEDULE_CACHE) && defined(PPENC_64BIT)
+  ppenc_threefish512_decrypt_chunk_64bit(receiver->session.key_schedule, pos, first_block,
+                                         dst, src, num_blocks, buf3f, scratch);
+#elif defined(PPENC_KEY_SCHEDULE_CACHE)
+  ppenc_threefish512_decrypt_chunk(receiver->session.key_schedule, pos, first_block,
+                                   dst, src, num_blocks, buf3f, scratch);
+#elif defined(PPENC_64BIT)
+  ppenc_threefish512_key_schedule_64bit(buf3f->subkeys, receiver->session.body_key, buf3f->keys);
+  ppenc_threefish512_decrypt_chunk_64bit(buf3f->subkeys, pos, first_block,
+                                         dst, src, num_blocks, buf3f, scratch);
+#else
+  ppenc_threefish512_key_schedule(buf3f->subkeys, receiver->session.body_key, buf3f->keys);
+  ppenc_threefish512_decrypt_chunk(buf3f->subkeys, pos, first_block,
+                                   dst, src, num_blocks, buf3f, scratch);
+#endif
+}
+
+ppenc_err_t
+ppenc_receiver_read_body_end(struct PPEncReceiver *const receiver,
+                             struct PPEncHeader *const header,
+                             uint8_t *const body,
+                             uint8_t *const response_mac,
+                             uint8_t *const scratch)
+{
+  return receiver_body_check(receiver, header, body, response_mac, scratch);
+}
+#endif
+
+/* validates the header's body fields and steps the session to *
+ * its body key                                                */
+static ppenc_err_t
+receiver_body_key(struct PPEncReceiver *const receiver,
+                  struct PPEncHeader *const header,
+                  uint8_t *const scratch)
+{
+  if (header->body_len > receiver->max_body_len)
+    return PPENC_ERR_BODY_TOO_LONG;
 
   /* body key num may not be in the past */
   if (header->body_key_num < receiver->session.body_key_num)
     return PPENC_ERR_BAD_BODY_KEY_NUM;
 
+#if defined(PPENC_INSTRUMENT)
+  receiver->session.stats.body_key_steps_last = header->body_key_num - receiver->session.body_key_num;
+  receiver->session.stats.body_key_steps += receiver->session.stats.body_key_steps_last;
+  if (receiver->session.stats.body_key_steps_last > receiver->session.stats.body_key_steps_max)
+    receiver->session.stats.body_key_steps_max = receiver->session.stats.body_key_steps_last;
+#endif
+
   /* advance to appropriate body key */
   while(receiver->session.body_key_num < header->body_key_num)
-    session_body_key_next(&(receiver->session), buf1400);
+    session_body_key_next(&(receiver->session), scratch);
 
-  /* decrypt the body */
-#if defined(PPENC_64BIT)
-  ppenc_threefish512_decrypt_64bit(receiver->session.body_key,
-                                   header->tweek_seed,
-                                   body,
-                                   body_len_padded / 64,
-                                   (struct ThreeFishBuffer64*) (buf1400 + 64),
-                                   buf1400);
-#else
-  ppenc_threefish512_decrypt(receiver->session.body_key,
-                             header->tweek_seed,
-                             body,
-                             body_len_padded / 64,
-                             (struct ThreeFishBuffer*) (buf1400 + 64),
-                             buf1400);
-#endif
+  return PPENC_OK;
+}
+
+/* checks the decrypted body and finishes the message */
+static ppenc_err_t
+receiver_body_check(struct PPEncReceiver *const receiver,
+                    struct PPEncHeader *const header,
+                    uint8_t *const body,
+                    uint8_t *const response_mac,
+                    uint8_t *const scratch)
+{
+  uint32_t body_len_padded;
+  uint16_t i;
+  uint8_t body_checksum[8];
+  STATS_CLOCK
+
+  body_len_padded = ppenc_body_padded_len(header->body_len);
 
   /* check the body checksum is correct */
-  compute_body_checksum(body_checksum, body, body_len_padded);
+  STATS_START();
+  if (body_len_padded == 64)
+    compute_block_checksum(body_checksum, body);
+  else
+    compute_body_checksum(body_checksum, body, body, body_len_padded, body_len_padded);
+  STATS_STOP(&(receiver->session), checksum);
   for (i = 0; i < 8; i++)
     if (body_checksum[i] != header->body_checksum[i])
       return PPENC_ERR_BAD_BODY_CHECKSUM;
@@ -278,15 +1372,15 @@ ppenc_receiver_read_body(struct PPEncReceiver *const receiver,
                                header->inner_salt,
                                body,
                                header->body_len,
-                               buf1400,
-                               buf1400 + 256);
+                               scratch,
+                               scratch + 256);
 
   /* expect next seq_num next time */
+  STATS_INC(&(receiver->session), msgs);
   receiver->session.seq_num += 1;
   return PPENC_OK;
 }
 
-
 static void
 session_init(struct PPEncSession *const session,
              const uint8_t *const header_salt,
@@ -294,19 +1388,24 @@ session_init(struct PPEncSession *const session,
              const uint8_t *const header_rng_nonce,
              const uint8_t *const body_salt,
              const uint8_t *const body_state0,
-             uint8_t *const buf1400)
+             uint8_t *const scratch)
 {
   uint16_t i;
 
+#if defined(PPENC_INSTRUMENT)
+  for (i = 0; i < sizeof(struct PPEncStats); i++)
+    ((uint8_t*) &(session->stats))[i] = 0;
+#endif
+
   /* compute sha256(header_salt + header_state_init) */
   for (i = 0; i < 16; i++)
-    buf1400[i + 32] = header_salt[i];
+    scratch[i + 32] = header_salt[i];
   for (; i < 48; i++)
-    buf1400[i + 32] = header_state_init[i - 16];
-  ppenc_sha256_len48(buf1400, buf1400 + 32, (uint32_t*) (buf1400 + 96));
+    scratch[i + 32] = header_state_init[i - 16];
+  ppenc_sha256_len48(scratch, scratch + 32, (uint32_t*) (scratch + 96));
 
   /* init header_key_rng */
-  ppenc_chacha20_init(&(session->header_key_rng), buf1400, header_rng_nonce);
+  ppenc_chacha20_init(&(session->header_key_rng), scratch, header_rng_nonce);
 
   /* body key */
   for(i = 0; i < 32; i++)
@@ -315,10 +1414,11 @@ session_init(struct PPEncSession *const session,
     session->body_key_salt[i] = body_salt[i];
 
   session->body_key_num = 0;
-  session_body_key_next(session, buf1400);
+  session_body_key_next(session, scratch);
   /* body_key_num is now 1 */
 
   session->seq_num = 1;
+  session->version = PPENC_VERSION_DEFAULT;
 }
 
 static void
@@ -326,7 +1426,9 @@ session_body_key_next(struct PPEncSession *const session,
                       uint8_t *const buf320)
 {
   uint16_t i;
-  uint8_t last_state_byte;
+  STATS_CLOCK
+
+  STATS_START();
 
   /* copy salt + state into buffer */
   for (i = 0; i < 16; i++)
@@ -336,12 +1438,20 @@ session_body_key_next(struct PPEncSession *const session,
 
   /* body_key_state[n] = sha256(salt + state[n-1] */
   ppenc_sha256_len48(session->body_key_state, buf320, (uint32_t*) (buf320 + 64));
-  last_state_byte = session->body_key_state[31];
+  session_body_key_derive(session, buf320);
 
+  session->body_key_num += 1;
+  STATS_STOP(session, body_key_next);
+}
+
+static void
+session_body_key_derive(struct PPEncSession *const session,
+                        uint8_t *const buf320)
+{
+  uint16_t i;
 
   /* compute cubehash(body_key_state[n] */
   ppenc_cubehash(buf320, session->body_key_state, 31);
-  session->body_key_state[31] = last_state_byte;
 
   /* the first 64 bytes is the key, the next 16 bytes is the response mac salt */
   for(i = 0; i < 64; i++)
@@ -349,47 +1459,292 @@ session_body_key_next(struct PPEncSession *const session,
   for(i = 0; i < 16; i++)
     session->response_mac_salt[i] = buf320[i + 64];
 
-  session->body_key_num += 1;
+#if defined(PPENC_KEY_SCHEDULE_CACHE) && defined(PPENC_64BIT)
+  ppenc_threefish512_key_schedule_64bit(session->key_schedule,
+                                        session->body_key,
+                                        (uint64_t*) buf320);
+#elif defined(PPENC_KEY_SCHEDULE_CACHE)
+  ppenc_threefish512_key_schedule(session->key_schedule,
+                                  session->body_key,
+                                  (struct ThreeFishKey*) buf320);
+#endif
+}
+
+/* snapshot layout, numbers big endian and the header key and nonce *
+ * as the bytes ppenc_chacha20_init read them from                  *
+ *     0  PPENC_SNAPSHOT_FORMAT   1                                 *
+ *     1  version                 1                                 *
+ *     2  body_key_num            2                                 *
+ *     4  seq_num                 4                                 *
+ *     8  max_body_len            4  (receiver)                     *
+ *    12  oversize_headers        4  (receiver)                     *
+ *    16  body_key_salt          16                                 *
+ *    32  body_key_state         32                                 *
+ *    64  header_key_rng key     32                                 *
+ *    96  header_key_rng nonce   12                                 *
+ *   108  header_key_rng counter  4                                 *
+ *   112  header_key_rng pos      1                                 */
+static void
+session_snapshot(const struct PPEncSession *const session,
+                 uint8_t *const snapshot)
+{
+  uint16_t i;
+
+  snapshot[1] = session->version;
+  write_be16(snapshot + 2, session->body_key_num);
+  write_be32(snapshot + 4, session->seq_num);
+  for (i = 0; i < 16; i++)
+    snapshot[i + 16] = session->body_key_salt[i];
+  for (i = 0; i < 32; i++)
+    snapshot[i + 32] = session->body_key_state[i];
+  for (i = 0; i < 32; i++)
+    snapshot[i + 64] = ((const uint8_t*) session->header_key_rng.key)[i];
+  for (i = 0; i < 12; i++)
+    snapshot[i + 96] = ((const uint8_t*) session->header_key_rng.nonce)[i];
+  write_be32(snapshot + 108, session->header_key_rng.counter);
+  snapshot[112] = session->header_key_rng.pos;
+}
+
+static ppenc_err_t
+session_restore(struct PPEncSession *const session,
+                const uint8_t *const snapshot,
+                uint8_t *const scratch)
+{
+  uint16_t i;
+
+  if (ppenc_header_len(snapshot[1]) == 0 || snapshot[112] > 2)
+    return PPENC_ERR_BAD_SNAPSHOT;
+
+#if defined(PPENC_INSTRUMENT)
+  for (i = 0; i < sizeof(struct PPEncStats); i++)
+    ((uint8_t*) &(session->stats))[i] = 0;
+#endif
+
+  /* the key and nonce are copied to scratch for alignment */
+  for (i = 0; i < 44; i++)
+    scratch[i] = snapshot[i + 64];
+  ppenc_chacha20_init(&(session->header_key_rng), scratch, scratch + 32);
+  ppenc_chacha20_seek(&(session->header_key_rng),
+                      read_be32((uint8_t*) snapshot + 108),
+                      snapshot[112]);
+
+  for (i = 0; i < 16; i++)
+    session->body_key_salt[i] = snapshot[i + 16];
+  for (i = 0; i < 32; i++)
+    session->body_key_state[i] = snapshot[i + 32];
+  session_body_key_derive(session, scratch);
+
+  session->body_key_num = read_be16((uint8_t*) snapshot + 2);
+  session->seq_num = read_be32((uint8_t*) snapshot + 4);
+  session->version = snapshot[1];
+  return PPENC_OK;
 }
 
 static void
 header_scramble_and_encrypt(struct PPEncSession *const session, uint8_t *const header_buf)
 {
-  header_scramble(header_buf);
-  ppenc_chacha20_xor_header(&(session->header_key_rng), header_buf);
+  uint8_t header_len;
+
+  header_len = ppenc_header_len(session->version);
+  header_scramble(header_buf, header_len);
+  ppenc_chacha20_xor_header_len(&(session->header_key_rng), header_buf, header_len);
+}
+
+/* the session's body key, whichever way this build keeps it */
+static void
+session_encrypt_to(const struct PPEncSession *const session,
+                   const uint8_t *const tweak_seed,
+                   uint8_t *const dst,
+                   const uint8_t *const src,
+                   const uint32_t src_len,
+                   const uint32_t num_blocks,
+                   uint8_t *const scratch)
+{
+#if defined(PPENC_KEY_SCHEDULE_CACHE) && defined(PPENC_64BIT)
+  ppenc_threefish512_encrypt_scheduled_64bit(session->key_schedule,
+                                             tweak_seed,
+                                             dst,
+                                             src,
+                                             src_len,
+                                             num_blocks,
+                                             (struct ThreeFishBuffer64*) (scratch + 64),
+                                             scratch);
+#elif defined(PPENC_KEY_SCHEDULE_CACHE)
+  ppenc_threefish512_encrypt_scheduled(session->key_schedule,
+                                       tweak_seed,
+                                       dst,
+                                       src,
+                                       src_len,
+                                       num_blocks,
+                                       (struct ThreeFishBuffer*) (scratch + 64),
+                                       scratch);
+#elif defined(PPENC_64BIT)
+  ppenc_threefish512_encrypt_to_64bit(session->body_key,
+                                      tweak_seed,
+                                      dst,
+                                      src,
+                                      src_len,
+                                      num_blocks,
+                                      (struct ThreeFishBuffer64*) (scratch + 64),
+                                      scratch);
+#else
+  ppenc_threefish512_encrypt_to(session->body_key,
+                                tweak_seed,
+                                dst,
+                                src,
+                                src_len,
+                                num_blocks,
+                                (struct ThreeFishBuffer*) (scratch + 64),
+                                scratch);
+#endif
+}
+
+static void
+session_decrypt_to(const struct PPEncSession *const session,
+                   const uint8_t *const tweak_seed,
+                   uint8_t *const dst,
+                   const uint8_t *const src,
+                   const uint32_t num_blocks,
+                   uint8_t *const scratch)
+{
+#if defined(PPENC_KEY_SCHEDULE_CACHE) && defined(PPENC_64BIT)
+  ppenc_threefish512_decrypt_scheduled_64bit(session->key_schedule,
+                                             tweak_seed,
+                                             dst,
+                                             src,
+                                             num_blocks,
+                                             (struct ThreeFishBuffer64*) (scratch + 64),
+                                             scratch);
+#elif defined(PPENC_KEY_SCHEDULE_CACHE)
+  ppenc_threefish512_decrypt_scheduled(session->key_schedule,
+                                       tweak_seed,
+                                       dst,
+                                       src,
+                                       num_blocks,
+                                       (struct ThreeFishBuffer*) (scratch + 64),
+                                       scratch);
+#elif defined(PPENC_64BIT)
+  ppenc_threefish512_decrypt_to_64bit(session->body_key,
+                                      tweak_seed,
+                                      dst,
+                                      src,
+                                      num_blocks,
+                                      (struct ThreeFishBuffer64*) (scratch + 64),
+                                      scratch);
+#else
+  ppenc_threefish512_decrypt_to(session->body_key,
+                                tweak_seed,
+                                dst,
+                                src,
+                                num_blocks,
+                                (struct ThreeFishBuffer*) (scratch + 64),
+                                scratch);
+#endif
 }
 
+/* encrypts the block at scratch + PPENC_SCRATCH_THREEFISH in *
+ * place under tweak_seed with seed_bit flipped               */
+static void
+session_compact_block(const struct PPEncSession *const session,
+                      const uint8_t *const tweak_seed,
+                      const uint8_t seed_bit,
+                      uint8_t *const scratch)
+{
+  uint8_t seed[8], i;
+
+  for (i = 0; i < 8; i++)
+    seed[i] = tweak_seed[i];
+  seed[0] ^= seed_bit;
+
+  session_encrypt_to(session,
+                     seed,
+                     scratch + PPENC_SCRATCH_THREEFISH,
+                     scratch + PPENC_SCRATCH_THREEFISH,
+                     64,
+                     1,
+                     scratch);
+}
+
+/* the tag block: the tail (the body after its whole blocks, the *
+ * first body_len bytes from body, the rest from padded) then    *
+ * zeros. The caller puts the whole blocks' checksum at 56       */
+static void
+compact_tag_block(uint8_t *const block,
+                  const uint8_t *const body,
+                  const uint8_t *const padded,
+                  const uint32_t body_len,
+                  const uint32_t body_wire_len)
+{
+  uint32_t full_len, i;
+
+  full_len = body_wire_len & ~((uint32_t) 63);
+  for (i = 0; i < 64; i++)
+    block[i] = 0;
+  for (i = full_len; i < body_wire_len; i++)
+    block[i - full_len] = i < body_len ? body[i] : padded[i];
+}
+
+/* the first body_len bytes are read from body, *
+ * the rest up to body_padded_len from padded    */
 static void
 compute_body_checksum(uint8_t *const body_checksum,
                       const uint8_t *const body,
+                      const uint8_t *const padded,
+                      const uint32_t body_len,
                       const uint32_t body_padded_len)
 {
   uint32_t i;
-  for (i = 0; i < body_padded_len && i < 8; i++)
-    body_checksum[i] = body[i];
+  for (i = 0; i < 8; i++)
+    body_checksum[i] = 0;
+
+  /* 8 bytes at a time, each byte has its own lane */
+  for (i = 0; i + 8 <= body_len; i += 8) {
+    body_checksum[0] ^= body[i];
+    body_checksum[1] ^= body[i + 1];
+    body_checksum[2] ^= body[i + 2];
+    body_checksum[3] ^= body[i + 3];
+    body_checksum[4] ^= body[i + 4];
+    body_checksum[5] ^= body[i + 5];
+    body_checksum[6] ^= body[i + 6];
+    body_checksum[7] ^= body[i + 7];
+  }
 
-  for(; i < body_padded_len; i++)
+  for (; i < body_len; i++)
     body_checksum[i % 8] ^= body[i];
+
+  for(; i < body_padded_len; i++)
+    body_checksum[i % 8] ^= padded[i];
+}
+
+static INLINE void
+compute_block_checksum(uint8_t *const body_checksum, const uint8_t *const block)
+{
+  uint8_t i;
+
+  for (i = 0; i < 8; i++)
+    body_checksum[i] = block[i] ^ block[i + 8] ^ block[i + 16] ^ block[i + 24]
+      ^ block[i + 32] ^ block[i + 40] ^ block[i + 48] ^ block[i + 56];
 }
 
 static void
 session_compute_response_mac(struct PPEncSession *const session,
                              uint8_t *const response_mac,
-                             uint8_t *const inner_salt,
-                             uint8_t *const body,
+                             const uint8_t *const inner_salt,
+                             const uint8_t *const body,
                              const uint32_t body_len,
                              uint8_t *const buf256,
                              uint8_t *const buf64)
 {
   uint16_t i;
+  STATS_CLOCK
 
-  /* XOR first 6 bytes of body with inner_salt *
-   * the purpose of doing this is to generate a *
-   * unique value if body and response_mac are the same */
-  for (i = 0; i < 6 && i < body_len; i++)
-    body[i] ^= inner_salt[i];
+  STATS_START();
 
-  ppenc_cubehash(buf256, body, body_len);
+  /* the first 6 bytes of body are XORed with inner_salt as *
+   * they are hashed, the purpose of doing this is to       *
+   * generate a unique value if body and response_mac are   *
+   * the same                                               */
+  ppenc_cubehash_salted(buf256, body, body_len, inner_salt, 6);
 
   for(i = 0; i < 16; i++)
     buf64[i] = session->response_mac_salt[i];
@@ -398,9 +1753,7 @@ session_compute_response_mac(struct PPEncSession *const session,
 
   ppenc_sha256_len48(response_mac, buf64, (uint32_t*) buf256);
 
-  /* undo the XOR body with inner salt */
-  for (i = 0; i < 6 && i < body_len; i++)
-    body[i] ^= inner_salt[i];
+  STATS_STOP(session, response_mac);
 }
 
 static void
@@ -428,20 +1781,21 @@ write_be16(uint8_t *const dst, const uint16_t val)
 }
 
 STATIC INLINE void
-header_scramble(uint8_t *const header)
+header_scramble(uint8_t *const header, const uint8_t len)
 {
   uint32_t *header32, scramble_const;
   uint16_t* header16;
-  uint8_t i;
+  uint8_t i, words;
 
   header32 = (uint32_t*) header;
   header16 = (uint16_t*) header;
+  words = len / 2;
   scramble_const = 0;
 
-  for (i = 0; i < 8; i++)
+  for (i = 0; i < len / 4; i++)
     scramble_const ^= header32[i];
 
-  for (i = 0; i < 8; i++) {
+  for (i = 0; i < len / 4; i++) {
     uint8_t odd, even, j;
 
     even = (scramble_const >> (i * 4)) & 0x0f;
@@ -451,34 +1805,38 @@ header_scramble(uint8_t *const header)
     } else {
       odd = (~even) & 0x0f;
     }
+    /* both stay in the header and keep their parity */
+    even %= words;
+    odd %= words;
 
     /* swap the 16 bit values */
     j = i * 2;
     if (j == even)
-      even = (even + 8) % 16;
+      even = (even + words / 2) % words;
     header16[j] ^= header16[even]; header16[even] ^= header16[j]; header16[j] ^= header16[even];
     j = j + 1;
     if (j == odd)
-      odd = (odd + 8) % 16;
+      odd = (odd + words / 2) % words;
     header16[j] ^= header16[odd]; header16[odd] ^= header16[j]; header16[j] ^= header16[odd];
   }
 }
 
 STATIC INLINE void
-header_scramble_inverse(uint8_t *const header)
+header_scramble_inverse(uint8_t *const header, const uint8_t len)
 {
   uint32_t *header32, scramble_const;
   uint16_t* header16;
-  uint8_t i;
+  uint8_t i, words;
 
   header32 = (uint32_t*) header;
   header16 = (uint16_t*) header;
+  words = len / 2;
   scramble_const = 0;
 
-  for (i = 0; i < 8; i++)
+  for (i = 0; i < len / 4; i++)
     scramble_const ^= header32[i];
 
-  for (i = 8; i > 0; i--) {
+  for (i = len / 4; i > 0; i--) {
     uint8_t odd, even, j;
 
     even = (scramble_const >> ((i - 1) * 4)) & 0x0f;
@@ -488,15 +1846,18 @@ header_scramble_inverse(uint8_t *const header)
     } else {
       odd = (~even) & 0x0f;
     }
+    /* both stay in the header and keep their parity */
+    even %= words;
+    odd %= words;
 
     /* swap the 16 bit values */
     j = (i - 1) * 2;
     if (j == even)
-      even = (even + 8) % 16;
+      even = (even + words / 2) % words;
     header16[j] ^= header16[even]; header16[even] ^= header16[j]; header16[j] ^= header16[even];
     j = j + 1;
     if (j == odd)
-      odd = (odd + 8) % 16;
+      odd = (odd + words / 2) % words;
     header16[j] ^= header16[odd]; header16[odd] ^= header16[j]; header16[j] ^= header16[odd];
   }
 }
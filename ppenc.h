@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "cprng.h"
+#include "blockcipher.h"
 
 /* errors */
 #define ppenc_err_t uint16_t
@@ -12,29 +13,211 @@
 #define PPENC_ERR_BAD_SEQ_NUM 2
 #define PPENC_ERR_BAD_BODY_CHECKSUM 3
 #define PPENC_ERR_BAD_BODY_KEY_NUM 4
+#define PPENC_ERR_BODY_TOO_LONG 5
+#define PPENC_ERR_WINDOW_FULL 6
+#define PPENC_ERR_UNKNOWN_RESPONSE_MAC 7
+#define PPENC_ERR_BATCH_FULL 8
+#define PPENC_ERR_BAD_RECORD 9
+#define PPENC_ERR_BAD_SNAPSHOT 10
 
+/* the longest body a message may carry, headers claiming more *
+ * are rejected before anything is allocated for the body      */
+#if !defined(PPENC_MAX_BODY_LEN)
+#define PPENC_MAX_BODY_LEN 16777216UL
+#endif
+
+/* wire format versions, both ends of a session must use the same *
+ * one (set before the first message, 0 unless set)               *
+ *   0  32 byte header, bodies padded to whole 64 byte blocks     *
+ *   1  compact: 24 byte header, bodies padded to 8 bytes, the    *
+ *      last partial block is xored with a Threefish keystream    *
+ *      block and covered by a 4 byte Threefish tag instead of    *
+ *      the 8 byte checksum. Bodies are at most 65535 bytes       */
+#define PPENC_VERSION_DEFAULT 0
+#define PPENC_VERSION_COMPACT 1
+#define PPENC_COMPACT_MAX_BODY_LEN 65535UL
+
+/* instrumentation (off unless PPENC_INSTRUMENT is defined)          *
+ * each stage counts its calls and the ticks spent in it, ticks are  *
+ * read with PPENC_CLOCK() which may be defined to read a cycle      *
+ * counter / timer register. Defining PPENC_INSTRUMENT_CLOCK instead *
+ * uses a ppenc_instrument_clock() function provided by the caller.  *
+ * Without either only calls are counted.                            */
+#if defined(PPENC_INSTRUMENT)
 
+#if !defined(PPENC_CLOCK_T)
+#define PPENC_CLOCK_T uint32_t
+#endif
+
+#if defined(PPENC_INSTRUMENT_CLOCK)
+PPENC_CLOCK_T ppenc_instrument_clock(void);
+#define PPENC_CLOCK() ppenc_instrument_clock()
+#elif !defined(PPENC_CLOCK)
+#define PPENC_CLOCK() 0
+#endif
+
+struct PPEncStage {
+  uint32_t calls;
+  PPENC_CLOCK_T ticks;
+};
+
+struct PPEncStats {
+  struct PPEncStage header;        /* header scramble + chacha20 */
+  struct PPEncStage body_key_next; /* body key ratchet */
+  struct PPEncStage threefish;
+  struct PPEncStage checksum;
+  struct PPEncStage response_mac;  /* cubehash + sha256 */
+  struct PPEncStage sender_rng;    /* inner salt, padding, tweek seed */
+  uint32_t msgs;
+  /* body key steps taken by ppenc_receiver_read_body */
+  uint32_t body_key_steps;
+  uint32_t body_key_steps_last;
+  uint32_t body_key_steps_max;
+};
+#endif
+
+/* key schedule cache (off unless PPENC_KEY_SCHEDULE_CACHE is *
+ * defined). The session keeps the Threefish subkeys of the   *
+ * current body key (19 x 64 bytes) so a message only applies *
+ * its tweaks instead of rebuilding the whole key schedule    */
 struct PPEncSession {
   uint8_t body_key_salt[16];
   uint8_t body_key_state[32];
   uint8_t body_key[64];
   uint16_t body_key_num;
+  uint8_t version;
+#if defined(PPENC_KEY_SCHEDULE_CACHE) && defined(PPENC_64BIT)
+  struct ThreeFishSubKeys64 key_schedule[19];
+#elif defined(PPENC_KEY_SCHEDULE_CACHE)
+  struct ThreeFishSubKeys key_schedule[19];
+#endif
   uint8_t response_mac_salt[16];
   struct PPEncChaCha20 header_key_rng;
   uint32_t seq_num;
+#if defined(PPENC_INSTRUMENT)
+  struct PPEncStats stats;
+#endif
+};
+
+#if defined(PPENC_64BIT)
+typedef struct ThreeFishTweakPos64 PPEncTweakPos;
+#elif !defined(PPENC_LOW_RAM)
+typedef struct ThreeFishTweakPos PPEncTweakPos;
+#endif
+
+/* the body independent parts of the next message, filled in *
+ * by ppenc_sender_prepare and used up by the next new_msg   */
+struct PPEncSenderPrepared {
+  uint8_t inner_salt[6];
+  uint8_t tweak_seed[8];
+  uint8_t ready;
+#if !defined(PPENC_LOW_RAM)
+  PPEncTweakPos tweak_pos;
+#endif
 };
 
 struct PPEncSender {
   struct PPEncSession session;
   struct PPEncChaCha8 *sender_rng;
+  struct PPEncSenderPrepared prepared;
+};
+
+/* response macs of the messages a sender has in flight, oldest *
+ * first. Acks may match any of them, messages never acked are  *
+ * dropped by ppenc_window_expire. sent_at and now are in the   *
+ * caller's time unit and may wrap                              */
+#if !defined(PPENC_WINDOW_LEN)
+#define PPENC_WINDOW_LEN 16
+#endif
+
+struct PPEncWindowEntry {
+  uint8_t response_mac[32];
+  uint32_t seq_num;
+  uint32_t sent_at;
+  uint8_t acked;
+};
+
+struct PPEncWindow {
+  struct PPEncWindowEntry entries[PPENC_WINDOW_LEN];
+  uint16_t head;
+  uint16_t len;
+};
+
+/* records batched into one message body, each prefixed by its *
+ * 16 bit big endian length. The batch is due for a flush once *
+ * flush_len bytes are batched or max_delay after its first    *
+ * record (in the caller's time unit, may wrap)                */
+#define PPENC_RECORD_PREFIX_LEN 2
+
+struct PPEncBatch {
+  uint8_t *body;        /* max_len + 71 bytes, the caller's */
+  uint32_t max_len;
+  uint32_t flush_len;
+  uint32_t max_delay;
+  uint32_t first_at;
+  uint32_t len;
+  uint16_t num_records;
 };
 
 struct PPEncReceiver {
   struct PPEncSession session;
+  uint32_t max_body_len;      /* <= PPENC_MAX_BODY_LEN */
+  uint32_t oversize_headers;  /* headers rejected for max_body_len */
+};
+
+/* receiving over datagrams: messages may arrive out of order, twice *
+ * or not at all. Headers are tried against the cached keystreams    *
+ * of the PPENC_DGRAM_WINDOW_LEN seq_nums from base on and each      *
+ * seq_num is read once. A message read more than half the window    *
+ * past base moves base up behind it, giving up on the messages it   *
+ * passes (counted in lost). A power of two from 2 to 32, seen is   *
+ * a 32 bit map and keystream slots must survive the seq_num wrap    */
+#if !defined(PPENC_DGRAM_WINDOW_LEN)
+#define PPENC_DGRAM_WINDOW_LEN 32
+#endif
+#if PPENC_DGRAM_WINDOW_LEN < 2 || PPENC_DGRAM_WINDOW_LEN > 32 \
+    || (PPENC_DGRAM_WINDOW_LEN & (PPENC_DGRAM_WINDOW_LEN - 1)) != 0
+#error "PPENC_DGRAM_WINDOW_LEN must be a power of two from 2 to 32"
+#endif
+
+struct PPEncDgramWindow {
+  uint8_t keystream[PPENC_DGRAM_WINDOW_LEN][32];  /* seq_num % LEN */
+  uint32_t base;
+  uint32_t seen;  /* bit i: base + i has been read */
+  uint32_t lost;
 };
 
+/* a receiver saved in PPENC_SNAPSHOT_LEN bytes, laid out the same *
+ * in every build, to pick its session up again elsewhere (e.g. in *
+ * a restarted server) without a new handshake. Snapshots hold the *
+ * session's key material and need the same care as the keys       */
+#define PPENC_SNAPSHOT_FORMAT 1
+#define PPENC_SNAPSHOT_LEN 113
+
 typedef struct PPEncChaCha8 PPEncSenderRng;
 
+#if defined(PPENC_64BIT)
+typedef struct ThreeFishBuffer64 PPEncThreeFishBuffer;
+#else
+typedef struct ThreeFishBuffer PPEncThreeFishBuffer;
+#endif
+
+/* scratch: the bytes each scratch argument needs in this build, *
+ * it must be aligned for a uint64_t and can be shared between   *
+ * sessions (but not between concurrent calls)                   *
+ *   INIT      sender/receiver init (sha256 + first body key)    *
+ *   HASH      new body keys, response macs, read_body_begin/end *
+ *   THREEFISH 64 bytes + the Threefish buffer, read_body_chunk  *
+ *   MSG       new_msg(_to), read_body(_to), with a block after  *
+ *             the Threefish buffer for the compact tail         *
+ *   SIZE      enough for every function                         */
+#define PPENC_SCRATCH_MAX_(a, b) ((a) > (b) ? (a) : (b))
+#define PPENC_SCRATCH_INIT 352
+#define PPENC_SCRATCH_HASH 320
+#define PPENC_SCRATCH_THREEFISH (64 + sizeof(PPEncThreeFishBuffer))
+#define PPENC_SCRATCH_MSG PPENC_SCRATCH_MAX_(PPENC_SCRATCH_HASH, PPENC_SCRATCH_THREEFISH + 64)
+#define PPENC_SCRATCH_SIZE PPENC_SCRATCH_MAX_(PPENC_SCRATCH_INIT, PPENC_SCRATCH_MSG)
+
 struct PPEncHeader {
   uint32_t seq_num;
   uint32_t body_len;
@@ -42,10 +225,33 @@ struct PPEncHeader {
   uint8_t* inner_salt;
   uint8_t* tweek_seed;
   uint8_t* body_checksum;
+  uint8_t version;
 };
 
+/* the PPENC_SCRATCH_ sizes for callers that can't see the build's defines */
+uint32_t ppenc_scratch_size();
+uint32_t ppenc_scratch_size_init();
+uint32_t ppenc_scratch_size_hash();
+uint32_t ppenc_scratch_size_threefish();
+uint32_t ppenc_scratch_size_msg();
+
+/* likewise PPENC_WINDOW_LEN and PPENC_DGRAM_WINDOW_LEN */
+uint32_t ppenc_window_len();
+uint32_t ppenc_dgram_window_len();
+
 uint32_t ppenc_sizeof_sender();
 
+/* PPENC_ERR_BAD_VERSION (and no change) for unknown versions */
+ppenc_err_t ppenc_sender_set_version(struct PPEncSender *const sender, const uint8_t version);
+
+/* bytes of header on the wire, 0 for unknown versions */
+uint8_t ppenc_header_len(const uint8_t version);
+
+/* bytes of body on the wire, 0 if body_len is over the version's *
+ * maximum. The body buffers passed to new_msg need room for      *
+ * ppenc_body_padded_len() bytes whatever the version             */
+uint32_t ppenc_body_wire_len(const uint8_t version, const uint32_t body_len);
+
 void
 ppenc_sender_rng_nbytes(PPEncSenderRng *const sender_rng,
                         uint8_t *const buf,
@@ -59,7 +265,7 @@ ppenc_sender_init(struct PPEncSender *const sender,
                   const uint8_t *const header_rng_nonce,
                   const uint8_t *const body_salt,
                   const uint8_t *const body_state0,
-                  uint8_t *const buf1400);
+                  uint8_t *const scratch);
 
 void ppenc_sender_rng_init(PPEncSenderRng *const rng,
                            const uint8_t *const key,
@@ -67,15 +273,117 @@ void ppenc_sender_rng_init(PPEncSenderRng *const rng,
 
 uint32_t ppenc_sizeof_sender_rng();
 
+/* returns the padded body length, or 0 (and sends nothing) if *
+ * body_len is over PPENC_MAX_BODY_LEN. header_buf receives    *
+ * ppenc_header_len(version) bytes                             */
 uint32_t ppenc_sender_new_msg(struct PPEncSender *const sender,
                               uint8_t *const header_buf,
                               uint8_t *const body,
                               const uint32_t body_len,
                               uint8_t *const response_mac,
-                              uint8_t *const buf1400);
+                              uint8_t *const scratch);
+
+/* out of place: src (body_len bytes) is only read, the padded *
+ * body is written to dst which needs ppenc_body_padded_len()  *
+ * bytes, src needs no padding slack                           */
+uint32_t ppenc_sender_new_msg_to(struct PPEncSender *const sender,
+                                 uint8_t *const header_buf,
+                                 uint8_t *const dst,
+                                 const uint8_t *const src,
+                                 const uint32_t body_len,
+                                 uint8_t *const response_mac,
+                                 uint8_t *const scratch);
+
+void ppenc_sender_new_body_key(struct PPEncSender *const sender, uint8_t *const scratch);
+
+/* does the work of the next new_msg that doesn't depend on the   *
+ * body (salt and tweak seed draws, the tweaks of the first       *
+ * block, the header keystream) so it can run while idle. new_msg *
+ * uses it up, calling prepare again before then does nothing     */
+void ppenc_sender_prepare(struct PPEncSender *const sender);
+
+void ppenc_window_init(struct PPEncWindow *const window);
+
+uint32_t ppenc_sizeof_window();
+
+/* messages sent and neither acked nor expired yet */
+uint16_t ppenc_window_outstanding(const struct PPEncWindow *const window);
+
+/* pushes that would succeed now. An ack out of order only frees *
+ * its slot once the older messages are acked or expired         */
+uint16_t ppenc_window_space(const struct PPEncWindow *const window);
+
+/* records the message the last new_msg made, PPENC_ERR_WINDOW_FULL *
+ * if there is no space (check ppenc_window_space before calling    *
+ * new_msg, the message can't be taken back)                        */
+ppenc_err_t ppenc_window_push(struct PPEncWindow *const window,
+                              const struct PPEncSender *const sender,
+                              const uint8_t *const response_mac,
+                              const uint32_t sent_at);
+
+/* matches a response mac against every outstanding message, on a *
+ * match seq_num and sent_at (either may be NULL) are filled in.  *
+ * PPENC_ERR_UNKNOWN_RESPONSE_MAC if it matches none of them      */
+ppenc_err_t ppenc_window_ack(struct PPEncWindow *const window,
+                             const uint8_t *const response_mac,
+                             uint32_t *const seq_num,
+                             uint32_t *const sent_at);
 
-void ppenc_sender_new_body_key(struct PPEncSender *const sender, uint8_t *const buf1400);
+/* drops messages sent at least timeout before now and returns how *
+ * many. seq_nums (NULL or room for PPENC_WINDOW_LEN) receives the *
+ * seq_nums dropped, oldest first                                  */
+uint16_t ppenc_window_expire(struct PPEncWindow *const window,
+                             const uint32_t now,
+                             const uint32_t timeout,
+                             uint32_t *const seq_nums);
 
+void ppenc_batch_init(struct PPEncBatch *const batch,
+                      uint8_t *const body,
+                      const uint32_t max_len,
+                      const uint32_t flush_len,
+                      const uint32_t max_delay);
+
+uint32_t ppenc_sizeof_batch();
+
+/* appends a record, PPENC_ERR_BATCH_FULL (and nothing added) if *
+ * it doesn't fit in what's left of max_len: flush and add again *
+ * (a record over max_len - 2 never fits)                        */
+ppenc_err_t ppenc_batch_add(struct PPEncBatch *const batch,
+                            const uint8_t *const record,
+                            const uint16_t record_len,
+                            const uint32_t now);
+
+/* nonzero if the batch has records and has reached flush_len or *
+ * max_delay                                                     */
+uint8_t ppenc_batch_due(const struct PPEncBatch *const batch, const uint32_t now);
+
+/* bytes and records batched so far */
+uint32_t ppenc_batch_len(const struct PPEncBatch *const batch);
+uint16_t ppenc_batch_num_records(const struct PPEncBatch *const batch);
+
+/* empties the batch without sending it */
+void ppenc_batch_clear(struct PPEncBatch *const batch);
+
+/* ppenc_sender_new_msg of the batched records, encrypting the body *
+ * in place and emptying the batch. Returns the padded body length  *
+ * like new_msg, or 0 and nothing sent for an empty batch. Send     *
+ * batch->body before adding the next record                        */
+uint32_t ppenc_batch_flush(struct PPEncBatch *const batch,
+                           struct PPEncSender *const sender,
+                           uint8_t *const header_buf,
+                           uint8_t *const response_mac,
+                           uint8_t *const scratch);
+
+/* reads the record at *pos of a decrypted body and moves *pos past *
+ * it, loop while *pos < body_len. PPENC_ERR_BAD_RECORD if its      *
+ * length runs past body_len                                        */
+ppenc_err_t ppenc_record_next(const uint8_t *const body,
+                              const uint32_t body_len,
+                              uint32_t *const pos,
+                              const uint8_t **const record,
+                              uint16_t *const record_len);
+
+/* 0 if body_len is over PPENC_MAX_BODY_LEN */
 uint32_t ppenc_body_padded_len(uint32_t body_len);
 
 void
@@ -85,10 +393,81 @@ ppenc_receiver_init(struct PPEncReceiver *const receiver,
                     const uint8_t *const header_rng_nonce,
                     const uint8_t *const body_salt,
                     const uint8_t *const body_state0,
-                    uint8_t *const buf1400);
+                    uint8_t *const scratch);
 
 uint32_t ppenc_sizeof_receiver();
 
+/* raw headers are then ppenc_header_len(version) bytes read into *
+ * a 32 byte buffer, read_header rearranges them in place         */
+ppenc_err_t ppenc_receiver_set_version(struct PPEncReceiver *const receiver, const uint8_t version);
+
+/* starts a datagram window at the receiver's next seq_num, the *
+ * receiver's own header stream is no longer used after this    */
+void ppenc_dgram_window_init(struct PPEncDgramWindow *const window,
+                             const struct PPEncReceiver *const receiver,
+                             uint8_t *const scratch);
+
+uint32_t ppenc_sizeof_dgram_window();
+
+/* messages given up on so far */
+uint32_t ppenc_dgram_window_lost(const struct PPEncDgramWindow *const window);
+
+/* the window's seen bits, saved along with a receiver snapshot */
+uint32_t ppenc_dgram_window_seen(const struct PPEncDgramWindow *const window);
+
+/* dgram_window_init for a restored receiver, given the seen and lost *
+ * saved with its snapshot so messages read before aren't read again  */
+void ppenc_dgram_window_restore(struct PPEncDgramWindow *const window,
+                                const struct PPEncReceiver *const receiver,
+                                const uint32_t seen,
+                                const uint32_t lost,
+                                uint8_t *const scratch);
+
+/* read_header for a message from any seq_num in the window not yet *
+ * read. PPENC_ERR_BAD_SEQ_NUM if it matches none of them (already  *
+ * read, given up on, too far ahead or not a header at all)         */
+ppenc_err_t ppenc_receiver_read_header_dgram(struct PPEncReceiver *const receiver,
+                                             const struct PPEncDgramWindow *const window,
+                                             struct PPEncHeader *const header,
+                                             uint8_t *const raw_header);
+
+/* read_body_to for a header from read_header_dgram, once the body *
+ * checks out its seq_num is marked read and the window moves on.  *
+ * Bodies under an older body key than one already read fail with  *
+ * PPENC_ERR_BAD_BODY_KEY_NUM, so messages reordered across a      *
+ * new_body_key are lost                                           */
+ppenc_err_t ppenc_receiver_read_body_dgram(struct PPEncReceiver *const receiver,
+                                           struct PPEncDgramWindow *const window,
+                                           struct PPEncHeader *const header,
+                                           uint8_t *const dst,
+                                           const uint8_t *const src,
+                                           uint8_t *const response_mac,
+                                           uint8_t *const scratch);
+
+/* per receiver limit on body_len, headers over it are rejected *
+ * with PPENC_ERR_BODY_TOO_LONG. Defaults to PPENC_MAX_BODY_LEN *
+ * and can only be lowered below it                             */
+void ppenc_receiver_set_max_body_len(struct PPEncReceiver *const receiver,
+                                     const uint32_t max_body_len);
+
+uint32_t ppenc_receiver_oversize_headers(const struct PPEncReceiver *const receiver);
+
+/* writes PPENC_SNAPSHOT_LEN bytes, taken between messages */
+void ppenc_receiver_snapshot(const struct PPEncReceiver *const receiver,
+                             uint8_t *const snapshot);
+
+/* instead of ppenc_receiver_init, the body key and its Threefish  *
+ * subkeys are derived again (scratch: INIT) and stats start over. *
+ * PPENC_ERR_BAD_SNAPSHOT if it isn't one of this format           */
+ppenc_err_t ppenc_receiver_restore(struct PPEncReceiver *const receiver,
+                                   const uint8_t *const snapshot,
+                                   uint8_t *const scratch);
+
+#if defined(PPENC_INSTRUMENT)
+const struct PPEncStats* ppenc_sender_stats(const struct PPEncSender *const sender);
+const struct PPEncStats* ppenc_receiver_stats(const struct PPEncReceiver *const receiver);
+#endif
+
 ppenc_err_t ppenc_receiver_read_header(struct PPEncReceiver *const receiver,
                                        struct PPEncHeader *const header,
                                        uint8_t *const raw_header);
@@ -97,5 +476,48 @@ ppenc_err_t ppenc_receiver_read_body(struct PPEncReceiver *const receiver,
                                      struct PPEncHeader *const header,
                                      uint8_t *const body,
                                      uint8_t *const response_mac,
-                                     uint8_t *const buf1400);
+                                     uint8_t *const scratch);
+
+/* out of place: the padded body is decrypted from src into dst, *
+ * src is only read                                              */
+ppenc_err_t ppenc_receiver_read_body_to(struct PPEncReceiver *const receiver,
+                                        struct PPEncHeader *const header,
+                                        uint8_t *const dst,
+                                        const uint8_t *const src,
+                                        uint8_t *const response_mac,
+                                        uint8_t *const scratch);
+
+#if !defined(PPENC_LOW_RAM)
+/* reading a large body on several threads. begin checks the     *
+ * header and fills pos (num_chunks entries) for chunks of       *
+ * chunk_blocks blocks. Each chunk is then decrypted with chunk, *
+ * which only reads the receiver and may run concurrently with   *
+ * other chunks given its own scratch. dst/src point at the      *
+ * chunk, first_block = chunk number * chunk_blocks. end checks  *
+ * the whole decrypted body and computes the response mac. Only  *
+ * version 0 bodies are read this way                            */
+uint32_t ppenc_sizeof_tweak_pos();
+
+ppenc_err_t ppenc_receiver_read_body_begin(struct PPEncReceiver *const receiver,
+                                           struct PPEncHeader *const header,
+                                           PPEncTweakPos *const pos,
+                                           const uint32_t chunk_blocks,
+                                           const uint32_t num_chunks,
+                                           uint8_t *const scratch);
+
+void ppenc_receiver_read_body_chunk(const struct PPEncReceiver *const receiver,
+                                    const PPEncTweakPos *const pos,
+                                    const uint32_t first_block,
+                                    uint8_t *const dst,
+                                    const uint8_t *const src,
+                                    const uint32_t num_blocks,
+                                    uint8_t *const scratch);
+
+ppenc_err_t ppenc_receiver_read_body_end(struct PPEncReceiver *const receiver,
+                                         struct PPEncHeader *const header,
+                                         uint8_t *const body,
+                                         uint8_t *const response_mac,
+                                         uint8_t *const scratch);
+#endif
+
 #endif
@@ -25,9 +25,6 @@ mod tests {
 
     extern "C" {
         fn sixty4_add_inplace(lhs: *mut u32, rhs_lower: u32, rhs_upper: u32);
-        fn sixty4_sub_inplace(lhs: *mut u32, rhs_lower: u32, rhs_upper: u32);
-        fn sixty4_rotleft_inplace(lhs: *mut u32, amount: u8);
-        fn sixty4_rotright_inplace(lhs: *mut u32, amount: u8);
 
         // PCG32
         fn pcg32_64bit(inc: u32, state: *mut u64) -> u32;
@@ -89,6 +86,92 @@ mod tests {
             buf3f: *mut u8,
             buf64: *mut u8,
         );
+
+        fn ppenc_threefish512_encrypt_to(
+            key: *const u8,
+            tweek_seed: *const u8,
+            dst: *mut u8,
+            src: *const u8,
+            src_len: u32,
+            num_blocks: u32,
+            buf3f: *mut u8,
+            buf64: *mut u8,
+        );
+
+        fn ppenc_threefish512_decrypt_to(
+            key: *const u8,
+            tweek_seed: *const u8,
+            dst: *mut u8,
+            src: *const u8,
+            num_blocks: u32,
+            buf3f: *mut u8,
+            buf64: *mut u8,
+        );
+
+        fn ppenc_threefish512_key_schedule(
+            key_schedule: *mut u8,
+            key: *const u8,
+            keys_buf: *mut u8,
+        );
+        fn ppenc_threefish512_key_schedule_64bit(
+            key_schedule: *mut u8,
+            key: *const u8,
+            keys_buf: *mut u8,
+        );
+        fn ppenc_threefish512_tweak_seek(
+            pos: *mut u8,
+            tweek_seed: *const u8,
+            chunk_blocks: u32,
+            num_chunks: u32,
+        );
+        fn ppenc_threefish512_tweak_seek_64bit(
+            pos: *mut u8,
+            tweek_seed: *const u8,
+            chunk_blocks: u32,
+            num_chunks: u32,
+        );
+        fn ppenc_threefish512_encrypt_chunk(
+            key_schedule: *const u8,
+            pos: *const u8,
+            first_block: u32,
+            dst: *mut u8,
+            src: *const u8,
+            src_len: u32,
+            num_blocks: u32,
+            buf3f: *mut u8,
+            buf64: *mut u8,
+        );
+        fn ppenc_threefish512_decrypt_chunk(
+            key_schedule: *const u8,
+            pos: *const u8,
+            first_block: u32,
+            dst: *mut u8,
+            src: *const u8,
+            num_blocks: u32,
+            buf3f: *mut u8,
+            buf64: *mut u8,
+        );
+        fn ppenc_threefish512_encrypt_chunk_64bit(
+            key_schedule: *const u8,
+            pos: *const u8,
+            first_block: u32,
+            dst: *mut u8,
+            src: *const u8,
+            src_len: u32,
+            num_blocks: u32,
+            buf3f: *mut u8,
+            buf64: *mut u8,
+        );
+        fn ppenc_threefish512_decrypt_chunk_64bit(
+            key_schedule: *const u8,
+            pos: *const u8,
+            first_block: u32,
+            dst: *mut u8,
+            src: *const u8,
+            num_blocks: u32,
+            buf3f: *mut u8,
+            buf64: *mut u8,
+        );
     }
     fn new64(val: &[u32; 2]) -> u64 {
         let mut ans: u64 = val[1] as u64;
@@ -200,56 +283,6 @@ mod tests {
         }
     }
 
-    #[test]
-    fn _sixty4_sub_inplace() {
-        let cases = build_cases();
-        for lhs in cases.iter() {
-            for rhs in cases.iter() {
-                let mut lhs2 = lhs.to_owned();
-
-                unsafe {
-                    sixty4_sub_inplace(lhs2.as_mut_ptr(), rhs[0], rhs[1]);
-                }
-
-                unsafe { sixty4_add_inplace(lhs2.as_mut_ptr(), rhs[0], rhs[1]) }
-
-                assert_eq!(&lhs2, lhs);
-            }
-        }
-    }
-
-    #[test]
-    fn _sixty4_rotleft_inplace() {
-        let cases = build_cases();
-
-        for lhs in cases.iter() {
-            for r in [1, 2, 30, 31] {
-                let mut lhs2 = lhs.to_owned();
-                unsafe {
-                    sixty4_rotleft_inplace(lhs2.as_mut_ptr(), r);
-                }
-
-                assert_eq!(new64(&lhs2), new64(lhs).rotate_left(r as u32));
-            }
-        }
-    }
-
-    #[test]
-    fn _sixty4_rotright_inplace() {
-        let cases = build_cases();
-
-        for lhs in cases.iter() {
-            for r in [1, 2, 30, 31] {
-                let mut lhs2 = lhs.to_owned();
-                unsafe {
-                    sixty4_rotright_inplace(lhs2.as_mut_ptr(), r);
-                }
-
-                assert_eq!(new64(&lhs2), new64(lhs).rotate_right(r as u32));
-            }
-        }
-    }
-
     #[test]
     fn pcg32_known_value() {
         let mut state: [u32; 2] = [0xfc1c7860, 0x4c0c30ef];
@@ -507,6 +540,59 @@ mod tests {
         assert_eq!(vec32_to_block(&block_32), vec64_to_block(&block_64));
     }
 
+    // words around the 32 bit carry/borrow boundaries in the block
+    // and the key, 32 bit blocks must match the 64 bit path and decrypt
+    #[test]
+    fn threefish_32_64_carry_cases() {
+        let cases = build_cases();
+
+        for i in 0..cases.len() {
+            let mut block = [0u8; 64];
+            let mut key = [0u8; 64];
+            for w in 0..8 {
+                let word = new64(&cases[(i + w) % cases.len()]).to_le_bytes();
+                block[w * 8..w * 8 + 8].copy_from_slice(&word);
+                let word = new64(&cases[(i * 7 + w) % cases.len()]).to_le_bytes();
+                key[w * 8..w * 8 + 8].copy_from_slice(&word);
+            }
+
+            let mut buf3f_32 = [0u8; 1312];
+            let mut buf3f_64 = ThreeFishBuffer64::default();
+            let mut state32 = [0xffffffffu32, 0xffffffff];
+            let mut state64 = u64::MAX;
+            unsafe {
+                threefish_buf_init(buf3f_32.as_mut_ptr(), key.as_ptr(), state32.as_mut_ptr());
+                threefish_buf_init_64bit(&mut buf3f_64, key.as_ptr(), &mut state64);
+            }
+
+            let mut block_32 = block_to_u32(&block);
+            let mut block_64 = block_to_u64(&block);
+            let mut block_alt = [0; 64];
+            unsafe {
+                threefish_encrypt_block(
+                    buf3f_32.as_ptr(),
+                    block_32.as_mut_ptr(),
+                    block_alt.as_mut_ptr(),
+                );
+                threefish_encrypt_block_64bit(
+                    &buf3f_64,
+                    block_64.as_mut_ptr(),
+                    block_alt.as_mut_ptr(),
+                );
+            }
+            assert_eq!(vec32_to_block(&block_32), vec64_to_block(&block_64));
+
+            unsafe {
+                threefish_decrypt_block(
+                    buf3f_32.as_ptr(),
+                    block_32.as_mut_ptr(),
+                    block_alt.as_mut_ptr(),
+                );
+            }
+            assert_eq!(vec32_to_block(&block_32), block);
+        }
+    }
+
     #[test]
     fn threefish_decrypt_block_known_value32() {
         let mut buf3f = [0; 1312];
@@ -725,4 +811,168 @@ mod tests {
             assert!(body_64 != data);
         }
     }
+
+    #[test]
+    fn encrypt_decrypt_to() {
+        let mut rng = FastRng::new();
+        let mut buf3f = [0; 1312];
+        let mut buf64 = [0; 64];
+
+        for num_blocks in [1, 2, 3, 15] {
+            let data = (0..num_blocks * 64).map(|_| rng.gen()).collect::<Vec<u8>>();
+            let key = rng.gen::<[u8; 64]>();
+            let tweek_seed = rng.gen::<[u8; 8]>();
+
+            // src shorter than the blocks, the tail comes from dst
+            let src_len = num_blocks * 64 - 9;
+            let mut in_place = data.clone();
+            let mut dst = vec![0u8; num_blocks * 64];
+            dst[src_len..].copy_from_slice(&data[src_len..]);
+            let mut decrypted = vec![0u8; num_blocks * 64];
+
+            unsafe {
+                ppenc_threefish512_encrypt(
+                    key.as_ptr(),
+                    tweek_seed.as_ptr(),
+                    in_place.as_mut_ptr(),
+                    num_blocks as u32,
+                    buf3f.as_mut_ptr(),
+                    buf64.as_mut_ptr(),
+                );
+
+                ppenc_threefish512_encrypt_to(
+                    key.as_ptr(),
+                    tweek_seed.as_ptr(),
+                    dst.as_mut_ptr(),
+                    data.as_ptr(),
+                    src_len as u32,
+                    num_blocks as u32,
+                    buf3f.as_mut_ptr(),
+                    buf64.as_mut_ptr(),
+                );
+                assert_eq!(dst, in_place);
+
+                ppenc_threefish512_decrypt_to(
+                    key.as_ptr(),
+                    tweek_seed.as_ptr(),
+                    decrypted.as_mut_ptr(),
+                    dst.as_ptr(),
+                    num_blocks as u32,
+                    buf3f.as_mut_ptr(),
+                    buf64.as_mut_ptr(),
+                );
+            }
+
+            assert_eq!(dst, in_place);
+            assert_eq!(decrypted, data);
+        }
+    }
+
+    #[test]
+    fn chunks_same_value() {
+        let mut rng = FastRng::new();
+        let mut buf3f = [0u64; 1312 / 8];
+        let mut buf64 = [0; 64];
+        let mut key_schedule = [0u64; 19 * 8];
+        let mut keys_buf = [0u64; 9];
+        let mut pos = [0u64; 8 * 4];
+
+        for (num_blocks, chunk_blocks) in [(1, 1), (7, 1), (7, 2), (16, 5), (16, 16)] {
+            let data = (0..num_blocks * 64).map(|_| rng.gen()).collect::<Vec<u8>>();
+            let key = rng.gen::<[u8; 64]>();
+            let tweek_seed = rng.gen::<[u8; 8]>();
+            let num_chunks = (num_blocks + chunk_blocks - 1) / chunk_blocks;
+
+            let mut whole = data.clone();
+            unsafe {
+                ppenc_threefish512_encrypt(
+                    key.as_ptr(),
+                    tweek_seed.as_ptr(),
+                    whole.as_mut_ptr(),
+                    num_blocks as u32,
+                    buf3f.as_mut_ptr() as *mut u8,
+                    buf64.as_mut_ptr(),
+                );
+            }
+
+            for bits64 in [false, true] {
+                let mut encrypted = vec![0u8; num_blocks * 64];
+                let mut decrypted = vec![0u8; num_blocks * 64];
+                unsafe {
+                    if bits64 {
+                        ppenc_threefish512_key_schedule_64bit(
+                            key_schedule.as_mut_ptr() as *mut u8,
+                            key.as_ptr(),
+                            keys_buf.as_mut_ptr() as *mut u8,
+                        );
+                        ppenc_threefish512_tweak_seek_64bit(
+                            pos.as_mut_ptr() as *mut u8,
+                            tweek_seed.as_ptr(),
+                            chunk_blocks as u32,
+                            num_chunks as u32,
+                        );
+                    } else {
+                        ppenc_threefish512_key_schedule(
+                            key_schedule.as_mut_ptr() as *mut u8,
+                            key.as_ptr(),
+                            keys_buf.as_mut_ptr() as *mut u8,
+                        );
+                        ppenc_threefish512_tweak_seek(
+                            pos.as_mut_ptr() as *mut u8,
+                            tweek_seed.as_ptr(),
+                            chunk_blocks as u32,
+                            num_chunks as u32,
+                        );
+                    }
+                }
+
+                // chunks in reverse, none depends on another having run
+                for chunk in (0..num_chunks).rev() {
+                    let first = chunk * chunk_blocks;
+                    let n = chunk_blocks.min(num_blocks - first);
+                    let range = first * 64..(first + n) * 64;
+                    let (encrypt, decrypt) = if bits64 {
+                        (
+                            ppenc_threefish512_encrypt_chunk_64bit
+                                as unsafe extern "C" fn(_, _, _, _, _, _, _, _, _),
+                            ppenc_threefish512_decrypt_chunk_64bit
+                                as unsafe extern "C" fn(_, _, _, _, _, _, _, _),
+                        )
+                    } else {
+                        (
+                            ppenc_threefish512_encrypt_chunk as _,
+                            ppenc_threefish512_decrypt_chunk as _,
+                        )
+                    };
+
+                    unsafe {
+                        encrypt(
+                            key_schedule.as_ptr() as *const u8,
+                            pos[chunk * 4..].as_ptr() as *const u8,
+                            first as u32,
+                            encrypted[range.clone()].as_mut_ptr(),
+                            data[range.clone()].as_ptr(),
+                            (n * 64) as u32,
+                            n as u32,
+                            buf3f.as_mut_ptr() as *mut u8,
+                            buf64.as_mut_ptr(),
+                        );
+                        decrypt(
+                            key_schedule.as_ptr() as *const u8,
+                            pos[chunk * 4..].as_ptr() as *const u8,
+                            first as u32,
+                            decrypted[range.clone()].as_mut_ptr(),
+                            whole[range].as_ptr(),
+                            n as u32,
+                            buf3f.as_mut_ptr() as *mut u8,
+                            buf64.as_mut_ptr(),
+                        );
+                    }
+                }
+
+                assert_eq!(encrypted, whole);
+                assert_eq!(decrypted, data);
+            }
+        }
+    }
 }
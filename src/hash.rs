@@ -5,7 +5,14 @@ mod tests {
     extern "C" {
         fn cubehash_rounds(state: *mut u32, num_rounds: u16);
         fn ppenc_sha256_len48(hash_value: *mut u8, msg: *const u8, message_schedule_buf: *mut u32);
-        //       fn ppenc_cubehash(hash_value: *mut u8, msg: *mut u8, msg_len: u32);
+        fn ppenc_cubehash(hash_value: *mut u8, msg: *const u8, msg_len: u32);
+        fn ppenc_cubehash_salted(
+            hash_value: *mut u8,
+            msg: *const u8,
+            msg_len: u32,
+            salt: *const u8,
+            salt_len: u8,
+        );
     }
 
     #[test]
@@ -57,7 +64,31 @@ mod tests {
     }
 
     #[test]
-    fn cubehash() {
-        /* TODO */
+    fn cubehash_salted() {
+        let mut rng = FastRng::new();
+        let salt = rng.gen::<[u8; 6]>();
+
+        for msg_len in [0, 1, 5, 6, 31, 32, 33, 64, 100] {
+            let msg = (0..msg_len).map(|_| rng.gen()).collect::<Vec<u8>>();
+            let mut salted = msg.clone();
+            for (b, s) in salted.iter_mut().zip(salt) {
+                *b ^= s;
+            }
+
+            let mut hash_value = [0u8; 128];
+            let mut hash_value2 = [0u8; 128];
+            unsafe {
+                ppenc_cubehash_salted(
+                    hash_value.as_mut_ptr(),
+                    msg.as_ptr(),
+                    msg_len as u32,
+                    salt.as_ptr(),
+                    6,
+                );
+                ppenc_cubehash(hash_value2.as_mut_ptr(), salted.as_ptr(), msg_len as u32);
+            }
+
+            assert_eq!(hash_value, hash_value2);
+        }
     }
 }
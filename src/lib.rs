@@ -1,3 +1,4 @@
+use std::cell::RefCell;
 use std::fmt;
 use std::result;
 
@@ -13,9 +14,12 @@ struct PPEncHeader {
     inner_salt: *const u8,
     tweek_seed: *const u8,
     body_checksum: *const u8,
+    version: u8,
 }
 
 extern "C" {
+    fn ppenc_scratch_size() -> u32;
+    fn ppenc_window_len() -> u32;
     fn ppenc_sizeof_receiver() -> u32;
     fn ppenc_receiver_init(
         receiver: *mut u8,
@@ -24,7 +28,7 @@ extern "C" {
         header_rng_nonce: *const u8,
         body_key_salt: *const u8,
         body_key_state0: *const u8,
-        buf1400: *mut u8,
+        scratch: *mut u8,
     );
     fn ppenc_receiver_read_header(
         receiver: *mut u8,
@@ -37,10 +41,194 @@ extern "C" {
         header: *const PPEncHeader,
         body: *mut u8,
         response_mac: *mut u8,
-        buf1400: *mut u8,
+        scratch: *mut u8,
     ) -> u16;
 
-    fn ppenc_body_padded_len(body_len: u32) -> u32;
+    fn ppenc_receiver_read_body_to(
+        receiver: *mut u8,
+        header: *const PPEncHeader,
+        dst: *mut u8,
+        src: *const u8,
+        response_mac: *mut u8,
+        scratch: *mut u8,
+    ) -> u16;
+
+    fn ppenc_sizeof_tweak_pos() -> u32;
+    fn ppenc_receiver_read_body_begin(
+        receiver: *mut u8,
+        header: *const PPEncHeader,
+        pos: *mut u8,
+        chunk_blocks: u32,
+        num_chunks: u32,
+        scratch: *mut u8,
+    ) -> u16;
+    fn ppenc_receiver_read_body_chunk(
+        receiver: *const u8,
+        pos: *const u8,
+        first_block: u32,
+        dst: *mut u8,
+        src: *const u8,
+        num_blocks: u32,
+        scratch: *mut u8,
+    );
+    fn ppenc_receiver_read_body_end(
+        receiver: *mut u8,
+        header: *const PPEncHeader,
+        body: *mut u8,
+        response_mac: *mut u8,
+        scratch: *mut u8,
+    ) -> u16;
+
+    fn ppenc_sizeof_dgram_window() -> u32;
+    fn ppenc_dgram_window_init(window: *mut u8, receiver: *const u8, scratch: *mut u8);
+    fn ppenc_dgram_window_lost(window: *const u8) -> u32;
+    fn ppenc_dgram_window_seen(window: *const u8) -> u32;
+    fn ppenc_dgram_window_restore(
+        window: *mut u8,
+        receiver: *const u8,
+        seen: u32,
+        lost: u32,
+        scratch: *mut u8,
+    );
+    fn ppenc_receiver_read_header_dgram(
+        receiver: *mut u8,
+        window: *const u8,
+        header: *mut PPEncHeader,
+        raw_header: *mut u8,
+    ) -> u16;
+    fn ppenc_receiver_read_body_dgram(
+        receiver: *mut u8,
+        window: *mut u8,
+        header: *const PPEncHeader,
+        dst: *mut u8,
+        src: *const u8,
+        response_mac: *mut u8,
+        scratch: *mut u8,
+    ) -> u16;
+
+    fn ppenc_receiver_set_max_body_len(receiver: *mut u8, max_body_len: u32);
+    fn ppenc_receiver_oversize_headers(receiver: *const u8) -> u32;
+    fn ppenc_receiver_snapshot(receiver: *const u8, snapshot: *mut u8);
+    fn ppenc_receiver_restore(receiver: *mut u8, snapshot: *const u8, scratch: *mut u8) -> u16;
+
+    fn ppenc_body_wire_len(version: u8, body_len: u32) -> u32;
+    fn ppenc_header_len(version: u8) -> u8;
+    fn ppenc_sender_set_version(sender: *mut u8, version: u8) -> u16;
+    fn ppenc_receiver_set_version(receiver: *mut u8, version: u8) -> u16;
+
+    fn ppenc_sizeof_sender_rng() -> u32;
+    fn ppenc_sender_rng_init(sender_rng: *mut u8, key: *const u8, nonce: *const u8);
+    fn ppenc_sender_rng_nbytes(sender_rng: *mut u8, dst: *mut u8, num_bytes: u16);
+
+    fn ppenc_sizeof_sender() -> u32;
+    fn ppenc_sender_init(
+        sender: *mut u8,
+        sender_rng: *mut u8,
+        header_salt: *const u8,
+        header_state_init: *const u8,
+        header_rng_nonce: *const u8,
+        body_salt: *const u8,
+        body_state0: *const u8,
+        scratch: *mut u8,
+    );
+    fn ppenc_sender_new_msg(
+        sender: *mut u8,
+        header_buf: *mut u8,
+        body: *mut u8,
+        body_len: u32,
+        response_mac: *mut u8,
+        scratch: *mut u8,
+    ) -> u32;
+    fn ppenc_sender_new_msg_to(
+        sender: *mut u8,
+        header_buf: *mut u8,
+        dst: *mut u8,
+        src: *const u8,
+        body_len: u32,
+        response_mac: *mut u8,
+        scratch: *mut u8,
+    ) -> u32;
+    fn ppenc_sender_new_body_key(sender: *mut u8, scratch: *mut u8);
+    fn ppenc_sender_prepare(sender: *mut u8);
+
+    fn ppenc_sizeof_batch() -> u32;
+    fn ppenc_batch_init(
+        batch: *mut u8,
+        body: *mut u8,
+        max_len: u32,
+        flush_len: u32,
+        max_delay: u32,
+    );
+    fn ppenc_batch_add(batch: *mut u8, record: *const u8, record_len: u16, now: u32) -> u16;
+    fn ppenc_batch_due(batch: *const u8, now: u32) -> u8;
+    fn ppenc_batch_len(batch: *const u8) -> u32;
+    fn ppenc_batch_num_records(batch: *const u8) -> u16;
+    fn ppenc_batch_clear(batch: *mut u8);
+    fn ppenc_record_next(
+        body: *const u8,
+        body_len: u32,
+        pos: *mut u32,
+        record: *mut *const u8,
+        record_len: *mut u16,
+    ) -> u16;
+
+    fn ppenc_sizeof_window() -> u32;
+    fn ppenc_window_init(window: *mut u8);
+    fn ppenc_window_outstanding(window: *const u8) -> u16;
+    fn ppenc_window_space(window: *const u8) -> u16;
+    fn ppenc_window_push(
+        window: *mut u8,
+        sender: *const u8,
+        response_mac: *const u8,
+        sent_at: u32,
+    ) -> u16;
+    fn ppenc_window_ack(
+        window: *mut u8,
+        response_mac: *const u8,
+        seq_num: *mut u32,
+        sent_at: *mut u32,
+    ) -> u16;
+    fn ppenc_window_expire(window: *mut u8, now: u32, timeout: u32, seq_nums: *mut u32) -> u16;
+
+    #[cfg(feature = "instrument")]
+    fn ppenc_receiver_stats(receiver: *const u8) -> *const Stats;
+}
+
+/// Calls and time (in nanoseconds) spent in one stage of the message path
+#[cfg(feature = "instrument")]
+#[repr(C)]
+#[derive(Copy, Clone, Debug, Default)]
+pub struct Stage {
+    pub calls: u32,
+    pub ns: u64,
+}
+
+/// Mirrors struct PPEncStats in ppenc.h
+#[cfg(feature = "instrument")]
+#[repr(C)]
+#[derive(Copy, Clone, Debug, Default)]
+pub struct Stats {
+    pub header: Stage,
+    pub body_key_next: Stage,
+    pub threefish: Stage,
+    pub checksum: Stage,
+    pub response_mac: Stage,
+    pub sender_rng: Stage,
+    pub msgs: u32,
+    pub body_key_steps: u32,
+    pub body_key_steps_last: u32,
+    pub body_key_steps_max: u32,
+}
+
+// PPENC_CLOCK() for the instrumented build
+#[cfg(feature = "instrument")]
+#[no_mangle]
+extern "C" fn ppenc_instrument_clock() -> u64 {
+    use std::sync::OnceLock;
+    use std::time::Instant;
+
+    static EPOCH: OnceLock<Instant> = OnceLock::new();
+    EPOCH.get_or_init(Instant::now).elapsed().as_nanos() as u64
 }
 
 #[derive(Copy, Clone, Debug)]
@@ -49,6 +237,12 @@ pub enum Error {
     BadSeqNum,
     BadBodyChecksum,
     BodyKeyInPast,
+    BodyTooLong,
+    WindowFull,
+    UnknownResponseMac,
+    BatchFull,
+    BadRecord,
+    BadSnapshot,
     Unknown(u16),
 }
 
@@ -62,6 +256,14 @@ impl fmt::Display for Error {
                 Error::BadSeqNum => "sequence number not expected - out of order".to_string(),
                 Error::BadBodyChecksum => "body checksum invalid".to_string(),
                 Error::BodyKeyInPast => "body key is in the past and may not be used".to_string(),
+                Error::BodyTooLong => "body length over the maximum".to_string(),
+                Error::WindowFull => "too many messages awaiting a response mac".to_string(),
+                Error::UnknownResponseMac => {
+                    "response mac matches no outstanding message".to_string()
+                }
+                Error::BatchFull => "record doesn't fit in the batch".to_string(),
+                Error::BadRecord => "record length runs past the body".to_string(),
+                Error::BadSnapshot => "not a receiver snapshot of this format".to_string(),
                 Error::Unknown(i) => i.to_string(),
             }
         )
@@ -70,9 +272,81 @@ impl fmt::Display for Error {
 
 pub type Result<T> = result::Result<T, Error>;
 
+/// Space after the body for padding and the cubehash padding
+pub const BODY_SLACK: usize = 71;
+const HEADER_LEN: usize = 32;
+/// 32 byte headers, bodies padded to whole 64 byte blocks
+pub const VERSION_DEFAULT: u8 = 0;
+/// 24 byte headers, bodies padded to 8 bytes and at most 65535 long
+pub const VERSION_COMPACT: u8 = 1;
+/// Bytes in a Receiver snapshot
+pub const SNAPSHOT_LEN: usize = 113;
+// Smallest share of a body worth a thread in read_body_parallel
+const PARALLEL_MIN_CHUNK_BLOCKS: usize = 1024;
+
+thread_local! {
+    // Scratch shared by every Sender and Receiver on the thread, sized
+    // for the C build and u64 backed for alignment
+    static SCRATCH: RefCell<Vec<u64>> =
+        RefCell::new(vec![0; (unsafe { ppenc_scratch_size() } as usize + 7) / 8]);
+}
+
+fn with_scratch<R>(f: impl FnOnce(*mut u8) -> R) -> R {
+    SCRATCH.with(|scratch| f(scratch.borrow_mut().as_mut_ptr() as *mut u8))
+}
+
+/// The sender's ChaCha8 rng, used for salts, padding and the header nonce
+pub struct SenderRng {
+    rng: Vec<u8>,
+}
+
+/// A message buffer: header space, the body and room for its padding.
+/// Buffers come from and go back to a Sender's pool.
+pub struct Message {
+    buf: Vec<u8>,
+    body_len: usize,
+    // shorter headers end at HEADER_LEN too, the wire starts here
+    wire_start: usize,
+    wire_len: usize,
+}
+
+pub struct Sender {
+    sender: Vec<u8>,
+    // sender points into rng's heap buffer
+    _rng: SenderRng,
+    pool: Vec<Vec<u8>>,
+    header_len: usize,
+}
+
 pub struct Receiver {
     receiver: Vec<u8>,
-    buf1400: Vec<u8>,
+    header_len: usize,
+}
+
+/// Expected response macs of the messages a Sender has in flight, so
+/// several can be sent before the first is acknowledged
+pub struct Window {
+    window: Vec<u64>,
+}
+
+/// A Receiver's window of seq_nums for messages arriving as datagrams,
+/// in any order, duplicated or not at all
+pub struct DgramWindow {
+    window: Vec<u64>,
+}
+
+/// Records batched into one message body, each with a 2 byte length
+/// prefix, so a message's fixed costs are shared between them
+pub struct Batch {
+    batch: Vec<u64>,
+    // batch points into body's heap buffer
+    body: Vec<u8>,
+}
+
+/// Iterator over the records of a body made by a Batch
+pub struct Records<'b> {
+    body: &'b [u8],
+    pos: u32,
 }
 
 pub struct Header<'h> {
@@ -82,6 +356,7 @@ pub struct Header<'h> {
     inner_salt: &'h [u8],
     body_checksum: &'h [u8],
     tweek_seed: &'h [u8],
+    version: u8,
 }
 
 impl Receiver {
@@ -92,10 +367,8 @@ impl Receiver {
         body_key_salt: &[u8; 16],
         body_key_state0: &[u8; 32],
     ) -> Self {
-        let mut receiver = Vec::new();
-        let mut buf1400 = vec![0; 1400];
-        unsafe {
-            receiver.resize(ppenc_sizeof_receiver() as usize, 0);
+        let mut receiver = vec![0; unsafe { ppenc_sizeof_receiver() as usize }];
+        with_scratch(|scratch| unsafe {
             ppenc_receiver_init(
                 receiver.as_mut_ptr(),
                 header_key_salt.as_ptr(),
@@ -103,11 +376,28 @@ impl Receiver {
                 header_rng_nonce.as_ptr(),
                 body_key_salt.as_ptr(),
                 body_key_state0.as_ptr(),
-                buf1400.as_mut_ptr(),
+                scratch,
             );
+        });
+
+        Self {
+            receiver,
+            header_len: HEADER_LEN,
         }
+    }
+
+    /// The wire format version, VERSION_DEFAULT unless set. The sender
+    /// must use the same one.
+    pub fn set_version(&mut self, version: u8) -> Result<()> {
+        check_err(unsafe { ppenc_receiver_set_version(self.receiver.as_mut_ptr(), version) })?;
+        self.header_len = unsafe { ppenc_header_len(version) as usize };
+        Ok(())
+    }
 
-        Self { receiver, buf1400 }
+    /// Bytes of header on the wire, read into the start of read_header's
+    /// raw_header
+    pub fn header_len(&self) -> usize {
+        self.header_len
     }
 
     pub fn read_header<'r, 'h: 'r>(&mut self, raw_header: &'r mut [u8; 32]) -> Result<Header<'h>> {
@@ -118,6 +408,7 @@ impl Receiver {
             inner_salt: std::ptr::null(),
             tweek_seed: std::ptr::null(),
             body_checksum: std::ptr::null(),
+            version: 0,
         };
         check_err(unsafe {
             ppenc_receiver_read_header(
@@ -127,38 +418,642 @@ impl Receiver {
             )
         })?;
 
-        let inner_salt = unsafe { std::slice::from_raw_parts(ppenc_header.inner_salt, 6) };
-        let tweek_seed = unsafe { std::slice::from_raw_parts(ppenc_header.tweek_seed, 8) };
-        let body_checksum = unsafe { std::slice::from_raw_parts(ppenc_header.body_checksum, 8) };
+        Ok(unsafe { Header::from_ppenc_header(&ppenc_header) })
+    }
 
-        Ok(Header {
-            seq_num: ppenc_header.seq_num,
-            body_len: ppenc_header.body_len,
-            body_key_num: ppenc_header.body_key_num,
-            inner_salt,
-            tweek_seed,
-            body_checksum,
-        })
+    /// read_header for a message from any seq_num in window not read yet
+    pub fn read_header_dgram<'r, 'h: 'r>(
+        &mut self,
+        window: &DgramWindow,
+        raw_header: &'r mut [u8; 32],
+    ) -> Result<Header<'h>> {
+        let mut ppenc_header = PPEncHeader {
+            seq_num: 0,
+            body_len: 0,
+            body_key_num: 0,
+            inner_salt: std::ptr::null(),
+            tweek_seed: std::ptr::null(),
+            body_checksum: std::ptr::null(),
+            version: 0,
+        };
+        check_err(unsafe {
+            ppenc_receiver_read_header_dgram(
+                self.receiver.as_mut_ptr(),
+                window.window.as_ptr() as *const u8,
+                &mut ppenc_header,
+                raw_header.as_mut_ptr(),
+            )
+        })?;
+
+        Ok(unsafe { Header::from_ppenc_header(&ppenc_header) })
+    }
+
+    /// read_body_to for a header from read_header_dgram, marking its
+    /// seq_num read in window once the body checks out
+    pub fn read_body_dgram(
+        &mut self,
+        window: &mut DgramWindow,
+        header: Header<'_>,
+        src: &[u8],
+        dst: &mut Vec<u8>,
+    ) -> Result<[u8; 32]> {
+        let body_padded_len = header.body_padded_len();
+        assert!(
+            src.len() >= body_padded_len,
+            "src shorter than the padded body"
+        );
+
+        let mut response_mac = [0u8; 32];
+        dst.clear();
+        dst.resize(body_padded_len, 0);
+        check_err(with_scratch(|scratch| unsafe {
+            ppenc_receiver_read_body_dgram(
+                self.receiver.as_mut_ptr(),
+                window.window.as_mut_ptr() as *mut u8,
+                &header.as_ppenc_header(),
+                dst.as_mut_ptr(),
+                src.as_ptr(),
+                response_mac.as_mut_ptr(),
+                scratch,
+            )
+        }))?;
+        dst.truncate(header.body_len as usize);
+        Ok(response_mac)
     }
 
     pub fn read_body(&mut self, header: Header<'_>, body: &mut Vec<u8>) -> Result<[u8; 32]> {
         // Make sure we have enough space to compute response_mac hash
         let mut response_mac = [0u8; 32];
-        check_err(unsafe {
+        check_err(with_scratch(|scratch| unsafe {
             ppenc_receiver_read_body(
                 self.receiver.as_mut_ptr(),
                 &header.as_ppenc_header(),
                 body.as_mut_ptr(),
                 response_mac.as_mut_ptr(),
-                self.buf1400.as_mut_ptr(),
+                scratch,
             )
-        })?;
+        }))?;
         body.truncate(header.body_len as usize);
         Ok(response_mac)
     }
+
+    /// Decrypt the padded body in src into dst, leaving src untouched
+    pub fn read_body_to(
+        &mut self,
+        header: Header<'_>,
+        src: &[u8],
+        dst: &mut Vec<u8>,
+    ) -> Result<[u8; 32]> {
+        let body_padded_len = header.body_padded_len();
+        assert!(
+            src.len() >= body_padded_len,
+            "src shorter than the padded body"
+        );
+
+        let mut response_mac = [0u8; 32];
+        dst.clear();
+        dst.resize(body_padded_len, 0);
+        check_err(with_scratch(|scratch| unsafe {
+            ppenc_receiver_read_body_to(
+                self.receiver.as_mut_ptr(),
+                &header.as_ppenc_header(),
+                dst.as_mut_ptr(),
+                src.as_ptr(),
+                response_mac.as_mut_ptr(),
+                scratch,
+            )
+        }))?;
+        dst.truncate(header.body_len as usize);
+        Ok(response_mac)
+    }
+
+    /// read_body_to with the decryption split over up to num_threads
+    /// threads. Bodies under a couple of chunks are read on this thread.
+    pub fn read_body_parallel(
+        &mut self,
+        header: Header<'_>,
+        src: &[u8],
+        dst: &mut Vec<u8>,
+        num_threads: usize,
+    ) -> Result<[u8; 32]> {
+        let body_padded_len = header.body_padded_len();
+        assert!(
+            src.len() >= body_padded_len,
+            "src shorter than the padded body"
+        );
+
+        let num_blocks = body_padded_len / 64;
+        let chunk_blocks = ((num_blocks + num_threads.max(1) - 1) / num_threads.max(1))
+            .max(PARALLEL_MIN_CHUNK_BLOCKS);
+        let num_chunks = (num_blocks + chunk_blocks - 1) / chunk_blocks;
+        if num_chunks < 2 {
+            return self.read_body_to(header, src, dst);
+        }
+
+        // u64 backed for the alignment of the C struct
+        let pos_len = unsafe { ppenc_sizeof_tweak_pos() as usize } / 8;
+        let mut pos = vec![0u64; num_chunks * pos_len];
+        let ppenc_header = unsafe { header.as_ppenc_header() };
+        check_err(with_scratch(|scratch| unsafe {
+            ppenc_receiver_read_body_begin(
+                self.receiver.as_mut_ptr(),
+                &ppenc_header,
+                pos.as_mut_ptr() as *mut u8,
+                chunk_blocks as u32,
+                num_chunks as u32,
+                scratch,
+            )
+        }))?;
+
+        dst.clear();
+        dst.resize(body_padded_len, 0);
+        let receiver = &self.receiver[..];
+        let chunk_len = chunk_blocks * 64;
+        std::thread::scope(|scope| {
+            let chunks = dst
+                .chunks_mut(chunk_len)
+                .zip(src[..body_padded_len].chunks(chunk_len))
+                .zip(pos.chunks(pos_len));
+            for (chunk, ((dst, src), pos)) in chunks.enumerate() {
+                scope.spawn(move || {
+                    with_scratch(|scratch| unsafe {
+                        ppenc_receiver_read_body_chunk(
+                            receiver.as_ptr(),
+                            pos.as_ptr() as *const u8,
+                            (chunk * chunk_blocks) as u32,
+                            dst.as_mut_ptr(),
+                            src.as_ptr(),
+                            (dst.len() / 64) as u32,
+                            scratch,
+                        )
+                    })
+                });
+            }
+        });
+
+        let mut response_mac = [0u8; 32];
+        check_err(with_scratch(|scratch| unsafe {
+            ppenc_receiver_read_body_end(
+                self.receiver.as_mut_ptr(),
+                &ppenc_header,
+                dst.as_mut_ptr(),
+                response_mac.as_mut_ptr(),
+                scratch,
+            )
+        }))?;
+        dst.truncate(header.body_len as usize);
+        Ok(response_mac)
+    }
+
+    /// Headers claiming a longer body fail read_header with
+    /// Error::BodyTooLong, so body buffers can be bounded by
+    /// max_body_len + BODY_SLACK. Clamped to the compiled in maximum.
+    pub fn set_max_body_len(&mut self, max_body_len: u32) {
+        unsafe { ppenc_receiver_set_max_body_len(self.receiver.as_mut_ptr(), max_body_len) }
+    }
+
+    /// Number of headers rejected for exceeding the max body length
+    pub fn oversize_headers(&self) -> u32 {
+        unsafe { ppenc_receiver_oversize_headers(self.receiver.as_ptr()) }
+    }
+
+    /// The receiver's session, to be picked up again with restore. It
+    /// holds the session's key material, keep it as secret as the keys.
+    pub fn snapshot(&self) -> [u8; SNAPSHOT_LEN] {
+        let mut snapshot = [0u8; SNAPSHOT_LEN];
+        unsafe { ppenc_receiver_snapshot(self.receiver.as_ptr(), snapshot.as_mut_ptr()) };
+        snapshot
+    }
+
+    /// A receiver carrying on from a snapshot, in this or any other build
+    pub fn restore(snapshot: &[u8; SNAPSHOT_LEN]) -> Result<Self> {
+        let mut receiver = vec![0; unsafe { ppenc_sizeof_receiver() as usize }];
+        check_err(with_scratch(|scratch| unsafe {
+            ppenc_receiver_restore(receiver.as_mut_ptr(), snapshot.as_ptr(), scratch)
+        }))?;
+
+        Ok(Self {
+            receiver,
+            header_len: unsafe { ppenc_header_len(snapshot[1]) as usize },
+        })
+    }
+
+    /// Counters for every header and body read so far
+    #[cfg(feature = "instrument")]
+    pub fn stats(&self) -> Stats {
+        unsafe { std::ptr::read_unaligned(ppenc_receiver_stats(self.receiver.as_ptr())) }
+    }
+}
+
+impl SenderRng {
+    pub fn new(key: &[u8; 32], nonce: &[u8; 8]) -> Self {
+        let mut rng = vec![0; unsafe { ppenc_sizeof_sender_rng() as usize }];
+        unsafe {
+            ppenc_sender_rng_init(rng.as_mut_ptr(), key.as_ptr(), nonce.as_ptr());
+        }
+
+        Self { rng }
+    }
+
+    pub fn fill(&mut self, dst: &mut [u8]) {
+        for chunk in dst.chunks_mut(u16::MAX as usize) {
+            unsafe {
+                ppenc_sender_rng_nbytes(
+                    self.rng.as_mut_ptr(),
+                    chunk.as_mut_ptr(),
+                    chunk.len() as u16,
+                );
+            }
+        }
+    }
+}
+
+impl Sender {
+    /// header_rng_nonce is normally drawn from rng and sent to the receiver
+    /// before it replies with header_state_init and body_key_state0
+    pub fn new(
+        mut rng: SenderRng,
+        header_key_salt: &[u8; 16],
+        header_state_init: &[u8; 32],
+        header_rng_nonce: &[u8; 12],
+        body_key_salt: &[u8; 16],
+        body_key_state0: &[u8; 32],
+    ) -> Self {
+        let mut sender = vec![0; unsafe { ppenc_sizeof_sender() as usize }];
+        with_scratch(|scratch| unsafe {
+            ppenc_sender_init(
+                sender.as_mut_ptr(),
+                rng.rng.as_mut_ptr(),
+                header_key_salt.as_ptr(),
+                header_state_init.as_ptr(),
+                header_rng_nonce.as_ptr(),
+                body_key_salt.as_ptr(),
+                body_key_state0.as_ptr(),
+                scratch,
+            );
+        });
+
+        Self {
+            sender,
+            _rng: rng,
+            pool: Vec::new(),
+            header_len: HEADER_LEN,
+        }
+    }
+
+    /// The wire format version, VERSION_DEFAULT unless set. The receiver
+    /// must use the same one.
+    pub fn set_version(&mut self, version: u8) -> Result<()> {
+        check_err(unsafe { ppenc_sender_set_version(self.sender.as_mut_ptr(), version) })?;
+        self.header_len = unsafe { ppenc_header_len(version) as usize };
+        Ok(())
+    }
+
+    /// Bytes of header at the start of each message's wire
+    pub fn header_len(&self) -> usize {
+        self.header_len
+    }
+
+    /// A zeroed message with room for body_len bytes, reusing a pooled
+    /// buffer when one is available
+    pub fn message(&mut self, body_len: usize) -> Message {
+        let mut buf = self.pool.pop().unwrap_or_default();
+        buf.clear();
+        buf.resize(HEADER_LEN + body_len + BODY_SLACK, 0);
+
+        Message {
+            buf,
+            body_len,
+            wire_start: 0,
+            wire_len: 0,
+        }
+    }
+
+    /// Encrypt body straight into a new message without modifying it,
+    /// returns the message (ready to send) and its response mac
+    pub fn new_msg_from(&mut self, body: &[u8]) -> (Message, [u8; 32]) {
+        // every byte up to the padded length is written by the encryption
+        let mut buf = self.pool.pop().unwrap_or_default();
+        buf.resize(HEADER_LEN + body.len() + BODY_SLACK, 0);
+
+        let mut response_mac = [0u8; 32];
+        let wire_start = HEADER_LEN - self.header_len;
+        let (header, dst) = buf.split_at_mut(HEADER_LEN);
+        let body_padded_len = with_scratch(|scratch| unsafe {
+            ppenc_sender_new_msg_to(
+                self.sender.as_mut_ptr(),
+                header[wire_start..].as_mut_ptr(),
+                dst.as_mut_ptr(),
+                body.as_ptr(),
+                body.len() as u32,
+                response_mac.as_mut_ptr(),
+                scratch,
+            )
+        });
+
+        assert!(body_padded_len != 0, "body over PPENC_MAX_BODY_LEN");
+        let msg = Message {
+            buf,
+            body_len: body.len(),
+            wire_start,
+            wire_len: self.header_len + body_padded_len as usize,
+        };
+        (msg, response_mac)
+    }
+
+    /// A message holding a copy of body
+    pub fn message_from(&mut self, body: &[u8]) -> Message {
+        let mut msg = self.message(body.len());
+        msg.body_mut().copy_from_slice(body);
+        msg
+    }
+
+    /// Return a message's buffer to the pool
+    pub fn recycle(&mut self, msg: Message) {
+        self.pool.push(msg.buf);
+    }
+
+    /// Encrypt msg in place, returns the response mac the receiver
+    /// will reply with. msg.as_wire() is then ready to send.
+    pub fn new_msg(&mut self, msg: &mut Message) -> [u8; 32] {
+        assert!(msg.wire_len == 0, "message already encrypted");
+
+        let mut response_mac = [0u8; 32];
+        let wire_start = HEADER_LEN - self.header_len;
+        let (header, body) = msg.buf.split_at_mut(HEADER_LEN);
+        let body_padded_len = with_scratch(|scratch| unsafe {
+            ppenc_sender_new_msg(
+                self.sender.as_mut_ptr(),
+                header[wire_start..].as_mut_ptr(),
+                body.as_mut_ptr(),
+                msg.body_len as u32,
+                response_mac.as_mut_ptr(),
+                scratch,
+            )
+        });
+
+        assert!(body_padded_len != 0, "body over PPENC_MAX_BODY_LEN");
+        msg.wire_start = wire_start;
+        msg.wire_len = self.header_len + body_padded_len as usize;
+        response_mac
+    }
+
+    /// Advance to the next body key
+    pub fn new_body_key(&mut self) {
+        with_scratch(|scratch| unsafe {
+            ppenc_sender_new_body_key(self.sender.as_mut_ptr(), scratch);
+        })
+    }
+
+    /// Does the body independent work of the next message ahead of time,
+    /// e.g. while waiting for the body. A no-op if already prepared.
+    pub fn prepare(&mut self) {
+        unsafe { ppenc_sender_prepare(self.sender.as_mut_ptr()) }
+    }
+}
+
+impl Window {
+    pub fn new() -> Self {
+        let mut window = vec![0; (unsafe { ppenc_sizeof_window() } as usize + 7) / 8];
+        unsafe { ppenc_window_init(window.as_mut_ptr() as *mut u8) };
+
+        Self { window }
+    }
+
+    /// Messages neither acked nor expired
+    pub fn outstanding(&self) -> usize {
+        unsafe { ppenc_window_outstanding(self.window.as_ptr() as *const u8) as usize }
+    }
+
+    /// Pushes that would succeed now, an ack out of order only frees its
+    /// slot once the older messages are acked or expired
+    pub fn space(&self) -> usize {
+        unsafe { ppenc_window_space(self.window.as_ptr() as *const u8) as usize }
+    }
+
+    /// Records the message sender's last new_msg made, sent_at is in the
+    /// caller's time unit. Check space() first, a message can't be taken
+    /// back once made.
+    pub fn push(&mut self, sender: &Sender, response_mac: &[u8; 32], sent_at: u32) -> Result<()> {
+        check_err(unsafe {
+            ppenc_window_push(
+                self.window.as_mut_ptr() as *mut u8,
+                sender.sender.as_ptr(),
+                response_mac.as_ptr(),
+                sent_at,
+            )
+        })
+    }
+
+    /// The seq_num and sent_at of the message a response mac acknowledges
+    pub fn ack(&mut self, response_mac: &[u8; 32]) -> Result<(u32, u32)> {
+        let (mut seq_num, mut sent_at) = (0, 0);
+        check_err(unsafe {
+            ppenc_window_ack(
+                self.window.as_mut_ptr() as *mut u8,
+                response_mac.as_ptr(),
+                &mut seq_num,
+                &mut sent_at,
+            )
+        })?;
+        Ok((seq_num, sent_at))
+    }
+
+    /// Drops messages sent at least timeout before now, returning their
+    /// seq_nums oldest first
+    pub fn expire(&mut self, now: u32, timeout: u32) -> Vec<u32> {
+        let mut seq_nums = vec![0; unsafe { ppenc_window_len() } as usize];
+        let n = unsafe {
+            ppenc_window_expire(
+                self.window.as_mut_ptr() as *mut u8,
+                now,
+                timeout,
+                seq_nums.as_mut_ptr(),
+            )
+        };
+        seq_nums.truncate(n as usize);
+        seq_nums
+    }
+}
+
+impl Default for Window {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl DgramWindow {
+    /// Starts at receiver's next seq_num, from then on its messages are
+    /// read with read_header_dgram and read_body_dgram
+    pub fn new(receiver: &Receiver) -> Self {
+        let mut window = vec![0; (unsafe { ppenc_sizeof_dgram_window() } as usize + 7) / 8];
+        with_scratch(|scratch| unsafe {
+            ppenc_dgram_window_init(
+                window.as_mut_ptr() as *mut u8,
+                receiver.receiver.as_ptr(),
+                scratch,
+            )
+        });
+
+        Self { window }
+    }
+
+    /// Messages given up on, read neither in time nor at all
+    pub fn lost(&self) -> u32 {
+        unsafe { ppenc_dgram_window_lost(self.window.as_ptr() as *const u8) }
+    }
+
+    /// The seq_nums read ahead of the receiver, to save with its snapshot
+    pub fn seen(&self) -> u32 {
+        unsafe { ppenc_dgram_window_seen(self.window.as_ptr() as *const u8) }
+    }
+
+    /// The window of a restored receiver, from the seen and lost saved
+    /// with its snapshot so messages read before aren't read again
+    pub fn restore(receiver: &Receiver, seen: u32, lost: u32) -> Self {
+        let mut window = vec![0; (unsafe { ppenc_sizeof_dgram_window() } as usize + 7) / 8];
+        with_scratch(|scratch| unsafe {
+            ppenc_dgram_window_restore(
+                window.as_mut_ptr() as *mut u8,
+                receiver.receiver.as_ptr(),
+                seen,
+                lost,
+                scratch,
+            )
+        });
+
+        Self { window }
+    }
+}
+
+impl Batch {
+    /// Holds up to max_len bytes of prefixed records and is due once
+    /// flush_len bytes are batched or max_delay (in the caller's time
+    /// unit) after the first record
+    pub fn new(max_len: usize, flush_len: usize, max_delay: u32) -> Self {
+        let mut body = vec![0; max_len + BODY_SLACK];
+        let mut batch = vec![0; (unsafe { ppenc_sizeof_batch() } as usize + 7) / 8];
+        unsafe {
+            ppenc_batch_init(
+                batch.as_mut_ptr() as *mut u8,
+                body.as_mut_ptr(),
+                max_len as u32,
+                flush_len as u32,
+                max_delay,
+            )
+        };
+
+        Self { batch, body }
+    }
+
+    /// Error::BatchFull if record doesn't fit, flush and push it again
+    pub fn push(&mut self, record: &[u8], now: u32) -> Result<()> {
+        if record.len() > u16::MAX as usize {
+            return Err(Error::BatchFull);
+        }
+        check_err(unsafe {
+            ppenc_batch_add(
+                self.batch.as_mut_ptr() as *mut u8,
+                record.as_ptr(),
+                record.len() as u16,
+                now,
+            )
+        })
+    }
+
+    pub fn is_due(&self, now: u32) -> bool {
+        unsafe { ppenc_batch_due(self.batch.as_ptr() as *const u8, now) != 0 }
+    }
+
+    /// Number of records batched
+    pub fn len(&self) -> usize {
+        unsafe { ppenc_batch_num_records(self.batch.as_ptr() as *const u8) as usize }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Bytes batched, prefixes included
+    pub fn body_len(&self) -> usize {
+        unsafe { ppenc_batch_len(self.batch.as_ptr() as *const u8) as usize }
+    }
+
+    /// Encrypts the batched records into a new message and empties the
+    /// batch, None if there was nothing to send
+    pub fn flush(&mut self, sender: &mut Sender) -> Option<(Message, [u8; 32])> {
+        if self.is_empty() {
+            return None;
+        }
+
+        let msg = sender.new_msg_from(&self.body[..self.body_len()]);
+        unsafe { ppenc_batch_clear(self.batch.as_mut_ptr() as *mut u8) };
+        Some(msg)
+    }
+}
+
+impl<'b> Records<'b> {
+    pub fn new(body: &'b [u8]) -> Self {
+        Self { body, pos: 0 }
+    }
+}
+
+impl<'b> Iterator for Records<'b> {
+    type Item = Result<&'b [u8]>;
+
+    /// A badly framed body ends the iteration with Error::BadRecord
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.pos as usize >= self.body.len() {
+            return None;
+        }
+
+        let mut record = std::ptr::null();
+        let mut record_len = 0;
+        let err = unsafe {
+            ppenc_record_next(
+                self.body.as_ptr(),
+                self.body.len() as u32,
+                &mut self.pos,
+                &mut record,
+                &mut record_len,
+            )
+        };
+        if let Err(e) = check_err(err) {
+            self.pos = self.body.len() as u32;
+            return Some(Err(e));
+        }
+
+        Some(Ok(unsafe {
+            std::slice::from_raw_parts(record, record_len as usize)
+        }))
+    }
+}
+
+impl Message {
+    pub fn body_mut(&mut self) -> &mut [u8] {
+        &mut self.buf[HEADER_LEN..HEADER_LEN + self.body_len]
+    }
+
+    /// Header followed by the padded body, empty until encrypted
+    pub fn as_wire(&self) -> &[u8] {
+        &self.buf[self.wire_start..self.wire_start + self.wire_len]
+    }
 }
 
 impl<'h> Header<'h> {
+    // The pointers are into the raw header read_header was given
+    unsafe fn from_ppenc_header(ppenc_header: &PPEncHeader) -> Self {
+        Header {
+            seq_num: ppenc_header.seq_num,
+            body_len: ppenc_header.body_len,
+            body_key_num: ppenc_header.body_key_num,
+            inner_salt: std::slice::from_raw_parts(ppenc_header.inner_salt, 6),
+            tweek_seed: std::slice::from_raw_parts(ppenc_header.tweek_seed, 8),
+            body_checksum: std::slice::from_raw_parts(ppenc_header.body_checksum, 8),
+            version: ppenc_header.version,
+        }
+    }
+
     unsafe fn as_ppenc_header(&self) -> PPEncHeader {
         PPEncHeader {
             seq_num: self.seq_num,
@@ -167,11 +1062,17 @@ impl<'h> Header<'h> {
             inner_salt: self.inner_salt.as_ptr(),
             tweek_seed: self.tweek_seed.as_ptr(),
             body_checksum: self.body_checksum.as_ptr(),
+            version: self.version,
         }
     }
 
+    pub fn seq_num(&self) -> u32 {
+        self.seq_num
+    }
+
+    /// Bytes of body on the wire after the header
     pub fn body_padded_len(&self) -> usize {
-        unsafe { ppenc_body_padded_len(self.body_len) as usize }
+        unsafe { ppenc_body_wire_len(self.version, self.body_len) as usize }
     }
 }
 
@@ -182,6 +1083,12 @@ fn check_err(err: u16) -> Result<()> {
         2 => Err(Error::BadSeqNum),
         3 => Err(Error::BadBodyChecksum),
         4 => Err(Error::BodyKeyInPast),
+        5 => Err(Error::BodyTooLong),
+        6 => Err(Error::WindowFull),
+        7 => Err(Error::UnknownResponseMac),
+        8 => Err(Error::BatchFull),
+        9 => Err(Error::BadRecord),
+        10 => Err(Error::BadSnapshot),
         _ => Err(Error::Unknown(err)),
     }
 }
@@ -193,72 +1100,35 @@ mod tests {
     use super::*;
 
     extern "C" {
-        fn header_scramble(header: *mut u8);
-        fn header_scramble_inverse(header: *mut u8);
-
-        /* sender rng */
-        fn ppenc_sizeof_sender_rng() -> u32;
-        fn ppenc_sender_rng_init(sender_rng: *mut u8, key: *const u8, nonce: *const u8);
-        fn ppenc_sender_rng_nbytes(sender_rng: *mut u8, dst: *mut u8, num_bytes: u16);
-
-        /* sender */
-        fn ppenc_sizeof_sender() -> u32;
-        fn ppenc_sender_init(
-            sender: *mut u8,
-            sender_rng: *mut u8,
-            header_salt: *const u8,
-            header_state_init: *const u8,
-            header_rng_nonce: *const u8,
-            body_salt: *const u8,
-            body_state0: *const u8,
-            buf1400: *mut u8,
-        );
-        fn ppenc_sender_new_msg(
-            sender: *mut u8,
-            header_buf: *mut u8,
-            body: *mut u8,
-            body_len: u32,
-            response_mac: *mut u8,
-            buf1400: *mut u8,
-        ) -> u32;
+        fn header_scramble(header: *mut u8, len: u8);
+        fn header_scramble_inverse(header: *mut u8, len: u8);
+        fn ppenc_body_padded_len(body_len: u32) -> u32;
 
-        fn ppenc_sender_new_body_key(sender: *mut u8, buf1400: *mut u8);
+        fn ppenc_scratch_size_init() -> u32;
+        fn ppenc_scratch_size_hash() -> u32;
+        fn ppenc_scratch_size_threefish() -> u32;
+        fn ppenc_scratch_size_msg() -> u32;
+
+        fn ppenc_dgram_window_len() -> u32;
     }
 
-    #[test]
-    fn send_receive() {
-        let mut rng = FastRng::new();
+    /* a sender and receiver sharing freshly drawn session keys */
+    fn session_pair(rng: &mut FastRng) -> (Sender, Receiver) {
         let header_key_salt = rng.gen::<[u8; 16]>();
         let header_state_init = rng.gen::<[u8; 32]>();
         let header_rng_nonce = rng.gen::<[u8; 12]>();
         let body_salt = rng.gen::<[u8; 16]>();
         let body_state0 = rng.gen::<[u8; 32]>();
-        let mut sender_rng = Vec::with_capacity(64);
-        sender_rng.resize(unsafe { ppenc_sizeof_sender_rng() as usize }, 0);
-        let mut sender = Vec::with_capacity(24);
-        sender.resize(unsafe { ppenc_sizeof_sender() as usize }, 0);
-        let mut buf1400 = vec![0; 1400];
-
-        unsafe {
-            ppenc_sender_rng_init(
-                sender_rng.as_mut_ptr(),
-                (rng.gen::<[u8; 32]>()).as_ptr(),
-                (rng.gen::<[u8; 8]>()).as_ptr(),
-            );
-
-            ppenc_sender_init(
-                sender.as_mut_ptr(),
-                sender_rng.as_mut_ptr(),
-                header_key_salt.as_ptr(),
-                header_state_init.as_ptr(),
-                header_rng_nonce.as_ptr(),
-                body_salt.as_ptr(),
-                body_state0.as_ptr(),
-                buf1400.as_mut_ptr(),
-            );
-        }
-
-        let mut receiver = Receiver::new(
+        let sender_rng = SenderRng::new(&rng.gen::<[u8; 32]>(), &rng.gen::<[u8; 8]>());
+        let sender = Sender::new(
+            sender_rng,
+            &header_key_salt,
+            &header_state_init,
+            &header_rng_nonce,
+            &body_salt,
+            &body_state0,
+        );
+        let receiver = Receiver::new(
             &header_key_salt,
             &header_state_init,
             &header_rng_nonce,
@@ -266,68 +1136,592 @@ mod tests {
             &body_state0,
         );
 
+        (sender, receiver)
+    }
+
+    #[test]
+    fn send_receive() {
+        let mut rng = FastRng::new();
+        let (mut sender, mut receiver) = session_pair(&mut rng);
+
         for (seq_num, msg_len) in [1, 2, 3, 62, 63, 64, 65, 66, 126, 127, 128, 129, 130]
             .into_iter()
             .enumerate()
         {
-            let mut header_raw = [0u8; 32];
-            let mut response_mac = [0u8; 32];
-            let mut body = Vec::with_capacity(msg_len);
-            body.resize(msg_len, 0);
-            for b in body.iter_mut() {
-                *b = rng.gen();
-            }
-            let body2 = body.clone();
-
-            /* space at the end for padding/hash padding */
-            body.resize(body.len() + 71, 0);
-
-            /* "send" a new message */
-            let body_padded_len = unsafe {
-                ppenc_sender_new_msg(
-                    sender.as_mut_ptr(),
-                    header_raw.as_mut_ptr(),
-                    body.as_mut_ptr(),
-                    msg_len as u32,
-                    response_mac.as_mut_ptr(),
-                    buf1400.as_mut_ptr(),
-                )
+            let body2 = (0..msg_len).map(|_| rng.gen()).collect::<Vec<u8>>();
+
+            /* "send" a new message, in place or out of place */
+            let out_of_place = seq_num % 2 == 1;
+            let (msg, response_mac) = if out_of_place {
+                sender.new_msg_from(&body2)
+            } else {
+                let mut msg = sender.message_from(&body2);
+                let response_mac = sender.new_msg(&mut msg);
+                (msg, response_mac)
             };
+            let wire = msg.as_wire();
+
+            let mut header_raw = [0u8; 32];
+            header_raw.copy_from_slice(&wire[..32]);
 
             let header = receiver
                 .read_header(&mut header_raw)
                 .expect("couldn't parse header");
             assert_eq!(header.body_len, msg_len as u32);
-            assert_eq!(header.body_padded_len(), body_padded_len as usize);
+            assert_eq!(header.body_padded_len(), wire.len() - 32);
             assert_eq!(header.seq_num, (seq_num + 1) as u32);
 
+            let mut body = Vec::new();
+            let response_mac2 = if out_of_place {
+                receiver
+                    .read_body_to(header, &wire[32..], &mut body)
+                    .expect("couldn't read body")
+            } else {
+                body.extend_from_slice(&wire[32..]);
+                body.resize(body.len() + 71, 0);
+                receiver
+                    .read_body(header, &mut body)
+                    .expect("couldn't read body")
+            };
+
+            assert_eq!(response_mac, response_mac2);
+            assert_eq!(body, body2);
+
+            /* the buffer is reused for the next message */
+            sender.recycle(msg);
+
+            if rng.gen::<u8>() & 1 != 0 {
+                sender.new_body_key();
+            }
+        }
+
+        #[cfg(feature = "instrument")]
+        {
+            let stats = receiver.stats();
+            assert_eq!(stats.msgs, 13);
+            assert_eq!(stats.header.calls, 13);
+            assert_eq!(stats.threefish.calls, 13);
+            assert_eq!(stats.response_mac.calls, 13);
+            /* one body key is derived by receiver_init */
+            assert_eq!(stats.body_key_next.calls, stats.body_key_steps + 1);
+        }
+    }
+
+    #[test]
+    fn read_body_parallel() {
+        let mut rng = FastRng::new();
+        let (mut sender, mut receiver) = session_pair(&mut rng);
+
+        /* single chunk, exact chunks and a short last chunk */
+        for (body_len, num_threads) in [(100, 4), (256 * 1024 - 8, 4), (300 * 1024, 3)] {
+            let body2 = (0..body_len).map(|_| rng.gen()).collect::<Vec<u8>>();
+            let (msg, response_mac) = sender.new_msg_from(&body2);
+            let wire = msg.as_wire();
+            let mut header_raw = [0u8; 32];
+            header_raw.copy_from_slice(&wire[..32]);
+
+            let header = receiver
+                .read_header(&mut header_raw)
+                .expect("couldn't parse header");
+            let mut body = Vec::new();
             let response_mac2 = receiver
-                .read_body(header, &mut body)
+                .read_body_parallel(header, &wire[32..], &mut body, num_threads)
                 .expect("couldn't read body");
 
             assert_eq!(response_mac, response_mac2);
             assert_eq!(body, body2);
+            sender.recycle(msg);
+            sender.new_body_key();
+        }
+    }
 
-            if rng.gen::<u8>() & 1 != 0 {
-                unsafe {
-                    ppenc_sender_new_body_key(sender.as_mut_ptr(), buf1400.as_mut_ptr());
+    #[test]
+    fn sender_prepare() {
+        let mut rng = FastRng::new();
+        let (mut sender, mut receiver) = session_pair(&mut rng);
+
+        /* prepared and unprepared messages mixed, on both sides of new header *
+         * keystream blocks and body keys changed between prepare and new_msg  */
+        for (i, body_len) in [0, 1, 56, 57, 64, 200, 1000, 3].into_iter().enumerate() {
+            match i % 4 {
+                0 => sender.prepare(),
+                1 => {
+                    sender.prepare();
+                    sender.prepare();
                 }
+                2 => {
+                    sender.prepare();
+                    sender.new_body_key();
+                }
+                _ => (),
             }
+
+            let body2 = (0..body_len).map(|_| rng.gen()).collect::<Vec<u8>>();
+            let (msg, response_mac) = sender.new_msg_from(&body2);
+            let wire = msg.as_wire();
+            let mut header_raw = [0u8; 32];
+            header_raw.copy_from_slice(&wire[..32]);
+
+            let header = receiver
+                .read_header(&mut header_raw)
+                .expect("couldn't parse header");
+            let mut body = Vec::new();
+            let response_mac2 = receiver
+                .read_body_to(header, &wire[32..], &mut body)
+                .expect("couldn't read body");
+
+            assert_eq!(response_mac, response_mac2);
+            assert_eq!(body, body2);
+            sender.recycle(msg);
         }
     }
 
     #[test]
-    fn header_scramble_() {
-        let mut header = FastRng::new().gen::<[u8; 32]>();
-        let header2 = header.clone();
+    fn window() {
+        let mut rng = FastRng::new();
+        let (mut sender, mut receiver) = session_pair(&mut rng);
+        let mut window = Window::new();
+        let window_len = unsafe { ppenc_window_len() } as usize;
 
+        /* fill the window before reading anything */
+        let mut wires = Vec::new();
+        for sent_at in 0..window_len as u32 {
+            let (msg, response_mac) = sender.new_msg_from(&[sent_at as u8; 10]);
+            window
+                .push(&sender, &response_mac, sent_at)
+                .expect("couldn't push");
+            wires.push(msg.as_wire().to_vec());
+            sender.recycle(msg);
+        }
+        assert_eq!(window.outstanding(), window_len);
+        let (_, response_mac) = sender.new_msg_from(&[0u8; 10]);
+        assert!(matches!(
+            window.push(&sender, &response_mac, 99),
+            Err(Error::WindowFull)
+        ));
+
+        let mut response_macs = Vec::new();
+        for wire in &wires {
+            let mut header_raw = [0u8; 32];
+            header_raw.copy_from_slice(&wire[..32]);
+            let header = receiver
+                .read_header(&mut header_raw)
+                .expect("couldn't parse header");
+            let mut body = Vec::new();
+            response_macs.push(
+                receiver
+                    .read_body_to(header, &wire[32..], &mut body)
+                    .expect("couldn't read body"),
+            );
+        }
+
+        /* out of order, twice, and one that was never pushed */
+        assert_eq!(window.ack(&response_macs[2]).expect("no ack"), (3, 2));
+        assert!(matches!(
+            window.ack(&response_macs[2]),
+            Err(Error::UnknownResponseMac)
+        ));
+        assert!(matches!(
+            window.ack(&response_mac),
+            Err(Error::UnknownResponseMac)
+        ));
+        assert_eq!(window.ack(&response_macs[0]).expect("no ack"), (1, 0));
+        assert_eq!(window.outstanding(), window_len - 2);
+        assert_eq!(window.space(), 1);
+
+        /* seq_nums 2 and 4 are dropped, 3 was acked, 5.. sent less than 10 ago */
+        assert_eq!(window.expire(13, 10), vec![2, 4]);
+        assert_eq!(window.outstanding(), window_len - 4);
+        assert_eq!(window.space(), 4);
+        assert_eq!(window.ack(&response_macs[4]).expect("no ack"), (5, 4));
+        assert!(matches!(
+            window.ack(&response_macs[3]),
+            Err(Error::UnknownResponseMac)
+        ));
+
+        /* sent_at wraps */
+        let mut window = Window::new();
+        window
+            .push(&sender, &response_mac, u32::MAX - 1)
+            .expect("couldn't push");
+        assert!(window.expire(3, 10).is_empty());
+        assert_eq!(window.expire(8, 10), vec![window_len as u32 + 1]);
+    }
+
+    #[test]
+    fn dgram() {
+        let mut rng = FastRng::new();
+        let (mut sender, mut receiver) = session_pair(&mut rng);
+        let mut window = DgramWindow::new(&receiver);
+
+        let msgs = (0..100)
+            .map(|i| {
+                let body = (0..i % 70).map(|_| rng.gen()).collect::<Vec<u8>>();
+                let (msg, response_mac) = sender.new_msg_from(&body);
+                (msg.as_wire().to_vec(), body, response_mac)
+            })
+            .collect::<Vec<_>>();
+
+        /* each run of 8 arrives backwards, every 7th is lost, every *
+         * 5th arrives twice, the last 20 in order                   */
+        let mut order = Vec::new();
+        for run in (0..80).collect::<Vec<usize>>().chunks(8) {
+            for &i in run.iter().rev() {
+                if i % 7 == 3 {
+                    continue;
+                }
+                order.push(i);
+                if i % 5 == 1 {
+                    order.push(i);
+                }
+            }
+        }
+        order.extend(80..100);
+
+        let mut read = vec![false; msgs.len()];
+        let mut body = Vec::new();
+        for i in order {
+            let (wire, body2, response_mac) = &msgs[i];
+            let mut header_raw = [0u8; 32];
+            header_raw.copy_from_slice(&wire[..32]);
+            let header = match receiver.read_header_dgram(&window, &mut header_raw) {
+                Ok(h) => h,
+                Err(Error::BadSeqNum) => {
+                    assert!(read[i], "message {} not read", i);
+                    continue;
+                }
+                Err(e) => panic!("{}", e),
+            };
+            assert_eq!(header.seq_num(), i as u32 + 1);
+
+            let response_mac2 = receiver
+                .read_body_dgram(&mut window, header, &wire[32..], &mut body)
+                .expect("couldn't read body");
+            assert_eq!(&response_mac2, response_mac);
+            assert_eq!(&body, body2);
+            assert!(!read[i]);
+            read[i] = true;
+        }
+
+        let lost = (0..80).filter(|i| i % 7 == 3).count();
+        assert_eq!(read.iter().filter(|r| !**r).count(), lost);
+        assert_eq!(window.lost(), lost as u32);
+
+        /* too far ahead of the window */
+        let (msg, _) = sender.new_msg_from(&[1]);
+        for _ in 0..unsafe { ppenc_dgram_window_len() } {
+            sender.new_msg_from(&[1]);
+        }
+        let (ahead, _) = sender.new_msg_from(&[1]);
+        let mut header_raw = [0u8; 32];
+        header_raw.copy_from_slice(&ahead.as_wire()[..32]);
+        assert!(matches!(
+            receiver.read_header_dgram(&window, &mut header_raw),
+            Err(Error::BadSeqNum)
+        ));
+        header_raw.copy_from_slice(&msg.as_wire()[..32]);
+        assert!(receiver.read_header_dgram(&window, &mut header_raw).is_ok());
+    }
+
+    #[test]
+    fn snapshot() {
+        let mut rng = FastRng::new();
+        let (mut sender, mut receiver) = session_pair(&mut rng);
+        sender
+            .set_version(VERSION_COMPACT)
+            .expect("couldn't set version");
+        receiver
+            .set_version(VERSION_COMPACT)
+            .expect("couldn't set version");
+        receiver.set_max_body_len(1000);
+
+        /* a new receiver from every other message on, across body keys *
+         * and both halves of a header keystream block                  */
+        for i in 0..20 {
+            if i % 3 == 1 {
+                sender.new_body_key();
+            }
+            if i % 2 == 0 {
+                receiver = Receiver::restore(&receiver.snapshot()).expect("couldn't restore");
+            }
+
+            let body2 = (0..i * 7).map(|_| rng.gen()).collect::<Vec<u8>>();
+            let (msg, response_mac) = sender.new_msg_from(&body2);
+            let wire = msg.as_wire();
+            let mut header_raw = [0u8; 32];
+            header_raw[..receiver.header_len()].copy_from_slice(&wire[..24]);
+            let header = receiver
+                .read_header(&mut header_raw)
+                .expect("couldn't parse header");
+
+            let mut body = Vec::new();
+            let response_mac2 = receiver
+                .read_body_to(header, &wire[24..], &mut body)
+                .expect("couldn't read body");
+            assert_eq!(response_mac, response_mac2);
+            assert_eq!(body, body2);
+        }
+
+        /* max_body_len came along */
+        let (msg, _) = sender.new_msg_from(&[0; 1001]);
+        let mut header_raw = [0u8; 32];
+        header_raw[..24].copy_from_slice(&msg.as_wire()[..24]);
+        assert!(matches!(
+            receiver.read_header(&mut header_raw),
+            Err(Error::BodyTooLong)
+        ));
+
+        /* a restored datagram window doesn't read a message twice */
+        let mut window = DgramWindow::new(&receiver);
+        let msgs = (0..4)
+            .map(|i| sender.new_msg_from(&[i]).0.as_wire().to_vec())
+            .collect::<Vec<_>>();
+        let mut body = Vec::new();
+        for wire in msgs[1..].iter().rev() {
+            header_raw[..24].copy_from_slice(&wire[..24]);
+            let header = receiver
+                .read_header_dgram(&window, &mut header_raw)
+                .expect("couldn't parse header");
+            receiver
+                .read_body_dgram(&mut window, header, &wire[24..], &mut body)
+                .expect("couldn't read body");
+        }
+
+        let receiver2 = Receiver::restore(&receiver.snapshot()).expect("couldn't restore");
+        let window2 = DgramWindow::restore(&receiver2, window.seen(), window.lost());
+        let mut receiver = receiver2;
+        header_raw[..24].copy_from_slice(&msgs[2][..24]);
+        assert!(matches!(
+            receiver.read_header_dgram(&window2, &mut header_raw),
+            Err(Error::BadSeqNum)
+        ));
+        header_raw[..24].copy_from_slice(&msgs[0][..24]);
+        assert!(receiver
+            .read_header_dgram(&window2, &mut header_raw)
+            .is_ok());
+
+        assert!(matches!(
+            Receiver::restore(&[0; SNAPSHOT_LEN]),
+            Err(Error::BadSnapshot)
+        ));
+    }
+
+    #[test]
+    fn batch() {
+        let mut rng = FastRng::new();
+        let (mut sender, mut receiver) = session_pair(&mut rng);
+
+        /* 100 bytes of records, due at 64 bytes or 10 ticks */
+        let mut batch = Batch::new(100, 64, 10);
+        assert!(batch.flush(&mut sender).is_none());
+        assert!(!batch.is_due(1000));
+
+        let records = (0..40)
+            .map(|i| (0..i % 23).map(|_| rng.gen()).collect::<Vec<u8>>())
+            .collect::<Vec<_>>();
+        let mut sent = Vec::new();
+        let mut received = Vec::new();
+        let mut flush = |batch: &mut Batch, sent: &mut Vec<Vec<u8>>| {
+            let (msg, response_mac) = batch.flush(&mut sender).expect("empty batch");
+            let wire = msg.as_wire();
+            let mut header_raw = [0u8; 32];
+            header_raw.copy_from_slice(&wire[..32]);
+            let header = receiver
+                .read_header(&mut header_raw)
+                .expect("couldn't parse header");
+            let mut body = Vec::new();
+            assert_eq!(
+                receiver
+                    .read_body_to(header, &wire[32..], &mut body)
+                    .expect("couldn't read body"),
+                response_mac
+            );
+            for record in Records::new(&body) {
+                received.push(record.expect("bad record").to_vec());
+            }
+            sent.push(body);
+            assert!(batch.is_empty());
+        };
+
+        for (now, record) in records.iter().enumerate() {
+            if batch.push(record, now as u32).is_err() {
+                flush(&mut batch, &mut sent);
+                batch.push(record, now as u32).expect("couldn't push");
+            }
+            if batch.is_due(now as u32) {
+                flush(&mut batch, &mut sent);
+            }
+        }
+        flush(&mut batch, &mut sent);
+        assert_eq!(received, records);
+        assert!(sent.len() < records.len() / 4);
+
+        /* due by time alone, u32 time wraps */
+        batch.push(&[1, 2, 3], u32::MAX - 4).expect("couldn't push");
+        assert_eq!(batch.body_len(), 5);
+        assert!(!batch.is_due(u32::MAX));
+        assert!(batch.is_due(5));
+        assert!(matches!(batch.push(&[0; 96], 5), Err(Error::BatchFull)));
+
+        /* a length running past the body ends the records */
+        let body = [0, 1, 7, 0, 2, 8];
+        let mut records = Records::new(&body);
+        assert_eq!(records.next().unwrap().unwrap(), &[7]);
+        assert!(matches!(records.next(), Some(Err(Error::BadRecord))));
+        assert!(records.next().is_none());
+        assert!(Records::new(&[0]).next().unwrap().is_err());
+        assert_eq!(Records::new(&[0, 0]).next().unwrap().unwrap(), &[]);
+    }
+
+    #[test]
+    fn max_body_len() {
+        let mut rng = FastRng::new();
+        let (mut sender, mut receiver) = session_pair(&mut rng);
+        receiver.set_max_body_len(64);
+
+        for (body_len, ok) in [(64, true), (65, false)] {
+            let (msg, _) = sender.new_msg_from(&vec![7u8; body_len]);
+            let wire = msg.as_wire();
+            let mut header_raw = [0u8; 32];
+            header_raw.copy_from_slice(&wire[..32]);
+
+            match receiver.read_header(&mut header_raw) {
+                Ok(header) => {
+                    assert!(ok);
+                    let mut body = Vec::new();
+                    receiver
+                        .read_body_to(header, &wire[32..], &mut body)
+                        .expect("couldn't read body");
+                    assert_eq!(body.len(), body_len);
+                }
+                Err(Error::BodyTooLong) => assert!(!ok),
+                Err(e) => panic!("unexpected error {}", e),
+            }
+        }
+        assert_eq!(receiver.oversize_headers(), 1);
+    }
+
+    #[test]
+    fn body_padded_len() {
+        const MAX_BODY_LEN: u32 = 16 * 1024 * 1024;
+
+        for (body_len, padded_len) in [
+            (0, 64),
+            (1, 64),
+            (56, 64),
+            (57, 128),
+            (120, 128),
+            (121, 192),
+            (MAX_BODY_LEN, MAX_BODY_LEN + 64),
+            (MAX_BODY_LEN + 1, 0),
+            (u32::MAX - 70, 0),
+            (u32::MAX, 0),
+        ] {
+            assert_eq!(unsafe { ppenc_body_padded_len(body_len) }, padded_len);
+        }
+    }
+
+    #[test]
+    fn scratch_size() {
+        // build.rs builds the 64 bit Threefish buffer (1312 bytes), messages
+        // need a block after it for the compact tail
         unsafe {
-            header_scramble(header.as_mut_ptr());
-            assert!(header != header2);
-            header_scramble_inverse(header.as_mut_ptr());
+            assert_eq!(ppenc_scratch_size_init(), 352);
+            assert_eq!(ppenc_scratch_size_hash(), 320);
+            assert_eq!(ppenc_scratch_size_threefish(), 64 + 1312);
+            assert_eq!(ppenc_scratch_size_msg(), 64 + 1312 + 64);
+            assert_eq!(ppenc_scratch_size(), 64 + 1312 + 64);
         }
+    }
 
-        assert_eq!(header, header2);
+    #[test]
+    fn compact() {
+        let mut rng = FastRng::new();
+        let (mut sender, mut receiver) = session_pair(&mut rng);
+
+        assert!(matches!(sender.set_version(2), Err(Error::BadVersion)));
+        sender
+            .set_version(VERSION_COMPACT)
+            .expect("couldn't set version");
+        receiver
+            .set_version(VERSION_COMPACT)
+            .expect("couldn't set version");
+        assert_eq!(sender.header_len(), 24);
+        assert_eq!(receiver.header_len(), 24);
+
+        for (i, body_len) in [0, 1, 7, 8, 9, 56, 63, 64, 65, 127, 128, 200, 1000, 65535]
+            .into_iter()
+            .enumerate()
+        {
+            let body2 = (0..body_len).map(|_| rng.gen()).collect::<Vec<u8>>();
+            match i % 3 {
+                0 => sender.prepare(),
+                1 => sender.new_body_key(),
+                _ => {}
+            }
+            let (msg, response_mac) = if i % 2 == 0 {
+                sender.new_msg_from(&body2)
+            } else {
+                let mut msg = sender.message_from(&body2);
+                let response_mac = sender.new_msg(&mut msg);
+                (msg, response_mac)
+            };
+            let wire = msg.as_wire();
+            /* 8 byte granularity, an empty body still sends 8 */
+            assert_eq!(wire.len(), 24 + ((body_len + 7) / 8).max(1) * 8);
+
+            let mut header_raw = [0u8; 32];
+            header_raw[..24].copy_from_slice(&wire[..24]);
+            let header = receiver
+                .read_header(&mut header_raw)
+                .expect("couldn't parse header");
+            assert_eq!(header.body_len, body_len as u32);
+            assert_eq!(header.body_padded_len(), wire.len() - 24);
+
+            let mut body = Vec::new();
+            let response_mac2 = receiver
+                .read_body_to(header, &wire[24..], &mut body)
+                .expect("couldn't read body");
+            assert_eq!(response_mac, response_mac2);
+            assert_eq!(body, body2);
+
+            sender.recycle(msg);
+        }
+
+        /* flipping the same bit of two tail words cancels out of an xor *
+         * checksum but not out of the tag                               */
+        let (msg, _) = sender.new_msg_from(&[7u8; 20]);
+        let mut wire = msg.as_wire().to_vec();
+        wire[24] ^= 1;
+        wire[32] ^= 1;
+        let mut header_raw = [0u8; 32];
+        header_raw[..24].copy_from_slice(&wire[..24]);
+        let header = receiver
+            .read_header(&mut header_raw)
+            .expect("couldn't parse header");
+        let mut body = Vec::new();
+        assert!(matches!(
+            receiver.read_body_to(header, &wire[24..], &mut body),
+            Err(Error::BadBodyChecksum)
+        ));
+    }
+
+    #[test]
+    fn header_scramble_() {
+        for len in [32, 24] {
+            let mut header = FastRng::new().gen::<[u8; 32]>();
+            let header2 = header.clone();
+
+            unsafe {
+                header_scramble(header.as_mut_ptr(), len as u8);
+                assert!(header != header2);
+                /* only the first len bytes are moved */
+                assert_eq!(header[len..], header2[len..]);
+                header_scramble_inverse(header.as_mut_ptr(), len as u8);
+            }
+
+            assert_eq!(header, header2);
+        }
     }
 
     #[test]